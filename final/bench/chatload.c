@@ -0,0 +1,416 @@
+// Compile: make bench
+// Load generator for chatserver. Simulated clients share one epoll loop:
+// they log in, register usernames, join rooms (uniform or zipf) and then
+// drive a broadcast / whisper / sendfile mix at a target rate. Every chat
+// payload carries its send time ("@@<ns>;"), so receivers measure end to
+// end latency; command acks give the request round trip.
+//
+// The protocol is unframed, so a client never has more than one command
+// in flight - two commands in one read would be parsed as one by the server.
+#include "../shared/chatDefination.h"
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <getopt.h>
+#include <math.h>
+
+#define MAX_EVENTS 256
+#define READ_CHUNK (64 * 1024)
+#define CARRY_SIZE 64           // longest token that can straddle two reads
+#define DRAIN_SECONDS 2
+
+typedef enum { CMD_KIND_BROADCAST, CMD_KIND_WHISPER, CMD_KIND_SENDFILE, CMD_KIND_COUNT } cmd_kind_t;
+static const char *kind_names[CMD_KIND_COUNT] = {"broadcast", "whisper", "sendfile"};
+
+typedef enum { ST_LOGIN, ST_USERNAME, ST_JOIN, ST_IDLE, ST_BUSY, ST_DEAD } conn_state_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    int room;
+    char name[MAX_USERNAME_LENGTH];
+    cmd_kind_t pending;
+    uint64_t sent_ns;
+    char carry[CARRY_SIZE];
+    size_t carry_len;
+} conn_t;
+
+typedef struct {
+    uint64_t *v;
+    size_t len, cap;
+} samples_t;
+
+static struct {
+    const char *host;
+    int port;
+    int clients;
+    int rooms;
+    int zipf;
+    double zipf_s;
+    double rate;
+    int duration;
+    int payload;
+    int mix[CMD_KIND_COUNT];    // percent
+} cfg = {"127.0.0.1", PORT, 25, 3, 0, 1.0, 200, 10, 64, {85, 13, 2}};
+
+static conn_t *conns;
+static int *room_members;
+static int epfd;
+static samples_t e2e, acks[CMD_KIND_COUNT];
+static uint64_t sent[CMD_KIND_COUNT], acked[CMD_KIND_COUNT];
+static uint64_t delivered, expected, stalled, dead;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sample_add(samples_t *s, uint64_t v) {
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+        if (!s->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->len++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(samples_t *s, double p) {
+    if (s->len == 0) return 0;
+    size_t idx = (size_t)(p * (s->len - 1));
+    return s->v[idx] / 1e3;
+}
+
+static void conn_send(conn_t *c, const char *msg) {
+    if (send(c->fd, msg, strlen(msg), MSG_NOSIGNAL) < 0) {
+        c->state = ST_DEAD;
+        dead++;
+    }
+}
+
+// Room for client i: uniform round robin or zipf, skipping full rooms
+static int pick_room(int i, const double *cdf) {
+    int room;
+    if (!cfg.zipf) {
+        room = i % cfg.rooms;
+    } else {
+        double u = (double)rand() / RAND_MAX;
+        room = 0;
+        while (room < cfg.rooms - 1 && u > cdf[room]) room++;
+    }
+    for (int k = 0; k < cfg.rooms; k++) {
+        int r = (room + k) % cfg.rooms;
+        if (room_members[r] < MAX_GROUP_MEMBERS) return r;
+    }
+    return room;
+}
+
+static void on_ack(conn_t *c, const double *cdf) {
+    char cmd[BUFFER_SIZE];
+    switch (c->state) {
+    case ST_USERNAME:
+        c->room = pick_room((int)(c - conns), cdf);
+        snprintf(cmd, sizeof(cmd), "/join loadroom%d\n", c->room);
+        c->state = ST_JOIN;
+        conn_send(c, cmd);
+        break;
+    case ST_JOIN:
+        room_members[c->room]++;
+        c->state = ST_IDLE;
+        break;
+    case ST_BUSY:
+        sample_add(&acks[c->pending], now_ns() - c->sent_ns);
+        acked[c->pending]++;
+        c->state = ST_IDLE;
+        break;
+    default:
+        break;
+    }
+}
+
+static int starts_with(const char *p, const char *end, const char *token) {
+    size_t n = strlen(token);
+    return (size_t)(end - p) >= n && memcmp(p, token, n) == 0;
+}
+
+// Scan carry + fresh bytes for acks and timestamps; keep a possibly cut token
+static void on_data(conn_t *c, const char *data, size_t len, const double *cdf) {
+    static char buf[CARRY_SIZE + READ_CHUNK];
+    memcpy(buf, c->carry, c->carry_len);
+    memcpy(buf + c->carry_len, data, len);
+    const char *p = buf, *end = buf + c->carry_len + len;
+    const char *consumed = buf;
+    uint64_t now = now_ns();
+
+    while (p < end) {
+        if (*p == '@' && starts_with(p, end, "@@")) {
+            const char *q = p + 2;
+            uint64_t ts = 0;
+            while (q < end && *q >= '0' && *q <= '9') ts = ts * 10 + (*q++ - '0');
+            if (q == end) break;    // cut off, finish with the next read
+            if (*q == ';' && ts > 0 && ts <= now) {
+                sample_add(&e2e, now - ts);
+                delivered++;
+            }
+            p = consumed = q + 1;
+            continue;
+        }
+        int ack = 0;
+        if (starts_with(p, end, "SUCCESS_LOGIN")) {
+            if (c->state == ST_LOGIN) {
+                char cmd[64];
+                snprintf(cmd, sizeof(cmd), "/username %s\n", c->name);
+                c->state = ST_USERNAME;
+                conn_send(c, cmd);
+            }
+            p = consumed = p + 13;
+            continue;
+        } else if (starts_with(p, end, "SET_USERNAME")) {
+            p += 12;
+            ack = c->state == ST_USERNAME;
+        } else if (starts_with(p, end, "[SERVER]")) {
+            p += 8;
+            if (c->state == ST_USERNAME) {
+                c->state = ST_DEAD;     // name taken or rejected
+                dead++;
+            }
+            ack = c->state == ST_JOIN || c->state == ST_BUSY;
+        } else if (starts_with(p, end, "READY_FOR_FILE") || starts_with(p, end, "FILE_QUEUE_FULL") ||
+                   starts_with(p, end, "RECIPIENT_") || starts_with(p, end, "INVALID_FILE_TYPE")) {
+            p += 10;
+            ack = c->state == ST_BUSY && c->pending == CMD_KIND_SENDFILE;
+        } else {
+            p++;
+            if (end - p >= CARRY_SIZE) consumed = p;
+            continue;
+        }
+        consumed = p;
+        if (ack) on_ack(c, cdf);
+    }
+
+    // Anything shorter than the longest token may be the start of one
+    if (end - consumed > CARRY_SIZE) consumed = end - CARRY_SIZE;
+    c->carry_len = end - consumed;
+    memmove(c->carry, consumed, c->carry_len);
+}
+
+static void pump(int timeout_ms, const double *cdf) {
+    struct epoll_event events[MAX_EVENTS];
+    static char chunk[READ_CHUNK];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        conn_t *c = events[i].data.ptr;
+        if (c->state == ST_DEAD) continue;
+        ssize_t len = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (len <= 0) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            c->state = ST_DEAD;
+            dead++;
+            continue;
+        }
+        on_data(c, chunk, len, cdf);
+    }
+}
+
+static cmd_kind_t pick_kind(void) {
+    int r = rand() % 100, acc = 0;
+    for (int k = 0; k < CMD_KIND_COUNT; k++) {
+        acc += cfg.mix[k];
+        if (r < acc) return k;
+    }
+    return CMD_KIND_BROADCAST;
+}
+
+// Send one command from the next idle client, returns 0 if all are busy
+static int fire(int *cursor) {
+    for (int tries = 0; tries < cfg.clients; tries++) {
+        conn_t *c = &conns[*cursor];
+        *cursor = (*cursor + 1) % cfg.clients;
+        if (c->state != ST_IDLE) continue;
+
+        cmd_kind_t kind = pick_kind();
+        conn_t *peer = &conns[rand() % cfg.clients];
+        if (kind != CMD_KIND_BROADCAST && (peer == c || peer->state == ST_DEAD ||
+                                          peer->state < ST_IDLE)) {
+            kind = CMD_KIND_BROADCAST;
+        }
+
+        char payload[BUFFER_SIZE / 2];
+        uint64_t ts = now_ns();
+        int len = snprintf(payload, sizeof(payload), "@@%lu;", (unsigned long)ts);
+        while (len < cfg.payload && len < (int)sizeof(payload) - 1) payload[len++] = 'x';
+        payload[len] = '\0';
+
+        char cmd[BUFFER_SIZE];
+        switch (kind) {
+        case CMD_KIND_BROADCAST:
+            snprintf(cmd, sizeof(cmd), "/broadcast %s\n", payload);
+            expected += room_members[c->room] - 1;
+            break;
+        case CMD_KIND_WHISPER:
+            snprintf(cmd, sizeof(cmd), "/whisper %s %s\n", peer->name, payload);
+            expected++;
+            break;
+        default:
+            snprintf(cmd, sizeof(cmd), "/sendfile load%lu.txt %s 1024\n", (unsigned long)sent[kind], peer->name);
+        }
+        c->pending = kind;
+        c->sent_ns = ts;
+        c->state = ST_BUSY;
+        sent[kind]++;
+        conn_send(c, cmd);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-c clients] [-r rooms] [-z zipf_s] [-R cmds/s]\n"
+            "          [-t seconds] [-s payload_bytes] [-m broadcast,whisper,sendfile %%]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:r:z:R:t:s:m:")) != -1) {
+        switch (opt) {
+        case 'h': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'r': cfg.rooms = atoi(optarg); break;
+        case 'z': cfg.zipf = 1; cfg.zipf_s = atof(optarg); break;
+        case 'R': cfg.rate = atof(optarg); break;
+        case 't': cfg.duration = atoi(optarg); break;
+        case 's': cfg.payload = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2]) != 3) usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (cfg.clients < 2 || cfg.rooms < 1 || cfg.rate <= 0 || cfg.duration < 1) usage(argv[0]);
+    if (cfg.clients > MAX_CLIENTS) {
+        fprintf(stderr, "note: chatserver accepts %d clients, the rest will be rejected\n", MAX_CLIENTS);
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)cfg.clients + 16) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)cfg.clients + 16 ? rl.rlim_max : (rlim_t)cfg.clients + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Zipf over rooms: P(k) ~ 1 / (k+1)^s
+    double *cdf = calloc(cfg.rooms, sizeof(double));
+    double total = 0;
+    for (int k = 0; k < cfg.rooms; k++) total += 1.0 / pow(k + 1, cfg.zipf_s);
+    for (int k = 0; k < cfg.rooms; k++) {
+        cdf[k] = (k ? cdf[k - 1] : 0) + 1.0 / pow(k + 1, cfg.zipf_s) / total;
+    }
+
+    conns = calloc(cfg.clients, sizeof(conn_t));
+    room_members = calloc(cfg.rooms, sizeof(int));
+    epfd = epoll_create1(0);
+    if (!conns || !room_members || !cdf || epfd < 0) {
+        perror("setup");
+        return 1;
+    }
+    srand(42);
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &addr.sin_addr) != 1) usage(argv[0]);
+
+    for (int i = 0; i < cfg.clients; i++) {
+        conn_t *c = &conns[i];
+        snprintf(c->name, sizeof(c->name), "load%d", i);
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return 1;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        c->state = ST_LOGIN;
+        pump(0, cdf);
+    }
+
+    // Wait until everyone has joined (or given up)
+    uint64_t setup_deadline = now_ns() + 10 * 1000000000ull;
+    while (now_ns() < setup_deadline) {
+        int pending = 0;
+        for (int i = 0; i < cfg.clients; i++) pending += conns[i].state < ST_IDLE;
+        if (!pending) break;
+        pump(10, cdf);
+    }
+    int joined = 0;
+    for (int i = 0; i < cfg.clients; i++) joined += conns[i].state == ST_IDLE;
+    if (joined < 2) {
+        fprintf(stderr, "Only %d clients got into a room, is the server running on %s:%d?\n",
+                joined, cfg.host, cfg.port);
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)cfg.duration * 1000000000ull;
+    uint64_t fired = 0;
+    int cursor = 0;
+    while (now_ns() < end) {
+        pump(1, cdf);
+        uint64_t due = (uint64_t)((now_ns() - start) / 1e9 * cfg.rate);
+        while (fired < due) {
+            if (!fire(&cursor)) {
+                stalled += due - fired;     // offered load the clients could not take
+                fired = due;
+                break;
+            }
+            fired++;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    uint64_t drain_end = now_ns() + DRAIN_SECONDS * 1000000000ull;
+    while (now_ns() < drain_end) pump(10, cdf);
+
+    qsort(e2e.v, e2e.len, sizeof(uint64_t), cmp_u64);
+    uint64_t total_sent = 0, total_acked = 0;
+    for (int k = 0; k < CMD_KIND_COUNT; k++) {
+        total_sent += sent[k];
+        total_acked += acked[k];
+        qsort(acks[k].v, acks[k].len, sizeof(uint64_t), cmp_u64);
+    }
+
+    printf("chatload: %d clients (%d joined) in %d rooms (%s), %d s at %.0f cmd/s offered\n",
+           cfg.clients, joined, cfg.rooms, cfg.zipf ? "zipf" : "uniform", cfg.duration, cfg.rate);
+    printf("  commands sent      : %lu (broadcast %lu, whisper %lu, sendfile %lu), %lu not sent, no idle client\n",
+           (unsigned long)total_sent, (unsigned long)sent[0], (unsigned long)sent[1],
+           (unsigned long)sent[2], (unsigned long)stalled);
+    printf("  throughput         : %.1f cmd/s acked, %.1f msg/s delivered\n",
+           total_acked / elapsed, delivered / elapsed);
+    printf("  deliveries         : %lu of %lu expected, %lu clients dropped\n",
+           (unsigned long)delivered, (unsigned long)expected, (unsigned long)dead);
+    printf("  end-to-end latency : p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           percentile_us(&e2e, 0.50), percentile_us(&e2e, 0.99), percentile_us(&e2e, 0.999),
+           percentile_us(&e2e, 1.0));
+    for (int k = 0; k < CMD_KIND_COUNT; k++) {
+        if (!acks[k].len) continue;
+        printf("  %-9s ack      : p50 %.1f us, p99 %.1f us, p999 %.1f us\n", kind_names[k],
+               percentile_us(&acks[k], 0.50), percentile_us(&acks[k], 0.99),
+               percentile_us(&acks[k], 0.999));
+    }
+
+    for (int i = 0; i < cfg.clients; i++) close(conns[i].fd);
+    return 0;
+}
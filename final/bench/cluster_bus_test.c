@@ -0,0 +1,396 @@
+// Compile: make test-cluster
+// Cluster and mesh mode test, in three parts:
+//  1. bus: 4 forked processes join one shared memory bus and each sends
+//     BUS_MSGS messages round robin to the other three. Checks that every
+//     message arrives once and in order per sender, and reports throughput.
+//  2. chatserver: starts 4 chatserver processes in one cluster, connects a
+//     client to each and checks cross-process broadcast, whisper, /list and
+//     username uniqueness, then measures broadcast delivery across nodes.
+//  3. the same with 4 chatservers federated over TCP links on localhost
+//     (--mesh), then stops one node and checks the others forget its users.
+// Exits non-zero on any failure.
+#define _GNU_SOURCE     // memmem
+#include <stdarg.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../shared/chatDefination.h"
+#include "../server/bus.h"
+
+#define NODES 4
+#define BUS_MSGS 300000         // per sending node, multiple of NODES - 1
+#define E2E_BROADCASTS 200      // per client
+#define E2E_TIMEOUT_MS 5000
+#define CARRY_SIZE 32
+
+static int failures = 0;
+
+// bus.c logs through the server's log_event
+void log_event(const char *format, ...) {
+    (void)format;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ok, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("  [%s] ", ok ? "ok" : "FAIL");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) failures++;
+}
+
+// ---- part 1: raw bus ----
+
+static uint64_t received_count;
+static int last_seq[NODES];
+static int out_of_order;
+
+static void count_message(const bus_msg_t *msg) {
+    int from, seq;
+    if (sscanf(msg->text, "from %d seq %d", &from, &seq) != 2 || from < 0 || from >= NODES) {
+        out_of_order++;
+    } else {
+        if (seq <= last_seq[from]) out_of_order++;
+        last_seq[from] = seq;
+    }
+    __atomic_add_fetch(&received_count, 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    double elapsed;
+    uint64_t received;
+    int out_of_order;
+    uint64_t retries;
+} node_result_t;
+
+static void run_bus_node(const char *cluster, int node, int start_fd, node_result_t *result) {
+    for (int i = 0; i < NODES; i++) last_seq[i] = -1;
+    if (bus_open(cluster, node) < 0 || bus_start(count_message) < 0) {
+        result->received = (uint64_t)-1;
+        _exit(1);
+    }
+    char go;
+    if (read(start_fd, &go, 1) != 1) _exit(1);
+
+    double start = now_sec();
+    char text[64];
+    uint64_t retries = 0;
+    for (int i = 0; i < BUS_MSGS; i++) {
+        int peer = (node + 1 + i % (NODES - 1)) % NODES;
+        int len = snprintf(text, sizeof(text), "from %d seq %d", node, i);
+        while (bus_send(peer, BUS_BROADCAST, "bench", text, len + 1) < 0) {
+            retries++;
+            sched_yield();
+        }
+    }
+    // Each node receives BUS_MSGS in total, a third from each peer
+    while (__atomic_load_n(&received_count, __ATOMIC_ACQUIRE) < BUS_MSGS &&
+           now_sec() - start < 30) {
+        usleep(100);
+    }
+    result->elapsed = now_sec() - start;
+    result->received = __atomic_load_n(&received_count, __ATOMIC_ACQUIRE);
+    result->out_of_order = out_of_order;
+    result->retries = retries;
+    _exit(0);
+}
+
+static void test_bus(void) {
+    printf("bus: %d processes, %d messages each\n", NODES, BUS_MSGS);
+    char cluster[64];
+    snprintf(cluster, sizeof(cluster), "bustest-%d", (int)getpid());
+
+    node_result_t *results = mmap(NULL, sizeof(node_result_t) * NODES, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int start_pipe[2];
+    if (results == MAP_FAILED || pipe(start_pipe) < 0) {
+        check(0, "setup: %s", strerror(errno));
+        return;
+    }
+    pid_t pids[NODES];
+    for (int i = 0; i < NODES; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(start_pipe[1]);
+            run_bus_node(cluster, i, start_pipe[0], &results[i]);
+        }
+    }
+    close(start_pipe[0]);
+    usleep(300000);     // let every node open the bus and start its consumer
+    if (write(start_pipe[1], "GGGG", NODES) != NODES) check(0, "start signal");
+    close(start_pipe[1]);
+
+    int exited_ok = 1;
+    for (int i = 0; i < NODES; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) exited_ok = 0;
+    }
+    check(exited_ok, "all bus nodes exited cleanly");
+
+    double slowest = 0;
+    uint64_t total = 0, retries = 0;
+    int disorder = 0, complete = 1;
+    for (int i = 0; i < NODES; i++) {
+        if (results[i].received != BUS_MSGS) complete = 0;
+        if (results[i].elapsed > slowest) slowest = results[i].elapsed;
+        total += results[i].received;
+        disorder += results[i].out_of_order;
+        retries += results[i].retries;
+    }
+    check(complete, "every node received exactly %d messages (%lu total)", BUS_MSGS, (unsigned long)total);
+    check(disorder == 0, "per-sender order kept (%d out of order)", disorder);
+    printf("  %.0f messages/s across the bus (%.3f s, %lu full-ring retries)\n",
+           slowest > 0 ? total / slowest : 0.0, slowest, (unsigned long)retries);
+
+    char name[80];
+    snprintf(name, sizeof(name), "/chatbus-%s", cluster);
+    shm_unlink(name);
+    munmap(results, sizeof(node_result_t) * NODES);
+}
+
+// ---- part 2: chatserver processes ----
+
+typedef struct {
+    int fd;
+    char carry[CARRY_SIZE];
+    size_t carry_len;
+    int broadcasts;     // "[BROADCAST]" lines received
+    int acks;           // "Message broadcasted" replies
+    int sent;
+} client_t;
+
+static int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int attempt = 0; attempt < 50; attempt++) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        usleep(100000);
+    }
+    close(fd);
+    return -1;
+}
+
+// Wait up to timeout_ms for a reply and return it NUL terminated
+static int request(int fd, const char *cmd, char *reply, size_t size, int timeout_ms) {
+    if (cmd && send(fd, cmd, strlen(cmd), 0) < 0) return -1;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        reply[0] = '\0';
+        return -1;
+    }
+    ssize_t n = recv(fd, reply, size - 1, 0);
+    reply[n > 0 ? n : 0] = '\0';
+    // Let the server see each command in its own read
+    usleep(20000);
+    return n > 0 ? 0 : -1;
+}
+
+// Count tokens ending in the new data; the carry holds the tail of the last read
+static int count_token(const char *buf, size_t len, size_t new_from, const char *token) {
+    int count = 0;
+    size_t tlen = strlen(token);
+    for (const char *p = buf; (p = memmem(p, buf + len - p, token, tlen)) != NULL; p++) {
+        if ((size_t)(p - buf) + tlen > new_from) count++;
+    }
+    return count;
+}
+
+static void scan(client_t *c, const char *data, size_t n) {
+    char buf[CARRY_SIZE + 4096];
+    memcpy(buf, c->carry, c->carry_len);
+    memcpy(buf + c->carry_len, data, n);
+    size_t len = c->carry_len + n;
+    c->broadcasts += count_token(buf, len, c->carry_len, "[BROADCAST]");
+    c->acks += count_token(buf, len, c->carry_len, "Message broadcasted");
+    c->carry_len = len < CARRY_SIZE ? len : CARRY_SIZE;
+    memcpy(c->carry, buf + len - c->carry_len, c->carry_len);
+}
+
+// mesh == 0: one shared memory cluster; otherwise TCP links on the ports
+// after the client ports
+static void test_servers(const char *server, int base_port, int mesh) {
+    printf("chatserver %s: %d processes on ports %d-%d\n", mesh ? "mesh" : "cluster",
+           NODES, base_port, base_port + NODES - 1);
+    char cluster[64];
+    snprintf(cluster, sizeof(cluster), "e2e-%d", (int)getpid());
+    if (mesh) {
+        size_t len = 0;
+        for (int i = 0; i < NODES; i++) {
+            len += snprintf(cluster + len, sizeof(cluster) - len, "%s127.0.0.1:%d",
+                            i ? "," : "", base_port + NODES + i);
+        }
+    }
+    pid_t pids[NODES];
+    for (int i = 0; i < NODES; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            char port[16], node[16];
+            snprintf(port, sizeof(port), "%d", base_port + i);
+            snprintf(node, sizeof(node), "%d", i);
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            execl(server, server, port, mesh ? "--mesh" : "--cluster", cluster, "--node", node, (char *)NULL);
+            _exit(127);
+        }
+    }
+
+    client_t clients[NODES];
+    char reply[4096], cmd[256];
+    int ready = 1;
+    for (int i = 0; i < NODES; i++) {
+        memset(&clients[i], 0, sizeof(client_t));
+        clients[i].fd = connect_to(base_port + i);
+        snprintf(cmd, sizeof(cmd), "/username node%d", i);
+        if (clients[i].fd < 0 || request(clients[i].fd, NULL, reply, sizeof(reply), 2000) < 0 ||
+            request(clients[i].fd, cmd, reply, sizeof(reply), 2000) < 0 ||
+            strncmp(reply, "SET_USERNAME", 12) != 0 ||
+            request(clients[i].fd, "/join lobby", reply, sizeof(reply), 2000) < 0) {
+            ready = 0;
+        }
+    }
+    check(ready, "4 clients registered, one per process, all in 'lobby'");
+    if (!ready) goto out;
+
+    // Every name is owned by some directory node, try them all from elsewhere
+    int refused = 0;
+    for (int i = 0; i < NODES; i++) {
+        int dup = connect_to(base_port + (i + 1) % NODES);
+        snprintf(cmd, sizeof(cmd), "/username node%d", i);
+        request(dup, NULL, reply, sizeof(reply), 2000);
+        request(dup, cmd, reply, sizeof(reply), 2000);
+        if (strncmp(reply, "ALREADY_TAKEN", 13) == 0) refused++;
+        close(dup);
+    }
+    check(refused == NODES, "each username is refused on the next node (%d/%d)", refused, NODES);
+
+    request(clients[3].fd, "/list", reply, sizeof(reply), 2000);
+    int listed = 0;
+    for (int i = 0; i < NODES; i++) {
+        snprintf(cmd, sizeof(cmd), "node%d ", i);
+        if (strstr(reply, cmd)) listed++;
+    }
+    check(listed == NODES, "/list on node 3 shows members of all nodes: %s", reply);
+
+    send(clients[0].fd, "/broadcast hello from node0", 27, 0);
+    int heard = 0;
+    for (int i = 1; i < NODES; i++) {
+        for (int tries = 0; tries < 3; tries++) {
+            if (request(clients[i].fd, NULL, reply, sizeof(reply), 1000) < 0) break;
+            if (strstr(reply, "[BROADCAST] node0: hello from node0")) {
+                heard++;
+                break;
+            }
+        }
+    }
+    request(clients[0].fd, NULL, reply, sizeof(reply), 500);   // the ack
+    check(heard == NODES - 1, "broadcast from node 0 reached the other %d processes", heard);
+
+    request(clients[1].fd, "/whisper node3 psst", reply, sizeof(reply), 2000);
+    request(clients[3].fd, NULL, reply, sizeof(reply), 2000);
+    if (!strstr(reply, "[WHISPER from node1]: psst")) {
+        request(clients[3].fd, NULL, reply, sizeof(reply), 1000);
+    }
+    check(strstr(reply, "[WHISPER from node1]: psst") != NULL, "whisper from node 1 reached node 3");
+
+    // Throughput: every client keeps one broadcast in flight
+    struct pollfd pfds[NODES];
+    for (int i = 0; i < NODES; i++) {
+        pfds[i].fd = clients[i].fd;
+        pfds[i].events = POLLIN;
+        clients[i].carry_len = 0;
+        clients[i].broadcasts = clients[i].acks = clients[i].sent = 0;
+        snprintf(cmd, sizeof(cmd), "/broadcast load %d %d", i, 0);
+        send(clients[i].fd, cmd, strlen(cmd), 0);
+        clients[i].sent = 1;
+    }
+    int expected = (NODES - 1) * E2E_BROADCASTS;
+    double start = now_sec(), last_progress = start;
+    while (now_sec() - last_progress < E2E_TIMEOUT_MS / 1000.0) {
+        int done = 1;
+        for (int i = 0; i < NODES; i++) {
+            if (clients[i].broadcasts < expected || clients[i].acks < E2E_BROADCASTS) done = 0;
+        }
+        if (done) break;
+        if (poll(pfds, NODES, 100) <= 0) continue;
+        for (int i = 0; i < NODES; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            char data[4096];
+            ssize_t n = recv(clients[i].fd, data, sizeof(data), 0);
+            if (n <= 0) continue;
+            int acks_before = clients[i].acks;
+            scan(&clients[i], data, n);
+            last_progress = now_sec();
+            if (clients[i].acks > acks_before && clients[i].sent < E2E_BROADCASTS) {
+                snprintf(cmd, sizeof(cmd), "/broadcast load %d %d", i, clients[i].sent++);
+                send(clients[i].fd, cmd, strlen(cmd), 0);
+            }
+        }
+    }
+    double elapsed = now_sec() - start;
+    int delivered = 0, complete = 1;
+    for (int i = 0; i < NODES; i++) {
+        delivered += clients[i].broadcasts;
+        if (clients[i].broadcasts != expected) complete = 0;
+    }
+    check(complete, "each client received all %d broadcasts from the other processes (%d total)",
+          expected, delivered);
+    printf("  %.0f cross-process deliveries/s (%d broadcasts in %.2f s)\n",
+           delivered / elapsed, NODES * E2E_BROADCASTS, elapsed);
+
+    if (mesh) {
+        // Drain the tail of the load so replies below are not mixed up with it
+        for (int i = 0; i < NODES; i++) {
+            while (request(clients[i].fd, NULL, reply, sizeof(reply), 200) == 0) {}
+        }
+        kill(pids[NODES - 1], SIGTERM);
+        waitpid(pids[NODES - 1], NULL, 0);
+        pids[NODES - 1] = -1;
+        usleep(300000);
+        request(clients[0].fd, "/list", reply, sizeof(reply), 2000);
+        snprintf(cmd, sizeof(cmd), "node%d ", NODES - 1);
+        check(strstr(reply, "node0 ") && !strstr(reply, cmd), "/list after node %d stopped: %s",
+              NODES - 1, reply);
+        int again = connect_to(base_port);
+        snprintf(cmd, sizeof(cmd), "/username node%d", NODES - 1);
+        request(again, NULL, reply, sizeof(reply), 2000);
+        request(again, cmd, reply, sizeof(reply), 2000);
+        check(strncmp(reply, "SET_USERNAME", 12) == 0, "its username can be taken on node 0");
+        close(again);
+    }
+
+out:
+    for (int i = 0; i < NODES; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+    for (int i = 0; i < NODES; i++) {
+        if (pids[i] < 0) continue;
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+    char name[80];
+    snprintf(name, sizeof(name), "/chatbus-%s", cluster);
+    shm_unlink(name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = argc > 1 ? argv[1] : "./chatserver";
+    int base_port = argc > 2 ? atoi(argv[2]) : 6100;
+    signal(SIGPIPE, SIG_IGN);
+
+    test_bus();
+    test_servers(server, base_port, 0);
+    test_servers(server, base_port + 2 * NODES, 1);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
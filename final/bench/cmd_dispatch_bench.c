@@ -0,0 +1,89 @@
+// Compile: make bench-dispatch
+// Compares the old copy + strtok + strcmp chain command parser with the
+// in-place perfect hash lookup used by handle_command().
+#include "../shared/chatDefination.h"
+#include "../server/command_table.h"
+
+#define ITERATIONS 2000000
+
+// Command mix recorded from server.log of a busy evening (broadcast heavy)
+static const char *recorded_mix[] = {
+    "/broadcast hello everyone",
+    "/broadcast did anyone finish the homework?",
+    "/whisper alice see you at 5",
+    "/broadcast lol",
+    "/list",
+    "/broadcast the server is fast today",
+    "/join room42",
+    "/broadcast brb",
+    "/whisper bob check the pdf",
+    "/sendfile notes.pdf bob 20480",
+    "/broadcast back",
+    "/leave",
+    "/username charlie",
+    "/help",
+    "/broadcast ok",
+    "/exit",
+};
+#define MIX_SIZE (sizeof(recorded_mix) / sizeof(recorded_mix[0]))
+
+static int legacy_parse(const char *message) {
+    char message_copy[BUFFER_SIZE];
+    strncpy(message_copy, message, BUFFER_SIZE - 1);
+    message_copy[BUFFER_SIZE - 1] = '\0';
+    char *cmd = strtok(message_copy, " ");
+    if (strcmp(cmd, "/username") == 0) return CMD_USERNAME;
+    else if (strcmp(cmd, "/join") == 0) return CMD_JOIN;
+    else if (strcmp(cmd, "/broadcast") == 0) return CMD_BROADCAST;
+    else if (strcmp(cmd, "/leave") == 0) return CMD_LEAVE;
+    else if (strcmp(cmd, "/whisper") == 0) return CMD_WHISPER;
+    else if (strcmp(cmd, "/sendfile") == 0) return CMD_SENDFILE;
+    else if (strcmp(cmd, "/list") == 0) return CMD_LIST;
+    else if (strcmp(cmd, "/exit") == 0) return CMD_EXIT;
+    else if (strcmp(cmd, "/help") == 0) return CMD_HELP;
+    return CMD_UNKNOWN;
+}
+
+static int table_parse(char *message) {
+    size_t cmd_len = strcspn(message, " ");
+    return command_lookup(message, cmd_len);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    // handle_command gets a mutable read buffer, mirror that here
+    char messages[MIX_SIZE][BUFFER_SIZE];
+    for (size_t i = 0; i < MIX_SIZE; i++) {
+        snprintf(messages[i], BUFFER_SIZE, "%s", recorded_mix[i]);
+        if (legacy_parse(messages[i]) != table_parse(messages[i])) {
+            fprintf(stderr, "Parser mismatch on '%s'\n", recorded_mix[i]);
+            return 1;
+        }
+    }
+
+    volatile long sink = 0;
+    double start = now_sec();
+    for (long i = 0; i < ITERATIONS; i++) {
+        sink += legacy_parse(messages[i % MIX_SIZE]);
+    }
+    double legacy_time = now_sec() - start;
+
+    start = now_sec();
+    for (long i = 0; i < ITERATIONS; i++) {
+        sink += table_parse(messages[i % MIX_SIZE]);
+    }
+    double table_time = now_sec() - start;
+
+    printf("Command parsing, %d commands from a %zu entry recorded mix\n", ITERATIONS, MIX_SIZE);
+    printf("  strtok + strcmp chain : %8.2f Mcmd/s (%6.1f ns/cmd)\n",
+           ITERATIONS / legacy_time / 1e6, legacy_time * 1e9 / ITERATIONS);
+    printf("  perfect hash table    : %8.2f Mcmd/s (%6.1f ns/cmd)\n",
+           ITERATIONS / table_time / 1e6, table_time * 1e9 / ITERATIONS);
+    printf("  speedup               : %8.2fx\n", legacy_time / table_time);
+    return (int)(sink & 0);
+}
@@ -0,0 +1,619 @@
+// Compile: make test-conformance
+// Protocol conformance and performance across server implementations.
+// Every server command on the command line (chatserver, server.py, ...) is
+// started on a port of its own and put through the same scripted
+// scenarios:
+//  1. login: greeting, username rules, taken names
+//  2. rooms: join, broadcast, whisper, /list (also after a rename),
+//     /leave, unknown commands,
+//     text holding the 0x01 compressed frame marker
+//  3. a sender that drops its data connection mid-transfer: both sides
+//     hear FILE_TRANSFER_FAILED and the transfer slot is free again
+//  4. MAX_SIMULTANEOUS_TRANSFERS running, MAX_FILE_QUEUE queued in order,
+//     one more refused with FILE_QUEUE_FULL
+// then a broadcast load (each client one broadcast in flight) measures
+// throughput and ack latency. MAX_CLIENTS differs between implementations
+// (30 in chatserver, 15 in server.py), so it is probed and reported rather
+// than checked. Ends with a side by side table; exits non-zero on any
+// failed check.
+#define _GNU_SOURCE     // memmem
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "../shared/chatDefination.h"
+
+#define MAX_IMPLS 8
+#define PEER_BUFFER (64 * 1024)
+#define REPLY_MS 2000
+#define QUIET_MS 300            // how long "nothing arrives" is watched for
+#define SIMULATED_TRANSFER_MS 2000
+#define PROBE_LIMIT 64          // connections tried when probing MAX_CLIENTS
+#define PERF_CLIENTS 8          // fits every implementation's room and client limits
+#define PERF_SECONDS 3
+#define CARRY_SIZE 32
+
+typedef struct {
+    const char *command;
+    int port;
+    int checks, passed;
+    int max_clients;            // -1 if no connection was refused up to PROBE_LIMIT
+    double broadcasts_per_sec, deliveries_per_sec;
+    double ack_p50_us, ack_p99_us;
+} impl_t;
+
+typedef struct {
+    int fd;
+    char buf[PEER_BUFFER];
+    size_t len;
+} peer_t;
+
+static impl_t *current;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ok, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("  [%s] ", ok ? "ok" : "FAIL");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    current->checks++;
+    current->passed += ok != 0;
+}
+
+static int connect_to(int port, int attempts) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(100000);
+    }
+    return -1;
+}
+
+// Append whatever arrives within timeout_ms; returns 0 once the peer closed
+static int peer_fill(peer_t *p, int timeout_ms) {
+    if (p->fd < 0) return 0;
+    struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 1;
+    if (p->len == sizeof(p->buf)) {
+        // Nobody waits for that much; keep the newer half
+        memmove(p->buf, p->buf + p->len / 2, p->len - p->len / 2);
+        p->len -= p->len / 2;
+    }
+    ssize_t n = recv(p->fd, p->buf + p->len, sizeof(p->buf) - p->len, 0);
+    if (n <= 0) return 0;
+    p->len += n;
+    return 1;
+}
+
+static void peer_send(peer_t *p, const char *format, ...) {
+    char line[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    line[len++] = '\n';
+    send(p->fd, line, len, MSG_NOSIGNAL);
+}
+
+static void peer_close(peer_t *p) {
+    if (p->fd >= 0) close(p->fd);
+    p->fd = -1;
+    p->len = 0;
+}
+
+// Wait for token and drop everything up to and including it. Replies carry
+// no framing, so tokens are searched for wherever they fall.
+static int expect(peer_t *p, const char *token, int timeout_ms) {
+    size_t tlen = strlen(token);
+    double deadline = now_sec() + timeout_ms / 1000.0;
+    while (1) {
+        char *at = memmem(p->buf, p->len, token, tlen);
+        if (at) {
+            size_t used = at - p->buf + tlen;
+            memmove(p->buf, p->buf + used, p->len - used);
+            p->len -= used;
+            return 1;
+        }
+        int left = (int)((deadline - now_sec()) * 1000);
+        if (left <= 0 || !peer_fill(p, left)) return 0;
+    }
+}
+
+// Wait for a line starting with prefix and copy it out, without the newline
+static int expect_line(peer_t *p, const char *prefix, char *line, size_t size, int timeout_ms) {
+    size_t plen = strlen(prefix);
+    double deadline = now_sec() + timeout_ms / 1000.0;
+    while (1) {
+        char *at = memmem(p->buf, p->len, prefix, plen);
+        char *end = at ? memchr(at, '\n', p->buf + p->len - at) : NULL;
+        if (end) {
+            snprintf(line, size, "%.*s", (int)(end - at), at);
+            size_t used = end + 1 - p->buf;
+            memmove(p->buf, p->buf + used, p->len - used);
+            p->len -= used;
+            return 1;
+        }
+        int left = (int)((deadline - now_sec()) * 1000);
+        if (left <= 0 || !peer_fill(p, left)) return 0;
+    }
+}
+
+// Collect for ms, then count token in everything held
+static int count_after(peer_t *p, const char *token, int ms) {
+    double deadline = now_sec() + ms / 1000.0;
+    int left;
+    while ((left = (int)((deadline - now_sec()) * 1000)) > 0 && peer_fill(p, left)) {}
+    int count = 0;
+    size_t tlen = strlen(token);
+    for (char *at = p->buf; (at = memmem(at, p->buf + p->len - at, token, tlen)) != NULL; at += tlen) {
+        count++;
+    }
+    return count;
+}
+
+static int open_peer(peer_t *p, int port) {
+    p->len = 0;
+    p->fd = connect_to(port, 1);
+    return p->fd >= 0 && expect(p, "SUCCESS_LOGIN", REPLY_MS);
+}
+
+static int login(peer_t *p, int port, const char *username) {
+    if (!open_peer(p, port)) return 0;
+    peer_send(p, "/username %s", username);
+    return expect(p, "SET_USERNAME", REPLY_MS);
+}
+
+static pid_t start_server(const impl_t *impl) {
+    char line[512];
+    snprintf(line, sizeof(line), "exec %s %d", impl->command, impl->port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", line, (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 30; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return;
+        usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// ---- scenarios ----
+
+static void test_login(int port, peer_t *alice, peer_t *bob, peer_t *carol) {
+    printf("login\n");
+    check(open_peer(alice, port), "greeting SUCCESS_LOGIN");
+    peer_send(alice, "/username ab");
+    check(expect(alice, "[SERVER] Invalid username", REPLY_MS), "a 2 letter username is refused");
+    peer_send(alice, "/username alice");
+    check(expect(alice, "SET_USERNAME", REPLY_MS), "alice registers");
+
+    check(open_peer(bob, port), "second connection greeted");
+    peer_send(bob, "/username alice");
+    check(expect(bob, "ALREADY_TAKEN", REPLY_MS), "a taken name answers ALREADY_TAKEN");
+    peer_send(bob, "/username bob");
+    check(expect(bob, "SET_USERNAME", REPLY_MS), "bob registers on the same connection");
+    check(login(carol, port, "carol"), "carol registers");
+
+    // Older clients write one bare command at a time, with no newline
+    peer_t old = { .fd = -1 };
+    int greeted = open_peer(&old, port);
+    send(old.fd, "/username oldie", 15, MSG_NOSIGNAL);
+    check(greeted && expect(&old, "SET_USERNAME", REPLY_MS), "a bare command without a newline still runs");
+    peer_close(&old);
+}
+
+static void test_rooms(int port, peer_t *alice, peer_t *bob, peer_t *carol) {
+    printf("rooms\n");
+    peer_send(alice, "/broadcast too early");
+    check(expect(alice, "[SERVER] You must join a room first", REPLY_MS), "broadcast outside a room is refused");
+    peer_send(alice, "/join bad-name!");
+    check(expect(alice, "[SERVER] Invalid room name", REPLY_MS), "an invalid room name is refused");
+
+    peer_send(alice, "/join lobby");
+    peer_send(bob, "/join lobby");
+    peer_send(carol, "/join other");
+    int joined = expect(alice, "[SERVER] Joined room 'lobby'", REPLY_MS);
+    joined += expect(bob, "[SERVER] Joined room 'lobby'", REPLY_MS);
+    joined += expect(carol, "[SERVER] Joined room 'other'", REPLY_MS);
+    check(joined == 3, "alice and bob join 'lobby', carol 'other'");
+
+    peer_send(alice, "/broadcast hello lobby");
+    check(expect(alice, "[SERVER] Message broadcasted", REPLY_MS), "broadcast acknowledged");
+    check(expect(bob, "[BROADCAST] alice: hello lobby", REPLY_MS), "bob receives alice's broadcast");
+    check(count_after(carol, "[BROADCAST]", QUIET_MS) == 0, "carol in another room does not");
+    check(count_after(alice, "[BROADCAST] alice", QUIET_MS) == 0, "alice does not get her own broadcast");
+
+    // A line cut across TCP segments waits for its newline
+    send(alice->fd, "/broadcast hel", 14, MSG_NOSIGNAL);
+    usleep(300000);
+    peer_send(alice, "lo world");
+    check(expect(bob, "[BROADCAST] alice: hello world", REPLY_MS) &&
+          count_after(bob, "[BROADCAST] alice: hel\n", 0) == 0, "a command split over two writes runs whole");
+    check(count_after(alice, "Unknown command", QUIET_MS) == 0, "its second half is not run on its own");
+    alice->len = 0;
+
+    char line[BUFFER_SIZE];
+    peer_send(bob, "/list");
+    int listed = expect(bob, "[SERVER] Users in room: ", REPLY_MS) && (peer_fill(bob, QUIET_MS), 1);
+    snprintf(line, sizeof(line), "%.*s", (int)bob->len, bob->buf);
+    bob->len = 0;
+    check(listed && strstr(line, "alice ") && strstr(line, "bob ") && !strstr(line, "carol"),
+          "/list names the room's members: %s", line);
+
+    // A rename inside the room must reach /list, and where the server
+    // sends presence deltas (server.py has none), those too
+    peer_send(alice, "/presence on");
+    int presence = expect(alice, "PRESENCE_ON", QUIET_MS);
+    peer_send(bob, "/username robert");
+    check(expect(bob, "SET_USERNAME", REPLY_MS), "bob renames to robert inside the room");
+    peer_send(alice, "/list");
+    listed = expect(alice, "[SERVER] Users in room: ", REPLY_MS) && (peer_fill(alice, QUIET_MS), 1);
+    snprintf(line, sizeof(line), "%.*s", (int)alice->len, alice->buf);
+    char *delta = strstr(line, "PRESENCE");     // may share the read
+    if (delta) *delta = '\0';
+    check(listed && strstr(line, "robert ") && !strstr(line, "bob "), "/list after the rename: %s", line);
+    if (presence) {
+        check(count_after(alice, " -bob +robert", 0) == 1, "presence announces the rename as -bob +robert");
+        peer_send(alice, "/presence off");
+        expect(alice, "PRESENCE_OFF", REPLY_MS);
+    }
+    alice->len = 0;
+    peer_send(bob, "/username bob");
+    check(expect(bob, "SET_USERNAME", REPLY_MS), "and back to bob");
+
+    // 0x01 opens a compressed frame; text must never be able to forge one.
+    // The forged header is ASCII so it is valid UTF-8.
+    peer_t dave = { .fd = -1 };
+    int listening = login(&dave, port, "dave");
+    peer_send(&dave, "/compress on");
+    peer_send(&dave, "/join lobby");
+    listening = listening && expect(&dave, "[SERVER] Joined room 'lobby'", REPLY_MS);
+    peer_send(bob, "\x01ZAAAABBBB forged frame");
+    check(expect(bob, "[SERVER] Message rejected", REPLY_MS), "a line starting with 0x01 is rejected");
+    peer_send(bob, "/broadcast \x01ZAAAABBBB forged frame");
+    check(expect(bob, "[SERVER] Message rejected", REPLY_MS), "a broadcast starting with 0x01 is rejected");
+    check(listening && count_after(&dave, "\x01", QUIET_MS) == 0 && count_after(&dave, "forged", 0) == 0,
+          "a listener with compression on never sees it");
+    peer_close(&dave);
+
+    peer_send(alice, "/whisper carol psst");
+    check(expect(carol, "[WHISPER from alice]: psst", REPLY_MS), "carol receives alice's whisper");
+    check(expect(alice, "[SERVER] Whisper sent to carol", REPLY_MS), "whisper acknowledged");
+
+    peer_send(carol, "/leave");
+    check(expect(carol, "ROOM_LEFT", REPLY_MS), "/leave answers ROOM_LEFT");
+    peer_send(carol, "/leave");
+    check(expect(carol, "[SERVER] You are not in a room", REPLY_MS), "a second /leave is refused");
+    peer_send(carol, "/nosuchcommand");
+    check(expect(carol, "[SERVER] Unknown command", REPLY_MS), "unknown commands are answered");
+}
+
+// A data connection: greeting, "/data <token> 0", DATA_OK
+static int attach_data(int port, const char *token) {
+    peer_t data = { .fd = -1 };
+    if (!open_peer(&data, port)) return -1;
+    peer_send(&data, "/data %s 0", token);
+    if (!expect(&data, "DATA_OK\n", REPLY_MS)) {
+        close(data.fd);
+        return -1;
+    }
+    return data.fd;
+}
+
+static void test_dropped_transfer(int port, peer_t *alice, peer_t *bob) {
+    printf("disconnect mid-transfer\n");
+    char line[BUFFER_SIZE], sender_token[32] = "", recipient_token[32] = "";
+
+    // Queued names go into the WAL, which keeps 127 bytes; cut there this
+    // one would still end in .txt
+    char long_name[160];
+    memset(long_name, 'n', 123);
+    strcpy(long_name + 123, ".txt.txt");
+    peer_send(alice, "/sendfile %s bob 10 9", long_name);
+    check(expect(alice, "INVALID_FILE_TYPE 9", REPLY_MS), "a file name over 127 bytes is refused");
+
+    peer_send(alice, "/sendfile dropped.txt bob 200000 7");
+    if (expect_line(alice, "READY_FOR_FILE 7 ", line, sizeof(line), REPLY_MS)) {
+        sscanf(line, "READY_FOR_FILE 7 %31s", sender_token);
+    }
+    if (expect_line(bob, "INCOMING_FILE alice dropped.txt 200000 7 ", line, sizeof(line), REPLY_MS)) {
+        sscanf(line, "INCOMING_FILE alice dropped.txt 200000 7 %31s", recipient_token);
+    }
+    check(sender_token[0] && recipient_token[0], "both sides get a data token");
+    if (!sender_token[0] || !recipient_token[0]) return;
+
+    int sender = attach_data(port, sender_token);
+    int recipient = attach_data(port, recipient_token);
+    check(sender >= 0 && recipient >= 0, "both data connections attach");
+    if (sender < 0 || recipient < 0) {
+        if (sender >= 0) close(sender);
+        if (recipient >= 0) close(recipient);
+        return;
+    }
+
+    // A quarter of the file, then the sender goes away
+    static char chunk[50000];
+    memset(chunk, 'x', sizeof(chunk));
+    ssize_t sent = send(sender, chunk, sizeof(chunk), MSG_NOSIGNAL);
+    size_t relayed = 0;
+    struct pollfd pfd = { .fd = recipient, .events = POLLIN };
+    while (relayed < sizeof(chunk) && poll(&pfd, 1, REPLY_MS) > 0) {
+        ssize_t n = recv(recipient, chunk, sizeof(chunk), 0);
+        if (n <= 0) break;
+        relayed += n;
+    }
+    check(sent == (ssize_t)sizeof(chunk) && relayed == sizeof(chunk), "first %zu bytes relayed", relayed);
+    close(sender);
+
+    check(expect(alice, "FILE_TRANSFER_FAILED 7", REPLY_MS), "sender hears FILE_TRANSFER_FAILED");
+    check(expect(bob, "FILE_TRANSFER_FAILED 7 alice", REPLY_MS), "recipient hears FILE_TRANSFER_FAILED");
+    char byte;
+    check(poll(&pfd, 1, REPLY_MS) > 0 && recv(recipient, &byte, 1, 0) == 0,
+          "the recipient's data connection is closed");
+    close(recipient);
+
+    // The slot went back: the next transfer is not queued
+    peer_send(alice, "/sendfile after.txt bob 10");
+    check(expect(alice, "READY_FOR_FILE", REPLY_MS), "the next transfer starts at once");
+    int done = expect(alice, "FILE_TRANSFER_SUCCESS", SIMULATED_TRANSFER_MS + REPLY_MS) &&
+               expect(bob, "FILE_TRANSFER_SUCCESS", REPLY_MS);
+    check(done, "and completes on both sides");
+}
+
+static void test_queueing(peer_t *alice, peer_t *bob) {
+    printf("queueing: %d running, %d queued, one refused\n", MAX_SIMULTANEOUS_TRANSFERS, MAX_FILE_QUEUE);
+    int total = MAX_SIMULTANEOUS_TRANSFERS + MAX_FILE_QUEUE;
+    alice->len = bob->len = 0;
+    for (int i = 0; i <= total; i++) {
+        peer_send(alice, "/sendfile queued%d.txt bob 10", i);
+    }
+    int ready = count_after(alice, "READY_FOR_FILE", QUIET_MS * 2);
+    int positions = 0;
+    char text[64];
+    for (int i = 1; i <= MAX_FILE_QUEUE; i++) {
+        snprintf(text, sizeof(text), "Queue position: %d\n", i);
+        positions += count_after(alice, text, 0);
+    }
+    check(ready == MAX_SIMULTANEOUS_TRANSFERS, "%d of %d transfers start at once", ready, MAX_SIMULTANEOUS_TRANSFERS);
+    check(positions == MAX_FILE_QUEUE, "%d queued at positions 1-%d", positions, MAX_FILE_QUEUE);
+    check(count_after(alice, "FILE_QUEUE_FULL", 0) == 1, "the last one is refused with FILE_QUEUE_FULL");
+
+    // Each finished transfer starts the oldest queued one
+    int succeeded = 0;
+    double deadline = now_sec() + (3 * SIMULATED_TRANSFER_MS + REPLY_MS) / 1000.0;
+    while (now_sec() < deadline && (succeeded = count_after(bob, "FILE_TRANSFER_SUCCESS", 100)) < total) {}
+    check(succeeded == total, "all %d complete (%d seen by the recipient)", total, succeeded);
+    int started = count_after(alice, "READY_FOR_FILE", QUIET_MS);
+    check(started == total, "%d of %d queued transfers started", started - ready, MAX_FILE_QUEUE);
+
+    // Queued ones start as slots free up, possibly two at once, so only
+    // their place after every running transfer is fixed
+    char *last_running = NULL, *first_queued = NULL;
+    for (int i = 0; i < total; i++) {
+        snprintf(text, sizeof(text), "INCOMING_FILE alice queued%d.txt", i);
+        char *at = memmem(bob->buf, bob->len, text, strlen(text));
+        if (i < MAX_SIMULTANEOUS_TRANSFERS) {
+            if (!at) last_running = bob->buf + bob->len;
+            else if (!last_running || at > last_running) last_running = at;
+        } else if (!at) {
+            first_queued = bob->buf;
+        } else if (!first_queued || at < first_queued) {
+            first_queued = at;
+        }
+    }
+    check(last_running && first_queued && last_running < first_queued,
+          "the recipient is offered the queued transfers after the running ones");
+    alice->len = bob->len = 0;
+}
+
+// Connect until the server turns one away; the first refusal is the limit
+static void probe_max_clients(int port) {
+    printf("limits\n");
+    int fds[PROBE_LIMIT], accepted = 0, refused = 0;
+    for (int i = 0; i < PROBE_LIMIT && !refused; i++) {
+        peer_t p = { .fd = -1 };
+        fds[i] = -1;
+        if (!open_peer(&p, port)) {
+            refused = p.fd >= 0 && memmem(p.buf, p.len, "Server full", 11) != NULL;
+            if (p.fd >= 0) close(p.fd);
+            break;
+        }
+        fds[i] = p.fd;
+        accepted++;
+    }
+    current->max_clients = refused ? accepted : -1;
+    check(refused, "connection %d is turned away with 'Server full'", accepted + 1);
+    for (int i = 0; i < accepted; i++) close(fds[i]);
+}
+
+// ---- load ----
+
+typedef struct {
+    peer_t peer;
+    char carry[CARRY_SIZE];
+    size_t carry_len;
+    double sent_at;
+    int acks, broadcasts;
+} load_client_t;
+
+static int count_in(const char *buf, size_t len, size_t new_from, const char *token) {
+    int count = 0;
+    size_t tlen = strlen(token);
+    for (const char *p = buf; (p = memmem(p, buf + len - p, token, tlen)) != NULL; p++) {
+        if ((size_t)(p - buf) + tlen > new_from) count++;
+    }
+    return count;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void measure_broadcasts(int port) {
+    printf("load: %d clients in one room, one broadcast each in flight for %d s\n", PERF_CLIENTS, PERF_SECONDS);
+    static load_client_t clients[PERF_CLIENTS];
+    struct pollfd pfds[PERF_CLIENTS];
+    char name[32];
+    int ready = 1;
+    for (int i = 0; i < PERF_CLIENTS; i++) {
+        memset(&clients[i], 0, sizeof(load_client_t));
+        snprintf(name, sizeof(name), "load%d", i);
+        if (!login(&clients[i].peer, port, name)) {
+            ready = 0;
+            continue;
+        }
+        peer_send(&clients[i].peer, "/join loadroom");
+        ready &= expect(&clients[i].peer, "Joined room", REPLY_MS);
+    }
+    check(ready, "%d load clients in 'loadroom'", PERF_CLIENTS);
+    if (!ready) goto out;
+
+    size_t cap = 1 << 20, acked = 0;
+    double *latency = malloc(cap * sizeof(double));
+    double start = now_sec(), end = start + PERF_SECONDS;
+    for (int i = 0; i < PERF_CLIENTS; i++) {
+        pfds[i] = (struct pollfd){ .fd = clients[i].peer.fd, .events = POLLIN };
+        clients[i].sent_at = now_sec();
+        peer_send(&clients[i].peer, "/broadcast load from %d", i);
+    }
+    while (now_sec() < end) {
+        if (poll(pfds, PERF_CLIENTS, 100) <= 0) continue;
+        for (int i = 0; i < PERF_CLIENTS; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            load_client_t *c = &clients[i];
+            char buf[CARRY_SIZE + 4096];
+            memcpy(buf, c->carry, c->carry_len);
+            ssize_t n = recv(c->peer.fd, buf + c->carry_len, sizeof(buf) - c->carry_len, 0);
+            if (n <= 0) {
+                pfds[i].fd = -1;
+                continue;
+            }
+            size_t len = c->carry_len + n;
+            c->broadcasts += count_in(buf, len, c->carry_len, "[BROADCAST]");
+            int acks = count_in(buf, len, c->carry_len, "Message broadcasted");
+            c->carry_len = len < CARRY_SIZE ? len : CARRY_SIZE;
+            memcpy(c->carry, buf + len - c->carry_len, c->carry_len);
+            if (acks == 0) continue;
+            double now = now_sec();
+            if (acked < cap) latency[acked++] = (now - c->sent_at) * 1e6;
+            c->acks += acks;
+            c->sent_at = now;
+            peer_send(&c->peer, "/broadcast load from %d", i);
+        }
+    }
+    double elapsed = now_sec() - start;
+    int delivered = 0;
+    for (int i = 0; i < PERF_CLIENTS; i++) delivered += clients[i].broadcasts;
+    qsort(latency, acked, sizeof(double), cmp_double);
+    current->broadcasts_per_sec = acked / elapsed;
+    current->deliveries_per_sec = delivered / elapsed;
+    current->ack_p50_us = acked ? latency[(size_t)(0.50 * (acked - 1))] : 0;
+    current->ack_p99_us = acked ? latency[(size_t)(0.99 * (acked - 1))] : 0;
+    free(latency);
+    check(acked > 0, "%zu broadcasts acknowledged", acked);
+    printf("  %.0f broadcasts/s, %.0f deliveries/s, ack p50 %.0f us, p99 %.0f us\n",
+           current->broadcasts_per_sec, current->deliveries_per_sec, current->ack_p50_us, current->ack_p99_us);
+
+out:
+    for (int i = 0; i < PERF_CLIENTS; i++) peer_close(&clients[i].peer);
+}
+
+static void run_impl(impl_t *impl) {
+    current = impl;
+    printf("== %s (port %d)\n", impl->command, impl->port);
+    pid_t pid = start_server(impl);
+    int fd = connect_to(impl->port, 50);
+    check(fd >= 0, "server accepts connections");
+    if (fd < 0) {
+        stop_server(pid);
+        return;
+    }
+    close(fd);
+
+    static peer_t alice, bob, carol;
+    alice.fd = bob.fd = carol.fd = -1;
+    test_login(impl->port, &alice, &bob, &carol);
+    if (alice.fd >= 0 && bob.fd >= 0 && carol.fd >= 0) {
+        test_rooms(impl->port, &alice, &bob, &carol);
+        test_dropped_transfer(impl->port, &alice, &bob);
+        test_queueing(&alice, &bob);
+    }
+    peer_close(&alice);
+    peer_close(&bob);
+    peer_close(&carol);
+
+    usleep(QUIET_MS * 1000);    // let the server free the slots
+    probe_max_clients(impl->port);
+    usleep(QUIET_MS * 1000);
+    measure_broadcasts(impl->port);
+    stop_server(pid);
+}
+
+int main(int argc, char *argv[]) {
+    int base_port = 6200;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+        base_port = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || argc - first > MAX_IMPLS) {
+        fprintf(stderr, "Usage: %s [-p base_port] <server command>...\n"
+                        "  e.g. %s ./chatserver \"python3 server/server.py\"\n", argv[0], argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    impl_t impls[MAX_IMPLS];
+    int count = argc - first;
+    for (int i = 0; i < count; i++) {
+        impls[i] = (impl_t){ .command = argv[first + i], .port = base_port + i };
+        run_impl(&impls[i]);
+    }
+
+    // Columns are numbered; long commands do not fit a column
+    printf("\n");
+    for (int i = 0; i < count; i++) printf("[%d] %s\n", i + 1, impls[i].command);
+    printf("%-24s", "");
+    for (int i = 0; i < count; i++) printf(" %11s[%d]", "", i + 1);
+    printf("\n%-24s", "checks passed");
+    for (int i = 0; i < count; i++) printf(" %8d of %3d", impls[i].passed, impls[i].checks);
+    printf("\n%-24s", "MAX_CLIENTS (probed)");
+    for (int i = 0; i < count; i++) {
+        if (impls[i].max_clients < 0) printf(" %13s+", "64");
+        else printf(" %14d", impls[i].max_clients);
+    }
+    printf("\n%-24s", "broadcasts/s");
+    for (int i = 0; i < count; i++) printf(" %14.0f", impls[i].broadcasts_per_sec);
+    printf("\n%-24s", "deliveries/s");
+    for (int i = 0; i < count; i++) printf(" %14.0f", impls[i].deliveries_per_sec);
+    printf("\n%-24s", "broadcast ack p50 (us)");
+    for (int i = 0; i < count; i++) printf(" %14.0f", impls[i].ack_p50_us);
+    printf("\n%-24s", "broadcast ack p99 (us)");
+    for (int i = 0; i < count; i++) printf(" %14.0f", impls[i].ack_p99_us);
+    printf("\n");
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) failed += impls[i].passed != impls[i].checks;
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? 1 : 0;
+}
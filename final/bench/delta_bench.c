@@ -0,0 +1,163 @@
+// Compile: make bench-delta
+// Delta transfers: times the weak block sum at every level this CPU has
+// and checks the levels agree, then re-sends a 3 MB file after the kinds
+// of edits people make to documents and reports the signature and delta
+// sizes, the bytes saved and the time to sign, encode and apply. Every
+// rebuilt file is compared with the one that was sent.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../client/delta.h"
+#include "../shared/chatDefination.h"
+#include "../shared/textscan.h"
+
+#define SUM_ROUNDS 200
+#define CHECK_CASES 20000
+
+static int failures = 0;
+static volatile uint32_t sink;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned next_random(unsigned *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void random_bytes(unsigned char *buf, size_t len, unsigned *seed) {
+    for (size_t i = 0; i < len; i++) buf[i] = (unsigned char)next_random(seed);
+}
+
+// rsync's definition, byte at a time, to check every level against
+static uint32_t reference_sum(const unsigned char *data, size_t len) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += (uint32_t)(len - i) * data[i];
+    }
+    return (s1 & 0xFFFF) | (s2 << 16);
+}
+
+static void cross_check(textscan_level_t top) {
+    unsigned seed = 0x2545F491u;
+    unsigned char *buf = malloc(DELTA_MAX_BLOCK + 64);
+    for (int c = 0; c < CHECK_CASES; c++) {
+        size_t len = next_random(&seed) % (DELTA_MAX_BLOCK + 1);
+        unsigned char *s = buf + next_random(&seed) % 48;
+        // Mostly random, sometimes all 0xFF to push the sums hardest
+        if (c % 8 == 0) memset(s, 0xFF, len);
+        else random_bytes(s, len, &seed);
+        uint32_t expect = reference_sum(s, len);
+        for (int level = TEXTSCAN_SCALAR; level <= (int)top; level++) {
+            textscan_limit(level);
+            if (delta_weak_sum(s, len) != expect) {
+                if (failures < 10) printf("  FAIL (%s): case %d, %zu bytes disagree\n", textscan_level_name(level), c, len);
+                failures++;
+            }
+        }
+    }
+    free(buf);
+}
+
+static void time_sums(textscan_level_t level, const unsigned char *data, size_t size) {
+    textscan_limit(level);
+    size_t block = delta_block_size(size);
+    double t0 = now_sec();
+    uint32_t acc = 0;
+    for (int r = 0; r < SUM_ROUNDS; r++) {
+        for (size_t i = 0; i + block <= size; i += block) acc += delta_weak_sum(data + i, block);
+    }
+    double elapsed = now_sec() - t0;
+    sink = acc;
+    printf("  %-7s %8.0f MB/s  (%zu byte blocks)\n", textscan_level_name(level),
+           size / 1048576.0 * SUM_ROUNDS / elapsed, block);
+}
+
+typedef struct {
+    const char *name;
+    size_t size;
+    unsigned char *data;
+} version_t;
+
+// Sign the basis, encode the new version against it and rebuild it
+static void run_case(const char *label, const unsigned char *basis, size_t basis_size, const version_t *v) {
+    double t0 = now_sec();
+    size_t signature_len;
+    unsigned char *signature = delta_signature(basis, basis_size, &signature_len);
+    double t1 = now_sec();
+    size_t delta_len;
+    unsigned char *delta = delta_encode(signature, signature_len, v->data, v->size, &delta_len);
+    double t2 = now_sec();
+    unsigned char *out = malloc(v->size + 1);
+    int applied = delta && delta_apply(basis, basis_size, delta_block_size(basis_size),
+                                       delta, delta_len, out, v->size) == 0;
+    double t3 = now_sec();
+    if (!applied || memcmp(out, v->data, v->size) != 0) {
+        printf("  FAIL (%s): rebuilt file differs from what was sent\n", label);
+        failures++;
+    }
+    if (delta && delta_len > DELTA_MAX_WIRE(v->size)) {
+        printf("  FAIL (%s): delta of %zu bytes is over the limit\n", label, delta_len);
+        failures++;
+    }
+    size_t wire = signature_len + delta_len + 8;
+    printf("  %-22s sig %6zu B  delta %8zu B  saved %7zu B (%5.1f%%)  sign %5.2f ms  encode %5.2f ms  apply %5.2f ms\n",
+           label, signature_len, delta_len, v->size > wire ? v->size - wire : 0,
+           v->size > wire ? 100.0 * (v->size - wire) / v->size : 0.0,
+           (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3);
+    free(signature);
+    free(delta);
+    free(out);
+}
+
+int main(void) {
+    textscan_level_t top = textscan_level();
+    size_t size = MAX_FILE_SIZE - 256 * 1024;
+    unsigned seed = 2463534242u;
+    unsigned char *basis = malloc(size);
+    random_bytes(basis, size, &seed);
+
+    printf("Weak block sums over %.1f MB, best level on this CPU: %s\n", size / 1048576.0, textscan_level_name(top));
+    cross_check(top);
+    for (int level = TEXTSCAN_SCALAR; level <= (int)top; level++) time_sums(level, basis, size);
+
+    // The edits, each applied to a copy of the basis
+    version_t v[6];
+    v[0] = (version_t){ "unchanged", size, malloc(size) };
+    memcpy(v[0].data, basis, size);
+    v[1] = (version_t){ "20 bytes changed", size, malloc(size) };
+    memcpy(v[1].data, basis, size);
+    for (int i = 0; i < 20; i++) v[1].data[next_random(&seed) % size] ^= 0x5A;
+    v[2] = (version_t){ "4 KB inserted", size + 4096, malloc(size + 4096) };
+    memcpy(v[2].data, basis, size / 2);
+    random_bytes(v[2].data + size / 2, 4096, &seed);
+    memcpy(v[2].data + size / 2 + 4096, basis + size / 2, size - size / 2);
+    v[3] = (version_t){ "64 KB deleted", size - 65536, malloc(size) };
+    memcpy(v[3].data, basis, size / 3);
+    memcpy(v[3].data + size / 3, basis + size / 3 + 65536, size - size / 3 - 65536);
+    v[4] = (version_t){ "200 KB appended", size + 204800, malloc(size + 204800) };
+    memcpy(v[4].data, basis, size);
+    random_bytes(v[4].data + size, 204800, &seed);
+    v[5] = (version_t){ "rewritten", size, malloc(size) };
+    random_bytes(v[5].data, size, &seed);
+
+    // Scalar sums next to the best level
+    textscan_level_t levels[] = { TEXTSCAN_SCALAR, top };
+    for (int l = 0; l < (top > TEXTSCAN_SCALAR ? 2 : 1); l++) {
+        textscan_limit(levels[l]);
+        printf("Re-sending after edits, sums at %s:\n", textscan_level_name(levels[l]));
+        for (int i = 0; i < 6; i++) run_case(v[i].name, basis, size, &v[i]);
+    }
+    run_case("no copy at the recipient", basis, 0, &v[0]);
+    for (int i = 0; i < 6; i++) free(v[i].data);
+    free(basis);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+// Compile: make bench-recv
+// Receives a file over a loopback TCP connection the two ways the client
+// has done it: recv() into a buffer and write() it out, and recv()
+// straight into a fallocated, mmapped temporary file that is msynced,
+// truncated and linked into place. Each with and without the sync, so the
+// cost of durability shows apart. Checks all produce the bytes sent.
+#include "../shared/chatDefination.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ROUNDS 7
+#define BENCH_DIR "bench/recv_bench_data"
+#define WRITE_CHUNK TRANSFER_CHUNK_SIZE     // the old write() loop's buffer
+#define MAP_CHUNK (1024 * 1024)             // DOWNLOAD_RECV_CHUNK in libchatclient.c
+
+static int failures = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    int listener;
+    const char *data;
+    size_t size;
+} sender_t;
+
+static void *send_file(void *arg) {
+    sender_t *s = arg;
+    int fd = accept(s->listener, NULL, NULL);
+    for (size_t sent = 0; fd >= 0 && sent < s->size; ) {
+        ssize_t n = send(fd, s->data + sent, s->size - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+// The path before: a buffer and a write() per recv(), synced or not
+static int receive_write(int sock, const char *path, size_t size, int sync) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *chunk = malloc(WRITE_CHUNK);
+    size_t done = 0;
+    while (fd >= 0 && chunk && done < size) {
+        size_t want = size - done < WRITE_CHUNK ? size - done : WRITE_CHUNK;
+        ssize_t n = recv(sock, chunk, want, 0);
+        if (n <= 0) break;
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(fd, chunk + written, n - written);
+            if (w <= 0) goto out;
+            written += w;
+        }
+        done += n;
+    }
+    if (sync && fd >= 0) fsync(fd);
+out:
+    free(chunk);
+    if (fd >= 0) close(fd);
+    return done == size ? 0 : -1;
+}
+
+// The path now: fallocate, mmap, recv() into the mapping, msync,
+// ftruncate, then link the temporary name to the real one
+static int receive_mmap(int sock, const char *path, size_t size, int sync) {
+    char temp[256];
+    snprintf(temp, sizeof(temp), BENCH_DIR "/.partXXXXXX");
+    int fd = mkstemp(temp);
+    if (fd < 0) return -1;
+    int result = -1;
+    char *map = MAP_FAILED;
+    if (posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) < 0) goto out;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) goto out;
+    size_t done = 0;
+    while (done < size) {
+        size_t want = size - done < MAP_CHUNK ? size - done : MAP_CHUNK;
+        ssize_t n = recv(sock, map + done, want, 0);
+        if (n <= 0) goto out;
+        done += n;
+    }
+    if ((sync && msync(map, size, MS_SYNC) < 0) || ftruncate(fd, size) < 0) goto out;
+    unlink(path);
+    result = link(temp, path);
+out:
+    if (map != MAP_FAILED) munmap(map, size);
+    close(fd);
+    unlink(temp);
+    return result;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int same_as_sent(const char *path, const char *data, size_t size) {
+    struct stat st;
+    if (stat(path, &st) < 0 || (size_t)st.st_size != size) return 0;
+    int fd = open(path, O_RDONLY);
+    char *map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    int same = size == 0 || (map != MAP_FAILED && memcmp(map, data, size) == 0);
+    if (map && map != MAP_FAILED) munmap(map, size);
+    close(fd);
+    return same;
+}
+
+// Best of ROUNDS, in MB/s. Mode bit 1 picks mmap over write(), bit 0 syncs.
+static double run(const char *label, int mode, const char *data, size_t size) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET };
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    socklen_t len = sizeof(address);
+    bind(listener, (struct sockaddr *)&address, sizeof(address));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr *)&address, &len);
+
+    char path[128];
+    snprintf(path, sizeof(path), BENCH_DIR "/received");
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        sender_t sender = { .listener = listener, .data = data, .size = size };
+        pthread_t thread;
+        pthread_create(&thread, NULL, send_file, &sender);
+        int sock = connect_to(ntohs(address.sin_port));
+        double start = now_sec();
+        int result = mode & 2 ? receive_mmap(sock, path, size, mode & 1) : receive_write(sock, path, size, mode & 1);
+        double elapsed = now_sec() - start;
+        close(sock);
+        pthread_join(thread, NULL);
+        if (result != 0 || !same_as_sent(path, data, size)) {
+            printf("  FAIL (%s): received file differs from what was sent\n", label);
+            failures++;
+        }
+        double rate = size / 1048576.0 / elapsed;
+        if (rate > best) best = rate;
+        unlink(path);
+    }
+    close(listener);
+    return best;
+}
+
+int main(void) {
+    static const size_t sizes[] = { MAX_FILE_SIZE, 64 * 1024 * 1024 };
+    mkdir(BENCH_DIR, 0755);
+    printf("Receiving over loopback TCP, best of %d rounds\n", ROUNDS);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+        char *data = malloc(size);
+        unsigned state = 2463534242u;
+        for (size_t j = 0; j < size; j++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            data[j] = (char)state;
+        }
+        double plain = run("write loop", 0, data, size);
+        double synced = run("write loop + fsync", 1, data, size);
+        double mapped = run("mmap", 2, data, size);
+        double mapped_synced = run("mmap + msync", 3, data, size);
+        printf("  %5.1f MB   write %7.1f MB/s   write + fsync %7.1f MB/s   mmap %7.1f MB/s   mmap + msync %7.1f MB/s\n",
+               size / 1048576.0, plain, synced, mapped, mapped_synced);
+        free(data);
+    }
+    rmdir(BENCH_DIR);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
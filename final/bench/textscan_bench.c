@@ -0,0 +1,184 @@
+// Compile: make bench-textscan
+// Times the text scans used per message (name validation, command
+// tokenising, newline search, UTF-8 checks) at every level this CPU has,
+// next to the isalnum/strchr loops they replaced, and checks that all
+// levels agree with each other and with the old code on random input.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "../shared/textscan.h"
+
+#define ROUNDS 2000000
+#define CHECK_CASES 200000
+
+static int failures = 0;
+static volatile size_t sink;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned next_random(unsigned *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// The validation loop the client and mailbox used
+static int old_is_name(const char *s, size_t min_len, size_t max_len) {
+    size_t len = strlen(s);
+    if (len < min_len || len > max_len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_') return 0;
+    }
+    return 1;
+}
+
+// next_token's old scan: the space, else the end of the string
+static char *old_find_delim(const char *s) {
+    char *end = strchr(s, ' ');
+    return end ? end : (char *)s + strlen(s);
+}
+
+static char *stop_at_delim(const char *s) {
+    while (*s != ' ' && *s != '\n' && *s != '\0') s++;
+    return (char *)s;
+}
+
+static const char *names[] = { "alice", "bob_the_builder", "room42", "x", "General_Chat_Room_Number_Nine" };
+static const char *lines[] = {
+    "/whisper bob hello there, are you coming to the meeting later?",
+    "/broadcast The quick brown fox jumps over the lazy dog. The quick brown fox jumps over the lazy dog.\n",
+    "/join lobby",
+};
+static const char *utf8_text =
+    "Merhaba dünya! Çalışma odası 3'te toplantı var, lütfen geç kalmayın. "
+    "Καλημέρα κόσμε, 日本語のテキスト, emoji \xF0\x9F\x98\x80 and plain ASCII padding to make it long.";
+
+static void time_level(const char *label, int old) {
+    double t0 = now_sec();
+    size_t acc = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        const char *n = names[r % 5];
+        acc += old ? (size_t)old_is_name(n, 1, 31) : (size_t)text_is_name(n, 1, 31);
+    }
+    double name_ns = (now_sec() - t0) * 1e9 / ROUNDS;
+
+    t0 = now_sec();
+    for (int r = 0; r < ROUNDS; r++) {
+        const char *p = lines[r % 3];
+        // Tokenise the whole line the way command handlers do
+        while (*p) {
+            const char *end = old ? old_find_delim(p) : text_find_delim(p);
+            acc += end - p;
+            p = *end ? end + 1 : end;
+        }
+    }
+    double token_ns = (now_sec() - t0) * 1e9 / ROUNDS;
+
+    // Read through a volatile so strchr on a literal is not folded away
+    const char *volatile line = lines[1];
+    size_t l_len = strlen(line);
+    t0 = now_sec();
+    for (int r = 0; r < ROUNDS; r++) {
+        const char *l = line;
+        const char *nl = old ? strchr(l, '\n') : text_find_byte(l, l_len, '\n');
+        acc += nl ? (size_t)(nl - l) : 0;
+    }
+    double newline_ns = (now_sec() - t0) * 1e9 / ROUNDS;
+
+    double utf8_ns = 0;
+    if (!old) {
+        size_t len = strlen(utf8_text);
+        t0 = now_sec();
+        for (int r = 0; r < ROUNDS; r++) acc += text_utf8_valid(utf8_text, len);
+        utf8_ns = (now_sec() - t0) * 1e9 / ROUNDS;
+    }
+    sink = acc;
+
+    printf("%-14s name %5.1f ns   tokenise %6.1f ns   newline %5.1f ns   ",
+           label, name_ns, token_ns, newline_ns);
+    if (old) printf("utf8     -\n");
+    else printf("utf8 %5.1f ns\n", utf8_ns);
+}
+
+// Random bytes biased toward the interesting classes and UTF-8 lead bytes
+static void random_text(char *buf, size_t len, unsigned *seed) {
+    static const char pool[] = "aZ09_ \n-./@`{[:";
+    static const unsigned char high[] = { 0x80, 0xBF, 0xC0, 0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF };
+    for (size_t i = 0; i < len; i++) {
+        unsigned r = next_random(seed) % 16;
+        if (r < 10) buf[i] = pool[next_random(seed) % (sizeof(pool) - 1)];
+        else if (r < 13) buf[i] = (char)(next_random(seed) % 128);
+        else buf[i] = (char)high[next_random(seed) % sizeof(high)];
+        if (buf[i] == '\0') buf[i] = 'a';
+    }
+    buf[len] = '\0';
+}
+
+// Known answers for the UTF-8 rules the decoder has to enforce
+static void check_utf8_cases(const char *label) {
+    static const struct { const char *s; int valid; } cases[] = {
+        { "plain", 1 }, { "\xC3\xA7", 1 }, { "\xE2\x82\xAC", 1 }, { "\xF0\x9F\x98\x80", 1 },
+        { "\xF4\x8F\xBF\xBF", 1 }, { "\xED\x9F\xBF", 1 },
+        { "\xC0\xAF", 0 }, { "\xC1\xBF", 0 }, { "\xE0\x80\xAF", 0 }, { "\xF0\x80\x80\xAF", 0 },
+        { "\xED\xA0\x80", 0 }, { "\xF4\x90\x80\x80", 0 }, { "\xF5\x80\x80\x80", 0 },
+        { "\x80", 0 }, { "\xC3", 0 }, { "\xE2\x82", 0 }, { "abc\xE2\x82", 0 }, { "\xC3\x28", 0 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (text_utf8_valid(cases[i].s, strlen(cases[i].s)) != cases[i].valid) {
+            printf("  FAIL (%s): utf8 case %zu expected %d\n", label, i, cases[i].valid);
+            failures++;
+        }
+    }
+}
+
+static void cross_check(textscan_level_t top) {
+    unsigned seed = 0x2545F491u;
+    char *buf = malloc(256 + 64);
+    for (int c = 0; c < CHECK_CASES; c++) {
+        size_t len = next_random(&seed) % 200;
+        // Odd offsets exercise unaligned starts and the aligned delimiter loads
+        char *s = buf + next_random(&seed) % 48;
+        random_text(s, len, &seed);
+
+        size_t expect_span = 0;
+        while (expect_span < len && (isalnum((unsigned char)s[expect_span]) || s[expect_span] == '_')) expect_span++;
+        int expect_name = old_is_name(s, 1, 31);
+        char *expect_delim = stop_at_delim(s);
+        char *expect_nl = strchr(s, '\n');
+        textscan_limit(TEXTSCAN_SCALAR);
+        int expect_utf8 = text_utf8_valid(s, len);
+
+        for (int level = TEXTSCAN_SCALAR; level <= (int)top; level++) {
+            textscan_limit(level);
+            const char *label = textscan_level_name(level);
+            if (text_name_span(s, len) != expect_span || text_is_name(s, 1, 31) != expect_name ||
+                text_find_delim(s) != expect_delim || text_find_byte(s, len, '\n') != expect_nl ||
+                text_utf8_valid(s, len) != expect_utf8) {
+                if (failures < 10) printf("  FAIL (%s): case %d, %zu bytes disagree\n", label, c, len);
+                failures++;
+            }
+        }
+    }
+    free(buf);
+}
+
+int main(void) {
+    textscan_level_t top = textscan_level();
+    printf("Text scanning, best level on this CPU: %s (%d rounds)\n", textscan_level_name(top), ROUNDS);
+    time_level("isalnum/strchr", 1);
+    for (int level = TEXTSCAN_SCALAR; level <= (int)top; level++) {
+        textscan_limit(level);
+        check_utf8_cases(textscan_level_name(level));
+        time_level(textscan_level_name(level), 0);
+    }
+    cross_check(top);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+// Compile: make bench-wal
+// Logs 1M state mutations through the write-ahead log, then measures how
+// long wal_open() takes to rebuild the state from a full log replay versus
+// snapshot + log tail.
+#include <stdarg.h>
+#include "../shared/chatDefination.h"
+#include "../server/wal.h"
+
+#define EVENTS 1000000
+#define USERS 500
+#define BENCH_DIR "bench/wal_bench_data"
+
+// wal.c logs through the server's log_event; only show its recovery timing,
+// which excludes the fsync of the recovery snapshot that wal_open() also does
+static int show_recovery_log = 0;
+
+void log_event(const char *format, ...) {
+    if (!show_recovery_log || strncmp(format, "[WAL] Recovered", 15) != 0) return;
+    va_list args;
+    va_start(args, format);
+    printf("    ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Session churn like server.log shows: log in, hop rooms, sometimes send a file
+static void make_event(long i, wal_event_t *ev) {
+    memset(ev, 0, sizeof(*ev));
+    snprintf(ev->username, sizeof(ev->username), "user%ld", i % USERS);
+    switch (i % 8) {
+    case 0:
+        ev->type = WAL_USERNAME_SET;
+        break;
+    case 1: case 2: case 4:
+        ev->type = WAL_JOIN;
+        snprintf(ev->room, sizeof(ev->room), "room%ld", (i / 8) % MAX_GROUPS);
+        break;
+    case 3:
+        ev->type = WAL_LEAVE;
+        break;
+    case 5:
+    case 6:
+        // Queued and dequeued records of one transfer must name the same pair
+        ev->type = (i % 8 == 5) ? WAL_TRANSFER_QUEUED : WAL_TRANSFER_DEQUEUED;
+        snprintf(ev->username, sizeof(ev->username), "user%ld", (i / 8) % USERS);
+        snprintf(ev->recipient, sizeof(ev->recipient), "user%ld", (i / 8 + 1) % USERS);
+        snprintf(ev->filename, sizeof(ev->filename), "notes%ld.pdf", i / 8);
+        ev->filesize = 20480;
+        break;
+    default:
+        ev->type = WAL_DISCONNECT;
+    }
+}
+
+static double fill_log(uint32_t snapshot_every) {
+    system("rm -rf " BENCH_DIR);
+    if (wal_open(BENCH_DIR, snapshot_every, NULL) < 0) {
+        fprintf(stderr, "wal_open failed\n");
+        exit(1);
+    }
+    wal_event_t ev;
+    double start = now_sec();
+    for (long i = 0; i < EVENTS; i++) {
+        make_event(i, &ev);
+        wal_append(&ev);
+    }
+    wal_sync();
+    double elapsed = now_sec() - start;
+    // Simulate a crash: stop the flusher without any extra snapshot
+    wal_close();
+    return elapsed;
+}
+
+static double recover(wal_state_t *st) {
+    show_recovery_log = 1;
+    double start = now_sec();
+    if (wal_open(BENCH_DIR, WAL_DEFAULT_SNAPSHOT_EVERY, st) < 0) {
+        fprintf(stderr, "wal_open failed during recovery\n");
+        exit(1);
+    }
+    double elapsed = now_sec() - start;
+    show_recovery_log = 0;
+    wal_close();
+    return elapsed;
+}
+
+// Far more distinct users than session slots, each logging in, joining and
+// leaving; the last one must still be persisted
+static int session_churn(void) {
+    static wal_state_t st;
+    memset(&st, 0, sizeof(st));
+    wal_event_t ev;
+    for (int i = 0; i < WAL_MAX_SESSIONS * 4; i++) {
+        memset(&ev, 0, sizeof(ev));
+        snprintf(ev.username, sizeof(ev.username), "churn%d", i);
+        ev.type = WAL_USERNAME_SET;
+        wal_state_apply(&st, &ev);
+        ev.type = WAL_JOIN;
+        snprintf(ev.room, sizeof(ev.room), "lobby");
+        wal_state_apply(&st, &ev);
+        if (i == WAL_MAX_SESSIONS * 4 - 1) break;
+        ev.type = WAL_DISCONNECT;
+        wal_state_apply(&st, &ev);
+    }
+    const wal_session_t *last = wal_state_session(&st, ev.username);
+    int ok = last && strcmp(last->room, "lobby") == 0 && st.session_count == 1;
+    printf("  session churn              : %d users through %d slots, last one %s\n",
+           WAL_MAX_SESSIONS * 4, WAL_MAX_SESSIONS, ok ? "persisted" : "LOST");
+    return ok;
+}
+
+int main(void) {
+    static wal_state_t full, snap;
+
+    printf("Write-ahead log, %d events\n", EVENTS);
+    double append_time = fill_log(EVENTS + 1);
+    printf("  append + group commit      : %8.2f Mev/s\n", EVENTS / append_time / 1e6);
+    double full_time = recover(&full);
+    printf("  wal_open, full log replay  : %8.1f ms\n", full_time * 1e3);
+
+    fill_log(WAL_DEFAULT_SNAPSHOT_EVERY);
+    double snap_time = recover(&snap);
+    printf("  wal_open, snapshot + tail  : %8.1f ms (snapshot every %d records)\n",
+           snap_time * 1e3, WAL_DEFAULT_SNAPSHOT_EVERY);
+    system("rm -rf " BENCH_DIR);
+
+    if (full.lsn != snap.lsn || full.room_count != snap.room_count ||
+        full.session_count != snap.session_count || full.pending_count != snap.pending_count) {
+        fprintf(stderr, "Recovered states differ (lsn %lu vs %lu)\n",
+                (unsigned long)full.lsn, (unsigned long)snap.lsn);
+        return 1;
+    }
+    printf("  recovered state            : %u rooms, %u sessions, %u queued transfers\n",
+           full.room_count, full.session_count, full.pending_count);
+    return session_churn() ? 0 : 1;
+}
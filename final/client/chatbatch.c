@@ -0,0 +1,279 @@
+// Compile: make batch
+// Scriptable chat client: commands come one per line on stdin, everything
+// the server sends goes to stdout as plain lines, a summary to stderr.
+//   printf '/join r1\n/broadcast hi\n' | ./chatbatch 127.0.0.1 5000 bot
+#include "libchatclient.h"
+#include "../shared/textscan.h"
+#include <time.h>
+
+#define INPUT_BATCH 64               // commands sent per loop pass, so replies get read
+#define EXIT_DRAIN_MS 2000           // after /exit, wait this long for the server to finish
+#define LOGIN_TIMEOUT_MS 5000
+
+int is_running = 1;
+int quiet = 0;
+long lines_sent = 0;
+long messages_received = 0;
+int transfers_failed = 0;
+
+char stdin_buffer[BUFFER_SIZE];
+size_t stdin_len = 0;
+int stdin_open = 1;
+
+static const char *transfer_states[] = { "requested", "queued", "connecting", "running", "finished" };
+
+void signal_handler(int signal) {
+    (void)signal;
+    is_running = 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read whatever stdin has; 0 once input has ended
+static int fill_stdin(void) {
+    ssize_t n = read(STDIN_FILENO, stdin_buffer + stdin_len, sizeof(stdin_buffer) - 1 - stdin_len);
+    if (n < 0 && errno == EINTR) return 1;
+    if (n <= 0) {
+        stdin_open = 0;
+        return 0;
+    }
+    stdin_len += n;
+    return 1;
+}
+
+// Take the next whole line out of stdin_buffer; 0 if there is none yet
+static int next_stdin_line(char *line, size_t size) {
+    char *newline = text_find_byte(stdin_buffer, stdin_len, '\n');
+    size_t len;
+    if (newline) {
+        len = newline - stdin_buffer;
+    } else if (stdin_len == sizeof(stdin_buffer) - 1 || (!stdin_open && stdin_len > 0)) {
+        len = stdin_len;
+    } else {
+        return 0;
+    }
+    size_t copy = len < size - 1 ? len : size - 1;
+    memcpy(line, stdin_buffer, copy);
+    line[copy] = '\0';
+    if (copy > 0 && line[copy - 1] == '\r') line[copy - 1] = '\0';
+    size_t used = newline ? len + 1 : len;
+    memmove(stdin_buffer, stdin_buffer + used, stdin_len - used);
+    stdin_len -= used;
+    return 1;
+}
+
+static int stdin_has_line(void) {
+    return text_find_byte(stdin_buffer, stdin_len, '\n') != NULL ||
+           stdin_len == sizeof(stdin_buffer) - 1 || (!stdin_open && stdin_len > 0);
+}
+
+// One line per event: MESSAGE <text>, TRANSFER <id> <what> ..., RECONNECTING
+// <ms> <why>, RECONNECTED resumed|new <room>, CLOSED <why>
+void on_chat_event(chat_client_t *client, const chat_event_t *event, void *user) {
+    const chat_transfer_t *t = event->transfer;
+    (void)client;
+    (void)user;
+
+    switch (event->type) {
+    case CHAT_EVENT_MESSAGE:
+        messages_received++;
+        if (!quiet) printf("MESSAGE %s\n", event->text);
+        break;
+    case CHAT_EVENT_TRANSFER_INCOMING:
+        printf("TRANSFER %u incoming %s %s %zu %s\n", t->id, t->peer, t->name, t->size, t->path);
+        break;
+    case CHAT_EVENT_TRANSFER_QUEUED:
+        printf("TRANSFER %u queued %d\n", t->id, event->value);
+        break;
+    case CHAT_EVENT_TRANSFER_STARTED:
+        printf("TRANSFER %u started %s %zu %d\n", t->id, t->peer, t->size, t->streams);
+        break;
+    case CHAT_EVENT_TRANSFER_PROGRESS:
+        if (!quiet) printf("TRANSFER %u progress %d\n", t->id, event->value);
+        break;
+    case CHAT_EVENT_TRANSFER_DONE:
+        printf("TRANSFER %u done %s %zu %.3f", t->id, t->upload ? t->name : t->path, t->size, t->seconds);
+        // A delta adds its bytes on the wire and what that saved
+        if (t->delta) printf(" delta %zu %zu", t->wire, t->size > t->wire ? t->size - t->wire : 0);
+        printf("\n");
+        break;
+    case CHAT_EVENT_TRANSFER_FAILED:
+        transfers_failed++;
+        printf("TRANSFER %u failed %zu/%zu %s\n", t->id, t->done, t->size, event->text ? event->text : "");
+        break;
+    case CHAT_EVENT_TRANSFER_CANCELLED:
+        transfers_failed++;
+        printf("TRANSFER %u cancelled %s\n", t->id, event->text);
+        break;
+    case CHAT_EVENT_RECONNECTING:
+        printf("RECONNECTING %d %s\n", event->value, event->text ? event->text : "");
+        break;
+    case CHAT_EVENT_RECONNECTED:
+        printf("RECONNECTED %s %s\n", event->value ? "resumed" : "new", event->text ? event->text : "-");
+        break;
+    case CHAT_EVENT_CLOSED:
+        if (event->text) printf("CLOSED %s\n", event->text);
+        break;
+    }
+}
+
+// Send one scripted line. /sendfile runs through the library's transfers,
+// /transfers prints the table, anything else goes to the server as is.
+static int send_line(chat_client_t *chat, char *line) {
+    if (line[0] == '\0' || line[0] == '#') return 1;
+
+    if (strcmp(line, "/exit") == 0) {
+        chat_leave(chat);
+        return 1;
+    }
+    if (strncmp(line, "/sendfile ", 10) == 0) {
+        char recipient[32], filename[128];
+        uint32_t id;
+        if (sscanf(line + 10, " %127s %31s ", filename, recipient) != 2) {
+            printf("ERROR usage: /sendfile <filename> <recipient>\n");
+            return 1;
+        }
+        int result = chat_send_file(chat, recipient, filename, &id);
+        if (result == CHAT_OK) {
+            printf("TRANSFER %u requested %s %s\n", id, recipient, filename);
+        } else {
+            transfers_failed++;
+            printf("ERROR %s: %s\n", filename, result == CHAT_ERR_OPEN ? strerror(errno) : chat_strerror(result));
+        }
+        return 1;
+    }
+    if (strcmp(line, "/transfers") == 0) {
+        chat_transfer_t list[CHAT_MAX_TRANSFERS];
+        int count = chat_transfers(chat, list, CHAT_MAX_TRANSFERS);
+        for (int i = 0; i < count; i++) {
+            printf("TRANSFER %u %s %zu/%zu %s\n", list[i].id, list[i].upload ? "send" : "recv",
+                   list[i].done, list[i].size, transfer_states[list[i].state]);
+        }
+        return 1;
+    }
+
+    if (chat_send(chat, line) != CHAT_OK) return 0;
+    lines_sent++;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int use_compression = 1;
+    int use_presence = 0;
+    double rate = 0;            // lines per second, 0 as fast as the socket takes them
+    int coalesce_us = 0;        // hold lines this long to send them together
+    size_t coalesce_bytes = CHAT_COALESCE_MAX;
+    int streams = 1;            // data connections per upload
+    int delta = 0;              // offer uploads as deltas
+    int reconnect = 0;          // resume the session after a dropped connection
+    int bad_option = 0;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--no-compress") == 0) use_compression = 0;
+        else if (strcmp(argv[i], "--presence") == 0) use_presence = 1;
+        else if (strcmp(argv[i], "--quiet") == 0) quiet = 1;
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--coalesce") == 0 && i + 1 < argc) coalesce_us = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--coalesce-bytes") == 0 && i + 1 < argc) coalesce_bytes = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--streams") == 0 && i + 1 < argc) streams = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--delta") == 0) delta = 1;
+        else if (strcmp(argv[i], "--reconnect") == 0) reconnect = 1;
+        else bad_option = 1;
+    }
+    if (argc < 4 || bad_option) {
+        fprintf(stderr, "Usage: %s <server_ip> <port> <username> [--no-compress] [--presence] [--rate N] [--coalesce US] [--coalesce-bytes N] [--streams K] [--delta] [--reconnect] [--quiet]\n", argv[0]);
+        exit(1);
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int error;
+    chat_client_t *chat = chat_connect(argv[1], atoi(argv[2]), on_chat_event, NULL, &error);
+    if (!chat) {
+        fprintf(stderr, "connect: %s\n", chat_strerror(error));
+        exit(1);
+    }
+    error = chat_login(chat, argv[3], LOGIN_TIMEOUT_MS);
+    if (error != CHAT_OK) {
+        fprintf(stderr, "login: %s\n", chat_strerror(error));
+        chat_close(chat);
+        exit(1);
+    }
+    if (use_compression) chat_send(chat, "/compress on");
+    if (use_presence) chat_send(chat, "/presence on");
+    chat_set_coalescing(chat, coalesce_us, coalesce_bytes);
+    chat_set_upload_streams(chat, streams);
+    chat_set_delta(chat, delta);
+    chat_set_reconnect(chat, reconnect);
+
+    double start = now_seconds();
+    double next_send = start;
+    char line[BUFFER_SIZE];
+    struct pollfd pfds[1 + CHAT_POLLFDS_MAX];
+
+    while (is_running) {
+        int leaving = chat_leaving(chat);
+        // Script done: leave once the last transfer has settled
+        if (!leaving && !stdin_open && stdin_len == 0 && !chat_transfers_in_flight(chat)) {
+            chat_leave(chat);
+            leaving = 1;
+        }
+
+        double now = now_seconds();
+        int pending = !leaving && stdin_has_line();
+        int timeout = leaving ? EXIT_DRAIN_MS : chat_timeout(chat);
+        if (pending && rate > 0 && now < next_send) {
+            int wait = (int)((next_send - now) * 1000) + 1;
+            if (timeout < 0 || wait < timeout) timeout = wait;
+            pending = 0;
+        }
+        pfds[0] = (struct pollfd){ .fd = stdin_open && !stdin_has_line() && !leaving ? STDIN_FILENO : -1, .events = POLLIN };
+        int count = chat_pollfds(chat, pfds + 1, CHAT_POLLFDS_MAX, pending);
+
+        int ready = poll(pfds, 1 + count, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (ready == 0 && leaving) break;
+
+        if (!chat_dispatch(chat, pfds + 1, count)) break;
+        if (pfds[1].revents & POLLOUT) {
+            for (int n = 0; n < INPUT_BATCH && !chat_leaving(chat) && next_stdin_line(line, sizeof(line)); n++) {
+                if (!send_line(chat, line)) {
+                    is_running = 0;
+                    break;
+                }
+                if (rate > 0) {
+                    next_send += 1.0 / rate;
+                    if (next_send > now_seconds()) break;
+                }
+            }
+        }
+        if (pfds[0].revents) fill_stdin();
+        fflush(stdout);
+    }
+
+    double elapsed = now_seconds() - start;
+    int unfinished = chat_transfers_in_flight(chat);
+    chat_close(chat);
+    fflush(stdout);
+    fprintf(stderr, "sent %ld lines, received %ld messages in %.3f s (%.0f sent/s, %.0f received/s)",
+            lines_sent, messages_received, elapsed,
+            elapsed > 0 ? lines_sent / elapsed : 0.0, elapsed > 0 ? messages_received / elapsed : 0.0);
+    if (transfers_failed || unfinished) {
+        fprintf(stderr, ", %d transfer(s) failed, %d unfinished", transfers_failed, unfinished);
+    }
+    fprintf(stderr, "\n");
+    return transfers_failed || unfinished ? 2 : 0;
+}
@@ -1,5 +1,8 @@
-// Compile: gcc chatclient.c -o chatclient -lpthread
-#include "../shared/chatDefination.h"
+// Compile: make client
+#include "libchatclient.h"
+#include "../shared/textscan.h"
+#include <stdarg.h>
+#include <poll.h>
 
 // Enhanced color definitions for better user experience
 #define ANSI_COLOR_SUCCESS      "\x1b[32m"      // Green for success messages
@@ -14,38 +17,40 @@
 #define ANSI_COLOR_PROMPT       "\x1b[1;32m"    // Bold green for prompts
 #define ANSI_COLOR_RESET        "\x1b[0m"       // Reset color
 
+#define INPUT_BATCH 64               // input lines sent per loop pass, so replies get read
+#define EXIT_DRAIN_MS 2000           // after /exit, wait this long for the server to finish
+#define LOGIN_TIMEOUT_MS 5000
+#define COALESCE_WINDOW_US 1000      // a pasted batch of input goes out in one write
+
 // Global variables
-pthread_t server_response_thread;
 int is_running = 1;
+chat_client_t *chat = NULL;
+int need_prompt = 0;            // something was printed over the prompt
 
-pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t file_transfer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t file_transfer_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t socket_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t prompt_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t file_transfer_progress_mutex = PTHREAD_MUTEX_INITIALIZER;
-int ready_for_file = 0;
-int file_transfer_finished = 0;
-int file_transfer_in_progress = 0;
-int prompt_shown = 0;
+int use_compression = 1;
+int use_presence = 0;
+int upload_streams = 1;         // --streams, data connections per upload
+int use_delta = 0;              // --delta, send only what changed in files the recipient has
+int use_reconnect = 1;          // resume the session after a dropped connection, --no-reconnect
 
-char username[MAX_USERNAME_LENGTH];
+// Input is read with read() rather than stdio so that poll() never misses
+// lines sitting in a stdio buffer; whole lines are taken out from here
+char stdin_buffer[BUFFER_SIZE];
+size_t stdin_len = 0;
+int stdin_open = 1;
 
 // Function prototypes
-void *handle_server_responses(void *arg);
-void handle_incoming_file(int socket_fd,char *buffer);
+void on_chat_event(chat_client_t *client, const chat_event_t *event, void *user);
 void print_help_menu(void);
 int validate_username(const char *username);
-int initialize_connection(const char *server_ip, int port);
-int setup_username(int socket_fd);
-void process_user_input(int socket_fd);
-void cleanup_resources(int socket_fd);
-int wait_for_ready(int timeout_seconds);
-int handle_send_file(int socket_fd, const char *recipient, const char *filename);
+int setup_username(void);
+void run_event_loop(void);
+int handle_user_input(char *input_buffer);
+void cleanup_resources(void);
 int validate_room_name(const char *room_name) ;
 void print_status_message(const char *message, const char *color);
-int wait_for_file_transfer(int timeout_seconds) ;
+void handle_server_message(char *response_buffer);
+void print_transfers(void);
 
 
 
@@ -56,32 +61,44 @@ void signal_handler(int signal) {
     }
 }
 
-int socket_send(int socket_fd, const char *buffer, size_t length) {
-    int result;
-    pthread_mutex_lock(&socket_mutex);
-    result = send(socket_fd, buffer, length, 0);
-    pthread_mutex_unlock(&socket_mutex);
-    return result;
+// Read whatever stdin has into stdin_buffer; 0 once input has ended
+int fill_stdin(void) {
+    ssize_t n = read(STDIN_FILENO, stdin_buffer + stdin_len, sizeof(stdin_buffer) - 1 - stdin_len);
+    if (n < 0 && errno == EINTR) return 1;
+    if (n <= 0) {
+        stdin_open = 0;
+        return 0;
+    }
+    stdin_len += n;
+    return 1;
 }
 
-void show_prompt() {
-    pthread_mutex_lock(&prompt_mutex);
-    if (!prompt_shown) {
-        printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
-        fflush(stdout);
-        prompt_shown = 1;
-    }
-    pthread_mutex_unlock(&prompt_mutex);
+// A whole line is waiting in stdin_buffer
+int stdin_has_line(void) {
+    return text_find_byte(stdin_buffer, stdin_len, '\n') != NULL ||
+           stdin_len == sizeof(stdin_buffer) - 1 || (!stdin_open && stdin_len > 0);
 }
 
-void clear_prompt() {
-    pthread_mutex_lock(&prompt_mutex);
-    if (prompt_shown) {
-        printf("\r\033[K");  // Clear current line
-        fflush(stdout);
-        prompt_shown = 0;
+// Take the next whole line, without its newline, out of stdin_buffer.
+// A line longer than the buffer, or the last one before end of input,
+// comes out as it is. Returns 0 if there is no line yet.
+int next_stdin_line(char *line, size_t size) {
+    char *newline = text_find_byte(stdin_buffer, stdin_len, '\n');
+    size_t len, used;
+    if (newline) {
+        len = newline - stdin_buffer;
+        used = len + 1;
+    } else if (stdin_len == sizeof(stdin_buffer) - 1 || (!stdin_open && stdin_len > 0)) {
+        len = used = stdin_len;
+    } else {
+        return 0;
     }
-    pthread_mutex_unlock(&prompt_mutex);
+    if (len > size - 1) len = size - 1;
+    memcpy(line, stdin_buffer, len);
+    line[len] = '\0';
+    memmove(stdin_buffer, stdin_buffer + used, stdin_len - used);
+    stdin_len -= used;
+    return 1;
 }
 
 // Enhanced function to print colored status messages
@@ -90,174 +107,213 @@ void print_status_message(const char *message, const char *color) {
     fflush(stdout);
 }
 
-// Handle server responses in a separate thread
-void *handle_server_responses(void *arg) {
-    int socket_fd = *(int *)arg;
-    char response_buffer[BUFFER_SIZE];
-    
-    while (is_running) {
-        memset(response_buffer, 0, BUFFER_SIZE);
-        int bytes_received = read(socket_fd, response_buffer, BUFFER_SIZE - 1);
-        
-        if (bytes_received > 0) {
-            response_buffer[bytes_received] = '\0';
-           
-            // Handle specific server responses with appropriate colors
-            if (strncmp(response_buffer, "FILE_SIZE_EXCEEDS_LIMIT", 23) == 0) {
-                print_status_message("[ERROR] File size exceeds server limit. Transfer aborted.", ANSI_COLOR_ERROR);
-                pthread_mutex_lock(&file_transfer_progress_mutex);
-                file_transfer_in_progress = 0;
-                pthread_mutex_unlock(&file_transfer_progress_mutex);
-                continue;
-            }
-
-
-
-            // Check for incoming file transfer
-            else if (strncmp(response_buffer, "INCOMING_FILE", 13) == 0) {
-                handle_incoming_file(socket_fd,response_buffer);
-            }
+// "PRESENCE <room> <version> +joined -left *typing .stopped =member ..."
+void print_presence(char *line) {
+    char *save = NULL;
+    strtok_r(line, " \n", &save);
+    char *room = strtok_r(NULL, " \n", &save);
+    strtok_r(NULL, " \n", &save);  // version
+    if (!room) return;
+    
+    printf(ANSI_COLOR_INFO "[PRESENCE] %s:", room);
+    char *entry;
+    int resync = 0;
+    while ((entry = strtok_r(NULL, " \n", &save)) != NULL) {
+        switch (entry[0]) {
+            case '+': printf(" %s joined", entry + 1); break;
+            case '-': printf(" %s left", entry + 1); break;
+            case '*': printf(" %s is typing", entry + 1); break;
+            case '.': printf(" %s stopped typing", entry + 1); break;
+            case '=': printf("%s %s", resync++ ? "" : " in room:", entry + 1); break;
+        }
+    }
+    printf(ANSI_COLOR_RESET "\n");
+    fflush(stdout);
+}
 
-            else if (strncmp(response_buffer, "RECIPIENT_NOT_FOUND", 19) == 0) {
+// One message from the server, after decompression and splitting
+void handle_server_message(char *response_buffer) {
+    // Handle specific server responses with appropriate colors
+    if (strncmp(response_buffer, "FILE_SIZE_EXCEEDS_LIMIT", 23) == 0) {
+        print_status_message("[ERROR] File size exceeds server limit. Transfer aborted.", ANSI_COLOR_ERROR);
+    }
 
-                print_status_message("[ERROR] Recipient not found. Please check the username.", ANSI_COLOR_ERROR);
-                pthread_mutex_lock(&ready_mutex);
-                ready_for_file = -1;
-                pthread_cond_signal(&ready_cond);
-                pthread_mutex_unlock(&ready_mutex);
-            }
-            else if (strncmp(response_buffer, "RECIPIENT_OFFLINE", 17) == 0) {
-                print_status_message("[ERROR] Recipient is offline. Cannot send file.", ANSI_COLOR_ERROR);
-                 pthread_mutex_lock(&ready_mutex);
-                ready_for_file = 0;
-                pthread_cond_signal(&ready_cond);
-                pthread_mutex_unlock(&ready_mutex);
-            }
-            else if (strncmp(response_buffer, "FILE_EXISTS", 11) == 0) {
-                print_status_message("[WARNING] File already exists on server. Renaming to avoid conflict.", ANSI_COLOR_WARNING);
-            }
-            
-            else if(strncmp(response_buffer, "FILE_TRANSFER_SUCCESS", 21) == 0) {
-               
+    // A simulated transfer from a server without data connections
+    else if (strncmp(response_buffer, "INCOMING_FILE", 13) == 0) {
+        char sender_name[32], filename[128];
+        size_t file_size;
+        if (sscanf(response_buffer, "INCOMING_FILE %31s %127s %zu", sender_name, filename, &file_size) == 3) {
+            printf(ANSI_COLOR_INFO "\n[FILE TRANSFER] Receiving file " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_INFO " from " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_INFO " (%zu bytes)" ANSI_COLOR_RESET "\n", filename, sender_name, file_size);
+        }
+    }
 
-                pthread_mutex_lock(&file_transfer_mutex);
-                file_transfer_finished = 1;
-                pthread_cond_broadcast(&file_transfer_cond);
-                pthread_mutex_unlock(&file_transfer_mutex);
+    else if (strncmp(response_buffer, "RECIPIENT_NOT_FOUND", 19) == 0) {
+        print_status_message("[ERROR] Recipient not found. Please check the username.", ANSI_COLOR_ERROR);
+    }
+    else if (strncmp(response_buffer, "RECIPIENT_OFFLINE", 17) == 0) {
+        print_status_message("[ERROR] Recipient is offline. Cannot send file.", ANSI_COLOR_ERROR);
+    }
+    else if (strncmp(response_buffer, "FILE_EXISTS", 11) == 0) {
+        print_status_message("[WARNING] File already exists on server. Renaming to avoid conflict.", ANSI_COLOR_WARNING);
+    }
+    else if(strncmp(response_buffer, "FILE_TRANSFER_SUCCESS", 21) == 0) {
+        print_status_message("[SUCCESS] File transfer completed.", ANSI_COLOR_SUCCESS);
+    }
+    else if(strncmp(response_buffer, "INVALID_FILE_TYPE", 17) == 0) {
+        print_status_message("[ERROR] Invalid file type. File transfer aborted.", ANSI_COLOR_ERROR);
+    }
+    else if(strncmp(response_buffer, "USER_NOT_FOUND", 14) == 0) {
+        print_status_message("[ERROR] User not found or not online.", ANSI_COLOR_ERROR);
+    }
+    else if(strncmp(response_buffer, "ROOM_JOINED", 11) == 0) {
+        print_status_message("[SUCCESS] Successfully joined the room.", ANSI_COLOR_SUCCESS);
+    }
+    else if(strncmp(response_buffer, "USERNAME_SET", 12) == 0) {
+        print_status_message("[SUCCESS] Username set successfully.", ANSI_COLOR_SUCCESS);
+    }
 
-            }
-            else if(strncmp(response_buffer, "INVALID_FILE_TYPE", 20) == 0) {
-                print_status_message("[ERROR] Invalid file type. File transfer aborted.", ANSI_COLOR_ERROR);
-                pthread_mutex_lock(&ready_mutex);
-                ready_for_file = 0;
-                pthread_cond_signal(&ready_cond);
-                pthread_mutex_unlock(&ready_mutex);
-            }
-            else if(strncmp(response_buffer, "READY_FOR_FILE", 14) == 0) {
-                pthread_mutex_lock(&ready_mutex);
-                ready_for_file = 1;
-                pthread_cond_signal(&ready_cond);
-                pthread_mutex_unlock(&ready_mutex);
-    
-            }
-            
-            else if(strncmp(response_buffer, "USER_NOT_FOUND", 14) == 0) {
-                print_status_message("[ERROR] User not found or not online.", ANSI_COLOR_ERROR);
-            }
-            else if(strncmp(response_buffer, "ROOM_JOINED", 11) == 0) {
-                print_status_message("[SUCCESS] Successfully joined the room.", ANSI_COLOR_SUCCESS);
-            }
-            else if(strncmp(response_buffer, "USERNAME_SET", 12) == 0) {
-                print_status_message("[SUCCESS] Username set successfully.", ANSI_COLOR_SUCCESS);
-            }
+    else if (strncmp(response_buffer, "FILE_QUEUE_FULL", 15) == 0) {
+        print_status_message("[ERROR] File queue is full. Please try again later.", ANSI_COLOR_ERROR);
+    }
 
-            else if (strncmp(response_buffer, "FILE_QUEUE_FULL", 15) == 0) {
-                print_status_message("[ERROR] File queue is full. Please try again later.", ANSI_COLOR_ERROR);
-                pthread_mutex_lock(&ready_mutex);
-                ready_for_file = 0;
-                pthread_cond_signal(&ready_cond);
-                pthread_mutex_unlock(&ready_mutex);
-        
-            }
+    else if (strncmp(response_buffer, "ROOM_LEFT", 9) == 0) {
+        print_status_message("[SUCCESS] Successfully left the room.", ANSI_COLOR_SUCCESS);
+    }
+    else if (strncmp(response_buffer, "PRESENCE ", 9) == 0) {
+        print_presence(response_buffer);
+    }
+    else if (strncmp(response_buffer, "PRESENCE_ON", 11) == 0) {
+        print_status_message("[INFO] You will see who joins, leaves and types in your room.", ANSI_COLOR_INFO);
+    }
+    else if (strncmp(response_buffer, "PRESENCE_OFF", 12) == 0) {
+        print_status_message("[INFO] Presence updates turned off.", ANSI_COLOR_INFO);
+    }
+    else if (strncmp(response_buffer, "COMPRESS_ON", 11) == 0) {
+        print_status_message("[INFO] Large messages from the server will be compressed.", ANSI_COLOR_INFO);
+    }
+    else if (strncmp(response_buffer, "COMPRESS_OFF", 12) == 0) {
+        print_status_message("[INFO] Message compression turned off.", ANSI_COLOR_INFO);
+    }
+    else {
+        // Use enhanced message parsing for other responses
+        printf("\n");
+        printf(ANSI_COLOR_SYSTEM "%s" ANSI_COLOR_RESET "\n", response_buffer);
+    }
+}
 
-            else if (strncmp(response_buffer, "ROOM_LEFT", 9) == 0) {
-                print_status_message("[SUCCESS] Successfully left the room.", ANSI_COLOR_SUCCESS);
-            }
-            else {
-                // Use enhanced message parsing for other responses
-                printf("\n");
-                printf(ANSI_COLOR_SYSTEM "%s" ANSI_COLOR_RESET "\n", response_buffer);
-            
-            }
+// Print a line about a transfer without tearing the prompt
+static void transfer_message(const char *color, const char *format, ...) {
+    char line[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    printf("\r\033[K%s%s" ANSI_COLOR_RESET "\n" ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET, color, line);
+    fflush(stdout);
+}
 
-            pthread_mutex_lock(&file_transfer_progress_mutex);
-            int transfer_active = file_transfer_in_progress;
-            pthread_mutex_unlock(&file_transfer_progress_mutex);
-            
-            if (!transfer_active && is_running) {
-                printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
-                fflush(stdout);
-            }
+static void format_bar(char *bar, size_t done, size_t size) {
+    int filled = size ? (int)(done * 20 / size) : 20;
+    for (int i = 0; i < 20; i++) bar[i] = i < filled ? '#' : '.';
+    bar[20] = '\0';
+}
 
-        } 
-        else if (bytes_received == 0) {
+// Everything the library has to say ends up here
+void on_chat_event(chat_client_t *client, const chat_event_t *event, void *user) {
+    const chat_transfer_t *t = event->transfer;
+    char message[BUFFER_SIZE * 2];
+    char bar[21];
+    (void)client;
+    (void)user;
+    
+    switch (event->type) {
+    case CHAT_EVENT_MESSAGE:
+        // The handlers cut the text up, so give them a copy
+        snprintf(message, sizeof(message), "%s", event->text);
+        handle_server_message(message);
+        need_prompt = 1;
+        break;
+    case CHAT_EVENT_TRANSFER_INCOMING:
+        printf(ANSI_COLOR_INFO "\n[FILE TRANSFER] Receiving file " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_INFO " from " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_INFO " (%zu bytes)" ANSI_COLOR_RESET "\n", t->name, t->peer, t->size);
+        need_prompt = 1;
+        break;
+    case CHAT_EVENT_TRANSFER_QUEUED:
+        transfer_message(ANSI_COLOR_WARNING, "[FILE TRANSFER #%u] '%s' is queued on the server at position %d",
+                         t->id, t->name, event->value);
+        break;
+    case CHAT_EVENT_TRANSFER_STARTED:
+        transfer_message(ANSI_COLOR_INFO, "[FILE TRANSFER #%u] Sending '%s' to %s (%zu bytes, %d stream%s)",
+                         t->id, t->name, t->peer, t->size, t->streams, t->streams == 1 ? "" : "s");
+        break;
+    case CHAT_EVENT_TRANSFER_PROGRESS:
+        format_bar(bar, t->done, t->size);
+        transfer_message(ANSI_COLOR_INFO, "[FILE TRANSFER #%u] %s '%s' %s %s [%s] %d%%",
+                         t->id, t->upload ? "sending" : "receiving", t->upload ? t->name : t->path,
+                         t->upload ? "to" : "from", t->peer, bar, event->value);
+        break;
+    case CHAT_EVENT_TRANSFER_DONE: {
+        // A download is only given its name once complete
+        const char *base = strrchr(t->name, '/');
+        base = base ? base + 1 : t->name;
+        if (!t->upload && strcmp(t->path, base) != 0) {
+            transfer_message(ANSI_COLOR_WARNING, "[WARNING] File '%s' already exists. Saved as '%s'", base, t->path);
+        }
+        transfer_message(ANSI_COLOR_SUCCESS, "[FILE TRANSFER #%u] '%s' %s %s: %zu bytes in %.3f s (%.1f KB/s)",
+                         t->id, t->upload ? t->name : t->path, t->upload ? "sent to" : "received from",
+                         t->peer, t->size, t->seconds, t->seconds > 0 ? t->size / 1024.0 / t->seconds : 0.0);
+        if (t->delta) {
+            transfer_message(ANSI_COLOR_INFO, "[FILE TRANSFER #%u] Delta: %zu bytes on the wire for %zu, %zu saved",
+                             t->id, t->wire, t->size, t->size > t->wire ? t->size - t->wire : 0);
+        }
+        break;
+    }
+    case CHAT_EVENT_TRANSFER_FAILED:
+        transfer_message(ANSI_COLOR_ERROR, "[FILE TRANSFER #%u] '%s' %s %s failed after %zu of %zu bytes%s%s",
+                         t->id, t->upload ? t->name : t->path, t->upload ? "to" : "from",
+                         t->peer, t->done, t->size, event->text ? ": " : "", event->text ? event->text : "");
+        break;
+    case CHAT_EVENT_TRANSFER_CANCELLED:
+        transfer_message(ANSI_COLOR_ERROR, "[FILE TRANSFER #%u] '%s' %s %s cancelled: %s",
+                         t->id, t->name, t->upload ? "to" : "from", t->peer, event->text);
+        break;
+    case CHAT_EVENT_RECONNECTING:
+        transfer_message(ANSI_COLOR_WARNING, "[SYSTEM] Connection lost (%s), reconnecting in %d ms...",
+                         event->text ? event->text : "unknown", event->value);
+        break;
+    case CHAT_EVENT_RECONNECTED:
+        if (event->value && event->text) {
+            transfer_message(ANSI_COLOR_SUCCESS, "[SYSTEM] Reconnected, session resumed in room '%s'", event->text);
+        } else if (event->value) {
+            transfer_message(ANSI_COLOR_SUCCESS, "[SYSTEM] Reconnected, session resumed");
+        } else {
+            transfer_message(ANSI_COLOR_WARNING, "[SYSTEM] Reconnected with a new session, join your room again");
+        }
+        break;
+    case CHAT_EVENT_CLOSED:
+        if (event->text) {
             printf("\r\033[K"); // Clear current line
-            print_status_message("[SYSTEM] Server disconnected.", ANSI_COLOR_WARNING);
-            is_running = 0;
-            break;
-        } 
-        else {
-            if (is_running) {
-                printf("\r\033[K"); // Clear current line
-                print_status_message("[ERROR] Connection read error.", ANSI_COLOR_ERROR);
-            }
-            break;
+            snprintf(message, sizeof(message), "[SYSTEM] Connection closed: %s.", event->text);
+            print_status_message(message, ANSI_COLOR_WARNING);
         }
+        need_prompt = 0;
+        break;
     }
-    return NULL;
 }
 
-void handle_incoming_file(int socket_fd, char *buffer) {
-    // Set file transfer in progress flag for incoming files too
-    pthread_mutex_lock(&file_transfer_progress_mutex);
-    file_transfer_in_progress = 1;
-    pthread_mutex_unlock(&file_transfer_progress_mutex);
-    
-    char sender_name[32], original_filename[128], actual_filename[256];
-    size_t file_size;
-    char output_buffer[BUFFER_SIZE];
-    sscanf(buffer, "INCOMING_FILE %31s %127s %zu", sender_name, original_filename, &file_size);
-    printf(ANSI_COLOR_INFO "\n[FILE TRANSFER] Receiving file " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_INFO " from " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_INFO " (%zu bytes)" ANSI_COLOR_RESET "\n", original_filename, sender_name, file_size);
-    
-    if (access(original_filename, F_OK) == 0) {
-        socket_send(socket_fd, "FILE_EXISTS", 12);
-        snprintf(actual_filename, sizeof(actual_filename), "%s_%s", sender_name, original_filename);
-        snprintf(output_buffer, sizeof(output_buffer), "[WARNING] File '%s' already exists. Renaming to '%s'", original_filename, actual_filename);
-        print_status_message(output_buffer, ANSI_COLOR_WARNING);    
-    } else {
-        snprintf(actual_filename, sizeof(actual_filename), "%s", original_filename);
-    }
-    
-     
-    int fd = open(actual_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        print_status_message("[ERROR] Failed to open file for writing.", ANSI_COLOR_ERROR);
-        // Clear file transfer flag on error
-        pthread_mutex_lock(&file_transfer_progress_mutex);
-        file_transfer_in_progress = 0;
-        pthread_mutex_unlock(&file_transfer_progress_mutex);
-        return;
-    }
-
-   
-    
-    print_status_message("[SUCCESS] File received successfully.", ANSI_COLOR_SUCCESS);
-    
-    // Clear file transfer in progress flag
-    pthread_mutex_lock(&file_transfer_progress_mutex);
-    file_transfer_in_progress = 0;
-    pthread_mutex_unlock(&file_transfer_progress_mutex);
-
+// /transfers: one line per transfer in flight
+void print_transfers(void) {
+    static const char *states[] = { "requested", "queued", "connecting", "running", "finishing" };
+    chat_transfer_t list[CHAT_MAX_TRANSFERS];
+    int count = chat_transfers(chat, list, CHAT_MAX_TRANSFERS);
+    for (int i = 0; i < count; i++) {
+        chat_transfer_t *t = &list[i];
+        char bar[21];
+        format_bar(bar, t->done, t->size);
+        printf(ANSI_COLOR_INFO "  #%-3u %s %-20s %s %-15s [%s] %3d%% %-10s" ANSI_COLOR_RESET "\n",
+               t->id, t->upload ? "send" : "recv", t->upload ? t->name : t->path, t->upload ? "->" : "<-",
+               t->peer, bar, t->size ? (int)(t->done * 100 / t->size) : 100, states[t->state]);
+    }
+    if (!count) print_status_message("[INFO] No file transfers in progress.", ANSI_COLOR_INFO);
 }
 
 void print_help_menu(void) {
@@ -269,8 +325,13 @@ void print_help_menu(void) {
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/broadcast <msg>" ANSI_COLOR_INFO "     - Broadcast message to current room       ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/whisper <user> <msg>" ANSI_COLOR_INFO "- Send private message to user            ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/sendfile <file> <user>" ANSI_COLOR_INFO " - Send file to user                   ║\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/transfers" ANSI_COLOR_INFO "           - Progress of your file transfers       ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/leave" ANSI_COLOR_INFO "                - Leave the current chat room              ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/list" ANSI_COLOR_INFO "                - List users in current room          ║\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/history [off] [n]" ANSI_COLOR_INFO "   - Show earlier messages in the room     ║\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/compress on|off|stats" ANSI_COLOR_INFO " - Compression of large messages    ║\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/presence on|off" ANSI_COLOR_INFO "     - Join/leave/typing updates             ║\n" ANSI_COLOR_RESET);
+    printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/typing [on|off]" ANSI_COLOR_INFO "     - Tell the room you are typing          ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/help" ANSI_COLOR_INFO "                - Show this help menu                 ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_INFO "║ " ANSI_COLOR_USERNAME "/exit" ANSI_COLOR_INFO "                - Exit the chat application           ║\n" ANSI_COLOR_RESET);
     printf(ANSI_COLOR_SYSTEM "╠══════════════════════════════════════════════════════════╣\n");
@@ -280,131 +341,42 @@ void print_help_menu(void) {
 
 // Validate username format
 int validate_username(const char *username) {
-    size_t username_length = strlen(username);
-    
-    if (username_length < 3 || username_length > MAX_USERNAME_LENGTH - 1) {
-        return 0; // Invalid length
-    }
-    
-    for (size_t i = 0; i < username_length; i++) {
-        if (!isalnum(username[i]) && username[i] != '_') {
-            return 0; // Invalid character
-        }
-    }
-    
-    return 1; // Valid username
-}
-
-// Initialize connection to server
-int initialize_connection(const char *server_ip, int port) {
-    int socket_fd;
-    struct sockaddr_in server_address;
-    
-    print_status_message("[INFO] Attempting to connect to server...", ANSI_COLOR_INFO);
-    
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        print_status_message("[ERROR] Socket creation failed", ANSI_COLOR_ERROR);
-        return -1;
-    }
-    
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, server_ip, &server_address.sin_addr) <= 0) {
-        printf(ANSI_COLOR_ERROR "[ERROR] Invalid server address: %s" ANSI_COLOR_RESET "\n", server_ip);
-        close(socket_fd);
-        return -1;
-    }
-    
-    if (connect(socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        print_status_message("[ERROR] Connection to server failed", ANSI_COLOR_ERROR);
-        close(socket_fd);
-        return -1;
-    }
-    
-    // Check for server full message
-    char buffer[BUFFER_SIZE];
-    int bytes_received = read(socket_fd, buffer, BUFFER_SIZE - 1);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        if (strstr(buffer, "Server full")) {
-            print_status_message("[ERROR] Server is full. Try again later.", ANSI_COLOR_ERROR);
-            close(socket_fd);
-            return -1;
-        }
-        else if (strstr(buffer, "SUCCESS_LOGIN")) {
-            print_status_message("[SUCCESS] Connected to server successfully.", ANSI_COLOR_SUCCESS);
-        } else {
-            print_status_message("[ERROR] Unexpected server response: ", ANSI_COLOR_ERROR);
-            printf(ANSI_COLOR_SYSTEM "%s" ANSI_COLOR_RESET "\n", buffer);
-            close(socket_fd);
-            return -1;
-        }
-    }
-    return socket_fd;
+    return text_is_name(username, 3, MAX_USERNAME_LENGTH - 1);
 }
 
 // Setup username with server
-int setup_username(int socket_fd) {
+int setup_username(void) {
     char input_buffer[BUFFER_SIZE];
     printf(ANSI_COLOR_PROMPT "enter username: " ANSI_COLOR_RESET);
     while (1) {
 
         fflush(stdout);
 
-        // Use select to monitor both stdin and socket for input/disconnection
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        FD_SET(socket_fd, &read_fds);
-        
-        int max_fd = (socket_fd > STDIN_FILENO) ? socket_fd : STDIN_FILENO;
-        struct timeval timeout = {1, 0}; // 1 second timeout for periodic checks
-        
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (activity < 0) {
-            print_status_message("[ERROR] Select failed", ANSI_COLOR_ERROR);
-            exit(1);
-        } else if (activity == 0) {
+        if (!next_stdin_line(input_buffer, sizeof(input_buffer))) {
+            if (!stdin_open) {
+                print_status_message("[ERROR] Failed to read username", ANSI_COLOR_ERROR);
+                return 0;
+            }
             
+            // Wait for input, and notice if the server goes away meanwhile
+            struct pollfd pfds[1 + CHAT_POLLFDS_MAX];
+            pfds[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+            int count = chat_pollfds(chat, pfds + 1, CHAT_POLLFDS_MAX, 0);
+            if (poll(pfds, 1 + count, -1) < 0) {
+                if (errno == EINTR && is_running) continue;
+                print_status_message("[ERROR] Poll failed", ANSI_COLOR_ERROR);
+                return 0;
+            }
+            if (!chat_dispatch(chat, pfds + 1, count)) {
+                print_status_message("[ERROR] Server disconnected while waiting for username", ANSI_COLOR_ERROR);
+                return 0;
+            }
+            if (pfds[0].revents) {
+                fill_stdin();
+            }
             continue;
         }
         
-        if (FD_ISSET(socket_fd, &read_fds)) {
-    char test_buffer[BUFFER_SIZE];
-    
-    // Actually receive the data (without MSG_PEEK first)
-    int bytes = recv(socket_fd, test_buffer, BUFFER_SIZE - 1, MSG_DONTWAIT);
-    
-    if (bytes <= 0) {
-        if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-            print_status_message("[ERROR] Server disconnected while waiting for username", ANSI_COLOR_ERROR);
-            close(socket_fd);
-            exit(1); 
-        }
-    } 
-}
-        
-        // Check if stdin has input
-        if (!FD_ISSET(STDIN_FILENO, &read_fds)) {
-            continue; // No stdin input, keep waiting
-        }
-         
-        // Read username from stdin
-        memset(input_buffer, 0, BUFFER_SIZE);
-        if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) {
-            print_status_message("[ERROR] Failed to read username", ANSI_COLOR_ERROR);
-            continue;
-        }
-        
-        // Remove newline character if present
-        size_t len = strlen(input_buffer);
-        if (len > 0 && input_buffer[len - 1] == '\n') {
-            input_buffer[len - 1] = '\0';
-        }
-        
         // Check for empty input
         if (input_buffer[0] == '\0') {
             print_status_message("[ERROR] Username cannot be empty", ANSI_COLOR_ERROR);
@@ -417,376 +389,196 @@ int setup_username(int socket_fd) {
             continue;
         }
         
-        // Copy validated username to global username variable
-        strncpy(username, input_buffer, BUFFER_SIZE - 1);
-        username[BUFFER_SIZE - 1] = '\0'; // Ensure null termination
-        
-        // Prepare command to send to server
-        char command_buffer[BUFFER_SIZE];
-        snprintf(command_buffer, BUFFER_SIZE, "/username %s", username);
-        
-        // Send username to server
-        if (send(socket_fd, command_buffer, strlen(command_buffer), 0) < 0) {
-            print_status_message("[ERROR] Failed to send username to server", ANSI_COLOR_ERROR);
-            exit(1);
-        }
-        
-        // Wait for server response with timeout
-        fd_set response_fds;
-        FD_ZERO(&response_fds);
-        FD_SET(socket_fd, &response_fds);
-        
-        struct timeval response_timeout = {5, 0}; // 5 second timeout for server response
-        int response_activity = select(socket_fd + 1, &response_fds, NULL, NULL, &response_timeout);
-        
-        if (response_activity < 0) {
-            print_status_message("[ERROR] Failed waiting for server response", ANSI_COLOR_ERROR);
-            exit(1);
-        } else if (response_activity == 0) {
-            print_status_message("[ERROR] Server response timeout", ANSI_COLOR_ERROR);
-            exit(1);
-        }
-        
-        // Read server response
-        char response_buffer[BUFFER_SIZE];
-        int bytes_received = recv(socket_fd, response_buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received < 0) {
-            print_status_message("[ERROR] Failed to receive server response", ANSI_COLOR_ERROR);
-            exit(1);
-        } else if (bytes_received == 0) {
-            print_status_message("[ERROR] Server disconnected", ANSI_COLOR_ERROR);
-            exit(1);
-        }
-        
-        response_buffer[bytes_received] = '\0'; // Null-terminate the response
-        
-        // Check server response
-        if (strncmp(response_buffer, "ALREADY_TAKEN", 13) == 0) {
+        int result = chat_login(chat, input_buffer, LOGIN_TIMEOUT_MS);
+        if (result == CHAT_ERR_TAKEN) {
             print_status_message("[ERROR] Username already taken. Please choose another.", ANSI_COLOR_ERROR);
             printf(ANSI_COLOR_PROMPT "enter username: " ANSI_COLOR_RESET);
             continue; // Try again
-        } else if (strncmp(response_buffer, "SET_USERNAME", 12) == 0) {
-            printf(ANSI_COLOR_SUCCESS "\n[SUCCESS] Welcome " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_SUCCESS "! Type " ANSI_COLOR_INFO "/help" ANSI_COLOR_SUCCESS " for available commands.\n" ANSI_COLOR_RESET, username);
-            return 1;
-        } else {
+        } else if (result == CHAT_ERR_PROTOCOL) {
+            // The library has passed the reply on as a message
             print_status_message("[ERROR] Unexpected server response", ANSI_COLOR_ERROR);
-            printf(ANSI_COLOR_SYSTEM "%s" ANSI_COLOR_RESET "\n", response_buffer);
             printf(ANSI_COLOR_PROMPT "enter username: " ANSI_COLOR_RESET);
             continue;
+        } else if (result != CHAT_OK) {
+            printf(ANSI_COLOR_ERROR "[ERROR] Login failed: %s" ANSI_COLOR_RESET "\n", chat_strerror(result));
+            return 0;
         }
+        printf(ANSI_COLOR_SUCCESS "\n[SUCCESS] Welcome " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_SUCCESS "! Type " ANSI_COLOR_INFO "/help" ANSI_COLOR_SUCCESS " for available commands.\n" ANSI_COLOR_RESET, chat_username(chat));
+        return 1;
     }
 }
 
-// Handle file sending in main thread (blocking)
-int handle_send_file(int socket_fd, const char *recipient, const char *filename) {
-    printf(ANSI_COLOR_INFO "[FILE TRANSFER] Preparing to send " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_INFO " to user " ANSI_COLOR_USERNAME "'%s'" ANSI_COLOR_INFO "..." ANSI_COLOR_RESET "\n", filename, recipient);
-    
-    if(strcmp(recipient, username) == 0) {
-        print_status_message("[ERROR] You cannot send a file to yourself.", ANSI_COLOR_ERROR);
-        return 0;
+// One line the user typed. Returns 0 if the connection is lost.
+int handle_user_input(char *input_buffer) {
+    // Check for empty input
+    if (input_buffer[0] == '\0') {
+        printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
+        fflush(stdout);
+        return 1;
     }
 
-    // First, check if file exists and is readable
-    int file_fd = open(filename, O_RDONLY);
-    if (file_fd < 0) {
-        printf(ANSI_COLOR_ERROR "[ERROR] Cannot open file " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_ERROR " - %s" ANSI_COLOR_RESET "\n", filename, strerror(errno));
-        return 0;
+    // Handle local commands (help, exit remain the same)
+    if (strcmp(input_buffer, "/help") == 0) {
+        print_help_menu();
+        return 1;
     }
 
-    // Get file size
-    off_t file_size = lseek(file_fd, 0, SEEK_END);
-    if (file_size < 0) {
-        printf(ANSI_COLOR_ERROR "[ERROR] Cannot get file size for " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_RESET "\n", filename);
-        close(file_fd);
-        return 0;
+    if (strcmp(input_buffer, "/exit") == 0) {
+        print_status_message("[INFO] Sending disconnect request to server...", ANSI_COLOR_INFO);
+        chat_leave(chat);
+        return 1;
     }
-    lseek(file_fd, 0, SEEK_SET); // Reset to beginning
-    close(file_fd); // Close for now, will reopen when ready to send
     
-    // Send the initial sendfile command to server
-    char command_buffer[BUFFER_SIZE];
-    snprintf(command_buffer, sizeof(command_buffer), "/sendfile %s %s %zu", filename, recipient, (size_t)file_size);
+    // Files go in the background, the prompt comes straight back
+    if (strncmp(input_buffer, "/sendfile ", 10) == 0) {
+        char recipient[32], filename[128];
+        if (sscanf(input_buffer + 10, " %127s %31s ", filename, recipient) == 2) {
+            uint32_t id;
+            int result = chat_send_file(chat, recipient, filename, &id);
+            if (result == CHAT_OK) {
+                printf(ANSI_COLOR_INFO "[FILE TRANSFER #%u] Requested sending " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_INFO " to " ANSI_COLOR_USERNAME "%s" ANSI_COLOR_INFO ". /transfers shows progress." ANSI_COLOR_RESET "\n",
+                       id, filename, recipient);
+            } else if (result == CHAT_ERR_OPEN) {
+                printf(ANSI_COLOR_ERROR "[ERROR] Cannot open file " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_ERROR " - %s" ANSI_COLOR_RESET "\n", filename, strerror(errno));
+            } else {
+                printf(ANSI_COLOR_ERROR "[ERROR] Cannot send " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_ERROR ": %s" ANSI_COLOR_RESET "\n", filename, chat_strerror(result));
+            }
+        } else {
+            print_status_message("[ERROR] Invalid syntax. Usage: /sendfile <filename> <recipient> ", ANSI_COLOR_ERROR);
+        }
+        printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
+        fflush(stdout);
+        return 1;
+    }
     
-    printf("[DEBUG] Sending command: '%s'\n", command_buffer);  // Debug output
-
-    if (send(socket_fd, command_buffer, strlen(command_buffer), 0) < 0) {
-        printf(ANSI_COLOR_ERROR "[ERROR] Failed to send file transfer command for " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_RESET "\n", filename);
-        return 0;
+    if (strcmp(input_buffer, "/transfers") == 0) {
+        print_transfers();
+        printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
+        fflush(stdout);
+        return 1;
     }
-
-    print_status_message("[INFO] File transfer request sent. Waiting for server confirmation...", ANSI_COLOR_INFO);
-    print_status_message("[WARNING] Please wait - file transfer will block other commands until complete.", ANSI_COLOR_WARNING);
     
+    // Provide feedback for common commands
+    if (strncmp(input_buffer, "/join ", 6) == 0) {
 
+       if (strlen(input_buffer) < 7 || !validate_room_name(input_buffer + 6)) {
+            print_status_message("[ERROR] Invalid room name. Use alphanumeric characters and underscores only (1-31 chars)", ANSI_COLOR_ERROR);
+            return 1;
+        }
+    
 
-    // Wait for READY_FOR_FILE signal with timeout
-    int timeout_seconds = 60; // Wait up to 60 seconds
-    int ret_code = wait_for_ready(timeout_seconds);
-    if (ret_code == 0) {
-        
-        printf(ANSI_COLOR_ERROR "[ERROR] Timeout: Server did not respond for file transfer of " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_RESET "\n", filename);
-        print_status_message("[WARNING] File transfer cancelled. You may try again later.", ANSI_COLOR_WARNING);
-        return 0;
+        print_status_message("[INFO] Attempting to join room...", ANSI_COLOR_INFO);
+    } else if (strncmp(input_buffer, "/whisper ", 9) == 0) {
+        print_status_message("[INFO] Sending private message...", ANSI_COLOR_INFO);
+    } else if (strncmp(input_buffer, "/broadcast ", 11) == 0) {
+        print_status_message("[INFO] Broadcasting message to room...", ANSI_COLOR_INFO);
+    } else if (strcmp(input_buffer, "/list") == 0) {
+        print_status_message("[INFO] Requesting user list...", ANSI_COLOR_INFO);
+    } else if (strcmp(input_buffer, "/leave") == 0) {
+        print_status_message("[INFO] Leaving current room...", ANSI_COLOR_INFO);
     }
-    else if (ret_code < 0) {
-        
-        return 0;
-    }
-    printf("---%d---\n", ret_code);
-    
-    printf(ANSI_COLOR_SUCCESS "[SUCCESS] Server is ready! Starting file transfer for " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_SUCCESS "..." ANSI_COLOR_RESET "\n", filename);
-   
-    
-    int timout = wait_for_file_transfer(20); // Wait for file transfer to complete
-    if (!timout) {
-        printf(ANSI_COLOR_ERROR "[ERROR] File transfer timed out for " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_RESET "\n", filename);
-        
+
+    // Send command/message to server
+    if (chat_send(chat, input_buffer) != CHAT_OK) {
+        print_status_message("[ERROR] Failed to send message to server", ANSI_COLOR_ERROR);
         return 0;
     }
-    
-    printf(ANSI_COLOR_SUCCESS "\n[SUCCESS] File " ANSI_COLOR_FILENAME "'%s'" ANSI_COLOR_SUCCESS " sent successfully!" ANSI_COLOR_RESET "\n", filename);
-    print_status_message("[INFO] You can now continue using chat commands.", ANSI_COLOR_INFO);
-    
     return 1;
 }
 
-// Process user input and handle commands
-void process_user_input(int socket_fd) {
+// The client's only loop: one poll() over stdin and the library's
+// descriptors (the chat socket and every transfer's data connection).
+// Input is only read and sent while the socket has room, a batch at a
+// time, so a fast sender never stops reading replies.
+void run_event_loop(void) {
+    struct pollfd pfds[1 + CHAT_POLLFDS_MAX];
     char input_buffer[BUFFER_SIZE];
-    int transfer_active = 0;
     
     // Show initial prompt
     printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
     fflush(stdout);
     
     while (is_running) {
-        // Check if file transfer is in progress
-        pthread_mutex_lock(&file_transfer_progress_mutex);
-        transfer_active = file_transfer_in_progress;
-        pthread_mutex_unlock(&file_transfer_progress_mutex);
-        
-        if (transfer_active) {
-            // Don't show the repeated message, just wait
-            usleep(500000); // Sleep for 500ms
-            continue;
+        int leaving = chat_leaving(chat);
+        // Piped input has run out: leave once the last transfer has settled
+        if (!leaving && !stdin_open && stdin_len == 0 && !chat_transfers_in_flight(chat)) {
+            print_status_message("[INFO] Sending disconnect request to server...", ANSI_COLOR_INFO);
+            chat_leave(chat);
+            leaving = 1;
         }
         
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        struct timeval timeout = {0, 100000}; // 100ms
-
-        int activity = select(STDIN_FILENO + 1, &read_fds, NULL, NULL, &timeout);
-        if (activity < 0) {
-            break;
-        } else if (activity == 0) {
-            continue;
-        }
+        int pending = !leaving && stdin_has_line();
+        pfds[0] = (struct pollfd){ .fd = stdin_open && !pending && !leaving ? STDIN_FILENO : -1, .events = POLLIN };
+        int count = chat_pollfds(chat, pfds + 1, CHAT_POLLFDS_MAX, pending);
         
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            memset(input_buffer, 0, BUFFER_SIZE);
-            // Don't print prompt here anymore - it's already shown
-            if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) {
-                print_status_message("[ERROR] Failed to read user input", ANSI_COLOR_ERROR);
-                printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
-                fflush(stdout);
-                continue;
-            }
-            
-            // Remove newline character
-            if (input_buffer[strlen(input_buffer) - 1] == '\n') {
-                input_buffer[strlen(input_buffer) - 1] = '\0';
-            }
-            
-            // Check for empty input
-            if (input_buffer[0] == '\0') {
-                printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
-                fflush(stdout);
-                continue;
-            }
+        int ready = poll(pfds, 1 + count, leaving ? EXIT_DRAIN_MS : chat_timeout(chat));
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            print_status_message("[ERROR] Poll failed", ANSI_COLOR_ERROR);
+            break;
         }
-
-        // Handle local commands (help, exit remain the same)
-        if (strcmp(input_buffer, "/help") == 0) {
-            print_help_menu();
-            continue;
+        if (ready == 0 && leaving) {
+            break;      // the server never closed after /exit
         }
-
-        if (strcmp(input_buffer, "/exit") == 0) {
-            print_status_message("[INFO] Sending disconnect request to server...", ANSI_COLOR_INFO);
-            if (send(socket_fd, input_buffer, strlen(input_buffer), 0) < 0) {
-                print_status_message("[WARNING] Failed to send disconnect message to server", ANSI_COLOR_WARNING);
-            }
-            is_running = 0;
+        
+        if (!chat_dispatch(chat, pfds + 1, count)) {
             break;
         }
-        
-        // Modified sendfile command handling with blocking
-        if (strncmp(input_buffer, "/sendfile ", 10) == 0) {
-            char recipient[32], filename[128];
-            if (sscanf(input_buffer + 10, " %127s %31s ", filename, recipient) == 2) {
-                // Set file transfer in progress flag
-                pthread_mutex_lock(&file_transfer_progress_mutex);
-                file_transfer_in_progress = 1;
-                pthread_mutex_unlock(&file_transfer_progress_mutex);
-                
-                // Call blocking file transfer function
-                int result = handle_send_file(socket_fd, recipient, filename);
-                
-                // Clear file transfer in progress flag
-                pthread_mutex_lock(&file_transfer_progress_mutex);
-                file_transfer_in_progress = 0;
-                pthread_mutex_unlock(&file_transfer_progress_mutex);
-                
-                if (result) {
-                    printf(ANSI_COLOR_PROMPT "\n> " ANSI_COLOR_RESET);
-                    fflush(stdout);
+        if (need_prompt) {
+            printf(ANSI_COLOR_PROMPT "> " ANSI_COLOR_RESET);
+            fflush(stdout);
+            need_prompt = 0;
+        }
+        if (pfds[1].revents & POLLOUT) {
+            for (int n = 0; n < INPUT_BATCH && !chat_leaving(chat) && next_stdin_line(input_buffer, sizeof(input_buffer)); n++) {
+                if (!handle_user_input(input_buffer)) {
+                    is_running = 0;
+                    break;
                 }
-            } else {
-                print_status_message("[ERROR] Invalid syntax. Usage: /sendfile <filename> <recipient> ", ANSI_COLOR_ERROR);
             }
-            continue;
-        }
-        
-        // Provide feedback for common commands
-        if (strncmp(input_buffer, "/join ", 6) == 0) {
-
-           if (strlen(input_buffer) < 7 || !validate_room_name(input_buffer + 6)) {
-                print_status_message("[ERROR] Invalid room name. Use alphanumeric characters and underscores only (1-32 chars)", ANSI_COLOR_ERROR);
-                continue;
+            // Whatever was typed goes now rather than at the end of the window
+            if (chat_flush(chat) != CHAT_OK) {
+                print_status_message("[ERROR] Failed to send message to server", ANSI_COLOR_ERROR);
+                break;
             }
-        
-
-            print_status_message("[INFO] Attempting to join room...", ANSI_COLOR_INFO);
-        } else if (strncmp(input_buffer, "/whisper ", 9) == 0) {
-            print_status_message("[INFO] Sending private message...", ANSI_COLOR_INFO);
-        } else if (strncmp(input_buffer, "/broadcast ", 11) == 0) {
-            print_status_message("[INFO] Broadcasting message to room...", ANSI_COLOR_INFO);
-        } else if (strcmp(input_buffer, "/list") == 0) {
-            print_status_message("[INFO] Requesting user list...", ANSI_COLOR_INFO);
-        } else if (strcmp(input_buffer, "/leave") == 0) {
-            print_status_message("[INFO] Leaving current room...", ANSI_COLOR_INFO);
         }
-
-        // Send command/message to server
-        strcat(input_buffer, "\n"); // Add newline for server parsing
-        if (send(socket_fd, input_buffer, strlen(input_buffer), 0) < 0) {
-            print_status_message("[ERROR] Failed to send message to server", ANSI_COLOR_ERROR);
-            break;
+        if (pfds[0].revents) {
+            fill_stdin();
         }
     }
 }
 
 int validate_room_name(const char *room_name) {
-    size_t len = strlen(room_name);
-    if (len < 1 || len > 32) {
-        return 0; // Invalid length
-    }
-    for (size_t i = 0; i < len; i++) {
-        if (!isalnum(room_name[i]) && room_name[i] != '_') {
-            return 0; // Invalid character
-        }
-    }
-    return 1; // Valid room name
-}
-
-// Wait for server to signal readiness for file transfer
-int wait_for_ready(int timeout_seconds) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += timeout_seconds;
-    
-    int rc = 0;
-    int success = 0;
-    
-    pthread_mutex_lock(&ready_mutex);
-    
-
-    
-    while (!ready_for_file && rc != ETIMEDOUT) {
-        rc = pthread_cond_timedwait(&ready_cond, &ready_mutex, &ts);
-        
-        // Check if the client is shutting down
-        if (!is_running) {
-            pthread_mutex_unlock(&ready_mutex);
-            return 0; // Client is shutting down
-        }
-    }
-   
-   
-    // Check the result after the loop
-    if (ready_for_file == 1) {
-      
-        ready_for_file = 0; // Reset for next use
-        success = 1; // Success: ready signal received
-    } 
-    else if(rc == ETIMEDOUT) {
-        print_status_message("[ERROR] Timeout waiting for server readiness for file transfer", ANSI_COLOR_ERROR);
-        success = 0; // Timeout occurred
-    }
-    else {
-        success = -1; // Timeout or other error
-    }
-    
-    pthread_mutex_unlock(&ready_mutex);
-    return success;
-}
-
-int wait_for_file_transfer(int timeout_seconds) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += timeout_seconds;
-
-    int rc = 0;
-    int success = 0;
-
-    pthread_mutex_lock(&file_transfer_mutex);
-
-    // Wait until file_transfer_finished is set or timeout occurs
-    while (!file_transfer_finished && rc != ETIMEDOUT) {
-        rc = pthread_cond_timedwait(&file_transfer_cond, &file_transfer_mutex, &ts);
-
-        // Check if the client is shutting down
-        if (!is_running) {
-            pthread_mutex_unlock(&file_transfer_mutex);
-            return 0; // Client is shutting down
-        }
-    }
-
-    // Check the result after the loop
-    if (file_transfer_finished) {
-        file_transfer_finished = 0; // Reset for next use
-        success = 1; // Success: file transfer finished
-    } else {
-        success = 0; // Timeout or other error
-    }
-
-    pthread_mutex_unlock(&file_transfer_mutex);
-    return success;
+    return text_is_name(room_name, 1, MAX_GROUP_NAME_LENGTH - 1);
 }
 
 // Clean up resources
-void cleanup_resources(int socket_fd) {
+void cleanup_resources(void) {
     is_running = 0;
     
-
-    
-    // Cleanup mutexes and condition variables
-    pthread_mutex_destroy(&ready_mutex);
-    pthread_cond_destroy(&ready_cond);
-    pthread_mutex_destroy(&file_transfer_mutex);
-    pthread_cond_destroy(&file_transfer_cond);
-    pthread_mutex_destroy(&socket_mutex);
-    pthread_mutex_destroy(&prompt_mutex);
-    pthread_mutex_destroy(&file_transfer_progress_mutex);
+    // Transfers still running are cut off with the process
+    int unfinished = chat_transfers_in_flight(chat);
+    if (unfinished) {
+        printf(ANSI_COLOR_WARNING "[WARNING] %d file transfer(s) did not finish." ANSI_COLOR_RESET "\n", unfinished);
+    }
     
-    close(socket_fd);
+    chat_close(chat);
+    chat = NULL;
     print_status_message("[SYSTEM] Disconnected from server. Goodbye!", ANSI_COLOR_SUCCESS);
 }
 // Main function
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, ANSI_COLOR_ERROR "[ERROR] Usage: %s <server_ip> <port>" ANSI_COLOR_RESET "\n", argv[0]);
+    int bad_option = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--no-compress") == 0) use_compression = 0;
+        else if (strcmp(argv[i], "--presence") == 0) use_presence = 1;
+        else if (strcmp(argv[i], "--streams") == 0 && i + 1 < argc) upload_streams = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--delta") == 0) use_delta = 1;
+        else if (strcmp(argv[i], "--no-reconnect") == 0) use_reconnect = 0;
+        else bad_option = 1;
+    }
+    if (argc < 3 || bad_option || upload_streams < 1 || upload_streams > MAX_TRANSFER_STREAMS) {
+        fprintf(stderr, ANSI_COLOR_ERROR "[ERROR] Usage: %s <server_ip> <port> [--no-compress] [--presence] [--streams 1-%d] [--delta] [--no-reconnect]" ANSI_COLOR_RESET "\n", argv[0], MAX_TRANSFER_STREAMS);
         exit(1);
     }
     
@@ -815,35 +607,42 @@ int main(int argc, char *argv[]) {
     }
 
     // Initialize connection
-    int socket_fd = initialize_connection(server_ip, port);
-    if (socket_fd < 0) {
+    print_status_message("[INFO] Attempting to connect to server...", ANSI_COLOR_INFO);
+    int error;
+    chat = chat_connect(server_ip, port, on_chat_event, NULL, &error);
+    if (!chat) {
+        if (error == CHAT_ERR_FULL) {
+            print_status_message("[ERROR] Server is full. Try again later.", ANSI_COLOR_ERROR);
+        } else {
+            printf(ANSI_COLOR_ERROR "[ERROR] %s (%s:%d)" ANSI_COLOR_RESET "\n", chat_strerror(error), server_ip, port);
+        }
         exit(1);
     }
+    print_status_message("[SUCCESS] Connected to server successfully.", ANSI_COLOR_SUCCESS);
     
     // Setup username
-    if (!setup_username(socket_fd)) {
-        close(socket_fd);
+    if (!setup_username()) {
+        chat_close(chat);
         exit(1);
     }
 
-    // Create server response handler thread
-    if (pthread_create(&server_response_thread, NULL, handle_server_responses, (void *)&socket_fd) != 0) {
-        print_status_message("[ERROR] Failed to create response handler thread", ANSI_COLOR_ERROR);
-        close(socket_fd);
-        exit(1);
+    chat_set_coalescing(chat, COALESCE_WINDOW_US, CHAT_COALESCE_MAX);
+    chat_set_upload_streams(chat, upload_streams);
+    chat_set_delta(chat, use_delta);
+    chat_set_reconnect(chat, use_reconnect);
+
+    // Offer compression; the reply is handled by the event loop
+    if (use_compression && chat_send(chat, "/compress on") != CHAT_OK) {
+        print_status_message("[WARNING] Failed to request compression", ANSI_COLOR_WARNING);
     }
-    
-    // Detach the thread so it cleans up automatically when it finishes
-    if (pthread_detach(server_response_thread) != 0) {
-        print_status_message("[WARNING] Failed to detach response handler thread", ANSI_COLOR_WARNING);
-    } 
-    
-    
-    
-    // Process user input
-    process_user_input(socket_fd);
+    if (use_presence && chat_send(chat, "/presence on") != CHAT_OK) {
+        print_status_message("[WARNING] Failed to request presence updates", ANSI_COLOR_WARNING);
+    }
+
+    // Process user input and server messages until the session ends
+    run_event_loop();
     
     // Cleanup and exit
-    cleanup_resources(socket_fd);
+    cleanup_resources();
     return 0;
-}
\ No newline at end of file
+}
@@ -40,6 +40,7 @@ class ChatClient:
         self.current_room = ""
         self.is_running = True
         self.server_response_thread = None
+        self.ping_tail = b""  # start of a PING line cut off by the last read
         
         # Thread synchronization
         self.socket_lock = threading.Lock()
@@ -85,6 +86,10 @@ class ChatClient:
         except:
             return False
 
+    def send_command(self, command: str) -> bool:
+        """Send one command line; the server runs it once the newline arrives"""
+        return self.socket_send(command.encode('utf-8') + b"\n")
+
     def print_help_menu(self):
         """Print help menu"""
         self.clear_prompt()
@@ -138,7 +143,7 @@ class ChatClient:
             try:
                 # Send username command to server
                 username_cmd = f"/username {username}"
-                self.socket_send(username_cmd.encode('utf-8'))
+                self.send_command(username_cmd)
                 
                 # Wait for server response
                 response = self.socket.recv(BUFFER_SIZE).decode('utf-8')
@@ -168,6 +173,9 @@ class ChatClient:
                 data = self.socket.recv(BUFFER_SIZE)
                 if not data:
                     break
+                data = self.answer_pings(data)
+                if not data:
+                    continue
                     
                 message = data.decode('utf-8')
                 self.handle_server_message(message)
@@ -181,6 +189,26 @@ class ChatClient:
                 
         self.is_running = False
 
+    def answer_pings(self, data: bytes) -> bytes:
+        """Answer the server's idle heartbeat, a "PING" line of its own, with
+        PONG and drop it; chat text that merely contains PING is left alone"""
+        data = self.ping_tail + data
+        self.ping_tail = b""
+        lines = data.split(b"\n")
+        last = lines.pop()  # after the final newline
+        kept = []
+        for line in lines:
+            if line == b"PING":
+                self.socket_send(b"PONG\n")
+            else:
+                kept.append(line + b"\n")
+        # A read may stop partway into a PING line, finish it next time
+        if last and b"PING".startswith(last):
+            self.ping_tail = last
+        else:
+            kept.append(last)
+        return b"".join(kept)
+
     def handle_server_message(self, message: str):
         """Handle incoming server messages"""
         self.clear_prompt()
@@ -277,10 +305,10 @@ class ChatClient:
             
             # Send file transfer command
             cmd = f"/sendfile {recipient} {basename}"
-            self.socket_send(cmd.encode('utf-8'))
+            self.send_command(cmd)
             
             # Send file size
-            self.socket_send(str(file_size).encode('utf-8'))
+            self.send_command(str(file_size))
             
             self.print_status_message(f"[FILE] Sending {basename} to {recipient}...", ANSI_COLOR_INFO)
                 
@@ -305,10 +333,10 @@ class ChatClient:
                     if not args.isalnum() or len(args) > 32:
                         self.print_status_message("[ERROR] Room name must be alphanumeric, max 32 chars", ANSI_COLOR_ERROR)
                         return
-                    self.socket_send(command.encode('utf-8'))
+                    self.send_command(command)
                     
             elif cmd == '/leave':
-                self.socket_send(command.encode('utf-8'))
+                self.send_command(command)
                 
             elif cmd == '/broadcast':
                 if not args:
@@ -316,14 +344,14 @@ class ChatClient:
                 elif not self.current_room:
                     self.print_status_message("[ERROR] You must join a room first", ANSI_COLOR_ERROR)
                 else:
-                    self.socket_send(command.encode('utf-8'))
+                    self.send_command(command)
                     
             elif cmd == '/whisper':
                 whisper_parts = args.split(' ', 1)
                 if len(whisper_parts) < 2:
                     self.print_status_message("[ERROR] Usage: /whisper <username> <message>", ANSI_COLOR_ERROR)
                 else:
-                    self.socket_send(command.encode('utf-8'))
+                    self.send_command(command)
                     
             elif cmd == '/sendfile':
                 file_parts = args.split(' ', 1)
@@ -337,10 +365,10 @@ class ChatClient:
                 if not self.current_room:
                     self.print_status_message("[ERROR] You must join a room first", ANSI_COLOR_ERROR)
                 else:
-                    self.socket_send(command.encode('utf-8'))
+                    self.send_command(command)
                     
             elif cmd == '/exit':
-                self.socket_send(command.encode('utf-8'))
+                self.send_command(command)
                 self.is_running = False
                 
             else:
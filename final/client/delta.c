@@ -0,0 +1,357 @@
+#include "delta.h"
+#include "../shared/chatDefination.h"
+#include "../shared/textscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DELTA_X86 1
+#include <immintrin.h>
+#endif
+
+static inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline unsigned char *put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+size_t delta_block_size(size_t basis_size) {
+    size_t block = 64;
+    while (block * block < basis_size && block < DELTA_MAX_BLOCK) block += 64;
+    return block < DELTA_MIN_BLOCK ? DELTA_MIN_BLOCK : block;
+}
+
+// ---- weak sum ----
+
+static inline uint32_t weak_pack(uint32_t s1, uint32_t s2) {
+    return (s1 & 0xFFFF) | (s2 << 16);
+}
+
+// Carry on from s1 and s2 one byte at a time: s1 += x, s2 += s1
+static uint32_t weak_scalar(const unsigned char *data, size_t len, uint32_t s1, uint32_t s2) {
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        s2 += 4 * s1 + 4 * data[i] + 3 * data[i + 1] + 2 * data[i + 2] + data[i + 3];
+        s1 += data[i] + data[i + 1] + data[i + 2] + data[i + 3];
+    }
+    for (; i < len; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+    return weak_pack(s1, s2);
+}
+
+#ifdef DELTA_X86
+
+// Over n steps of W bytes, s2 = W * (sum of s1 after each step) - (sum of
+// each byte times its place in its step). psadbw sums a step's bytes,
+// pmaddwd weighs them; 32-bit lanes wrap, which the 16-bit sums allow.
+static uint32_t weak_sse2(const unsigned char *data, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i place_lo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m128i place_hi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i s1 = zero, s1_sum = zero, placed = zero;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        s1 = _mm_add_epi64(s1, _mm_sad_epu8(v, zero));
+        s1_sum = _mm_add_epi64(s1_sum, s1);
+        placed = _mm_add_epi32(placed, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), place_lo));
+        placed = _mm_add_epi32(placed, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), place_hi));
+    }
+    uint32_t a = _mm_cvtsi128_si32(s1) + _mm_cvtsi128_si32(_mm_srli_si128(s1, 8));
+    uint32_t p = _mm_cvtsi128_si32(s1_sum) + _mm_cvtsi128_si32(_mm_srli_si128(s1_sum, 8));
+    placed = _mm_add_epi32(placed, _mm_srli_si128(placed, 8));
+    placed = _mm_add_epi32(placed, _mm_srli_si128(placed, 4));
+    uint32_t b = 16 * p - (uint32_t)_mm_cvtsi128_si32(placed);
+    return weak_scalar(data + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static uint32_t weak_avx2(const unsigned char *data, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i place_lo = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256i place_hi = _mm256_setr_epi16(16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    __m256i s1 = zero, s1_sum = zero, placed = zero;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        s1 = _mm256_add_epi64(s1, _mm256_sad_epu8(v, zero));
+        s1_sum = _mm256_add_epi64(s1_sum, s1);
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+        placed = _mm256_add_epi32(placed, _mm256_madd_epi16(lo, place_lo));
+        placed = _mm256_add_epi32(placed, _mm256_madd_epi16(hi, place_hi));
+    }
+    __m128i a2 = _mm_add_epi64(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1));
+    __m128i p2 = _mm_add_epi64(_mm256_castsi256_si128(s1_sum), _mm256_extracti128_si256(s1_sum, 1));
+    __m128i k = _mm_add_epi32(_mm256_castsi256_si128(placed), _mm256_extracti128_si256(placed, 1));
+    uint32_t a = _mm_cvtsi128_si32(a2) + _mm_cvtsi128_si32(_mm_srli_si128(a2, 8));
+    uint32_t p = _mm_cvtsi128_si32(p2) + _mm_cvtsi128_si32(_mm_srli_si128(p2, 8));
+    k = _mm_add_epi32(k, _mm_srli_si128(k, 8));
+    k = _mm_add_epi32(k, _mm_srli_si128(k, 4));
+    uint32_t b = 32 * p - (uint32_t)_mm_cvtsi128_si32(k);
+    // gcc leaves the upper halves dirty across the tail call, which slows
+    // the SSE code that runs next
+    _mm256_zeroupper();
+    return weak_scalar(data + i, len - i, a, b);
+}
+
+#endif // DELTA_X86
+
+uint32_t delta_weak_sum(const unsigned char *data, size_t len) {
+#ifdef DELTA_X86
+    switch (textscan_level()) {
+    case TEXTSCAN_AVX2: return weak_avx2(data, len);
+    case TEXTSCAN_SSE2: return weak_sse2(data, len);
+    default: break;
+    }
+#endif
+    return weak_scalar(data, len, 0, 0);
+}
+
+// Slide the block one byte: drop out, take in
+static inline uint32_t weak_roll(uint32_t sum, unsigned char out, unsigned char in, size_t block) {
+    uint32_t s1 = (sum & 0xFFFF) - out + in;
+    uint32_t s2 = (sum >> 16) - (uint32_t)block * out + s1;
+    return weak_pack(s1, s2);
+}
+
+// Only checked when the weak sums agree; the whole-file checksum the
+// recipient verifies stands behind it. A word at a time, multiply-xorshift.
+static uint64_t strong_hash(const unsigned char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ data[i]) * 0x100000001B3ull;
+    }
+    return h ^ (h >> 32);
+}
+
+// ---- signature ----
+
+unsigned char *delta_signature(const unsigned char *basis, size_t size, size_t *len) {
+    size_t block = delta_block_size(size);
+    size_t count = (size + block - 1) / block;
+    unsigned char *signature = malloc(DELTA_SIGNATURE_HEADER + count * DELTA_SIGNATURE_ENTRY);
+    if (!signature) return NULL;
+    unsigned char *p = put32(put32(signature, block), size);
+    for (size_t i = 0; i < count; i++) {
+        size_t n = i + 1 < count ? block : size - i * block;
+        uint64_t strong = strong_hash(basis + i * block, n);
+        p = put32(p, delta_weak_sum(basis + i * block, n));
+        p = put32(put32(p, strong >> 32), strong);
+    }
+    *len = p - signature;
+    return signature;
+}
+
+// ---- encode ----
+
+typedef struct {
+    size_t block, basis_size, count;
+    size_t tail;                    // length of a short last block, 0 if none
+    uint32_t *weak;
+    uint64_t *strong;
+    uint32_t *head;                 // bucket -> first block + 1, 0 empty
+    uint32_t *next;                 // block -> next block in its bucket + 1
+    int bits;
+} signature_t;
+
+static inline uint32_t bucket(const signature_t *sig, uint32_t weak) {
+    return (weak * 2654435761u) >> (32 - sig->bits);
+}
+
+static int parse_signature(signature_t *sig, const unsigned char *data, size_t len) {
+    memset(sig, 0, sizeof(*sig));
+    if (len < DELTA_SIGNATURE_HEADER || len > DELTA_MAX_SIGNATURE) return 0;
+    sig->block = get32(data);
+    sig->basis_size = get32(data + 4);
+    if (sig->block < DELTA_MIN_BLOCK || sig->block > DELTA_MAX_BLOCK) return 0;
+    sig->count = (sig->basis_size + sig->block - 1) / sig->block;
+    if (len != DELTA_SIGNATURE_HEADER + sig->count * DELTA_SIGNATURE_ENTRY) return 0;
+    sig->tail = sig->basis_size % sig->block;
+    sig->bits = 4;
+    while ((1u << sig->bits) < 2 * sig->count) sig->bits++;
+    sig->weak = malloc(sig->count * sizeof(uint32_t) + 1);
+    sig->strong = malloc(sig->count * sizeof(uint64_t) + 1);
+    sig->next = malloc(sig->count * sizeof(uint32_t) + 1);
+    sig->head = calloc((size_t)1 << sig->bits, sizeof(uint32_t));
+    if (!sig->weak || !sig->strong || !sig->next || !sig->head) return 0;
+    const unsigned char *p = data + DELTA_SIGNATURE_HEADER;
+    // Inserted last to first, so each bucket lists blocks in file order
+    for (size_t i = sig->count; i-- > 0; ) {
+        const unsigned char *entry = p + i * DELTA_SIGNATURE_ENTRY;
+        sig->weak[i] = get32(entry);
+        sig->strong[i] = (uint64_t)get32(entry + 4) << 32 | get32(entry + 8);
+        uint32_t b = bucket(sig, sig->weak[i]);
+        sig->next[i] = sig->head[b];
+        sig->head[b] = i + 1;
+    }
+    return 1;
+}
+
+static void free_signature(signature_t *sig) {
+    free(sig->weak);
+    free(sig->strong);
+    free(sig->next);
+    free(sig->head);
+}
+
+// Instructions go out through here; a run of copies is held back so that
+// consecutive blocks become one instruction
+typedef struct {
+    unsigned char *out;
+    size_t len;
+    uint32_t copy_first, copy_count;
+} encoder_t;
+
+static void flush_copy(encoder_t *e) {
+    if (!e->copy_count) return;
+    e->out[e->len] = 'C';
+    put32(put32(e->out + e->len + 1, e->copy_first), e->copy_count);
+    e->len += 9;
+    e->copy_count = 0;
+}
+
+static void put_copy(encoder_t *e, uint32_t block) {
+    if (e->copy_count && block == e->copy_first + e->copy_count) {
+        e->copy_count++;
+        return;
+    }
+    flush_copy(e);
+    e->copy_first = block;
+    e->copy_count = 1;
+}
+
+static void put_literal(encoder_t *e, const unsigned char *data, size_t n) {
+    if (n == 0) return;
+    flush_copy(e);
+    e->out[e->len] = 'L';
+    put32(e->out + e->len + 1, n);
+    memcpy(e->out + e->len + 5, data, n);
+    e->len += 5 + n;
+}
+
+// A full block of the basis matching data[0..block), -1 if none. The
+// block after the last copied one is tried first, to keep runs together.
+static long match_block(const signature_t *sig, const encoder_t *e, uint32_t weak, const unsigned char *data) {
+    size_t full = sig->tail ? sig->count - 1 : sig->count;
+    uint64_t strong = 0;
+    int hashed = 0;
+    if (e->copy_count) {
+        size_t expected = e->copy_first + e->copy_count;
+        if (expected < full && sig->weak[expected] == weak) {
+            strong = strong_hash(data, sig->block);
+            hashed = 1;
+            if (strong == sig->strong[expected]) return expected;
+        }
+    }
+    for (uint32_t entry = sig->head[bucket(sig, weak)]; entry; entry = sig->next[entry - 1]) {
+        size_t i = entry - 1;
+        if (i >= full || sig->weak[i] != weak) continue;
+        if (!hashed) {
+            strong = strong_hash(data, sig->block);
+            hashed = 1;
+        }
+        if (strong == sig->strong[i]) return i;
+    }
+    return -1;
+}
+
+unsigned char *delta_encode(const unsigned char *signature, size_t signature_len,
+                            const unsigned char *data, size_t size, size_t *len) {
+    encoder_t e = { .out = malloc(DELTA_MAX_WIRE(size) + 9), .len = 0 };
+    if (!e.out) return NULL;
+    if (signature_len == 0) {
+        put_literal(&e, data, size);
+        *len = e.len;
+        return e.out;
+    }
+    signature_t sig;
+    if (!parse_signature(&sig, signature, signature_len)) {
+        free_signature(&sig);
+        free(e.out);
+        return NULL;
+    }
+
+    size_t block = sig.block;
+    size_t pos = 0, literal = 0;
+    uint32_t weak = size >= block ? delta_weak_sum(data, block) : 0;
+    while (pos + block <= size) {
+        long match = match_block(&sig, &e, weak, data + pos);
+        if (match >= 0) {
+            put_literal(&e, data + literal, pos - literal);
+            put_copy(&e, match);
+            pos += block;
+            literal = pos;
+            // Restarting the sum over a whole block is where the vector code pays
+            if (pos + block <= size) weak = delta_weak_sum(data + pos, block);
+            continue;
+        }
+        if (pos + block == size) break;
+        weak = weak_roll(weak, data[pos], data[pos + block], block);
+        pos++;
+    }
+    // The basis's short last block can only be the end of the file
+    size_t tail = sig.tail;
+    if (tail && size - literal >= tail &&
+        delta_weak_sum(data + size - tail, tail) == sig.weak[sig.count - 1] &&
+        strong_hash(data + size - tail, tail) == sig.strong[sig.count - 1]) {
+        put_literal(&e, data + literal, size - tail - literal);
+        put_copy(&e, sig.count - 1);
+    } else {
+        put_literal(&e, data + literal, size - literal);
+    }
+    flush_copy(&e);
+    free_signature(&sig);
+
+    // Tiny files can come out longer than themselves
+    if (e.len > DELTA_MAX_WIRE(size)) {
+        e.len = 0;
+        put_literal(&e, data, size);
+    }
+    *len = e.len;
+    return e.out;
+}
+
+// ---- apply ----
+
+int delta_apply(const unsigned char *basis, size_t basis_size, size_t block_size,
+                const unsigned char *delta, size_t len, unsigned char *out, size_t size) {
+    size_t count = block_size ? (basis_size + block_size - 1) / block_size : 0;
+    size_t written = 0, i = 0;
+    while (i < len) {
+        unsigned char op = delta[i++];
+        if (op == 'C' && len - i >= 8) {
+            size_t first = get32(delta + i), n = get32(delta + i + 4);
+            i += 8;
+            if (first >= count || n == 0 || n > count - first) return -1;
+            size_t start = first * block_size;
+            size_t end = (first + n) * block_size < basis_size ? (first + n) * block_size : basis_size;
+            if (end - start > size - written) return -1;
+            memcpy(out + written, basis + start, end - start);
+            written += end - start;
+        } else if (op == 'L' && len - i >= 4) {
+            size_t n = get32(delta + i);
+            i += 4;
+            if (n > len - i || n > size - written) return -1;
+            memcpy(out + written, delta + i, n);
+            written += n;
+            i += n;
+        } else {
+            return -1;
+        }
+    }
+    return written == size ? 0 : -1;
+}
@@ -0,0 +1,46 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// rsync-style deltas for re-sending a file the recipient already has a
+// version of. The recipient cuts its copy (the basis) into blocks and
+// sends a signature: a rolling weak sum and a strong hash per block. The
+// sender rolls the weak sum over its file one byte at a time, and where
+// both sums match a block it sends a copy instruction in place of the
+// bytes. Everything else goes as literals.
+//
+// Signature: block size and basis size, then per block the weak sum and
+// the strong hash; all big-endian. Delta: a series of
+//   'C' <first block> <block count>    copy blocks of the basis
+//   'L' <length> <bytes>               literal bytes
+// with u32 operands, never longer than DELTA_MAX_WIRE of the file.
+//
+// The weak sum is rsync's: s1 = sum of the bytes, s2 = sum of the running
+// s1, 16 bits each. On x86 whole blocks are summed 16 (SSE2) or 32 (AVX2)
+// bytes per step at the level textscan picked; this is most of the work
+// for a file that barely changed, since every match restarts the sum.
+
+#define DELTA_SIGNATURE_HEADER 8
+#define DELTA_SIGNATURE_ENTRY 12    // u32 weak sum, u64 strong hash
+#define DELTA_MAX_BLOCK (16 * 1024)
+
+// Block size for a basis of this size: about its square root, as rsync
+// does, between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK
+size_t delta_block_size(size_t basis_size);
+// Weak sum of one block
+uint32_t delta_weak_sum(const unsigned char *data, size_t len);
+// The signature of basis[0..size), malloc'd. NULL if out of memory.
+unsigned char *delta_signature(const unsigned char *basis, size_t size, size_t *len);
+// The delta turning the signed basis into data[0..size), malloc'd. An
+// empty signature (len 0) means there is no basis: one literal. NULL if
+// the signature is malformed or out of memory.
+unsigned char *delta_encode(const unsigned char *signature, size_t signature_len,
+                            const unsigned char *data, size_t size, size_t *len);
+// Rebuild the file into out[0..size) from the basis and a delta. Returns
+// 0 once exactly size bytes were written, -1 for a delta that does not fit.
+int delta_apply(const unsigned char *basis, size_t basis_size, size_t block_size,
+                const unsigned char *delta, size_t len, unsigned char *out, size_t size);
+
+#endif // DELTA_H
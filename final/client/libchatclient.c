@@ -0,0 +1,1351 @@
+#include "libchatclient.h"
+#include "../shared/compress.h"
+#include "delta.h"
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+#define LOGIN_GREETING_LEN 14       // "SUCCESS_LOGIN" and its NUL
+#define DOWNLOAD_RECV_CHUNK (1024 * 1024)   // most one recv() puts into a download's mapping
+
+// One data connection of a transfer, carrying the file's bytes from
+// offset up to end. Uploads pread() their range, downloads recv() it
+// straight into the file's mapping.
+typedef struct {
+    int socket;                     // non-blocking, -1 when closed
+    int connected;                  // connect() has finished
+    int running;                    // the handshake is through
+    size_t greeting;                // bytes of the server's greeting read so far
+    char answer[16];                // reply to /data, read up to its newline
+    size_t answer_len;
+    size_t offset, end;
+    char *chunk;                    // upload: TRANSFER_CHUNK_SIZE bytes
+    size_t chunk_len, chunk_off;    // read from the file, not yet sent
+} data_stream_t;
+
+// One upload or download. The server's notices about it arrive on the chat
+// socket; its bytes move over data connections of its own, driven from
+// the event loop without blocking, so chat never waits for a file.
+// Whichever of the two finishes last reports the result and frees the slot.
+typedef struct {
+    int used;
+    chat_transfer_t info;
+    int verdict;                    // server's word: 0 none yet, 1 success, -1 failed
+    int ok;                         // every byte moved
+    int file_fd;
+    char *map;                      // download: the whole file, mapped shared
+    char temp_path[256];            // download: where it is written until complete
+    char token[32];
+    data_stream_t streams[MAX_TRANSFER_STREAMS];
+    int streams_running;
+    int streams_done;
+    int checked;                    // a download has a checksum to verify
+    uint32_t checksum;
+    // Delta mode: stream 0 carries one frame each way, length first. The
+    // recipient sends its signature and reads the delta, the sender the
+    // other way round.
+    unsigned char *out_frame;
+    size_t out_len, out_off;
+    unsigned char in_head[4];
+    size_t in_head_len;
+    unsigned char *in_frame;
+    size_t in_len, in_got;
+    int delta_done;
+    unsigned char *basis;           // download: our copy the signature is of
+    size_t basis_size, basis_block;
+    int reported;                   // progress quarters already reported
+    char error[320];                // local cause of a failure
+    struct timespec started;
+} transfer_slot_t;
+
+struct chat_client {
+    int socket;
+    char host[64];                  // data connections go to the same server
+    int port;
+    chat_event_cb callback;
+    void *user;
+    char username[MAX_USERNAME_LENGTH];
+    int leaving;                    // /exit sent, reading what the server still has
+    int closed;
+    transfer_slot_t transfers[CHAT_MAX_TRANSFERS];
+    struct {
+        transfer_slot_t *transfer;
+        data_stream_t *stream;
+    } polled[CHAT_POLLFDS_MAX - 1];     // data connections in the last chat_pollfds
+    int polled_count;
+    uint32_t next_transfer_id;
+    int upload_streams;             // chat_set_upload_streams
+    int delta;                      // chat_set_delta
+    // Coalescing (chat_set_coalescing): lines wait in outbox until the
+    // window runs out, the threshold fills, or chat_flush, then go in one writev
+    int coalesce_us;
+    size_t coalesce_bytes;
+    char *outbox;
+    size_t frame_end[CHAT_COALESCE_FRAMES];     // where each waiting line ends in outbox
+    int frame_count;
+    struct timespec first_queued;
+    // Reconnecting (chat_set_reconnect): the socket is -1 between attempts
+    int reconnect;
+    char session[SESSION_TOKEN_HEX + 1];        // the server's token, "" until it sends one
+    int reconnecting;
+    int reconnect_attempts;
+    struct timespec dropped_at;
+    struct timespec next_attempt;
+    char options[2][32];            // last /compress and /presence, set again after a fresh login
+    char ping_tail[4];              // start of a PING line the last read stopped inside
+    int ping_tail_len;
+};
+
+static void emit(chat_client_t *client, chat_event_type_t type, const char *text,
+                 const chat_transfer_t *transfer, int value) {
+    chat_event_t event = { .type = type, .text = text, .transfer = transfer, .value = value };
+    if (client->callback) client->callback(client, &event, client->user);
+}
+
+static void close_connection(chat_client_t *client, const char *reason) {
+    if (client->closed) return;
+    client->closed = 1;
+    emit(client, CHAT_EVENT_CLOSED, reason, NULL, 0);
+}
+
+const char *chat_strerror(int error) {
+    switch (error) {
+        case CHAT_OK: return "ok";
+        case CHAT_ERR_ADDRESS: return "invalid server address";
+        case CHAT_ERR_CONNECT: return "connection to server failed";
+        case CHAT_ERR_FULL: return "server is full";
+        case CHAT_ERR_PROTOCOL: return "unexpected server response";
+        case CHAT_ERR_TAKEN: return "username already taken";
+        case CHAT_ERR_TIMEOUT: return "server response timeout";
+        case CHAT_ERR_CLOSED: return "server disconnected";
+        case CHAT_ERR_SELF: return "cannot send a file to yourself";
+        case CHAT_ERR_OPEN: return "cannot open file";
+        case CHAT_ERR_BUSY: return "too many transfers in progress";
+        case CHAT_ERR_SEND: return "failed to send to server";
+        case CHAT_ERR_NOMEM: return "out of memory";
+    }
+    return "unknown error";
+}
+
+// Connect and read the server's greeting, waiting up to timeout_ms for
+// each (-1 forever). Returns the socket, blocking like every chat socket,
+// or -1 with the reason in *status.
+static int open_connection(const char *host, int port, int timeout_ms, int *status) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, host, &address.sin_addr) <= 0) {
+        *status = CHAT_ERR_ADDRESS;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        *status = CHAT_ERR_CONNECT;
+        return -1;
+    }
+    *status = CHAT_OK;
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 &&
+        (errno != EINPROGRESS || poll(&pfd, 1, timeout_ms) <= 0 ||
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)) {
+        *status = CHAT_ERR_CONNECT;
+    } else {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        // Check for server full message
+        char buffer[BUFFER_SIZE];
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, timeout_ms);
+        int bytes_received = ready > 0 ? read(fd, buffer, BUFFER_SIZE - 1) : -1;
+        if (ready == 0) {
+            *status = CHAT_ERR_TIMEOUT;
+        } else if (bytes_received <= 0) {
+            *status = CHAT_ERR_CLOSED;
+        } else {
+            buffer[bytes_received] = '\0';
+            if (strstr(buffer, "Server full")) *status = CHAT_ERR_FULL;
+            else if (!strstr(buffer, "SUCCESS_LOGIN")) *status = CHAT_ERR_PROTOCOL;
+        }
+    }
+    if (*status != CHAT_OK) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+chat_client_t *chat_connect(const char *host, int port, chat_event_cb callback, void *user, int *error) {
+    int status;
+    int fd = open_connection(host, port, -1, &status);
+    if (fd < 0) {
+        if (error) *error = status;
+        return NULL;
+    }
+    chat_client_t *client = calloc(1, sizeof(chat_client_t));
+    if (!client) {
+        close(fd);
+        if (error) *error = CHAT_ERR_NOMEM;
+        return NULL;
+    }
+    client->socket = fd;
+
+    snprintf(client->host, sizeof(client->host), "%s", host);
+    client->port = port;
+    client->callback = callback;
+    client->user = user;
+    client->next_transfer_id = 1;
+    client->upload_streams = 1;
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        client->transfers[i].file_fd = -1;
+    }
+    if (error) *error = CHAT_OK;
+    return client;
+}
+
+int chat_login(chat_client_t *client, const char *username, int timeout_ms) {
+    char command_buffer[BUFFER_SIZE];
+    snprintf(command_buffer, BUFFER_SIZE, "/username %s\n", username);
+    if (send(client->socket, command_buffer, strlen(command_buffer), MSG_NOSIGNAL) < 0) {
+        return CHAT_ERR_SEND;
+    }
+
+    struct pollfd pfd = { .fd = client->socket, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) return CHAT_ERR_CLOSED;
+    if (ready == 0) return CHAT_ERR_TIMEOUT;
+
+    char response_buffer[BUFFER_SIZE];
+    int bytes_received = recv(client->socket, response_buffer, BUFFER_SIZE - 1, 0);
+    if (bytes_received <= 0) return CHAT_ERR_CLOSED;
+    response_buffer[bytes_received] = '\0';
+
+    if (strncmp(response_buffer, "ALREADY_TAKEN", 13) == 0) {
+        return CHAT_ERR_TAKEN;
+    }
+    if (strncmp(response_buffer, "SET_USERNAME", 12) != 0) {
+        emit(client, CHAT_EVENT_MESSAGE, response_buffer, NULL, 0);
+        return CHAT_ERR_PROTOCOL;
+    }
+    if (client->username != username) {
+        snprintf(client->username, sizeof(client->username), "%s", username);
+    }
+    // Offline mailbox delivery may arrive in the same read
+    if (response_buffer[12] != '\0') {
+        emit(client, CHAT_EVENT_MESSAGE, response_buffer + 12, NULL, 0);
+    }
+    // The token comes back through the event loop
+    if (client->reconnect) chat_send(client, "/session");
+    return CHAT_OK;
+}
+
+const char *chat_username(const chat_client_t *client) {
+    return client->username;
+}
+
+// Microseconds from a to b
+static long elapsed_us(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+void chat_set_coalescing(chat_client_t *client, int window_us, size_t max_bytes) {
+    chat_flush(client);
+    if (max_bytes < BUFFER_SIZE) max_bytes = BUFFER_SIZE;
+    if (max_bytes > CHAT_COALESCE_MAX) max_bytes = CHAT_COALESCE_MAX;
+    client->coalesce_us = window_us > 0 ? window_us : 0;
+    client->coalesce_bytes = max_bytes;
+    if (client->coalesce_us && !client->outbox) {
+        // A line is at most BUFFER_SIZE, so one always fits after a flush
+        client->outbox = malloc(CHAT_COALESCE_MAX);
+        if (!client->outbox) client->coalesce_us = 0;
+    }
+}
+
+int chat_flush(chat_client_t *client) {
+    if (client->frame_count == 0) return CHAT_OK;
+    struct iovec iov[CHAT_COALESCE_FRAMES];
+    size_t start = 0;
+    for (int i = 0; i < client->frame_count; i++) {
+        iov[i].iov_base = client->outbox + start;
+        iov[i].iov_len = client->frame_end[i] - start;
+        start = client->frame_end[i];
+    }
+    int count = client->frame_count;
+    client->frame_count = 0;
+
+    // The socket blocks, so a short write only happens on a signal
+    struct iovec *next = iov;
+    while (count > 0) {
+        ssize_t sent = writev(client->socket, next, count);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return CHAT_ERR_SEND;
+        }
+        while (count > 0 && (size_t)sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return CHAT_OK;
+}
+
+int chat_timeout(const chat_client_t *client) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (client->reconnecting) {
+        long wait = -elapsed_us(&client->next_attempt, &now);
+        return wait > 0 ? (int)((wait + 999) / 1000) : 0;
+    }
+    if (client->frame_count == 0) return -1;
+    long left = client->coalesce_us - elapsed_us(&client->first_queued, &now);
+    return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+// Send the waiting lines if their window has run out
+static int flush_if_due(chat_client_t *client) {
+    if (client->frame_count == 0 || chat_timeout(client) > 0) return CHAT_OK;
+    return chat_flush(client);
+}
+
+int chat_send(chat_client_t *client, const char *line) {
+    char buffer[BUFFER_SIZE + 1];
+    size_t len = strlen(line);
+    if (client->closed || client->leaving || client->reconnecting) return CHAT_ERR_CLOSED;
+    if (len > BUFFER_SIZE - 1) len = BUFFER_SIZE - 1;
+    // Options the server only keeps with a session, for a fresh login
+    int option = strncmp(line, "/compress o", 11) == 0 ? 0 : strncmp(line, "/presence ", 10) == 0 ? 1 : -1;
+    if (option >= 0) snprintf(client->options[option], sizeof(client->options[option]), "%.*s", (int)strcspn(line, "\n"), line);
+    memcpy(buffer, line, len);
+    if (len == 0 || buffer[len - 1] != '\n') buffer[len++] = '\n';
+    if (!client->coalesce_us) {
+        if (send(client->socket, buffer, len, MSG_NOSIGNAL) < 0) return CHAT_ERR_SEND;
+        return CHAT_OK;
+    }
+
+    size_t queued = client->frame_count ? client->frame_end[client->frame_count - 1] : 0;
+    if (queued + len > client->coalesce_bytes || client->frame_count == CHAT_COALESCE_FRAMES) {
+        if (chat_flush(client) != CHAT_OK) return CHAT_ERR_SEND;
+        queued = 0;
+    }
+    if (client->frame_count == 0) clock_gettime(CLOCK_MONOTONIC, &client->first_queued);
+    memcpy(client->outbox + queued, buffer, len);
+    client->frame_end[client->frame_count++] = queued + len;
+    if (queued + len >= client->coalesce_bytes) return chat_flush(client);
+    return flush_if_due(client);
+}
+
+void chat_leave(chat_client_t *client) {
+    if (client->leaving || client->closed) return;
+    if (client->reconnecting) {
+        client->reconnecting = 0;
+        client->leaving = 1;
+        close_connection(client, NULL);
+        return;
+    }
+    chat_flush(client);
+    send(client->socket, "/exit\n", 6, MSG_NOSIGNAL);
+    shutdown(client->socket, SHUT_WR);
+    client->leaving = 1;
+}
+
+int chat_leaving(const chat_client_t *client) {
+    return client->leaving;
+}
+
+// Replace compressed frames in wire[0..len) with their text, reading the
+// rest of a frame from the socket if it was split. Returns the text length
+// in out, or -1 on a broken frame or connection.
+static int inflate_response(int socket_fd, char *wire, int len, size_t wire_size, char *out, size_t out_size) {
+    size_t pos = 0, out_len = 0;
+
+    while (pos < (size_t)len) {
+        char *frame = memchr(wire + pos, LZ_FRAME_MAGIC0, len - pos);
+        size_t text_len = frame ? (size_t)(frame - (wire + pos)) : len - pos;
+        if (out_len + text_len >= out_size) return -1;
+        memcpy(out + out_len, wire + pos, text_len);
+        out_len += text_len;
+        pos += text_len;
+        if (!frame) break;
+
+        uint32_t raw_len, comp_len;
+        int header;
+        while ((header = lz_frame_header(wire + pos, len - pos, &raw_len, &comp_len)) == 0 ||
+               (header == 1 && len - pos < LZ_FRAME_HEADER + comp_len)) {
+            // Read only the missing part so the next message stays in the socket
+            size_t want = (header == 1 ? LZ_FRAME_HEADER + comp_len : LZ_FRAME_HEADER) - (len - pos);
+            if (want > wire_size - len) return -1;
+            int more = read(socket_fd, wire + len, want);
+            if (more <= 0) return -1;
+            len += more;
+        }
+        if (header < 0) return -1;
+        size_t n = lz_decompress(wire + pos + LZ_FRAME_HEADER, comp_len, out + out_len, out_size - out_len - 1);
+        if (n != raw_len) return -1;
+        out_len += n;
+        pos += LZ_FRAME_HEADER + comp_len;
+    }
+    out[out_len] = '\0';
+    return (int)out_len;
+}
+
+// The server's idle timer sends "PING\n" to a quiet connection. Answer each
+// line that is exactly PING and cut it out of buf; chat text that only
+// contains PING stays. A last, unfinished line that could still become PING
+// waits in ping_tail for the next read. Returns the remaining length.
+static int answer_pings(chat_client_t *client, char *buf, int len) {
+    int out = 0;
+    int pos = 0;
+    while (pos < len) {
+        char *nl = memchr(buf + pos, '\n', len - pos);
+        int line_len = nl ? (int)(nl - (buf + pos)) + 1 : len - pos;
+        if (nl && line_len == 5 && memcmp(buf + pos, "PING", 4) == 0) {
+            send(client->socket, "PONG\n", 5, MSG_NOSIGNAL);
+        } else if (!nl && line_len <= 4 && memcmp(buf + pos, "PING", line_len) == 0) {
+            memcpy(client->ping_tail, buf + pos, line_len);
+            client->ping_tail_len = line_len;
+        } else {
+            memmove(buf + out, buf + pos, line_len);
+            out += line_len;
+        }
+        pos += line_len;
+    }
+    return out;
+}
+
+// Transfer notices and the session token can share a read with chat text
+// and with each other; they always start a line, so the buffer is cut
+// before each one
+static const char *notice_codes[] = {
+    "READY_FOR_FILE", "INCOMING_FILE", "FILE_QUEUED", "FILE_QUEUE_FULL", "FILE_QUEUE_EXPIRED",
+    "FILE_TRANSFER_SUCCESS", "FILE_TRANSFER_FAILED", "FILE_SIZE_EXCEEDS_LIMIT",
+    "RECIPIENT_NOT_FOUND", "RECIPIENT_OFFLINE", "INVALID_FILE_TYPE", "SESSION",
+};
+
+static int is_transfer_notice(const char *line) {
+    for (size_t i = 0; i < sizeof(notice_codes) / sizeof(notice_codes[0]); i++) {
+        if (strncmp(line, notice_codes[i], strlen(notice_codes[i])) == 0) return 1;
+    }
+    return 0;
+}
+
+// The server's replies carry no newline, so a notice sent right after one
+// can arrive glued to its end ("[SERVER] Joined room 'r1'READY_FOR_FILE ...").
+// Only the first line is searched, and never one relaying what a user wrote.
+static char *glued_notice(char *message) {
+    if (strncmp(message, "[BROADCAST]", 11) == 0 || strncmp(message, "[WHISPER", 8) == 0) return NULL;
+    char *line_end = strchr(message, '\n');
+    char *first = NULL;
+    for (size_t i = 0; i < sizeof(notice_codes) / sizeof(notice_codes[0]); i++) {
+        size_t len = strlen(notice_codes[i]);
+        for (char *p = strstr(message + 1, notice_codes[i]); p && (!line_end || p < line_end);
+             p = strstr(p + 1, notice_codes[i])) {
+            if ((p[len] == ' ' || p[len] == '\n' || p[len] == '\0') && (!first || p < first)) {
+                first = p;
+                break;
+            }
+        }
+    }
+    return first;
+}
+
+static transfer_slot_t *find_transfer(chat_client_t *client, int upload, uint32_t id, const char *peer) {
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        transfer_slot_t *t = &client->transfers[i];
+        if (t->used && t->info.upload == upload && t->info.id == id &&
+            (!peer || strcmp(t->info.peer, peer) == 0)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static transfer_slot_t *new_transfer(chat_client_t *client) {
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        transfer_slot_t *t = &client->transfers[i];
+        if (!t->used) {
+            memset(t, 0, sizeof(transfer_slot_t));
+            t->used = 1;
+            t->file_fd = -1;
+            for (int j = 0; j < MAX_TRANSFER_STREAMS; j++) t->streams[j].socket = -1;
+            clock_gettime(CLOCK_MONOTONIC, &t->started);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+int chat_transfers_in_flight(const chat_client_t *client) {
+    int count = 0;
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) count += client->transfers[i].used;
+    return count;
+}
+
+int chat_transfers(const chat_client_t *client, chat_transfer_t *out, int max) {
+    int count = 0;
+    for (int i = 0; i < CHAT_MAX_TRANSFERS && count < max; i++) {
+        if (client->transfers[i].used) out[count++] = client->transfers[i].info;
+    }
+    return count;
+}
+
+// Report and free a transfer once its bytes and the server are both done
+static void settle_transfer(chat_client_t *client, transfer_slot_t *t) {
+    if (t->info.state != CHAT_TRANSFER_FINISHED || t->verdict == 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->info.seconds = (now.tv_sec - t->started.tv_sec) + (now.tv_nsec - t->started.tv_nsec) / 1e9;
+    t->used = 0;
+    if (t->verdict > 0 && t->ok) {
+        emit(client, CHAT_EVENT_TRANSFER_DONE, NULL, &t->info, 0);
+    } else {
+        emit(client, CHAT_EVENT_TRANSFER_FAILED, t->error[0] ? t->error : NULL, &t->info, 0);
+    }
+}
+
+static void close_stream(data_stream_t *stream) {
+    if (stream->socket >= 0) close(stream->socket);
+    free(stream->chunk);
+    stream->socket = -1;
+    stream->chunk = NULL;
+}
+
+static void release_delta(transfer_slot_t *t) {
+    free(t->out_frame);
+    free(t->in_frame);
+    free(t->basis);
+    t->out_frame = t->in_frame = t->basis = NULL;
+}
+
+// The bytes are done with, one way or the other: let go of the data
+// connections and the file, then settle if the server has spoken
+static void finish_transfer(chat_client_t *client, transfer_slot_t *t, int ok) {
+    for (int i = 0; i < MAX_TRANSFER_STREAMS; i++) close_stream(&t->streams[i]);
+    release_delta(t);
+    if (t->map) munmap(t->map, t->info.size);
+    if (t->file_fd >= 0) close(t->file_fd);
+    // A download that did not make it leaves nothing behind
+    if (t->temp_path[0]) unlink(t->temp_path);
+    t->map = NULL;
+    t->temp_path[0] = '\0';
+    t->file_fd = -1;
+    t->ok = ok;
+    t->info.state = CHAT_TRANSFER_FINISHED;
+    settle_transfer(client, t);
+}
+
+static void fail_transfer(chat_client_t *client, transfer_slot_t *t, const char *cause) {
+    if (!t->error[0]) snprintf(t->error, sizeof(t->error), "%s", cause);
+    finish_transfer(client, t, 0);
+}
+
+// FNV-1a, as the server's WAL uses for its records
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// FNV-1a over the first size bytes of the file. Returns 0 if the file
+// cannot be read that far.
+static int file_checksum(int fd, size_t size, uint32_t *sum) {
+    char *buffer = malloc(TRANSFER_CHUNK_SIZE);
+    if (!buffer) return 0;
+    uint32_t h = 2166136261u;
+    size_t done = 0;
+    while (done < size) {
+        size_t want = size - done < TRANSFER_CHUNK_SIZE ? size - done : TRANSFER_CHUNK_SIZE;
+        ssize_t n = pread(fd, buffer, want, done);
+        if (n <= 0) break;
+        h = fnv1a(h, buffer, n);
+        done += n;
+    }
+    free(buffer);
+    *sum = h;
+    return done == size;
+}
+
+// A download goes to a hidden temporary file next to its destination,
+// allocated to full size up front and mapped, so each stream recv()s into
+// its range of the mapping with no copy through a buffer
+static int open_download(transfer_slot_t *t) {
+    snprintf(t->temp_path, sizeof(t->temp_path), ".%.200s.partXXXXXX", t->info.path);
+    t->file_fd = mkstemp(t->temp_path);
+    if (t->file_fd < 0) {
+        t->temp_path[0] = '\0';
+        return 0;
+    }
+    fchmod(t->file_fd, 0644);
+    if (t->info.size == 0) return 1;
+    // Not every filesystem can allocate; a sparse file still maps
+    if (posix_fallocate(t->file_fd, 0, t->info.size) != 0 && ftruncate(t->file_fd, t->info.size) < 0) {
+        return 0;
+    }
+    t->map = mmap(NULL, t->info.size, PROT_READ | PROT_WRITE, MAP_SHARED, t->file_fd, 0);
+    if (t->map == MAP_FAILED) {
+        t->map = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Every range of a download is in: check it against the sender's sum,
+// write it out, and give it its name. link() claims the name only if it
+// is free, so a file that appeared meanwhile is never overwritten;
+// the first clash is reported to the server as before. Returns 0 on failure.
+static int complete_download(chat_client_t *client, transfer_slot_t *t) {
+    if (t->checked && fnv1a(2166136261u, t->map, t->info.size) != t->checksum) {
+        snprintf(t->error, sizeof(t->error), "checksum mismatch");
+        return 0;
+    }
+    if (t->map && msync(t->map, t->info.size, MS_SYNC) < 0) {
+        snprintf(t->error, sizeof(t->error), "cannot write '%s' - %s", t->temp_path, strerror(errno));
+        return 0;
+    }
+    if (ftruncate(t->file_fd, t->info.size) < 0) {
+        snprintf(t->error, sizeof(t->error), "cannot write '%s' - %s", t->temp_path, strerror(errno));
+        return 0;
+    }
+
+    char base[128], name[256];
+    snprintf(base, sizeof(base), "%.127s", t->info.path);
+    snprintf(name, sizeof(name), "%s", base);
+    for (int attempt = 0; link(t->temp_path, name) < 0; attempt++) {
+        if (errno != EEXIST) {
+            snprintf(t->error, sizeof(t->error), "cannot create '%s' - %s", name, strerror(errno));
+            return 0;
+        }
+        if (attempt == 0) {
+            char conflict[BUFFER_SIZE];
+            int len = snprintf(conflict, sizeof(conflict), "FILE_EXISTS %s\n", base);
+            send(client->socket, conflict, len, MSG_NOSIGNAL);
+            snprintf(name, sizeof(name), "%s_%s", t->info.peer, base);
+        } else {
+            snprintf(name, sizeof(name), "%s_%d_%s", t->info.peer, attempt, base);
+        }
+    }
+    snprintf(t->info.path, sizeof(t->info.path), "%s", name);
+    return 1;       // finish_transfer unlinks the temporary name
+}
+
+// The first size bytes of a file, malloc'd. Read rather than mapped, so a
+// file cut short meanwhile fails the transfer instead of the process.
+static unsigned char *read_whole(int fd, size_t size) {
+    unsigned char *data = malloc(size ? size : 1);
+    size_t done = 0;
+    while (data && done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
+
+// Queue one frame to send: its length, then the bytes
+static int queue_frame(transfer_slot_t *t, const unsigned char *data, size_t len) {
+    t->out_frame = malloc(len + 4);
+    if (!t->out_frame) return 0;
+    t->out_frame[0] = len >> 24;
+    t->out_frame[1] = len >> 16;
+    t->out_frame[2] = len >> 8;
+    t->out_frame[3] = len;
+    if (len) memcpy(t->out_frame + 4, data, len);
+    t->out_len = len + 4;
+    t->out_off = 0;
+    return 1;
+}
+
+// A delta download signs the copy already here under the file's name,
+// the FILE_EXISTS case; with none, or one too big to be a version of
+// this file, the signature is empty and the whole file comes
+static int queue_signature(transfer_slot_t *t) {
+    struct stat st;
+    unsigned char *signature = NULL;
+    size_t len = 0;
+    int fd = open(t->info.path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= MAX_FILE_SIZE) {
+        t->basis = read_whole(fd, st.st_size);
+        if (t->basis) {
+            t->basis_size = st.st_size;
+            t->basis_block = delta_block_size(t->basis_size);
+            signature = delta_signature(t->basis, t->basis_size, &len);
+        }
+    }
+    if (fd >= 0) close(fd);
+    int ok = (!t->basis || signature) && queue_frame(t, signature, len);
+    free(signature);
+    return ok;
+}
+
+// The recipient's signature is in: work out the delta and queue it
+static int queue_delta(transfer_slot_t *t) {
+    unsigned char *data = read_whole(t->file_fd, t->info.size);
+    if (!data) {
+        snprintf(t->error, sizeof(t->error), "cannot read '%s'", t->info.path);
+        return 0;
+    }
+    size_t len;
+    unsigned char *delta = delta_encode(t->in_frame, t->in_len, data, t->info.size, &len);
+    free(data);
+    if (!delta) {
+        snprintf(t->error, sizeof(t->error), "unusable signature from %s", t->info.peer);
+        return 0;
+    }
+    int ok = queue_frame(t, delta, len);
+    free(delta);
+    return ok;
+}
+
+// Open the file and start a non-blocking connect for each data
+// connection; handle_data_socket carries on from there
+static void start_data_connection(chat_client_t *client, transfer_slot_t *t) {
+    t->info.state = CHAT_TRANSFER_CONNECTING;
+    if (t->info.upload) {
+        t->file_fd = open(t->info.path, O_RDONLY);
+    } else if (!open_download(t) && t->file_fd >= 0) {
+        close(t->file_fd);
+        t->file_fd = -1;
+    }
+    if (t->file_fd < 0) {
+        snprintf(t->error, sizeof(t->error), "cannot open '%s' - %s",
+                 t->info.upload ? t->info.path : t->temp_path, strerror(errno));
+        finish_transfer(client, t, 0);
+        return;
+    }
+
+    if (t->info.delta && !t->info.upload && !queue_signature(t)) {
+        fail_transfer(client, t, "cannot sign our copy for a delta");
+        return;
+    }
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+    if (inet_pton(AF_INET, client->host, &address.sin_addr) <= 0) {
+        fail_transfer(client, t, "data connection to the server failed");
+        return;
+    }
+    for (int i = 0; i < t->info.streams; i++) {
+        data_stream_t *stream = &t->streams[i];
+        stream->offset = TRANSFER_RANGE_START(t->info.size, t->info.streams, i);
+        stream->end = TRANSFER_RANGE_START(t->info.size, t->info.streams, i + 1);
+        stream->chunk = t->info.upload && !t->info.delta ? malloc(TRANSFER_CHUNK_SIZE) : NULL;
+        stream->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if ((t->info.upload && !t->info.delta && !stream->chunk) || stream->socket < 0 ||
+            (connect(stream->socket, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)) {
+            fail_transfer(client, t, "data connection to the server failed");
+            return;
+        }
+    }
+}
+
+// What poll() should wait for on one of a transfer's data connections
+static short data_socket_events(const transfer_slot_t *t, const data_stream_t *stream) {
+    if (!stream->running) {
+        // Writable once connected, then the greeting and the answer come in
+        return stream->connected ? POLLIN : POLLOUT;
+    }
+    if (t->info.delta) return t->out_off < t->out_len ? POLLOUT : POLLIN;
+    return t->info.upload ? POLLOUT : POLLIN;
+}
+
+// The handshake on a new data connection: "SUCCESS_LOGIN" and its NUL from
+// the server, "/data <token> <stream>" from us, then "DATA_OK\n" back.
+// Returns 0 on failure, and marks the stream running once it is through;
+// the transfer is RUNNING when all of its streams are.
+static int data_handshake(chat_client_t *client, transfer_slot_t *t, data_stream_t *stream, short revents) {
+    if (!stream->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(stream->socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) return 0;
+        stream->connected = 1;
+        return 1;
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) return 1;
+
+    char greeting[LOGIN_GREETING_LEN];
+    if (stream->greeting < sizeof(greeting)) {
+        ssize_t n = recv(stream->socket, greeting, sizeof(greeting) - stream->greeting, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return 0;
+        if (n < 0) return 1;
+        stream->greeting += n;
+        if (stream->greeting < sizeof(greeting)) return 1;
+        char command[64];
+        int len = snprintf(command, sizeof(command), "/data %s %d\n", t->token, (int)(stream - t->streams));
+        return send(stream->socket, command, len, MSG_NOSIGNAL) == len;
+    }
+
+    // Byte by byte so no file data is read along with the answer
+    char c;
+    ssize_t n;
+    while ((n = recv(stream->socket, &c, 1, 0)) == 1 && c != '\n') {
+        if (stream->answer_len == sizeof(stream->answer) - 1) return 0;
+        stream->answer[stream->answer_len++] = c;
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return 0;
+    if (n < 0) return 1;
+    stream->answer[stream->answer_len] = '\0';
+    if (strcmp(stream->answer, "DATA_OK") != 0) return 0;
+    stream->running = 1;
+    if (++t->streams_running == t->info.streams) {
+        t->info.state = CHAT_TRANSFER_RUNNING;
+        if (t->info.upload) emit(client, CHAT_EVENT_TRANSFER_STARTED, NULL, &t->info, 0);
+    }
+    return 1;
+}
+
+// Report each quarter of the way once
+static void report_progress(chat_client_t *client, transfer_slot_t *t) {
+    int quarter = t->info.size ? (int)(t->info.done * 4 / t->info.size) : 4;
+    if (quarter <= t->reported || quarter >= 4) return;
+    t->reported = quarter;
+    emit(client, CHAT_EVENT_TRANSFER_PROGRESS, NULL, &t->info, quarter * 25);
+}
+
+// Delta mode: send our frame while it lasts, then read the other side's.
+// The sender is done once its delta is out, the recipient once the delta
+// is in and applied to the mapping. Returns 0 on failure.
+static int move_delta_bytes(chat_client_t *client, transfer_slot_t *t, data_stream_t *stream) {
+    if (t->out_off < t->out_len) {
+        ssize_t sent = send(stream->socket, t->out_frame + t->out_off, t->out_len - t->out_off, MSG_NOSIGNAL);
+        if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        t->out_off += sent;
+        if (t->info.upload) {
+            t->info.done = t->info.size * t->out_off / t->out_len;
+            t->delta_done = t->out_off == t->out_len;
+            report_progress(client, t);
+        }
+        return 1;
+    }
+
+    ssize_t n;
+    if (t->in_head_len < sizeof(t->in_head)) {
+        n = recv(stream->socket, t->in_head + t->in_head_len, sizeof(t->in_head) - t->in_head_len, 0);
+        if (n == 0) return 0;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        t->in_head_len += n;
+        if (t->in_head_len < sizeof(t->in_head)) return 1;
+        t->in_len = (size_t)t->in_head[0] << 24 | (size_t)t->in_head[1] << 16 |
+                    (size_t)t->in_head[2] << 8 | t->in_head[3];
+        if (t->in_len > (t->info.upload ? DELTA_MAX_SIGNATURE : DELTA_MAX_WIRE(t->info.size))) return 0;
+        t->in_frame = malloc(t->in_len ? t->in_len : 1);
+        if (!t->in_frame) return 0;
+    }
+    if (t->in_got < t->in_len) {
+        n = recv(stream->socket, t->in_frame + t->in_got, t->in_len - t->in_got, 0);
+        if (n == 0) return 0;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        t->in_got += n;
+        if (t->in_got < t->in_len) return 1;
+    }
+
+    if (t->info.upload) {
+        if (!queue_delta(t)) return 0;
+        t->info.wire = t->out_len + 4 + t->in_len;
+        return 1;
+    }
+    if (delta_apply(t->basis, t->basis_size, t->basis_block, t->in_frame, t->in_len,
+                    (unsigned char *)t->map, t->info.size) != 0) {
+        snprintf(t->error, sizeof(t->error), "delta from %s does not fit our copy", t->info.peer);
+        return 0;
+    }
+    t->info.done = t->info.size;
+    t->info.wire = t->out_len + 4 + t->in_len;
+    t->delta_done = 1;
+    return 1;
+}
+
+// Move as many bytes of the stream's range as its data connection takes
+// or gives right now. Returns 0 on failure.
+static int move_transfer_bytes(chat_client_t *client, transfer_slot_t *t, data_stream_t *stream) {
+    if (t->info.delta) return move_delta_bytes(client, t, stream);
+    size_t left = stream->end - stream->offset;
+    if (t->info.upload) {
+        size_t want = left < TRANSFER_CHUNK_SIZE ? left : TRANSFER_CHUNK_SIZE;
+        if (stream->chunk_off == stream->chunk_len) {
+            ssize_t n = pread(t->file_fd, stream->chunk, want, stream->offset);
+            if (n <= 0) return 0;
+            stream->chunk_len = n;
+            stream->chunk_off = 0;
+        }
+        ssize_t sent = send(stream->socket, stream->chunk + stream->chunk_off,
+                            stream->chunk_len - stream->chunk_off, MSG_NOSIGNAL);
+        if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        stream->chunk_off += sent;
+        stream->offset += sent;
+        t->info.done += sent;
+    } else {
+        size_t want = left < DOWNLOAD_RECV_CHUNK ? left : DOWNLOAD_RECV_CHUNK;
+        ssize_t n = recv(stream->socket, t->map + stream->offset, want, 0);
+        if (n == 0) return 0;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        stream->offset += n;
+        t->info.done += n;
+    }
+    report_progress(client, t);
+    return 1;
+}
+
+// poll() saw activity on one of a transfer's data connections
+static void handle_data_socket(chat_client_t *client, transfer_slot_t *t, data_stream_t *stream, short revents) {
+    if (!stream->running) {
+        if (!data_handshake(client, t, stream, revents)) {
+            fail_transfer(client, t, "data connection to the server failed");
+            return;
+        }
+        if (!stream->running || t->info.delta || stream->offset < stream->end) return;
+    } else if (!move_transfer_bytes(client, t, stream)) {
+        fail_transfer(client, t, "data connection to the server was lost");
+        return;
+    }
+    if (t->info.delta ? !t->delta_done : stream->offset < stream->end) return;
+
+    close_stream(stream);
+    if (++t->streams_done < t->info.streams) return;
+    finish_transfer(client, t, t->info.upload || complete_download(client, t));
+}
+
+// "INCOMING_FILE <sender> <file> <size> <id> <token> [<streams> <checksum> [1]]":
+// the file arrives over data connections of its own. Returns 0 for a
+// simulated transfer, which has no token and sends nothing.
+static int handle_incoming_file(chat_client_t *client, const char *notice) {
+    char sender_name[MAX_USERNAME_LENGTH], original_filename[128], token[32];
+    size_t file_size;
+    unsigned int id = 0, streams = 1, checksum = 0, delta = 0;
+    int fields = sscanf(notice, "INCOMING_FILE %15s %127s %zu %u %31s %u %x %u",
+                        sender_name, original_filename, &file_size, &id, token, &streams, &checksum, &delta);
+    if (fields < 5) {
+        return 0;
+    }
+    if (streams < 1 || streams > MAX_TRANSFER_STREAMS) streams = 1;
+
+    // Never write outside the working directory whatever the sender called it
+    const char *base = strrchr(original_filename, '/');
+    base = base ? base + 1 : original_filename;
+
+    transfer_slot_t *t = new_transfer(client);
+    if (!t) {
+        // Nobody connects for it, so the server's stall watch fails it
+        chat_transfer_t dropped = { .upload = 0, .id = id, .size = file_size };
+        snprintf(dropped.peer, sizeof(dropped.peer), "%s", sender_name);
+        snprintf(dropped.name, sizeof(dropped.name), "%s", original_filename);
+        emit(client, CHAT_EVENT_TRANSFER_CANCELLED, chat_strerror(CHAT_ERR_BUSY), &dropped, 0);
+        return 1;
+    }
+    t->info.upload = 0;
+    t->info.id = id;
+    t->info.size = file_size;
+    t->info.streams = streams;
+    t->checked = fields >= 7;
+    t->info.delta = fields == 8 && delta == 1;
+    t->checksum = checksum;
+    snprintf(t->info.peer, sizeof(t->info.peer), "%s", sender_name);
+    snprintf(t->info.name, sizeof(t->info.name), "%s", original_filename);
+    // The name it should get; complete_download settles the one it does get
+    snprintf(t->info.path, sizeof(t->info.path), "%s", base);
+    snprintf(t->token, sizeof(t->token), "%s", token);
+    emit(client, CHAT_EVENT_TRANSFER_INCOMING, NULL, &t->info, 0);
+    start_data_connection(client, t);
+    return 1;
+}
+
+// Notices about transfers we started with an id: "<CODE> <id> ..." for
+// uploads, "<CODE> <id> <sender>" for downloads. Returns 0 for anything
+// else, including notices from a server that does not send ids.
+static int handle_transfer_notice(chat_client_t *client, const char *notice) {
+    char code[32], sender[MAX_USERNAME_LENGTH] = {0}, token[32] = {0};
+    unsigned int id = 0;
+    int position = 0;
+    if (strncmp(notice, "INCOMING_FILE", 13) == 0) {
+        return handle_incoming_file(client, notice);
+    }
+    if (strncmp(notice, "FILE_QUEUE_EXPIRED ", 19) == 0) {
+        char recipient[MAX_USERNAME_LENGTH], name[128];
+        if (sscanf(notice, "%31s %15s %127s %u", code, recipient, name, &id) != 4) return 0;
+    } else if (sscanf(notice, "%31s %u %31s", code, &id, token) < 2 || !is_transfer_notice(notice)) {
+        return 0;
+    }
+
+    if (strcmp(code, "FILE_TRANSFER_SUCCESS") == 0 || strcmp(code, "FILE_TRANSFER_FAILED") == 0) {
+        // A download's notice names the sender after the id
+        int download = token[0] != '\0';
+        if (download) snprintf(sender, sizeof(sender), "%.*s", MAX_USERNAME_LENGTH - 1, token);
+        transfer_slot_t *t = find_transfer(client, !download, id, download ? sender : NULL);
+        if (t) {
+            t->verdict = strcmp(code, "FILE_TRANSFER_SUCCESS") == 0 ? 1 : -1;
+            if (t->verdict < 0 && t->info.state != CHAT_TRANSFER_FINISHED) finish_transfer(client, t, 0);
+            else settle_transfer(client, t);
+        }
+        return 1;
+    }
+
+    transfer_slot_t *t = find_transfer(client, 1, id, NULL);
+    if (!t) {
+        return 1;
+    }
+    if (strcmp(code, "READY_FOR_FILE") == 0 && token[0]) {
+        // The server names the number of streams it set up, 1 if it does
+        // not, then 1 if it took up the offer of a delta
+        int streams = 1, delta = 0;
+        sscanf(notice, "%*s %*u %*s %d %d", &streams, &delta);
+        t->info.streams = streams >= 1 && streams <= t->info.streams ? streams : 1;
+        t->info.delta = t->info.delta && delta == 1;
+        snprintf(t->token, sizeof(t->token), "%s", token);
+        start_data_connection(client, t);
+    } else if (strcmp(code, "FILE_QUEUED") == 0) {
+        sscanf(notice, "%*s %*u %d", &position);
+        t->info.state = CHAT_TRANSFER_QUEUED;
+        emit(client, CHAT_EVENT_TRANSFER_QUEUED, NULL, &t->info, position);
+    } else {
+        const char *reason =
+            strcmp(code, "RECIPIENT_NOT_FOUND") == 0 ? "recipient not found" :
+            strcmp(code, "RECIPIENT_OFFLINE") == 0 ? "recipient is offline" :
+            strcmp(code, "INVALID_FILE_TYPE") == 0 ? "invalid file type" :
+            strcmp(code, "FILE_SIZE_EXCEEDS_LIMIT") == 0 ? "file exceeds the server's size limit" :
+            strcmp(code, "FILE_QUEUE_FULL") == 0 ? "the server's queue is full, try again later" :
+            strcmp(code, "FILE_QUEUE_EXPIRED") == 0 ? "it waited too long in the server's queue" :
+            "unexpected reply";
+        t->used = 0;
+        emit(client, CHAT_EVENT_TRANSFER_CANCELLED, reason, &t->info, 0);
+    }
+    return 1;
+}
+
+// Sleep until the next attempt, longer after each one that failed, with
+// jitter so clients dropped together do not all dial at once
+static void schedule_reconnect(chat_client_t *client, const char *reason) {
+    int shift = client->reconnect_attempts < 8 ? client->reconnect_attempts : 8;
+    int delay = CHAT_RECONNECT_FIRST_MS << shift;
+    if (delay > CHAT_RECONNECT_MAX_MS) delay = CHAT_RECONNECT_MAX_MS;
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+    client->reconnect_attempts++;
+    clock_gettime(CLOCK_MONOTONIC, &client->next_attempt);
+    client->next_attempt.tv_sec += delay / 1000;
+    client->next_attempt.tv_nsec += (delay % 1000) * 1000000L;
+    if (client->next_attempt.tv_nsec >= 1000000000L) {
+        client->next_attempt.tv_sec++;
+        client->next_attempt.tv_nsec -= 1000000000L;
+    }
+    emit(client, CHAT_EVENT_RECONNECTING, reason, NULL, delay);
+}
+
+// The chat connection is gone. With a session to resume, dial again
+// instead of giving up; transfers in flight go down with the connection
+// on the server's side, so they fail here too.
+static void connection_lost(chat_client_t *client, const char *reason) {
+    if (!client->reconnect || !client->session[0] || client->leaving) {
+        close_connection(client, reason);
+        return;
+    }
+    close(client->socket);
+    client->socket = -1;
+    client->ping_tail_len = 0;
+    client->reconnecting = 1;
+    client->reconnect_attempts = 0;
+    clock_gettime(CLOCK_MONOTONIC, &client->dropped_at);
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        transfer_slot_t *t = &client->transfers[i];
+        if (!t->used) continue;
+        t->verdict = -1;
+        if (t->info.state == CHAT_TRANSFER_FINISHED) settle_transfer(client, t);
+        else fail_transfer(client, t, "connection to the server was lost");
+    }
+    schedule_reconnect(client, reason);
+}
+
+// One line of an answer, read byte by byte so whatever follows stays in
+// the socket for the event loop. Returns 0 on timeout or a closed socket.
+static int read_answer(int socket_fd, char *line, size_t size, int timeout_ms) {
+    size_t len = 0;
+    struct pollfd pfd = { .fd = socket_fd, .events = POLLIN };
+    while (len < size - 1) {
+        if (poll(&pfd, 1, timeout_ms) <= 0 || recv(socket_fd, line + len, 1, 0) != 1) return 0;
+        if (line[len] == '\n') break;
+        len++;
+    }
+    line[len] = '\0';
+    return 1;
+}
+
+// Dial again and send "/resume <username> <token>". A server that has
+// forgotten the session gets a fresh login under the same name instead.
+static void attempt_reconnect(chat_client_t *client) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_us(&client->dropped_at, &now) > SESSION_RESUME_WINDOW * 1000000L) {
+        client->reconnecting = 0;
+        close_connection(client, "could not reconnect to the server");
+        return;
+    }
+    int status;
+    client->socket = open_connection(client->host, client->port, CHAT_RECONNECT_STEP_MS, &status);
+    if (client->socket < 0) {
+        schedule_reconnect(client, chat_strerror(status));
+        return;
+    }
+
+    char frame[BUFFER_SIZE], answer[BUFFER_SIZE], room[MAX_GROUP_NAME_LENGTH];
+    int len = snprintf(frame, sizeof(frame), "/resume %s %s\n", client->username, client->session);
+    if (send(client->socket, frame, len, MSG_NOSIGNAL) != len ||
+        !read_answer(client->socket, answer, sizeof(answer), CHAT_RECONNECT_STEP_MS) ||
+        strcmp(answer, "RESUME_RETRY") == 0) {
+        // RESUME_RETRY: the server had not seen the old connection drop yet
+        close(client->socket);
+        client->socket = -1;
+        schedule_reconnect(client, "the server is still closing the old connection");
+        return;
+    }
+    if (sscanf(answer, "RESUMED %*s %31s", room) == 1) {
+        client->reconnecting = 0;
+        emit(client, CHAT_EVENT_RECONNECTED, strcmp(room, "-") != 0 ? room : NULL, NULL, 1);
+        // Lines coalesced before the drop go out now
+        if (chat_flush(client) != CHAT_OK) connection_lost(client, "failed to send to server");
+        return;
+    }
+
+    // RESUME_FAILED: the server restarted or the window ran out
+    client->session[0] = '\0';
+    client->reconnecting = 0;
+    status = chat_login(client, client->username, CHAT_RECONNECT_STEP_MS);
+    if (status != CHAT_OK) {
+        close(client->socket);
+        client->socket = -1;
+        client->reconnecting = 1;
+        schedule_reconnect(client, chat_strerror(status));
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (client->options[i][0]) chat_send(client, client->options[i]);
+    }
+    emit(client, CHAT_EVENT_RECONNECTED, NULL, NULL, 0);
+    if (chat_flush(client) != CHAT_OK) connection_lost(client, "failed to send to server");
+}
+
+void chat_set_reconnect(chat_client_t *client, int on) {
+    client->reconnect = on != 0;
+    if (client->reconnect && client->username[0] && !client->session[0]) chat_send(client, "/session");
+}
+
+int chat_reconnecting(const chat_client_t *client) {
+    return client->reconnecting;
+}
+
+// "SESSION <token>": keep it for resuming, and pass on a reply glued behind
+static void handle_session_notice(chat_client_t *client, char *notice) {
+    char *token = notice + 8;
+    if (strspn(token, "0123456789abcdef") < SESSION_TOKEN_HEX) {
+        emit(client, CHAT_EVENT_MESSAGE, notice, NULL, 0);
+        return;
+    }
+    memcpy(client->session, token, SESSION_TOKEN_HEX);
+    client->session[SESSION_TOKEN_HEX] = '\0';
+    char *rest = token + SESSION_TOKEN_HEX;
+    rest += *rest == '\n';
+    if (*rest) emit(client, CHAT_EVENT_MESSAGE, rest, NULL, 0);
+}
+
+// The chat socket is readable: read what the server sent, split it into
+// messages and hand each one on. Returns 0 once the connection is gone.
+static int handle_server_data(chat_client_t *client) {
+    char wire_buffer[LZ_FRAME_BOUND(BUFFER_SIZE * 2)];
+    char response_buffer[BUFFER_SIZE * 2];
+
+    int bytes_received = read(client->socket, wire_buffer, BUFFER_SIZE - 1);
+    if (bytes_received < 0 && errno == EINTR) {
+        return 1;
+    }
+    if (bytes_received == 0) {
+        if (client->leaving) close_connection(client, NULL);
+        else connection_lost(client, "server disconnected");
+        return !client->closed;
+    }
+    if (bytes_received < 0) {
+        connection_lost(client, "connection read error");
+        return !client->closed;
+    }
+    int tail = client->ping_tail_len;
+    memcpy(response_buffer, client->ping_tail, tail);
+    client->ping_tail_len = 0;
+    bytes_received = inflate_response(client->socket, wire_buffer, bytes_received, sizeof(wire_buffer),
+                                      response_buffer + tail, sizeof(response_buffer) - tail);
+    if (bytes_received < 0) {
+        close_connection(client, "received a corrupt compressed message");
+        return 0;
+    }
+    bytes_received = answer_pings(client, response_buffer, tail + bytes_received);
+    response_buffer[bytes_received] = '\0';
+
+    char *message = response_buffer;
+    while (message && *message) {
+        char *next = NULL;
+        char *glued = NULL;
+        if (is_transfer_notice(message)) {
+            next = strchr(message, '\n');
+        } else {
+            for (char *nl = strchr(message, '\n'); nl && !next; nl = strchr(nl + 1, '\n')) {
+                if (is_transfer_notice(nl + 1)) next = nl;
+            }
+            glued = glued_notice(message);
+            if (glued && next && next < glued) glued = NULL;
+        }
+        char saved = 0;
+        if (glued) {
+            saved = *glued;
+            *glued = '\0';
+            next = glued;
+        } else if (next) {
+            *next++ = '\0';
+        }
+        if (strncmp(message, "SESSION ", 8) == 0) {
+            handle_session_notice(client, message);
+        } else if (!handle_transfer_notice(client, message)) {
+            emit(client, CHAT_EVENT_MESSAGE, message, NULL, 0);
+        }
+        if (glued) *glued = saved;
+        message = next;
+    }
+    return 1;
+}
+
+int chat_send_file(chat_client_t *client, const char *recipient, const char *path, uint32_t *id) {
+    if (strcmp(recipient, client->username) == 0) {
+        return CHAT_ERR_SELF;
+    }
+    struct stat st;
+    if (stat(path, &st) < 0 || access(path, R_OK) < 0) {
+        return CHAT_ERR_OPEN;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EISDIR;
+        return CHAT_ERR_OPEN;
+    }
+
+    // The recipient gets the bare name, not our directory layout
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    // Ranges below CHAT_STREAM_MIN_BYTES are not worth a connection of their own
+    size_t size = (size_t)st.st_size;
+    int streams = client->delta ? 1 : client->upload_streams;
+    if ((size_t)streams > size / CHAT_STREAM_MIN_BYTES) streams = size / CHAT_STREAM_MIN_BYTES;
+    if (streams < 1) streams = 1;
+
+    int fd = open(path, O_RDONLY);
+    uint32_t checksum = 0;
+    int readable = fd >= 0 && file_checksum(fd, size, &checksum);
+    if (fd >= 0) close(fd);
+    if (!readable) {
+        return CHAT_ERR_OPEN;
+    }
+
+    transfer_slot_t *t = new_transfer(client);
+    if (!t) {
+        return CHAT_ERR_BUSY;
+    }
+    t->info.upload = 1;
+    t->info.id = client->next_transfer_id++;
+    t->info.size = size;
+    t->info.streams = streams;
+    t->info.delta = client->delta;      // until the server says otherwise
+    t->info.state = CHAT_TRANSFER_REQUESTED;
+    snprintf(t->info.peer, sizeof(t->info.peer), "%s", recipient);
+    snprintf(t->info.name, sizeof(t->info.name), "%s", name);
+    snprintf(t->info.path, sizeof(t->info.path), "%s", path);
+
+    char command_buffer[BUFFER_SIZE];
+    snprintf(command_buffer, sizeof(command_buffer), "/sendfile %s %s %zu %u %d %08x%s",
+             t->info.name, t->info.peer, t->info.size, t->info.id, t->info.streams, checksum,
+             client->delta ? " 1" : "");
+    if (chat_send(client, command_buffer) != CHAT_OK) {
+        t->used = 0;
+        return CHAT_ERR_SEND;
+    }
+    if (id) *id = t->info.id;
+    return CHAT_OK;
+}
+
+void chat_set_upload_streams(chat_client_t *client, int streams) {
+    if (streams < 1) streams = 1;
+    if (streams > MAX_TRANSFER_STREAMS) streams = MAX_TRANSFER_STREAMS;
+    client->upload_streams = streams;
+}
+
+void chat_set_delta(chat_client_t *client, int on) {
+    client->delta = on != 0;
+}
+
+int chat_pollfds(chat_client_t *client, struct pollfd *pfds, int max, int want_write) {
+    if (max < 1 || client->closed) return 0;
+    // Between reconnect attempts there is nothing to wait on but the timeout
+    pfds[0] = (struct pollfd){ .fd = client->reconnecting ? -1 : client->socket,
+                               .events = POLLIN | (want_write ? POLLOUT : 0) };
+    int count = 1;
+    client->polled_count = 0;
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        transfer_slot_t *t = &client->transfers[i];
+        for (int j = 0; t->used && j < MAX_TRANSFER_STREAMS && count < max; j++) {
+            data_stream_t *stream = &t->streams[j];
+            if (stream->socket < 0) continue;
+            pfds[count++] = (struct pollfd){ .fd = stream->socket, .events = data_socket_events(t, stream) };
+            client->polled[client->polled_count].transfer = t;
+            client->polled[client->polled_count++].stream = stream;
+        }
+    }
+    return count;
+}
+
+int chat_dispatch(chat_client_t *client, const struct pollfd *pfds, int count) {
+    if (client->closed) return 0;
+    if (client->reconnecting) {
+        if (chat_timeout(client) == 0) attempt_reconnect(client);
+        return !client->closed;
+    }
+    if (flush_if_due(client) != CHAT_OK) {
+        connection_lost(client, "failed to send to server");
+        return !client->closed;
+    }
+    // Data connections first: a notice read below may free their slots
+    for (int i = 1; i < count && i - 1 < client->polled_count; i++) {
+        transfer_slot_t *t = client->polled[i - 1].transfer;
+        data_stream_t *stream = client->polled[i - 1].stream;
+        if (pfds[i].revents && t->used && stream->socket == pfds[i].fd) {
+            handle_data_socket(client, t, stream, pfds[i].revents);
+        }
+    }
+    if (count > 0 && (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+        return handle_server_data(client);
+    }
+    return 1;
+}
+
+int chat_poll(chat_client_t *client, int timeout_ms) {
+    struct pollfd pfds[CHAT_POLLFDS_MAX];
+    int count = chat_pollfds(client, pfds, CHAT_POLLFDS_MAX, 0);
+    if (count == 0) return 0;
+    int due = chat_timeout(client);
+    if (due >= 0 && (timeout_ms < 0 || due < timeout_ms)) timeout_ms = due;
+    int ready = poll(pfds, count, timeout_ms);
+    if (ready < 0) return errno == EINTR;
+    return chat_dispatch(client, pfds, count);
+}
+
+void chat_close(chat_client_t *client) {
+    if (!client) return;
+    for (int i = 0; i < CHAT_MAX_TRANSFERS; i++) {
+        transfer_slot_t *t = &client->transfers[i];
+        for (int j = 0; t->used && j < MAX_TRANSFER_STREAMS; j++) close_stream(&t->streams[j]);
+        if (t->map) munmap(t->map, t->info.size);
+        if (t->file_fd >= 0) close(t->file_fd);
+        if (t->temp_path[0]) unlink(t->temp_path);
+        release_delta(t);
+    }
+    free(client->outbox);
+    if (client->socket >= 0) close(client->socket);
+    free(client);
+}
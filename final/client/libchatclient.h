@@ -0,0 +1,151 @@
+#ifndef LIBCHATCLIENT_H
+#define LIBCHATCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include "../shared/chatDefination.h"
+
+// A chat server connection without a terminal: connecting and logging in,
+// compressed frames and heartbeats, splitting what the server sends into
+// messages, and file transfers over their own data connections. Nothing
+// here reads stdin or prints; everything the server says comes back
+// through one callback, and the caller owns the loop. Either hand the
+// client's descriptors to your own poll() (chat_pollfds, chat_dispatch)
+// or let chat_poll wait on them alone. One thread per client.
+
+#define CHAT_MAX_TRANSFERS 8        // uploads and downloads in flight at once
+#define CHAT_POLLFDS_MAX (1 + CHAT_MAX_TRANSFERS * MAX_TRANSFER_STREAMS)
+#define CHAT_STREAM_MIN_BYTES (256 * 1024)  // smallest range given a data connection of its own
+#define CHAT_COALESCE_FRAMES 64     // lines one coalesced writev carries at most
+#define CHAT_COALESCE_MAX 65536     // largest coalescing threshold in bytes
+#define CHAT_RECONNECT_FIRST_MS 100 // first retry after a dropped connection, doubling from there
+#define CHAT_RECONNECT_MAX_MS 5000  // longest wait between retries
+#define CHAT_RECONNECT_STEP_MS 2000 // one attempt's connect, greeting and answer together
+
+typedef enum {
+    CHAT_OK = 0,
+    CHAT_ERR_ADDRESS = -1,      // not an IPv4 address
+    CHAT_ERR_CONNECT = -2,
+    CHAT_ERR_FULL = -3,         // the server has no free slot
+    CHAT_ERR_PROTOCOL = -4,     // the server said something unexpected
+    CHAT_ERR_TAKEN = -5,        // username in use
+    CHAT_ERR_TIMEOUT = -6,
+    CHAT_ERR_CLOSED = -7,
+    CHAT_ERR_SELF = -8,         // a file to yourself
+    CHAT_ERR_OPEN = -9,         // the local file, errno has the reason
+    CHAT_ERR_BUSY = -10,        // CHAT_MAX_TRANSFERS already in flight
+    CHAT_ERR_SEND = -11,
+    CHAT_ERR_NOMEM = -12
+} chat_error_t;
+
+typedef enum {
+    CHAT_TRANSFER_REQUESTED,    // /sendfile sent, waiting for the server
+    CHAT_TRANSFER_QUEUED,       // waiting in the server's queue
+    CHAT_TRANSFER_CONNECTING,   // data connection: connect, greeting, /data <token>
+    CHAT_TRANSFER_RUNNING,      // moving bytes
+    CHAT_TRANSFER_FINISHED      // bytes done with, waiting for the server's verdict
+} chat_transfer_state_t;
+
+typedef struct {
+    int upload;                     // 1 we send, 0 we receive
+    uint32_t id;                    // ours for uploads, the sender's for downloads
+    char peer[MAX_USERNAME_LENGTH]; // recipient of an upload, sender of a download
+    char name[128];                 // the file name the server knows
+    char path[256];                 // the local file
+    size_t size;
+    size_t done;                    // bytes moved so far
+    int streams;                    // data connections it is split over
+    int delta;                      // sent as a delta against the recipient's copy
+    size_t wire;                    // a delta's bytes on the data connection, both ways
+    chat_transfer_state_t state;
+    double seconds;                 // since the request, set when it ends
+} chat_transfer_t;
+
+typedef enum {
+    CHAT_EVENT_MESSAGE,             // text: one message from the server
+    CHAT_EVENT_TRANSFER_INCOMING,   // a download begins; path may differ from name
+    CHAT_EVENT_TRANSFER_QUEUED,     // value: position in the server's queue
+    CHAT_EVENT_TRANSFER_STARTED,    // an upload's data connection is up
+    CHAT_EVENT_TRANSFER_PROGRESS,   // value: 25, 50 or 75 percent
+    CHAT_EVENT_TRANSFER_DONE,
+    CHAT_EVENT_TRANSFER_FAILED,     // text: the local cause, or NULL
+    CHAT_EVENT_TRANSFER_CANCELLED,  // text: why the server turned it down
+    CHAT_EVENT_RECONNECTING,        // text: why the connection dropped, value: ms to the next attempt
+    CHAT_EVENT_RECONNECTED,         // text: the room given back, value: 1 resumed, 0 logged in afresh
+    CHAT_EVENT_CLOSED               // text: why, NULL after chat_leave
+} chat_event_type_t;
+
+typedef struct {
+    chat_event_type_t type;
+    const char *text;
+    const chat_transfer_t *transfer;    // transfer events only
+    int value;
+} chat_event_t;
+
+typedef struct chat_client chat_client_t;
+typedef void (*chat_event_cb)(chat_client_t *client, const chat_event_t *event, void *user);
+
+// Connect and read the server's greeting. NULL on failure, with the
+// reason in *error.
+chat_client_t *chat_connect(const char *host, int port, chat_event_cb callback, void *user, int *error);
+// Claim a username, waiting up to timeout_ms for the answer. Mail kept for
+// the user while offline arrives as messages before this returns.
+int chat_login(chat_client_t *client, const char *username, int timeout_ms);
+const char *chat_username(const chat_client_t *client);
+
+// One command or chat line; the newline is added
+int chat_send(chat_client_t *client, const char *line);
+// Offer a file; the transfer then runs from the event loop and reports
+// through the callback. *id, if given, receives the transfer's id.
+int chat_send_file(chat_client_t *client, const char *recipient, const char *path, uint32_t *id);
+// Coalesce outgoing lines: hold them for up to window_us after the first
+// one, or until max_bytes are waiting, and send them with one writev.
+// A window of 0 (the default) sends every line as it comes.
+void chat_set_coalescing(chat_client_t *client, int window_us, size_t max_bytes);
+// Send the lines waiting to be coalesced now, e.g. after a typed command
+int chat_flush(chat_client_t *client);
+// Milliseconds until waiting lines are due, -1 if none. Callers running
+// their own poll() wait no longer than this; chat_dispatch sends them.
+int chat_timeout(const chat_client_t *client);
+// Split uploads over up to this many parallel data connections (1 to
+// MAX_TRANSFER_STREAMS, default 1), each carrying a range of the file.
+// Files too small to give every stream CHAT_STREAM_MIN_BYTES use fewer.
+void chat_set_upload_streams(chat_client_t *client, int streams);
+// Offer uploads as deltas (delta.h): the recipient signs the copy it has
+// under the file's name and only what changed is sent, over one data
+// connection. Without a copy the whole file goes. Off by default.
+void chat_set_delta(chat_client_t *client, int on);
+// Reconnect when the connection drops. Once logged in the client asks
+// the server for a session token; on a drop it dials again with
+// exponential backoff for up to SESSION_RESUME_WINDOW seconds and resumes
+// the session with one frame, getting its room and the messages it missed
+// back. If the server no longer knows the session the client logs in
+// again under the same name. Transfers in flight fail on the drop, and
+// nothing is sent while reconnecting. Off by default.
+void chat_set_reconnect(chat_client_t *client, int on);
+int chat_reconnecting(const chat_client_t *client);
+// Send /exit and stop writing. The loop keeps reading until the server
+// closes, so nothing still in flight is lost to a reset.
+void chat_leave(chat_client_t *client);
+int chat_leaving(const chat_client_t *client);
+
+// Entries to wait on: the chat socket first, then every data connection.
+// want_write adds POLLOUT on the chat socket, for callers pacing their
+// sends. Returns the number of entries filled.
+int chat_pollfds(chat_client_t *client, struct pollfd *pfds, int max, int want_write);
+// Handle what poll() reported for the entries chat_pollfds filled.
+// Returns 0 once the connection is closed.
+int chat_dispatch(chat_client_t *client, const struct pollfd *pfds, int count);
+// Wait up to timeout_ms (-1 forever) on the client's own descriptors and
+// handle what comes. Returns 0 once closed, 1 otherwise, even on timeout.
+int chat_poll(chat_client_t *client, int timeout_ms);
+
+int chat_transfers_in_flight(const chat_client_t *client);
+// Copy out the transfers in flight; returns how many
+int chat_transfers(const chat_client_t *client, chat_transfer_t *out, int max);
+
+void chat_close(chat_client_t *client);
+const char *chat_strerror(int error);
+
+#endif // LIBCHATCLIENT_H
@@ -0,0 +1,384 @@
+#include "bus.h"
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define BUS_MAGIC 0x43425553u      // "CBUS"
+#define BUS_WAIT_MS 100            // consumer re-checks running this often
+#define BUS_OPEN_TIMEOUT_MS 1000   // for a peer that is still initialising
+
+typedef struct {
+    uint64_t seq;       // == pos: free for producer pos, == pos + 1: holds message pos
+    bus_msg_t msg;
+} bus_slot_t;
+
+// A producer that dies between claiming and publishing a slot stalls the
+// inbox; the owner then has to be restarted with an empty ring.
+typedef struct {
+    uint64_t enqueue_pos __attribute__((aligned(64)));
+    uint64_t dequeue_pos __attribute__((aligned(64)));
+    uint32_t wake __attribute__((aligned(64)));     // futex word, bumped per message
+    uint32_t sleeping;
+    bus_slot_t slots[BUS_RING_SLOTS];
+} bus_inbox_t;
+
+typedef struct {
+    char name[MAX_USERNAME_LENGTH];
+    char room[MAX_GROUP_NAME_LENGTH];
+    int32_t node;       // -1 = free entry
+} bus_user_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ready;
+    pthread_mutex_t dir_lock;           // process-shared, robust
+    int32_t node_pid[BUS_MAX_NODES];
+    bus_user_t users[BUS_MAX_USERS];
+    bus_inbox_t inbox[BUS_MAX_NODES];
+} bus_shm_t;
+
+static bus_shm_t *bus = NULL;
+static int my_node = -1;
+static bus_handler_t handler_fn;
+static bus_stats_t stats;
+static int bus_running = 0;
+
+void log_event(const char *format, ...);
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void inbox_init(bus_inbox_t *in) {
+    in->enqueue_pos = 0;
+    in->dequeue_pos = 0;
+    in->wake = 0;
+    in->sleeping = 0;
+    for (uint64_t i = 0; i < BUS_RING_SLOTS; i++) {
+        in->slots[i].seq = i;
+    }
+}
+
+static void dir_lock(void) {
+    if (pthread_mutex_lock(&bus->dir_lock) == EOWNERDEAD) {
+        // A node died holding the lock; every update is a single field, so keep going
+        pthread_mutex_consistent(&bus->dir_lock);
+    }
+}
+
+static void dir_unlock(void) {
+    pthread_mutex_unlock(&bus->dir_lock);
+}
+
+static int node_alive(int node) {
+    pid_t pid = bus->node_pid[node];
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static int wait_until(int (*cond)(int), int arg) {
+    for (int waited = 0; waited < BUS_OPEN_TIMEOUT_MS; waited += 10) {
+        if (cond(arg)) return 0;
+        usleep(10000);
+    }
+    return cond(arg) ? 0 : -1;
+}
+
+static int segment_sized(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(bus_shm_t);
+}
+
+static int segment_ready(int unused) {
+    (void)unused;
+    return __atomic_load_n(&bus->ready, __ATOMIC_ACQUIRE) == 1;
+}
+
+// Caller is the only consumer; returns 1 if msg was filled
+static int inbox_pop(bus_inbox_t *in, bus_msg_t *msg) {
+    uint64_t pos = in->dequeue_pos;
+    bus_slot_t *slot = &in->slots[pos & (BUS_RING_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) return 0;
+
+    uint32_t len = slot->msg.len < BUS_MAX_TEXT ? slot->msg.len : BUS_MAX_TEXT;
+    memcpy(msg, &slot->msg, offsetof(bus_msg_t, text) + len);
+    msg->len = len;
+    in->dequeue_pos = pos + 1;
+    __atomic_store_n(&slot->seq, pos + BUS_RING_SLOTS, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int bus_open(const char *cluster, int node_id) {
+    if (node_id < 0 || node_id >= BUS_MAX_NODES) return -1;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/chatbus-%s", cluster);
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) return -1;
+    if (created ? ftruncate(fd, sizeof(bus_shm_t)) < 0 : wait_until(segment_sized, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(bus_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    bus = map;
+
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&bus->dir_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        for (int i = 0; i < BUS_MAX_USERS; i++) bus->users[i].node = -1;
+        for (int i = 0; i < BUS_MAX_NODES; i++) inbox_init(&bus->inbox[i]);
+        bus->magic = BUS_MAGIC;
+        __atomic_store_n(&bus->ready, 1, __ATOMIC_RELEASE);
+    } else if (wait_until(segment_ready, 0) < 0 || bus->magic != BUS_MAGIC) {
+        munmap(map, sizeof(bus_shm_t));
+        bus = NULL;
+        return -1;
+    }
+
+    dir_lock();
+    pid_t previous = bus->node_pid[node_id];
+    // A hot restart execs in a child of the running node: keep its users and inbox
+    int handed_over = previous == getppid();
+    if (!handed_over && previous != getpid() && node_alive(node_id)) {
+        dir_unlock();
+        log_event("[BUS_ERROR] Node %d is already run by pid %d", node_id, (int)previous);
+        munmap(map, sizeof(bus_shm_t));
+        bus = NULL;
+        return -1;
+    }
+    bus->node_pid[node_id] = getpid();
+    my_node = node_id;
+    int stale = 0;
+    if (!handed_over) {
+        for (int i = 0; i < BUS_MAX_USERS; i++) {
+            if (bus->users[i].node == node_id) {
+                bus->users[i].node = -1;
+                stale++;
+            }
+        }
+    }
+    dir_unlock();
+
+    if (!handed_over) {
+        bus_msg_t msg;
+        while (inbox_pop(&bus->inbox[node_id], &msg)) stale++;
+    }
+    log_event("[BUS] Joined cluster '%s' as node %d (%s segment, %d stale entries dropped)",
+              cluster, node_id, created ? "new" : "existing", stale);
+    return 0;
+}
+
+static void *bus_consumer(void *arg) {
+    (void)arg;
+    bus_inbox_t *in = &bus->inbox[my_node];
+    bus_msg_t msg;
+
+    while (__atomic_load_n(&bus_running, __ATOMIC_RELAXED)) {
+        if (inbox_pop(in, &msg)) {
+            __atomic_add_fetch(&stats.received, 1, __ATOMIC_RELAXED);
+            handler_fn(&msg);
+            continue;
+        }
+        // Announce we are going to sleep, then look once more: a producer
+        // either sees sleeping == 1 or its message is found here
+        uint32_t wake = __atomic_load_n(&in->wake, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&in->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!inbox_pop(in, &msg)) {
+            struct timespec timeout = { 0, BUS_WAIT_MS * 1000000L };
+            futex(&in->wake, FUTEX_WAIT, wake, &timeout);
+            __atomic_store_n(&in->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        __atomic_store_n(&in->sleeping, 0, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&stats.received, 1, __ATOMIC_RELAXED);
+        handler_fn(&msg);
+    }
+    return NULL;
+}
+
+int bus_start(bus_handler_t handler) {
+    if (!bus) return -1;
+    handler_fn = handler;
+    bus_running = 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bus_consumer, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+void bus_close(void) {
+    if (!bus) return;
+    __atomic_store_n(&bus_running, 0, __ATOMIC_RELAXED);
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        if (bus->users[i].node == my_node) bus->users[i].node = -1;
+    }
+    bus->node_pid[my_node] = 0;
+    dir_unlock();
+    log_event("[BUS] Left cluster: %lu sent, %lu received, %lu dropped",
+              (unsigned long)stats.sent, (unsigned long)stats.received, (unsigned long)stats.dropped);
+}
+
+int bus_send(int node, bus_type_t type, const char *target, const char *text, size_t len) {
+    if (!bus || node < 0 || node >= BUS_MAX_NODES || len > BUS_MAX_TEXT) return -1;
+    bus_inbox_t *in = &bus->inbox[node];
+    bus_slot_t *slot;
+
+    uint64_t pos = __atomic_load_n(&in->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &in->slots[pos & (BUS_RING_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&in->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&stats.dropped, 1, __ATOMIC_RELAXED);
+            return -1;      // full
+        } else {
+            pos = __atomic_load_n(&in->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->msg.type = type;
+    slot->msg.from_node = my_node;
+    snprintf(slot->msg.target, sizeof(slot->msg.target), "%s", target);
+    slot->msg.len = len;
+    memcpy(slot->msg.text, text, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&in->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&in->sleeping, __ATOMIC_SEQ_CST)) {
+        futex(&in->wake, FUTEX_WAKE, 1, NULL);
+    }
+    __atomic_add_fetch(&stats.sent, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int bus_claim_user(const char *username) {
+    if (!bus) return 0;
+    int result = -1;
+    dir_lock();
+    bus_user_t *free_entry = NULL;
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        bus_user_t *u = &bus->users[i];
+        if (u->node < 0 || (u->node != my_node && !node_alive(u->node))) {
+            if (!free_entry) free_entry = u;
+            continue;
+        }
+        if (strcmp(u->name, username) == 0) {
+            result = u->node == my_node ? 0 : -1;
+            goto out;
+        }
+    }
+    if (free_entry) {
+        snprintf(free_entry->name, sizeof(free_entry->name), "%s", username);
+        free_entry->room[0] = '\0';
+        free_entry->node = my_node;
+        result = 0;
+    }
+out:
+    dir_unlock();
+    return result;
+}
+
+void bus_release_user(const char *username) {
+    if (!bus) return;
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        if (bus->users[i].node == my_node && strcmp(bus->users[i].name, username) == 0) {
+            bus->users[i].node = -1;
+        }
+    }
+    dir_unlock();
+}
+
+void bus_set_room(const char *username, const char *room) {
+    if (!bus) return;
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        if (bus->users[i].node == my_node && strcmp(bus->users[i].name, username) == 0) {
+            snprintf(bus->users[i].room, sizeof(bus->users[i].room), "%s", room);
+        }
+    }
+    dir_unlock();
+}
+
+int bus_room_members(const char *room, char *out, size_t size) {
+    size_t len = 0;
+    int count = 0;
+    out[0] = '\0';
+    if (!bus) return 0;
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        bus_user_t *u = &bus->users[i];
+        if (u->node < 0 || strcmp(u->room, room) != 0) continue;
+        if (u->node != my_node && !node_alive(u->node)) continue;
+        size_t n = strlen(u->name);
+        if (len + n + 2 > size) break;
+        memcpy(out + len, u->name, n);
+        out[len + n] = ' ';
+        len += n + 1;
+        out[len] = '\0';
+        count++;
+    }
+    dir_unlock();
+    return count;
+}
+
+int bus_broadcast(const char *room, const char *text, size_t len) {
+    if (!bus) return 0;
+    int has_members[BUS_MAX_NODES] = {0};
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        bus_user_t *u = &bus->users[i];
+        if (u->node >= 0 && u->node != my_node && strcmp(u->room, room) == 0) {
+            has_members[u->node] = 1;
+        }
+    }
+    dir_unlock();
+
+    int queued = 0;
+    for (int node = 0; node < BUS_MAX_NODES; node++) {
+        if (!has_members[node] || !node_alive(node)) continue;
+        if (bus_send(node, BUS_BROADCAST, room, text, len) == 0) {
+            queued++;
+        } else {
+            log_event("[BUS_ERROR] Inbox of node %d full, broadcast to '%s' dropped", node, room);
+        }
+    }
+    return queued;
+}
+
+int bus_whisper(const char *target, const char *text, size_t len) {
+    if (!bus) return -1;
+    int node = -1;
+    dir_lock();
+    for (int i = 0; i < BUS_MAX_USERS; i++) {
+        bus_user_t *u = &bus->users[i];
+        if (u->node >= 0 && u->node != my_node && strcmp(u->name, target) == 0) {
+            node = u->node;
+            break;
+        }
+    }
+    dir_unlock();
+    if (node < 0 || !node_alive(node)) return -1;
+    return bus_send(node, BUS_WHISPER, target, text, len);
+}
+
+void bus_get_stats(bus_stats_t *out) {
+    out->sent = __atomic_load_n(&stats.sent, __ATOMIC_RELAXED);
+    out->received = __atomic_load_n(&stats.received, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Cluster mode: several chatserver processes on one host (one port each)
+// share a POSIX shared memory segment /chatbus-<cluster>. It holds
+//  - a directory of every registered user: node and current room, under a
+//    process-shared robust mutex, so usernames are unique cluster-wide
+//    and a node knows which peers have members in a room;
+//  - one inbox ring per node. Any node may produce, only the owner
+//    consumes (bounded MPSC queue with per-slot sequence numbers); an idle
+//    consumer sleeps on a futex that producers wake.
+// A broadcast is delivered locally and enqueued once per other node that
+// has members in the room; the receiving node fans it out to its clients.
+
+#define BUS_MAX_NODES 8
+#define BUS_MAX_USERS (BUS_MAX_NODES * MAX_CLIENTS)
+#define BUS_RING_SLOTS 512          // per node, must be a power of two
+#define BUS_MAX_TEXT (BUFFER_SIZE + 128)
+
+typedef enum {
+    BUS_BROADCAST = 1,      // target is a room
+    BUS_WHISPER             // target is a username
+} bus_type_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t from_node;
+    char target[MAX_GROUP_NAME_LENGTH];
+    uint32_t len;
+    char text[BUS_MAX_TEXT];
+} bus_msg_t;
+
+typedef void (*bus_handler_t)(const bus_msg_t *msg);
+
+// Map (creating if needed) the cluster segment and claim node_id. Users a
+// previous incarnation of this node left in the directory are dropped.
+int bus_open(const char *cluster, int node_id);
+// Start the thread that feeds this node's inbox to handler
+int bus_start(bus_handler_t handler);
+void bus_close(void);
+
+// Directory. bus_claim_user returns -1 if the name is in use on another node.
+int bus_claim_user(const char *username);
+void bus_release_user(const char *username);
+void bus_set_room(const char *username, const char *room);
+// Space separated members of room on all nodes, returns the count
+int bus_room_members(const char *room, char *out, size_t size);
+
+// Returns how many nodes the message was queued to
+int bus_broadcast(const char *room, const char *text, size_t len);
+// 0 if target is online on another node and the message was queued
+int bus_whisper(const char *target, const char *text, size_t len);
+
+// Low level: queue to one node, -1 if its inbox is full
+int bus_send(int node, bus_type_t type, const char *target, const char *text, size_t len);
+
+typedef struct {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t dropped;       // inbox of the destination was full
+} bus_stats_t;
+
+void bus_get_stats(bus_stats_t *stats);
+
+#endif // BUS_H
@@ -1,8 +1,28 @@
 // Compile: gcc chatserver.c -o chatserver -lpthread
 #include "../shared/chatDefination.h"
+#include "../shared/compress.h"
+#include "../shared/textscan.h"
+#include "command_table.h"
+#include "mailbox.h"
+#include "history.h"
+#include "wal.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "presence.h"
+#include "bus.h"
+#include "mesh.h"
+#include "timerwheel.h"
+#include "session.h"
 #include <time.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 
 int running = 1;
 
@@ -15,18 +35,91 @@ pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 FileQueue file_queue;
 
+int wal_enabled = 0;
+wal_state_t recovered_state;    // what the WAL held at startup, consumed on /username
+const char *wal_dir = NULL;
+int metrics_port = 0;
+int cluster_enabled = 0;        // --cluster: rooms and users shared through bus.h
+int mesh_enabled = 0;           // --mesh: rooms and users federated over TCP links (mesh.h)
+
+// Hot restart (SIGUSR2): the handler pokes restart_pipe so the accept loop
+// runs the handoff; a byte in park_pipe makes every reader step aside.
+int restart_pipe[2] = {-1, -1};
+int park_pipe[2] = {-1, -1};
+pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readers_cond = PTHREAD_COND_INITIALIZER;
+int live_readers = 0;
+int parked_readers = 0;
+int parking = 0;
+int reader_parked[MAX_CLIENTS];
+int transfers_paused = 0;
+char exec_path[PATH_MAX];
+char **server_argv;
+handoff_state_t handoff;    // also holds parked readers' partial input (readers_mutex)
+
+// Timers (timerwheel.h). Input only stamps last_input_ms; the idle timer
+// looks at it when it fires and re-arms for the remainder.
+int idle_timeout_ms = IDLE_TIMEOUT_DEFAULT * 1000;     // 0 = never drop silent clients
+wheel_timer_t idle_timers[MAX_CLIENTS];
+uint64_t last_input_ms[MAX_CLIENTS];
+
+typedef struct {
+    wheel_timer_t timer;
+    uint64_t last_progress_ms;
+    int stalled;
+    int used;
+    // Data connections of a transfer with an id, attached by cmd_data,
+    // one pair per stream
+    uint64_t sender_token;
+    uint64_t recipient_token;
+    int streams;
+    int sender_fd[MAX_TRANSFER_STREAMS];        // -1 until attached
+    int recipient_fd[MAX_TRANSFER_STREAMS];
+    size_t relayed;         // bytes a delta transfer moved, both frames
+} transfer_watch_t;
+
+// What a relay thread gets: the transfer and the watch it reports to
+typedef struct {
+    FileMeta meta;
+    transfer_watch_t *watch;
+} transfer_job_t;
+
+transfer_watch_t transfer_watches[MAX_SIMULTANEOUS_TRANSFERS];    // guarded by file_queue.mutex
+pthread_cond_t data_attached_cond = PTHREAD_COND_INITIALIZER;      // with file_queue.mutex
+int data_connection[MAX_CLIENTS];      // set by cmd_data, the reader lets go of the socket
+wheel_timer_t queue_timers[MAX_FILE_QUEUE];
+uint32_t queue_timer_ids[MAX_FILE_QUEUE];     // queue_id each timer watches, 0 = free
+uint32_t next_queue_id = 1;
+
 void *handle_client_read(void *arg);
 void broadcast_to_room(char *msg, char *room_name, int sender_socket);
+void handle_bus_message(const bus_msg_t *msg);
+void session_expired(const char *username);
+void deliver_presence(const char *room_name, const int *client_indices, int count,
+                      const char *frame, size_t len);
 void send_private_message(char *msg, char *target_username, int sender_socket);
 int find_client_by_socket(int socket);
 int find_client_by_username(char *username);
 int find_or_create_room(char *room_name);
+int find_room_index(const char *room_name);
+int join_room(int client_index, const char *room_name);
+void wal_log(wal_type_t type, const char *username, const char *room);
+void wal_log_transfer(wal_type_t type, const FileMeta *meta);
+void restore_wal_state(void);
+int start_client_reader(int client_index);
+void hot_restart(void);
+void take_over(const handoff_state_t *st);
+int launch_next_transfer(void);
 void remove_client_from_room(int client_index);
 void add_client_to_room(int client_index, char *room_name);
 void handle_command(int client_socket, char *message);
 void log_event(const char *format, ...);
 void *handle_file_transfer(void *arg);
-int relay_file();
+int relay_file(transfer_watch_t *watch);
+int relay_data(const FileMeta *meta, transfer_watch_t *watch);
+void start_file_transfer(const FileMeta *meta);
+void send_transfer_reply(int socket, const char *code, uint32_t transfer_id);
+void arm_queue_expiry(uint32_t queue_id, uint64_t delay_ms);
 int validate_file_type(const char *filename);
 int validate_room_name(const char *room_name);
 void filequeue_init(FileQueue *q);
@@ -37,6 +130,11 @@ void filequeue_finish_transfer(FileQueue *q);
 int filequeue_try_start_next(FileQueue *q, FileMeta *meta);
 
 void signal_handler(int signal) {
+    if (signal == SIGUSR2) {
+        // Only async-signal-safe work here, the accept loop does the rest
+        if (restart_pipe[1] >= 0) write(restart_pipe[1], "R", 1);
+        return;
+    }
     if (signal == SIGINT || signal == SIGTERM) {
         log_event("[SHUTDOWN] %s received. Disconnecting clients, saving logs", 
                   signal == SIGINT ? "SIGINT" : "SIGTERM");
@@ -49,7 +147,7 @@ void signal_handler(int signal) {
         close(server_fd);
         
         int disconnected_clients = 0;
-        pthread_mutex_lock(&clients_mutex);
+        LOCK(clients_mutex);
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (clients[i].active) {
                 send(clients[i].socket, "[SERVER] Server is shutting down. Disconnecting...\n", 50, 0);
@@ -61,7 +159,7 @@ void signal_handler(int signal) {
                          i, clients[i].username[0] ? clients[i].username : "unnamed");
             }
         }
-        pthread_mutex_unlock(&clients_mutex);
+        UNLOCK(clients_mutex);
         
         log_event("[SHUTDOWN] Server socket closed, %d clients disconnected", disconnected_clients);
     }
@@ -70,9 +168,48 @@ void signal_handler(int signal) {
 int main(int argc, char *argv[]) {
     log_event("[STARTUP] Chat server starting up");
     
-    if (argc != 2) {
+    if (argc < 2) {
         log_event("[ERROR] Invalid arguments provided, expected port number");
-        fprintf(stderr, "Usage: ./%s <port>\n", argv[0]);
+        fprintf(stderr, "Usage: ./%s <port> [--history-dir <dir>] [--wal-dir <dir>] [--metrics-port <port>] [--trace] [--idle-timeout <sec>] [--cluster <name> | --mesh <host:port,...>] [--node <id>]\n", argv[0]);
+        exit(1);
+    }
+    
+    const char *history_dir = NULL;
+    const char *cluster_name = NULL;
+    const char *mesh_peers = NULL;
+    int cluster_node = -1;
+    int handoff_fd = -1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--history-dir") == 0 && i + 1 < argc) {
+            history_dir = argv[++i];
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout_ms = atoi(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--wal-dir") == 0 && i + 1 < argc) {
+            wal_dir = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_set_enabled(1);
+        } else if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc) {
+            cluster_name = argv[++i];
+        } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            mesh_peers = argv[++i];
+        } else if (strcmp(argv[i], "--node") == 0 && i + 1 < argc) {
+            cluster_node = atoi(argv[++i]);
+        } else if (strcmp(argv[i], HANDOFF_FD_OPTION) == 0 && i + 1 < argc) {
+            handoff_fd = atoi(argv[++i]);
+        } else {
+            log_event("[ERROR] Unknown option '%s'", argv[i]);
+            fprintf(stderr, "Usage: ./%s <port> [--history-dir <dir>] [--wal-dir <dir>] [--metrics-port <port>] [--trace] [--idle-timeout <sec>] [--cluster <name> | --mesh <host:port,...>] [--node <id>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (cluster_name && mesh_peers) {
+        fprintf(stderr, "--cluster and --mesh cannot be combined\n");
+        exit(1);
+    }
+    if ((cluster_name != NULL || mesh_peers != NULL) != (cluster_node >= 0)) {
+        fprintf(stderr, "--cluster or --mesh and --node go together\n");
         exit(1);
     }
 
@@ -91,7 +228,22 @@ int main(int argc, char *argv[]) {
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
+    if (pipe(restart_pipe) < 0 || pipe(park_pipe) < 0 || sigaction(SIGUSR2, &sa, NULL) == -1) {
+        log_event("[ERROR] Failed to set up hot restart (SIGUSR2)");
+        perror("hot restart setup");
+        exit(EXIT_FAILURE);
+    }
+    // Exec whatever binary is at our path now, so an upgrade takes effect
+    if (!realpath(argv[0], exec_path)) {
+        snprintf(exec_path, sizeof(exec_path), "/proc/self/exe");
+    }
+    server_argv = argv;
     log_event("[STARTUP] Signal handlers configured");
+#ifdef LOCK_PROFILE
+    if (lockprof_init() < 0) {
+        log_event("[ERROR] Failed to start lock profiler");
+    }
+#endif
 
     int port = atoi(argv[1]);
     log_event("[STARTUP] Server port set to %d", port);
@@ -118,40 +270,124 @@ int main(int argc, char *argv[]) {
     }
     log_event("[STARTUP] Room array initialized (%d max rooms)", MAX_GROUPS);
     
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        log_event("[ERROR] Socket creation failed");
-        perror("Socket creation failed");
-        exit(1);
+    if (handoff_fd >= 0) {
+        // Hot restart: the previous process hands us its sockets and tables
+        if (handoff_receive(handoff_fd, &handoff) < 0) {
+            fprintf(stderr, "Hot restart handoff failed\n");
+            exit(1);
+        }
+        server_fd = handoff.listen_fd;
+        log_event("[HOT_RESTART] Received listening socket (fd: %d) from previous process", server_fd);
+    } else {
+        // Create socket
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            log_event("[ERROR] Socket creation failed");
+            perror("Socket creation failed");
+            exit(1);
+        }
+        log_event("[STARTUP] Server socket created (fd: %d)", server_fd);
+    
+        // Set socket options to reuse address
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            log_event("[ERROR] Failed to set socket options");
+            perror("Setsockopt failed");
+            exit(1);
+        }
+        log_event("[STARTUP] Socket options configured (SO_REUSEADDR)");
+    
+        // Setup server address
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+    
+        // Bind
+        if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            log_event("[ERROR] Bind failed on port %d", port);
+            perror("Bind failed");
+            exit(1);
+        }
+        log_event("[STARTUP] Socket bound to port %d", port);
     }
-    log_event("[STARTUP] Server socket created (fd: %d)", server_fd);
     
-    // Set socket options to reuse address
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        log_event("[ERROR] Failed to set socket options");
-        perror("Setsockopt failed");
+    //setup file transfer queue
+    filequeue_init(&file_queue);
+    
+    if (timers_init() < 0) {
+        log_event("[ERROR] Could not start the timer thread");
         exit(1);
     }
-    log_event("[STARTUP] Socket options configured (SO_REUSEADDR)");
+    session_init(session_expired);
+    log_event("[STARTUP] Idle timeout %d s, transfer stall timeout %d s, queued transfers expire after %d s, "
+              "dropped sessions resumable for %d s",
+              idle_timeout_ms / 1000, TRANSFER_STALL_TIMEOUT, QUEUED_TRANSFER_EXPIRY, SESSION_RESUME_WINDOW);
+    log_event("[STARTUP] File transfer queue initialized");
+
+    // Offline mailboxes are optional, the server still runs without them
+    if (mailbox_init() == 0) {
+        log_event("[STARTUP] Offline mailboxes ready in '%s'", MAILBOX_DIR);
+    }
     
-    // Setup server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    history_init(history_dir);
+    log_event("[STARTUP] Room history %s", history_dir ? "backed by mmap'd segments" : "kept in memory");
     
-    // Bind
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        log_event("[ERROR] Bind failed on port %d", port);
-        perror("Bind failed");
+    if (presence_init(deliver_presence) < 0) {
+        log_event("[ERROR] Could not start the presence flush thread");
         exit(1);
     }
-    log_event("[STARTUP] Socket bound to port %d", port);
     
-    //setup file transfer queue
-    filequeue_init(&file_queue);
-    log_event("[STARTUP] File transfer queue initialized");
+    if (handoff_fd >= 0) {
+        take_over(&handoff);
+    }
+    
+    // Rebuild rooms, sessions and queued transfers from the write-ahead log
+    if (wal_dir) {
+        if (wal_open(wal_dir, WAL_DEFAULT_SNAPSHOT_EVERY, &recovered_state) < 0) {
+            log_event("[ERROR] Could not open write-ahead log in '%s'", wal_dir);
+            fprintf(stderr, "Could not open write-ahead log in '%s'\n", wal_dir);
+            exit(1);
+        }
+        wal_enabled = 1;
+        if (handoff_fd >= 0) {
+            // Handed over users never left and their transfers are still queued
+            recovered_state.pending_count = 0;
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                if (!clients[i].active || !clients[i].username[0]) continue;
+                wal_event_t live = { .type = WAL_LEAVE };
+                strcpy(live.username, clients[i].username);
+                wal_state_apply(&recovered_state, &live);
+            }
+        }
+        restore_wal_state();
+    }
+    
+    if (cluster_name) {
+        if (bus_open(cluster_name, cluster_node) < 0 || bus_start(handle_bus_message) < 0) {
+            log_event("[ERROR] Could not join cluster '%s' as node %d", cluster_name, cluster_node);
+            fprintf(stderr, "Could not join cluster '%s' as node %d\n", cluster_name, cluster_node);
+            exit(1);
+        }
+        cluster_enabled = 1;
+    }
+    if (mesh_peers) {
+        if (mesh_open(mesh_peers, cluster_node) < 0) {
+            log_event("[ERROR] Could not join mesh '%s' as node %d", mesh_peers, cluster_node);
+            fprintf(stderr, "Could not join mesh '%s' as node %d\n", mesh_peers, cluster_node);
+            exit(1);
+        }
+        // Handed over sessions are registered again as links come up
+        for (int i = 0; handoff_fd >= 0 && i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].username[0]) {
+                mesh_restore_user(clients[i].username, clients[i].current_room);
+            }
+        }
+        if (mesh_start(handle_bus_message) < 0) {
+            log_event("[ERROR] Could not start mesh links");
+            exit(1);
+        }
+        mesh_enabled = 1;
+    }
 
     // Listen
     if (listen(server_fd, MAX_CLIENTS) < 0) {
@@ -161,8 +397,44 @@ int main(int argc, char *argv[]) {
     }
     printf("Server listening on ip 127.0.0.1 on port %d...\n", port);
     log_event("[STARTUP] Server listening on ip 127.0.0.1 on port %d, ready for connections", port);
+    
+    if (metrics_port > 0) {
+        metrics_serve(metrics_port);
+    }
+    
+    if (handoff_fd >= 0) {
+        int resumed = 0;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (!clients[i].active) continue;
+            if (start_client_reader(i) == 0) {
+                resumed++;
+            } else {
+                close(clients[i].socket);
+                clients[i].active = 0;
+            }
+        }
+        metrics_gauge_set(METRIC_ACTIVE_CONNECTIONS, resumed);
+        metrics_gauge_set(METRIC_QUEUED_TRANSFERS, file_queue.count);
+        while (launch_next_transfer()) {}
+        handoff_ready(handoff_fd);
+        log_event("[HOT_RESTART] Serving %d handed over clients in %d rooms", resumed, room_count);
+    }
 
     while (running) {
+        struct pollfd pfds[2] = {
+            { .fd = server_fd, .events = POLLIN },
+            { .fd = restart_pipe[0], .events = POLLIN }
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            continue;  // interrupted by a signal, running says whether to go on
+        }
+        if (pfds[1].revents & POLLIN) {
+            char c;
+            read(restart_pipe[0], &c, 1);
+            hot_restart();
+            continue;
+        }
+        
         addr_len = sizeof(client_addr);
         int client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
         if (client_socket < 0) {
@@ -186,7 +458,7 @@ int main(int argc, char *argv[]) {
                   client_ip, client_port, client_socket);
         
         // Find available slot for client
-        pthread_mutex_lock(&clients_mutex);
+        LOCK(clients_mutex);
         int client_index = -1;
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (!clients[i].active) {
@@ -195,10 +467,14 @@ int main(int argc, char *argv[]) {
                 clients[i].active = 1;
                 memset(clients[i].username, 0, MAX_USERNAME_LENGTH);
                 memset(clients[i].current_room, 0, MAX_GROUP_NAME_LENGTH);
+                clients[i].compress = 0;
+                clients[i].presence = 0;
+                clients[i].line_framed = 0;
+                clients[i].raw_bytes = clients[i].wire_bytes = clients[i].compress_ns = 0;
                 break;
             }
         }
-        pthread_mutex_unlock(&clients_mutex);
+        UNLOCK(clients_mutex);
         
         if (client_index == -1) {
             log_event("[CONNECTION_REJECTED] Max clients reached, rejecting %s:%d", 
@@ -212,109 +488,551 @@ int main(int argc, char *argv[]) {
         printf("Client connected from %s:%d (slot %d)\n", client_ip, client_port, client_index);
         log_event("[CONNECTION_ACCEPTED] Client assigned to slot %d from %s:%d", 
                   client_index, client_ip, client_port);
+        // Replies and deliveries are separate small sends; with Nagle on, a
+        // reply queued behind an unacked delivery waits out the client's
+        // delayed ACK (~40 ms)
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
         send(client_socket, "SUCCESS_LOGIN", 14, 0);
         
-        pthread_t client_handler_thread;
-        int *client_index_ptr = malloc(sizeof(int));
-        *client_index_ptr = client_index;
-        
-        if (pthread_create(&client_handler_thread, NULL, handle_client_read, client_index_ptr) != 0) {
-            log_event("[ERROR] Failed to create thread for client %d", client_index);
+        if (start_client_reader(client_index) != 0) {
             perror("Failed to create thread");
             close(client_socket);
-            pthread_mutex_lock(&clients_mutex);
+            LOCK(clients_mutex);
             clients[client_index].active = 0;
-            pthread_mutex_unlock(&clients_mutex);
-            free(client_index_ptr);
+            UNLOCK(clients_mutex);
             continue;
         }
-        
-        pthread_detach(client_handler_thread);
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        metrics_gauge_add(METRIC_ACTIVE_CONNECTIONS, 1);
     }
     
     close(server_fd);
+    if (cluster_enabled) {
+        bus_close();
+    }
+    if (mesh_enabled) {
+        mesh_close();
+    }
+    if (wal_enabled) {
+        wal_sync();
+        wal_close();
+        log_event("[SHUTDOWN] Write-ahead log flushed");
+    }
+    history_close();
+    mailbox_close();
     log_event("[SHUTDOWN] Server shutdown complete");
     return 0;
 }
 
+// Recreate rooms in their original order and hand recovered transfers to
+// the mailboxes; sessions are restored lazily when each user registers.
+void restore_wal_state(void) {
+    LOCK(rooms_mutex);
+    for (uint32_t i = 0; i < recovered_state.room_count; i++) {
+        find_or_create_room(recovered_state.rooms[i]);
+    }
+    UNLOCK(rooms_mutex);
+    
+    for (uint32_t i = 0; i < recovered_state.pending_count; i++) {
+        wal_transfer_t *t = &recovered_state.pending[i];
+        char offer[BUFFER_SIZE];
+        snprintf(offer, sizeof(offer), 
+                 "[FILE OFFER] %s queued '%s' (%lu bytes) for you before the server restarted", 
+                 t->sender, t->filename, (unsigned long)t->filesize);
+        mailbox_store(t->recipient, MAILBOX_FILE_OFFER, offer);
+        
+        FileMeta meta;
+        memset(&meta, 0, sizeof(meta));
+        strncpy(meta.sender, t->sender, sizeof(meta.sender) - 1);
+        strncpy(meta.recipient, t->recipient, sizeof(meta.recipient) - 1);
+        strncpy(meta.filename, t->filename, sizeof(meta.filename) - 1);
+        wal_log_transfer(WAL_TRANSFER_DEQUEUED, &meta);
+    }
+    
+    int sessions = 0;
+    for (int i = 0; i < WAL_MAX_SESSIONS; i++) {
+        if (recovered_state.sessions[i].room[0]) sessions++;
+    }
+    log_event("[STARTUP] Recovered %u rooms, %d sessions to restore, %u queued transfers moved to mailboxes", 
+              recovered_state.room_count, sessions, recovered_state.pending_count);
+}
+
+void wal_log(wal_type_t type, const char *username, const char *room) {
+    if (!wal_enabled || !username || !username[0]) return;
+    wal_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    snprintf(ev.username, sizeof(ev.username), "%s", username);
+    if (room) snprintf(ev.room, sizeof(ev.room), "%s", room);
+    wal_append(&ev);
+}
+
+void wal_log_transfer(wal_type_t type, const FileMeta *meta) {
+    if (!wal_enabled) return;
+    wal_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    snprintf(ev.username, sizeof(ev.username), "%s", meta->sender);
+    snprintf(ev.recipient, sizeof(ev.recipient), "%s", meta->recipient);
+    snprintf(ev.filename, sizeof(ev.filename), "%s", meta->filename);
+    ev.filesize = meta->filesize;
+    wal_append(&ev);
+}
+
+// A client's idle timer: PING it every timeout/HEARTBEATS_PER_TIMEOUT of
+// silence (a live client answers PONG), drop it after the full timeout
+static void idle_timer_fired(void *arg) {
+    int client_index = (int)(intptr_t)arg;
+    uint64_t heartbeat_ms = idle_timeout_ms / HEARTBEATS_PER_TIMEOUT;
+    
+    pthread_mutex_lock(&readers_mutex);
+    int handing_off = parking;
+    pthread_mutex_unlock(&readers_mutex);
+    if (handing_off) {
+        // The socket may belong to the next process soon; look again later
+        timer_arm(&idle_timers[client_index], heartbeat_ms, idle_timer_fired, arg);
+        return;
+    }
+    
+    LOCK(clients_mutex);
+    if (!clients[client_index].active) {
+        UNLOCK(clients_mutex);
+        return;
+    }
+    uint64_t idle = timers_now_ms() - __atomic_load_n(&last_input_ms[client_index], __ATOMIC_RELAXED);
+    if (idle >= (uint64_t)idle_timeout_ms) {
+        log_event("[IDLE_TIMEOUT] Client %d (%s) silent for %lu ms, disconnecting", client_index,
+                  clients[client_index].username[0] ? clients[client_index].username : "unnamed",
+                  (unsigned long)idle);
+        // The reader sees EOF and cleans up as for any disconnect
+        shutdown(clients[client_index].socket, SHUT_RDWR);
+        metrics_add(METRIC_IDLE_DISCONNECTS, 1);
+        UNLOCK(clients_mutex);
+        return;
+    }
+    uint64_t delay = heartbeat_ms - idle;
+    if (idle >= heartbeat_ms) {
+        send(clients[client_index].socket, "PING\n", 5, MSG_NOSIGNAL);
+        metrics_add(METRIC_HEARTBEATS_SENT, 1);
+        delay = idle_timeout_ms - idle < heartbeat_ms ? idle_timeout_ms - idle : heartbeat_ms;
+    }
+    timer_arm(&idle_timers[client_index], delay, idle_timer_fired, arg);
+    UNLOCK(clients_mutex);
+}
+
+int start_client_reader(int client_index) {
+    pthread_t client_handler_thread;
+    int *client_index_ptr = malloc(sizeof(int));
+    if (!client_index_ptr) return -1;
+    *client_index_ptr = client_index;
+    
+    pthread_mutex_lock(&readers_mutex);
+    live_readers++;
+    pthread_mutex_unlock(&readers_mutex);
+    
+    if (pthread_create(&client_handler_thread, NULL, handle_client_read, client_index_ptr) != 0) {
+        log_event("[ERROR] Failed to create thread for client %d", client_index);
+        pthread_mutex_lock(&readers_mutex);
+        live_readers--;
+        pthread_mutex_unlock(&readers_mutex);
+        free(client_index_ptr);
+        return -1;
+    }
+    pthread_detach(client_handler_thread);
+    
+    last_input_ms[client_index] = timers_now_ms();
+    if (idle_timeout_ms > 0) {
+        timer_arm(&idle_timers[client_index], idle_timeout_ms / HEARTBEATS_PER_TIMEOUT,
+                  idle_timer_fired, (void *)(intptr_t)client_index);
+    }
+    return 0;
+}
+
+static void reader_exited(void) {
+    pthread_mutex_lock(&readers_mutex);
+    live_readers--;
+    pthread_cond_broadcast(&readers_cond);
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Undo the parking after a failed handoff and carry on serving
+static void resume_after_failed_restart(void) {
+    pthread_mutex_lock(&readers_mutex);
+    parking = 0;
+    char c;
+    read(park_pipe[0], &c, 1);
+    int parked[MAX_CLIENTS];
+    memcpy(parked, reader_parked, sizeof(parked));
+    memset(reader_parked, 0, sizeof(reader_parked));
+    parked_readers = 0;
+    pthread_mutex_unlock(&readers_mutex);
+    
+    if (wal_enabled && wal_open(wal_dir, WAL_DEFAULT_SNAPSHOT_EVERY, NULL) < 0) {
+        log_event("[HOT_RESTART_ERROR] Could not reopen write-ahead log, continuing without it");
+        wal_enabled = 0;
+    }
+    
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (parked[i] && start_client_reader(i) != 0) {
+            log_event("[HOT_RESTART_ERROR] Could not resume reader for client %d", i);
+        }
+    }
+    
+    pthread_mutex_lock(&file_queue.mutex);
+    transfers_paused = 0;
+    pthread_mutex_unlock(&file_queue.mutex);
+    while (launch_next_transfer()) {}
+    log_event("[HOT_RESTART] Aborted, old process keeps serving");
+}
+
+// SIGUSR2: hand every socket to a freshly exec'd server and exit.
+// Runs on the accept loop, so no new connections arrive meanwhile.
+void hot_restart(void) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    log_event("[HOT_RESTART] SIGUSR2 received, handing off to '%s'", exec_path);
+    
+    // Park readers between commands; unread input stays in the socket buffers
+    pthread_mutex_lock(&readers_mutex);
+    parking = 1;
+    write(park_pipe[1], "P", 1);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_PARK_TIMEOUT_MS / 1000;
+    int timed_out = 0;
+    while (parked_readers < live_readers && !timed_out) {
+        timed_out = pthread_cond_timedwait(&readers_cond, &readers_mutex, &deadline) == ETIMEDOUT;
+    }
+    int parked = parked_readers;
+    pthread_mutex_unlock(&readers_mutex);
+    if (timed_out) {
+        log_event("[HOT_RESTART_ERROR] Only %d readers parked within %d ms", parked, HANDOFF_PARK_TIMEOUT_MS);
+        resume_after_failed_restart();
+        return;
+    }
+    
+    // Queued transfers travel with the state, running ones have to finish here
+    pthread_mutex_lock(&file_queue.mutex);
+    transfers_paused = 1;
+    pthread_mutex_unlock(&file_queue.mutex);
+    int waited = 0;
+    while (1) {
+        pthread_mutex_lock(&file_queue.mutex);
+        int active = file_queue.active_transfers;
+        pthread_mutex_unlock(&file_queue.mutex);
+        if (active == 0) break;
+        if (waited >= HANDOFF_DRAIN_TIMEOUT_MS) {
+            log_event("[HOT_RESTART_ERROR] %d transfers still running after %d ms", active, waited);
+            resume_after_failed_restart();
+            return;
+        }
+        usleep(10 * 1000);
+        waited += 10;
+    }
+    
+    // The new process replays the log, so it must be complete and closed
+    if (wal_enabled) {
+        wal_sync();
+        wal_close();
+    }
+    
+    pthread_mutex_lock(&file_queue.mutex);
+    LOCK(clients_mutex);
+    LOCK(rooms_mutex);
+    handoff.listen_fd = server_fd;
+    memcpy(handoff.clients, clients, sizeof(clients));
+    memcpy(handoff.rooms, rooms, sizeof(rooms));
+    handoff.room_count = room_count;
+    handoff.queued_count = file_queue.count;
+    for (int i = 0; i < file_queue.count; i++) {
+        handoff.queued[i] = file_queue.files[(file_queue.front + i) % MAX_FILE_QUEUE];
+    }
+    handoff.session_count = session_export(handoff.sessions);
+    UNLOCK(rooms_mutex);
+    UNLOCK(clients_mutex);
+    pthread_mutex_unlock(&file_queue.mutex);
+    
+    // The new process binds the admin port itself
+    metrics_stop();
+    pid_t pid = handoff_start(exec_path, server_argv, &handoff);
+    if (pid < 0) {
+        if (metrics_port > 0) metrics_serve(metrics_port);
+        resume_after_failed_restart();
+        return;
+    }
+    
+    log_event("[HOT_RESTART] Handed %d clients, %d rooms, %d queued transfers and %d sessions to pid %d, paused %.1f ms", 
+              parked, handoff.room_count, handoff.queued_count, handoff.session_count, (int)pid, elapsed_ms(&start));
+    printf("Hot restart complete, new server pid %d\n", (int)pid);
+    // Exit without closing client sockets, the new process holds them now
+    _exit(0);
+}
+
+// New process: install the tables received from the old one
+void take_over(const handoff_state_t *st) {
+    LOCK(clients_mutex);
+    LOCK(rooms_mutex);
+    memcpy(clients, st->clients, sizeof(clients));
+    memcpy(rooms, st->rooms, sizeof(rooms));
+    room_count = st->room_count;
+    for (int i = 0; i < room_count; i++) {
+        history_open_room(i, rooms[i].name);
+        for (int m = 0; m < rooms[i].member_count; m++) {
+            int member = rooms[i].members[m];
+            presence_restore(i, rooms[i].name, member, clients[member].username);
+        }
+    }
+    UNLOCK(rooms_mutex);
+    UNLOCK(clients_mutex);
+    
+    // Resume tokens stay valid; detached sessions keep their deadline
+    session_import(st->sessions, st->session_count);
+    
+    pthread_mutex_lock(&file_queue.mutex);
+    for (int i = 0; i < st->queued_count; i++) {
+        FileMeta meta = st->queued[i];
+        int sender_idx = find_client_by_username(meta.sender);
+        int recipient_idx = find_client_by_username(meta.recipient);
+        meta.sender_socket = sender_idx != -1 ? clients[sender_idx].socket : -1;
+        meta.recipient_socket = recipient_idx != -1 ? clients[recipient_idx].socket : -1;
+        file_queue.files[i] = meta;
+    }
+    file_queue.front = 0;
+    file_queue.count = st->queued_count;
+    file_queue.rear = st->queued_count % MAX_FILE_QUEUE;
+    // Queued transfers keep the expiry they had in the old process
+    for (int i = 0; i < st->queued_count; i++) {
+        time_t waited = time(NULL) - file_queue.files[i].enqueue_time;
+        if (file_queue.files[i].queue_id >= next_queue_id) next_queue_id = file_queue.files[i].queue_id + 1;
+        arm_queue_expiry(file_queue.files[i].queue_id,
+                         waited < QUEUED_TRANSFER_EXPIRY ? (QUEUED_TRANSFER_EXPIRY - waited) * 1000 : 0);
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+}
+
+// One command or message from a client, without its newline
+static void handle_client_message(int client_index, int client_socket, char *message) {
+    // Heartbeat answers share the stream with commands
+    if (message[0] == '\0' || strcmp(message, "PONG") == 0) {
+        return;
+    }
+    // Starts after read() so time spent idle waiting for input is not counted
+    uint64_t message_span = TRACE_START();
+    size_t length = strlen(message);
+
+    if (!text_utf8_valid(message, length)) {
+        const char *reply = "[SERVER] Message rejected, text must be valid UTF-8";
+        send(client_socket, reply, strlen(reply), 0);
+        log_event("[INVALID_UTF8] Client %d sent %zu bytes that are not valid UTF-8", client_index, length);
+        TRACE_END("handle_client_read", message_span);
+        return;
+    }
+    // 0x01 opens a compressed frame (compress.h); relayed text must not be
+    // able to pass for one at a recipient that has compression on
+    if (text_find_byte(message, length, LZ_FRAME_MAGIC0)) {
+        const char *reply = "[SERVER] Message rejected, text must not contain byte 0x01";
+        send(client_socket, reply, strlen(reply), 0);
+        log_event("[INVALID_TEXT] Client %d sent a 0x01 byte", client_index);
+        TRACE_END("handle_client_read", message_span);
+        return;
+    }
+    
+    LOCK(clients_mutex);
+    log_event("[MESSAGE_RECEIVED] Client %d (%s): %s [%zu bytes]", 
+              client_index, 
+              clients[client_index].username[0] ? clients[client_index].username : "unnamed",
+              message, length);
+    UNLOCK(clients_mutex);
+    
+    printf("Client %d: %s\n", client_index, message);
+    
+    if (message[0] == '/') {
+        log_event("[COMMAND] Processing command from client %d: %s", client_index, message);
+        handle_command(client_socket, message);
+    }
+    else if (strncmp(message, "FILE_EXISTS", 11) == 0) {
+        log_event("[FILE] Conflict: '%s' received twice -> renamed by client",
+                  message[11] ? message + 12 : "?");
+    }
+    else {
+        // if not a command, warn the user for entering a command
+        char response[BUFFER_SIZE*2];
+        snprintf(response, sizeof(response), "Unknown command: '%s'. Type /help for available commands.", message);
+        send(client_socket, response, strlen(response), 0);
+        log_event("[UNKNOWN_COMMAND] Client %d sent invalid command: %s", client_index, message);
+    }
+    TRACE_END("handle_client_read", message_span);
+}
+
 void *handle_client_read(void *arg) {
     int client_index = *(int *)arg;
     free(arg);  // Free the allocated memory immediately
     
-    pthread_mutex_lock(&clients_mutex);
+    LOCK(clients_mutex);
     int client_socket = clients[client_index].socket;
     int is_active = clients[client_index].active;
-    pthread_mutex_unlock(&clients_mutex);
+    UNLOCK(clients_mutex);
     
     if (!is_active) {
+        reader_exited();
         return NULL;
     }
     
     char buffer[BUFFER_SIZE];
     int bytes_read;
+    int carried = 0;        // start of a command cut off by the last read
+    
+    // Picked up after a hot restart (or an aborted one) from the parked reader
+    pthread_mutex_lock(&readers_mutex);
+    carried = handoff.carried_len[client_index];
+    memcpy(buffer, handoff.carried[client_index], carried);
+    handoff.carried_len[client_index] = 0;
+    pthread_mutex_unlock(&readers_mutex);
     
     while (1) {
         // Check if client is still active before reading
-        pthread_mutex_lock(&clients_mutex);
-        if (!clients[client_index].active) {
-            pthread_mutex_unlock(&clients_mutex);
+        LOCK(clients_mutex);
+        if (!clients[client_index].active || data_connection[client_index]) {
+            UNLOCK(clients_mutex);
             break;
         }
-        pthread_mutex_unlock(&clients_mutex);
+        UNLOCK(clients_mutex);
         
-        bytes_read = read(client_socket, buffer, BUFFER_SIZE - 1);
-        if (bytes_read <= 0) {
+        struct pollfd pfds[2] = {
+            { .fd = client_socket, .events = POLLIN },
+            { .fd = park_pipe[0], .events = POLLIN }
+        };
+        // A line-framed client's tail waits for its newline; a bare command
+        // from an older client runs once the connection goes quiet
+        int wait_ms = carried > 0 && !clients[client_index].line_framed ? BARE_COMMAND_WAIT_MS : -1;
+        int ready = poll(pfds, 2, wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
             break;
         }
+        if (ready == 0) {
+            buffer[carried] = '\0';
+            carried = 0;
+            handle_client_message(client_index, client_socket, buffer);
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            // Hot restart: leave the socket and its unread input to the next process
+            pthread_mutex_lock(&readers_mutex);
+            if (parking) {
+                memcpy(handoff.carried[client_index], buffer, carried);
+                handoff.carried_len[client_index] = carried;
+                reader_parked[client_index] = 1;
+                parked_readers++;
+                pthread_cond_broadcast(&readers_cond);
+                pthread_mutex_unlock(&readers_mutex);
+                return NULL;
+            }
+            pthread_mutex_unlock(&readers_mutex);
+            if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        }
         
+        bytes_read = read(client_socket, buffer + carried, BUFFER_SIZE - 1 - carried);
+        if (bytes_read <= 0) {
+            // A last command the client wrote without a newline before closing
+            if (bytes_read == 0 && carried > 0) {
+                buffer[carried] = '\0';
+                handle_client_message(client_index, client_socket, buffer);
+            }
+            break;
+        }
+        __atomic_store_n(&last_input_ms[client_index], timers_now_ms(), __ATOMIC_RELAXED);
+        bytes_read += carried;
+        carried = 0;
         buffer[bytes_read] = '\0';
         
-        // Remove newline if present
-        char *newline = strchr(buffer, '\n');
-        if (newline) *newline = '\0';
-        
-        pthread_mutex_lock(&clients_mutex);
-        log_event("[MESSAGE_RECEIVED] Client %d (%s): %s [%d bytes]", 
-                  client_index, 
-                  clients[client_index].username[0] ? clients[client_index].username : "unnamed",
-                  buffer, bytes_read);
-        pthread_mutex_unlock(&clients_mutex);
-        
-        printf("Client %d: %s\n", client_index, buffer);
-        
-        if (buffer[0] == '/') {
-            log_event("[COMMAND] Processing command from client %d: %s", client_index, buffer);
-            handle_command(client_socket, buffer);
-        }
-        else if (strncmp(buffer, "FILE_EXISTS", 11) == 0) {
-            log_event("[FILE] Conflict: '%s' received twice -> renamed by client", buffer + 12);
-        }
-        else {
-            // if not a command, warn the user for entering a command
-            char response[BUFFER_SIZE*2];
-            snprintf(response, sizeof(response), "Unknown command: '%s'. Type /help for available commands.", buffer);
-            send(client_socket, response, strlen(response), 0);
-            log_event("[UNKNOWN_COMMAND] Client %d sent invalid command: %s", client_index, buffer);
+        // A read can hold several commands from a client sending back to
+        // back, one per line. Whatever follows the last newline waits in
+        // the buffer for the rest; only a full buffer with no newline at
+        // all runs as it is, since nothing more fits.
+        char *line = buffer, *end = buffer + bytes_read;
+        while (line < end && !data_connection[client_index]) {
+            char *newline = text_find_byte(line, end - line, '\n');
+            if (!newline && end - line < BUFFER_SIZE - 1) {
+                carried = end - line;
+                memmove(buffer, line, carried);
+                break;
+            }
+            char *next = newline ? newline + 1 : end;
+            if (newline) {
+                *newline = '\0';
+                clients[client_index].line_framed = 1;
+            }
+            handle_client_message(client_index, client_socket, line);
+            line = next;
         }
     }
     
+    timer_cancel(&idle_timers[client_index]);
+    if (data_connection[client_index]) {
+        // The socket now carries a transfer (cmd_data): free the slot only
+        LOCK(clients_mutex);
+        data_connection[client_index] = 0;
+        clients[client_index].socket = -1;
+        clients[client_index].active = 0;
+        UNLOCK(clients_mutex);
+        metrics_gauge_add(METRIC_ACTIVE_CONNECTIONS, -1);
+        reader_exited();
+        return NULL;
+    }
+    
     // Client disconnected
-    pthread_mutex_lock(&clients_mutex);
+    LOCK(clients_mutex);
     log_event("[DISCONNECT] Client %d (%s) disconnected", 
               client_index, 
               clients[client_index].username[0] ? clients[client_index].username : "unnamed");
     printf("Client %d disconnected\n", client_index);
     
-    pthread_mutex_lock(&rooms_mutex);
+    if (clients[client_index].raw_bytes > 0) {
+        log_event("[COMPRESS] Client %d (%s): %lu -> %lu bytes, %.3f ms CPU", client_index,
+                  clients[client_index].username, (unsigned long)clients[client_index].raw_bytes,
+                  (unsigned long)clients[client_index].wire_bytes, clients[client_index].compress_ns / 1e6);
+    }
+    
+    // A client holding a session token gets SESSION_RESUME_WINDOW to come
+    // back: its name stays claimed and the WAL still has it in its room
+    int detached = running && clients[client_index].username[0] &&
+                   session_detach(client_index, &clients[client_index]);
+    if (detached) {
+        log_event("[SESSION_DETACHED] Client %d (%s) can resume in room '%s' for %d s", client_index,
+                  clients[client_index].username, clients[client_index].current_room, SESSION_RESUME_WINDOW);
+    }
+    
+    // During shutdown keep the session so a restart can restore it
+    if (running && !detached) {
+        wal_log(WAL_DISCONNECT, clients[client_index].username, NULL);
+    }
+    
+    LOCK(rooms_mutex);
     remove_client_from_room(client_index);
-    pthread_mutex_unlock(&rooms_mutex);
+    UNLOCK(rooms_mutex);
+    if (cluster_enabled && clients[client_index].username[0] && !detached) {
+        bus_release_user(clients[client_index].username);
+    }
+    if (mesh_enabled && clients[client_index].username[0] && !detached) {
+        mesh_release_user(clients[client_index].username);
+    }
     
     clients[client_index].active = 0;
     close(clients[client_index].socket);
     clients[client_index].socket = -1;
-    pthread_mutex_unlock(&clients_mutex);
+    UNLOCK(clients_mutex);
     
     log_event("[CLEANUP] Client %d resources cleaned up", client_index);
+    metrics_gauge_add(METRIC_ACTIVE_CONNECTIONS, -1);
+    reader_exited();
     return NULL;
 }
 
@@ -331,373 +1049,853 @@ int validate_file_type(const char *filename) {
     return 0; 
 }
 
+// Same rule as the client: letters, digits and '_', short enough to fit
+// the room name buffers with their terminator
 int validate_room_name(const char *room_name) {
-    if (!room_name || strlen(room_name) == 0) {
-        return 0; // Empty room name
+    return text_is_name(room_name, 1, MAX_GROUP_NAME_LENGTH - 1);
+}
+
+typedef void (*command_handler_t)(int client_socket, int client_index, char *args);
+
+static void cmd_username(int client_socket, int client_index, char *args);
+static void cmd_join(int client_socket, int client_index, char *args);
+static void cmd_broadcast(int client_socket, int client_index, char *args);
+static void cmd_leave(int client_socket, int client_index, char *args);
+static void cmd_whisper(int client_socket, int client_index, char *args);
+static void cmd_sendfile(int client_socket, int client_index, char *args);
+static void cmd_list(int client_socket, int client_index, char *args);
+static void cmd_exit(int client_socket, int client_index, char *args);
+static void cmd_help(int client_socket, int client_index, char *args);
+static void cmd_history(int client_socket, int client_index, char *args);
+static void cmd_compress(int client_socket, int client_index, char *args);
+static void cmd_presence(int client_socket, int client_index, char *args);
+static void cmd_typing(int client_socket, int client_index, char *args);
+static void cmd_data(int client_socket, int client_index, char *args);
+static void cmd_session(int client_socket, int client_index, char *args);
+static void cmd_resume(int client_socket, int client_index, char *args);
+
+// Indexed by the opcode from command_lookup()
+static const command_handler_t command_handlers[CMD_COUNT] = {
+    [CMD_USERNAME]  = cmd_username,
+    [CMD_JOIN]      = cmd_join,
+    [CMD_BROADCAST] = cmd_broadcast,
+    [CMD_LEAVE]     = cmd_leave,
+    [CMD_WHISPER]   = cmd_whisper,
+    [CMD_SENDFILE]  = cmd_sendfile,
+    [CMD_LIST]      = cmd_list,
+    [CMD_EXIT]      = cmd_exit,
+    [CMD_HELP]      = cmd_help,
+    [CMD_HISTORY]   = cmd_history,
+    [CMD_COMPRESS]  = cmd_compress,
+    [CMD_PRESENCE]  = cmd_presence,
+    [CMD_TYPING]    = cmd_typing,
+    [CMD_DATA]      = cmd_data,
+    [CMD_SESSION]   = cmd_session,
+    [CMD_RESUME]    = cmd_resume,
+};
+
+// Split off the first space separated word of *args in place (strtok(" ") semantics)
+static char *next_token(char **args) {
+    char *p = *args;
+    while (*p == ' ') p++;
+    if (*p == '\0') {
+        *args = p;
+        return NULL;
+    }
+    char *end = text_find_delim(p);
+    if (*end == ' ') {
+        *end = '\0';
+        *args = end + 1;
+    } else {
+        *args = end;
+    }
+    return p;
+}
+
+void handle_command(int client_socket, char *message) {
+    uint64_t start_ns = metrics_now_ns();
+    uint64_t command_span = TRACE_START();
+    uint64_t span = TRACE_START();
+    int client_index = find_client_by_socket(client_socket);
+    TRACE_END("find_client", span);
+    if (client_index == -1) {
+        log_event("[ERROR] Could not find client by socket %d", client_socket);
+        return;
+    }
+    
+    // Parse in place: terminate the command word, args point just past it
+    span = TRACE_START();
+    size_t cmd_len = strcspn(message, " ");
+    char *args = message + cmd_len;
+    if (*args == ' ') {
+        *args++ = '\0';
+    }
+    TRACE_END("parse", span);
+    
+    log_event("[COMMAND_PARSE] Client %d executing command: %s", client_index, message);
+    
+    span = TRACE_START();
+    command_id_t id = command_lookup(message, cmd_len);
+    TRACE_END("lookup", span);
+    if (id == CMD_UNKNOWN) {
+        char response[BUFFER_SIZE];
+        strcpy(response, "[SERVER] Unknown command. Type /help for available commands.");
+        send(client_socket, response, strlen(response), 0);
+        log_event("[UNKNOWN_COMMAND] Client %d sent unrecognized command: %s", client_index, message);
+        metrics_observe_command(id, metrics_now_ns() - start_ns);
+        TRACE_END("handle_command", command_span);
+        return;
+    }
+    
+    span = TRACE_START();
+    command_handlers[id](client_socket, client_index, args);
+    TRACE_END(command_name(id), span);
+    metrics_observe_command(id, metrics_now_ns() - start_ns);
+    TRACE_END("handle_command", command_span);
+}
+
+static void cmd_username(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *username = next_token(&args);
+    int registered = 0;
+    char restore_room[MAX_GROUP_NAME_LENGTH] = {0};
+    if (username && !text_is_name(username, 3, MAX_USERNAME_LENGTH - 1)) {
+        // Names become mailbox and history file names, so hold the server
+        // to the client's rule too
+        snprintf(response, sizeof(response), "[SERVER] Invalid username. Use 3-%d letters, digits or underscores",
+                 MAX_USERNAME_LENGTH - 1);
+        log_event("[COMMAND_ERROR] Client %d sent invalid username: %s", client_index, username);
+    } else if (username) {
+        // The mesh directory may be on another node, ask before locking
+        int mesh_claimed = !mesh_enabled || mesh_claim_user(username) == 0;
+        LOCK(clients_mutex);
+        // Check if username already exists
+        // In a cluster the name must also be free on the other nodes
+        if (find_client_by_username(username) != -1 || session_held(username) || !mesh_claimed ||
+            (cluster_enabled && bus_claim_user(username) < 0)) {
+            snprintf(response, sizeof(response), "ALREADY_TAKEN");
+            log_event("[USERNAME_TAKEN] Client %d tried to use taken username: %s", 
+                     client_index, username);
+        } else {
+            char old_username[MAX_USERNAME_LENGTH];
+            strcpy(old_username, clients[client_index].username);
+            strncpy(clients[client_index].username, username, MAX_USERNAME_LENGTH - 1);
+            clients[client_index].username[MAX_USERNAME_LENGTH - 1] = '\0';
+            snprintf(response, sizeof(response), "SET_USERNAME");
+            if (old_username[0]) {
+                session_end(client_index);
+                wal_log(WAL_DISCONNECT, old_username, NULL);
+                if (cluster_enabled) bus_release_user(old_username);
+                if (mesh_enabled) mesh_release_user(old_username);
+            }
+            wal_log(WAL_USERNAME_SET, username, NULL);
+            // Renamed inside a room: the room's member list follows the new name
+            const char *room = clients[client_index].current_room;
+            if (room[0]) {
+                presence_rename(client_index, username);
+                wal_log(WAL_JOIN, username, room);
+                if (cluster_enabled) bus_set_room(username, room);
+                if (mesh_enabled) mesh_set_room(username, room);
+            }
+            
+            // A session that was live when the server went down gets its room back
+            const wal_session_t *session = wal_state_session(&recovered_state, username);
+            if (session && session->room[0] && !clients[client_index].current_room[0]) {
+                strcpy(restore_room, session->room);
+                wal_event_t consumed = { .type = WAL_LEAVE };
+                strcpy(consumed.username, username);
+                wal_state_apply(&recovered_state, &consumed);
+            }
+            log_event("[USERNAME_SET] Client %d changed username from '%s' to '%s'", 
+                     client_index, 
+                     old_username[0] ? old_username : "unnamed", 
+                     username);
+            registered = 1;
+        }
+        UNLOCK(clients_mutex);
+    } else {
+        strcpy(response, "[SERVER] Usage: /username <name>");
+        log_event("[COMMAND_ERROR] Client %d sent invalid username command", client_index);
+    }
+    send(client_socket, response, strlen(response), 0);
+    
+    if (registered) {
+        mailbox_deliver(username, client_socket);
+    }
+    
+    if (restore_room[0]) {
+        int room_index = join_room(client_index, restore_room);
+        snprintf(response, sizeof(response), "[SERVER] Restored your session in room '%s'", restore_room);
+        send(client_socket, response, strlen(response), 0);
+        log_event("[SESSION_RESTORE] Client %d (%s) rejoined room '%s' after restart", 
+                 client_index, username, restore_room);
+        if (room_index != -1) {
+            history_replay(room_index, client_socket, 0, HISTORY_REPLAY_COUNT);
+        }
+    }
+}
+
+static void cmd_session(int client_socket, int client_index, char *args) {
+    (void)args;
+    char response[BUFFER_SIZE];
+    LOCK(clients_mutex);
+    char username[MAX_USERNAME_LENGTH];
+    strcpy(username, clients[client_index].username);
+    UNLOCK(clients_mutex);
+    
+    uint64_t token = username[0] ? session_issue(client_index, username) : 0;
+    if (token) {
+        snprintf(response, sizeof(response), "SESSION %0*llx", SESSION_TOKEN_HEX, (unsigned long long)token);
+        log_event("[SESSION] Client %d (%s) issued a session token", client_index, username);
+    } else if (username[0]) {
+        strcpy(response, "[SERVER] No session slots free, try again later");
+        log_event("[SESSION_ERROR] No session slot for client %d (%s)", client_index, username);
+    } else {
+        strcpy(response, "[SERVER] Set a username before asking for a session");
+    }
+    send(client_socket, response, strlen(response), 0);
+}
+
+// "/resume <username> <token>" as the first frame of a new connection:
+// take over a dropped session, rejoin its room and flush what it missed
+static void cmd_resume(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *username = next_token(&args);
+    char *token_arg = next_token(&args);
+    uint64_t token = token_arg ? strtoull(token_arg, NULL, 16) : 0;
+    session_t *session = malloc(sizeof(session_t));
+    int owner = -1;
+    int result = SESSION_UNKNOWN;
+    
+    LOCK(clients_mutex);
+    if (session && username && token && !clients[client_index].username[0] &&
+        text_is_name(username, 3, MAX_USERNAME_LENGTH - 1)) {
+        result = session_resume(client_index, username, token, session, &owner);
+    }
+    if (result >= 0) {
+        strcpy(clients[client_index].username, username);
+        clients[client_index].compress = session->compress;
+        clients[client_index].presence = session->presence;
+    } else if (result == SESSION_ATTACHED && clients[owner].active) {
+        // The client noticed the drop before we did; the reader cleaning up
+        // the old connection detaches the session for the next attempt
+        shutdown(clients[owner].socket, SHUT_RDWR);
+    }
+    UNLOCK(clients_mutex);
+    
+    if (result == SESSION_ATTACHED) {
+        send(client_socket, "RESUME_RETRY\n", 13, 0);
+        log_event("[SESSION_RESUME] Client %d resuming '%s' before the old connection closed, retry", 
+                  client_index, username);
+        free(session);
+        return;
+    }
+    if (result < 0) {
+        send(client_socket, "RESUME_FAILED\n", 14, 0);
+        log_event("[SESSION_RESUME_ERROR] Client %d sent an unknown or expired session", client_index);
+        free(session);
+        return;
+    }
+    
+    snprintf(response, sizeof(response), "RESUMED %s %s\n", username, session->room[0] ? session->room : "-");
+    send(client_socket, response, strlen(response), 0);
+    if (session->room[0]) join_room(client_index, session->room);
+    
+    // Everything buffered goes out in one write, like a history replay
+    if (result > 0 || session->dropped > 0) {
+        struct iovec iov[2];
+        iov[0].iov_base = response;
+        iov[0].iov_len = snprintf(response, sizeof(response), "[SESSION] %d message(s) arrived while you were away%s:\n",
+                                  result, session->dropped ? " (older ones dropped)" : "");
+        iov[1].iov_base = session->buffer;
+        iov[1].iov_len = session->buffered;
+        writev(client_socket, iov, 2);
+    }
+    mailbox_deliver(username, client_socket);
+    metrics_add(METRIC_SESSIONS_RESUMED, 1);
+    log_event("[SESSION_RESUME] Client %d resumed '%s' in room '%s', %d buffered message(s) flushed, %d dropped", 
+              client_index, username, session->room, result, session->dropped);
+    free(session);
+}
+
+// Timer thread: a detached session was not resumed in time
+void session_expired(const char *username) {
+    LOCK(clients_mutex);
+    // The name may have been registered again since the session let go of it
+    if (find_client_by_username((char *)username) == -1) {
+        wal_log(WAL_DISCONNECT, username, NULL);
+        if (cluster_enabled) bus_release_user(username);
+        if (mesh_enabled) mesh_release_user(username);
+    }
+    UNLOCK(clients_mutex);
+    metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+}
+
+static void cmd_join(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *room_name = next_token(&args);
+    int room_index = -1;
+    if (room_name && strlen(room_name) > 0) {
+        // Validate room name
+        if (!validate_room_name(room_name)) {
+            strcpy(response, "[SERVER] Invalid room name. Use 1-31 letters, digits or underscores");
+            log_event("[COMMAND_ERROR] Client %d tried to join invalid room name: '%s'", 
+                     client_index, room_name);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+        
+        room_index = join_room(client_index, room_name);
+        snprintf(response, sizeof(response), "[SERVER] Joined room '%s'", room_name);
+    } else {
+        strcpy(response, "[SERVER] Usage: /join <room_name>");
+        log_event("[COMMAND_ERROR] Client %d sent invalid join command", client_index);
+    }
+    send(client_socket, response, strlen(response), 0);
+    
+    // Catch the new member up on what was said before
+    if (room_index != -1) {
+        int replayed = history_replay(room_index, client_socket, 0, HISTORY_REPLAY_COUNT);
+        log_event("[HISTORY_REPLAY] Sent %d earlier message(s) to client %d", replayed, client_index);
     }
+}
+
+// Move client_index from its current room into room_name, returns the room index
+int join_room(int client_index, const char *room_name) {
+    LOCK(clients_mutex);
+    LOCK(rooms_mutex);
     
-    size_t len = strlen(room_name);
-    if (len > 32) {
-        return 0; // Too long
+    char old_room[MAX_GROUP_NAME_LENGTH];
+    strcpy(old_room, clients[client_index].current_room);
+    
+    // Remove from current room
+    remove_client_from_room(client_index);
+    if (old_room[0]) {
+        log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", 
+                 client_index, clients[client_index].username, old_room);
     }
     
-    // Check each character is alphanumeric
-    for (size_t i = 0; i < len; i++) {
-        if (!isalnum(room_name[i])) {
-            return 0; // Non-alphanumeric character found
+    // Add to new room
+    add_client_to_room(client_index, (char *)room_name);
+    strncpy(clients[client_index].current_room, room_name, MAX_GROUP_NAME_LENGTH - 1);
+    clients[client_index].current_room[MAX_GROUP_NAME_LENGTH - 1] = '\0';
+    log_event("[ROOM_JOIN] Client %d (%s) joined room '%s'", 
+             client_index, clients[client_index].username, room_name);
+    wal_log(WAL_JOIN, clients[client_index].username, room_name);
+    int room_index = find_room_index(room_name);
+    
+    UNLOCK(rooms_mutex);
+    UNLOCK(clients_mutex);
+    return room_index;
+}
+
+static void cmd_broadcast(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    // Everything after "/broadcast " is the message
+    if (strlen(args) > 0) {
+        char *msg = args;
+        
+        LOCK(clients_mutex);
+        char current_room[MAX_GROUP_NAME_LENGTH];
+        char username[MAX_USERNAME_LENGTH];
+        strcpy(current_room, clients[client_index].current_room);
+        strcpy(username, clients[client_index].username);
+        UNLOCK(clients_mutex);
+        
+        if (strlen(current_room) > 0) {
+            char formatted_msg[BUFFER_SIZE + 100];
+            snprintf(formatted_msg, sizeof(formatted_msg), "[BROADCAST] %s: %s", username, msg);
+            
+            log_event("[BROADCAST_START] Client %d (%s) broadcasting to room '%s': %s", 
+                     client_index, username, current_room, msg);
+            
+            broadcast_to_room(formatted_msg, current_room, client_socket);
+            if (cluster_enabled) {
+                bus_broadcast(current_room, formatted_msg, strlen(formatted_msg));
+            }
+            if (mesh_enabled) {
+                mesh_broadcast(current_room, formatted_msg, strlen(formatted_msg));
+            }
+            strcpy(response, "[SERVER] Message broadcasted");
+            
+            log_event("[BROADCAST_COMPLETE] Message from %s broadcasted to room '%s'", 
+                     username, current_room);
+        } else {
+            strcpy(response, "[SERVER] You must join a room first");
+            log_event("[BROADCAST_ERROR] Client %d tried to broadcast without joining room", 
+                     client_index);
         }
+    } else {
+        strcpy(response, "[SERVER] Usage: /broadcast <message>");
+        log_event("[COMMAND_ERROR] Client %d sent empty broadcast command", client_index);
+    }
+    send(client_socket, response, strlen(response), 0);
+}
+
+static void cmd_leave(int client_socket, int client_index, char *args) {
+    (void)args;
+    char response[BUFFER_SIZE];
+    LOCK(clients_mutex);
+    LOCK(rooms_mutex);
+    if (strlen(clients[client_index].current_room) > 0) {
+        char old_room[MAX_GROUP_NAME_LENGTH];
+        strcpy(old_room, clients[client_index].current_room);
+        remove_client_from_room(client_index);
+        memset(clients[client_index].current_room, 0, MAX_GROUP_NAME_LENGTH);
+        snprintf(response, sizeof(response), "ROOM_LEFT");
+        wal_log(WAL_LEAVE, clients[client_index].username, old_room);
+        log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", 
+                client_index, clients[client_index].username, old_room);
+    } else {
+        strcpy(response, "[SERVER] You are not in a room");
+        log_event("[COMMAND_ERROR] Client %d (%s) tried to leave without being in a room", 
+                client_index, clients[client_index].username);
+    }
+    UNLOCK(rooms_mutex);
+    UNLOCK(clients_mutex);
+    send(client_socket, response, strlen(response), 0);
+}
+
+static void cmd_whisper(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *target_user = next_token(&args);
+    char *msg = *args ? args : NULL; // Rest of the message
+    if (target_user && msg) {
+        LOCK(clients_mutex);
+        char sender_username[MAX_USERNAME_LENGTH];
+        strcpy(sender_username, clients[client_index].username);
+        UNLOCK(clients_mutex);
+        
+        char formatted_msg[BUFFER_SIZE + 100];
+        snprintf(formatted_msg, sizeof(formatted_msg), "[WHISPER from %s]: %s", 
+                sender_username, msg);
+        
+        log_event("[WHISPER_START] Client %d (%s) whispering to '%s': %s", 
+                 client_index, sender_username, target_user, msg);
+        
+        send_private_message(formatted_msg, target_user, client_socket);
+        snprintf(response, sizeof(response), "[SERVER] Whisper sent to %s", target_user);
+        
+        log_event("[WHISPER_COMPLETE] Whisper from %s to %s processed", 
+                 sender_username, target_user);
+    } else {
+        strcpy(response, "[SERVER] Usage: /whisper <username> <message>");
+        log_event("[COMMAND_ERROR] Client %d sent invalid whisper command", client_index);
+    }
+    send(client_socket, response, strlen(response), 0);
+}
+
+static void cmd_sendfile(int client_socket, int client_index, char *args) {
+    char recipient[32] = {0}, filename[MAX_FILENAME_LENGTH] = {0}, size_buffer[64] = {0};
+    unsigned int transfer_id = 0, streams = 0, checksum = 0, delta = 0;
+    
+    // Refuse names that do not fit MAX_FILENAME_LENGTH, which a queued
+    // transfer keeps in the WAL, instead of letting sscanf cut them and
+    // shift the words after them
+    const char *name = args + strspn(args, " ");
+    size_t name_len = strcspn(name, " ");
+    if (name_len >= MAX_FILENAME_LENGTH) {
+        unsigned int id = 0;
+        sscanf(name + name_len, "%*s %*s %u", &id);
+        send_transfer_reply(client_socket, "INVALID_FILE_TYPE", id);
+        log_event("[FILE_TRANSFER_ERROR] File name of %zu characters from %s is too long",
+                  name_len, clients[client_index].username);
+        return;
+    }
+    
+    if (strlen(args) > 0) {
+        sscanf(args, "%127s %31s %63s %u %u %x %u", filename, recipient, size_buffer, &transfer_id,
+               &streams, &checksum, &delta);
     }
+    if (streams > MAX_TRANSFER_STREAMS) streams = MAX_TRANSFER_STREAMS;
+
+    log_event("[FILE_TRANSFER_START] Client %d (%s) initiating file transfer to '%s', file: %s", 
+             client_index, clients[client_index].username, recipient, filename);
+
+    if (strlen(recipient) == 0 || strlen(filename) == 0) {
+        send(client_socket, "[SERVER] Usage: /sendfile <recipient> <filename> <size>\n", 56, 0);
+        log_event("[FILE_TRANSFER_ERROR] Client %d sent invalid file transfer command", client_index);
+        return;
+    }
+
+    if (!validate_file_type(filename)) {
+        send_transfer_reply(client_socket, "INVALID_FILE_TYPE", transfer_id);
+        log_event("[FILE_TRANSFER_ERROR] Invalid file type '%s' from %s", filename, clients[client_index].username);
+        return;
+    }
+
+    // Find recipient first
+    int recp_idx = find_client_by_username(recipient);
+    if (recp_idx < 0) {
+        send_transfer_reply(client_socket, "RECIPIENT_NOT_FOUND", transfer_id);
+        log_event("[FILE_TRANSFER_ERROR] Recipient '%s' not found for file from %s", 
+                 recipient, clients[client_index].username);
+        return;
+    }
+
+    // Check if recipient is online
+    LOCK(clients_mutex);
+    if (!clients[recp_idx].active) {
+        UNLOCK(clients_mutex);
+        send_transfer_reply(client_socket, "RECIPIENT_OFFLINE", transfer_id);
+        log_event("[FILE_TRANSFER_ERROR] Recipient '%s' is offline", recipient);
+        return;
+    }
+    int recipient_socket = clients[recp_idx].socket;
+    UNLOCK(clients_mutex);
+
+    // Get filesize
+    size_t filesize = atol(size_buffer);
     
-    return 1; // Valid room name
+    log_event("[FILE_TRANSFER] File metadata received - size: %zu bytes", filesize);
+
+    // Check file size limit
+    if (filesize > MAX_FILE_SIZE) {
+        send_transfer_reply(client_socket, "FILE_SIZE_EXCEEDS_LIMIT", transfer_id);
+        log_event("[FILE_TRANSFER_ERROR] File size %zu exceeds limit for %s", filesize, clients[client_index].username);
+        return;
+    }
+
+    // Create file metadata for queue
+    FileMeta file_meta;
+    memset(&file_meta, 0, sizeof(file_meta));
+    LOCK(clients_mutex);
+    strncpy(file_meta.sender, clients[client_index].username, sizeof(file_meta.sender) - 1);
+    file_meta.sender[sizeof(file_meta.sender) - 1] = '\0';
+    UNLOCK(clients_mutex);
+    
+    strncpy(file_meta.recipient, recipient, sizeof(file_meta.recipient) - 1);
+    file_meta.recipient[sizeof(file_meta.recipient) - 1] = '\0';
+    strncpy(file_meta.filename, filename, sizeof(file_meta.filename) - 1);
+    file_meta.filename[sizeof(file_meta.filename) - 1] = '\0';
+    file_meta.filesize = filesize;
+    file_meta.sender_socket = client_socket;
+    file_meta.recipient_socket = recipient_socket;
+    file_meta.queued_ns = metrics_now_ns();
+    file_meta.enqueue_time = time(NULL);
+    file_meta.transfer_id = transfer_id;
+    file_meta.streams = streams;
+    file_meta.checksum = checksum;
+    file_meta.delta = delta && transfer_id && streams;
+    
+    // Try to start transfer immediately or queue it
+    if (filequeue_start_transfer(&file_queue, &file_meta)) {
+        // Transfer can start immediately
+        log_event("[FILE_TRANSFER] Starting immediate transfer: %s -> %s", 
+                 file_meta.sender, recipient);
+        printf("[FILE_TRANSFER] Starting immediate transfer: %s -> %s\n", 
+               file_meta.sender, recipient);
+        start_file_transfer(&file_meta);
+    } else {
+        // Transfer was queued - handled inside filequeue_start_transfer
+        log_event("[FILE_TRANSFER] Transfer queued for %s -> %s", file_meta.sender, recipient);
+    }
+}
+
+// The first command of a transfer's data connection. Once the token
+// matches, the socket belongs to the relay and the reader lets go of it.
+static void cmd_data(int client_socket, int client_index, char *args) {
+    char *token_arg = next_token(&args);
+    char *stream_arg = next_token(&args);
+    uint64_t token = token_arg ? strtoull(token_arg, NULL, 16) : 0;
+    int stream = stream_arg ? atoi(stream_arg) : 0;
+    const char *role = NULL;
+    
+    LOCK(clients_mutex);
+    int registered = clients[client_index].username[0] != '\0';
+    UNLOCK(clients_mutex);
+    
+    pthread_mutex_lock(&file_queue.mutex);
+    for (int i = 0; i < MAX_SIMULTANEOUS_TRANSFERS && token && !registered && !role; i++) {
+        transfer_watch_t *watch = &transfer_watches[i];
+        if (!watch->used || stream < 0 || stream >= watch->streams) continue;
+        int *fd = watch->sender_token == token ? &watch->sender_fd[stream] :
+                  watch->recipient_token == token ? &watch->recipient_fd[stream] : NULL;
+        if (!fd || *fd >= 0) continue;
+        // Acknowledge before the relay can write file data behind it
+        send(client_socket, "DATA_OK\n", 8, MSG_NOSIGNAL);
+        *fd = client_socket;
+        role = fd == &watch->sender_fd[stream] ? "sender" : "recipient";
+        data_connection[client_index] = 1;     // only this reader thread looks at it
+        pthread_cond_broadcast(&data_attached_cond);
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+    
+    if (role) {
+        log_event("[FILE_TRANSFER] Client %d attached as %s data connection %d", client_index, role, stream);
+    } else {
+        send(client_socket, "DATA_REJECTED\n", 14, MSG_NOSIGNAL);
+        log_event("[FILE_TRANSFER_ERROR] Client %d sent an unknown data token", client_index);
+    }
+}
+
+static void cmd_list(int client_socket, int client_index, char *args) {
+    (void)args;
+    char response[BUFFER_SIZE];
+    LOCK(clients_mutex);
+    char current_room[MAX_GROUP_NAME_LENGTH];
+    strcpy(current_room, clients[client_index].current_room);
+    UNLOCK(clients_mutex);
+    
+    log_event("[LIST_COMMAND] Client %d (%s) requesting user list for room '%s'", 
+             client_index, clients[client_index].username, current_room);
+    
+    // Served from the presence snapshot, rebuilt only when membership changed;
+    // a cluster lists the members on every node from the shared directory
+    uint64_t version = 0;
+    int user_count = strlen(current_room) > 0 ?
+                     presence_list(client_index, response, sizeof(response), &version) : -1;
+    if (user_count >= 0 && (cluster_enabled || mesh_enabled)) {
+        int prefix = snprintf(response, sizeof(response), "[SERVER] Users in room: ");
+        user_count = cluster_enabled ?
+                     bus_room_members(current_room, response + prefix, sizeof(response) - prefix) :
+                     mesh_room_members(current_room, response + prefix, sizeof(response) - prefix);
+    }
+    if (user_count >= 0) {
+        log_event("[LIST_RESULT] Room '%s' has %d active users (version %lu)", 
+                 current_room, user_count, (unsigned long)version);
+    } else {
+        strcpy(response, "[SERVER] You must join a room first");
+        log_event("[LIST_ERROR] Client %d tried to list users without joining room", 
+                 client_index);
+    }
+    send(client_socket, response, strlen(response), 0);
+}
+
+static void cmd_exit(int client_socket, int client_index, char *args) {
+    (void)args;
+    char response[BUFFER_SIZE];
+    strcpy(response, "[SERVER] Goodbye!");
+    send(client_socket, response, strlen(response), 0);
+    session_end(client_index);
+    LOCK(clients_mutex);
+    clients[client_index].active = 0;
+    UNLOCK(clients_mutex);
+    log_event("[EXIT] Client %d (%s) disconnected voluntarily", 
+             client_index, clients[client_index].username);
+}
+
+static void cmd_help(int client_socket, int client_index, char *args) {
+    (void)args;
+    char response[BUFFER_SIZE];
+    strcpy(response, "[SERVER] Available commands:\n"
+                    "/username <name> - Set your username\n"
+                    "/join <room> - Join a chat room\n"
+                    "/leave - Leave current room\n"
+                    "/broadcast <msg> - Send message to room\n"
+                    "/whisper <user> <msg> - Private message\n"
+                    "/sendfile <user> <file> <size> - Send file\n"
+                    "/list - List users in current room\n"
+                    "/history [offset] [limit] - Show earlier room messages\n"
+                    "/compress on|off|stats - Compress large messages to you\n"
+                    "/presence on|off - Get room join/leave/typing updates\n"
+                    "/typing [on|off] - Tell the room you are typing\n"
+                    "/session - Get a token to resume a dropped connection\n"
+                    "/exit - Disconnect from server");
+    send(client_socket, response, strlen(response), 0);
+    log_event("[HELP] Client %d requested help", client_index);
 }
 
-void handle_command(int client_socket, char *message) {
-    int client_index = find_client_by_socket(client_socket);
-    if (client_index == -1) {
-        log_event("[ERROR] Could not find client by socket %d", client_socket);
+static void cmd_history(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *offset_arg = next_token(&args);
+    char *limit_arg = next_token(&args);
+    int offset = offset_arg ? atoi(offset_arg) : 0;
+    int limit = limit_arg ? atoi(limit_arg) : HISTORY_REPLAY_COUNT;
+    
+    if (offset < 0 || limit <= 0) {
+        strcpy(response, "[SERVER] Usage: /history [offset] [limit]");
+        send(client_socket, response, strlen(response), 0);
         return;
     }
     
-    char message_copy[BUFFER_SIZE];
-    strncpy(message_copy, message, BUFFER_SIZE - 1);
-    message_copy[BUFFER_SIZE - 1] = '\0';
-    
-    char *cmd = strtok(message_copy, " ");
-    char response[BUFFER_SIZE];
+    LOCK(clients_mutex);
+    char current_room[MAX_GROUP_NAME_LENGTH];
+    strcpy(current_room, clients[client_index].current_room);
+    UNLOCK(clients_mutex);
     
-    log_event("[COMMAND_PARSE] Client %d executing command: %s", client_index, cmd);
-    
-    if (strcmp(cmd, "/username") == 0) {
-        char *username = strtok(NULL, " ");
-        if (username && strlen(username) > 0) {
-            pthread_mutex_lock(&clients_mutex);
-            // Check if username already exists
-            if (find_client_by_username(username) != -1) {
-                snprintf(response, sizeof(response), "ALREADY_TAKEN");
-                log_event("[USERNAME_TAKEN] Client %d tried to use taken username: %s", 
-                         client_index, username);
-            } else {
-                char old_username[MAX_USERNAME_LENGTH];
-                strcpy(old_username, clients[client_index].username);
-                strncpy(clients[client_index].username, username, MAX_USERNAME_LENGTH - 1);
-                clients[client_index].username[MAX_USERNAME_LENGTH - 1] = '\0';
-                snprintf(response, sizeof(response), "SET_USERNAME");
-                log_event("[USERNAME_SET] Client %d changed username from '%s' to '%s'", 
-                         client_index, 
-                         old_username[0] ? old_username : "unnamed", 
-                         username);
-            }
-            pthread_mutex_unlock(&clients_mutex);
-        } else {
-            strcpy(response, "[SERVER] Usage: /username <name>");
-            log_event("[COMMAND_ERROR] Client %d sent invalid username command", client_index);
-        }
-        send(client_socket, response, strlen(response), 0);
-        
-    } else if (strcmp(cmd, "/join") == 0) {
-        char *room_name = strtok(NULL, " ");
-        if (room_name && strlen(room_name) > 0) {
-            // Validate room name
-            if (!validate_room_name(room_name)) {
-                strcpy(response, "[SERVER] Invalid room name. Must be alphanumeric, max 32 chars, no spaces/special chars");
-                log_event("[COMMAND_ERROR] Client %d tried to join invalid room name: '%s'", 
-                         client_index, room_name);
-                send(client_socket, response, strlen(response), 0);
-                return;
-            }
-            
-            pthread_mutex_lock(&clients_mutex);
-            pthread_mutex_lock(&rooms_mutex);
-            
-            char old_room[MAX_GROUP_NAME_LENGTH];
-            strcpy(old_room, clients[client_index].current_room);
-            
-            // Remove from current room
-            remove_client_from_room(client_index);
-            if (old_room[0]) {
-                log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", 
-                         client_index, clients[client_index].username, old_room);
-            }
-            
-            // Add to new room
-            add_client_to_room(client_index, room_name);
-            strncpy(clients[client_index].current_room, room_name, MAX_GROUP_NAME_LENGTH - 1);
-            clients[client_index].current_room[MAX_GROUP_NAME_LENGTH - 1] = '\0';
-            snprintf(response, sizeof(response), "[SERVER] Joined room '%s'", room_name);
-            log_event("[ROOM_JOIN] Client %d (%s) joined room '%s'", 
-                     client_index, clients[client_index].username, room_name);
-            
-            pthread_mutex_unlock(&rooms_mutex);
-            pthread_mutex_unlock(&clients_mutex);
-        } else {
-            strcpy(response, "[SERVER] Usage: /join <room_name>");
-            log_event("[COMMAND_ERROR] Client %d sent invalid join command", client_index);
-        }
-        send(client_socket, response, strlen(response), 0);
-        
-    } else if (strcmp(cmd, "/broadcast") == 0) {
-        // Safely extract message after "/broadcast "
-        if (strlen(message) > 11) {  // "/broadcast " is 11 characters
-            char *msg = message + 11;
-            
-            pthread_mutex_lock(&clients_mutex);
-            char current_room[MAX_GROUP_NAME_LENGTH];
-            char username[MAX_USERNAME_LENGTH];
-            strcpy(current_room, clients[client_index].current_room);
-            strcpy(username, clients[client_index].username);
-            pthread_mutex_unlock(&clients_mutex);
-            
-            if (strlen(current_room) > 0) {
-                char formatted_msg[BUFFER_SIZE + 100];
-                snprintf(formatted_msg, sizeof(formatted_msg), "[BROADCAST] %s: %s", username, msg);
-                
-                log_event("[BROADCAST_START] Client %d (%s) broadcasting to room '%s': %s", 
-                         client_index, username, current_room, msg);
-                
-                broadcast_to_room(formatted_msg, current_room, client_socket);
-                strcpy(response, "[SERVER] Message broadcasted");
-                
-                log_event("[BROADCAST_COMPLETE] Message from %s broadcasted to room '%s'", 
-                         username, current_room);
-            } else {
-                strcpy(response, "[SERVER] You must join a room first");
-                log_event("[BROADCAST_ERROR] Client %d tried to broadcast without joining room", 
-                         client_index);
-            }
-        } else {
-            strcpy(response, "[SERVER] Usage: /broadcast <message>");
-            log_event("[COMMAND_ERROR] Client %d sent empty broadcast command", client_index);
-        }
+    if (current_room[0] == '\0') {
+        strcpy(response, "[SERVER] You must join a room first");
         send(client_socket, response, strlen(response), 0);
-        
-    } else if (strcmp(cmd, "/leave") == 0) {
-        pthread_mutex_lock(&clients_mutex);
-        pthread_mutex_lock(&rooms_mutex);
-        if (strlen(clients[client_index].current_room) > 0) {
-            char old_room[MAX_GROUP_NAME_LENGTH];
-            strcpy(old_room, clients[client_index].current_room);
-            remove_client_from_room(client_index);
-            memset(clients[client_index].current_room, 0, MAX_GROUP_NAME_LENGTH);
-            snprintf(response, sizeof(response), "ROOM_LEFT");
-            log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", 
-                    client_index, clients[client_index].username, old_room);
-        } else {
-            strcpy(response, "[SERVER] You are not in a room");
-            log_event("[COMMAND_ERROR] Client %d (%s) tried to leave without being in a room", 
-                    client_index, clients[client_index].username);
-        }
-        pthread_mutex_unlock(&rooms_mutex);
-        pthread_mutex_unlock(&clients_mutex);
-        send(client_socket, response, strlen(response), 0);
-    } 
-    
-    else if (strcmp(cmd, "/whisper") == 0) {
-        char *target_user = strtok(NULL, " ");
-        char *msg = strtok(NULL, ""); // Get rest of the message
-        if (target_user && msg) {
-            pthread_mutex_lock(&clients_mutex);
-            char sender_username[MAX_USERNAME_LENGTH];
-            strcpy(sender_username, clients[client_index].username);
-            pthread_mutex_unlock(&clients_mutex);
-            
-            char formatted_msg[BUFFER_SIZE + 100];
-            snprintf(formatted_msg, sizeof(formatted_msg), "[WHISPER from %s]: %s", 
-                    sender_username, msg);
-            
-            log_event("[WHISPER_START] Client %d (%s) whispering to '%s': %s", 
-                     client_index, sender_username, target_user, msg);
-            
-            send_private_message(formatted_msg, target_user, client_socket);
-            snprintf(response, sizeof(response), "[SERVER] Whisper sent to %s", target_user);
-            
-            log_event("[WHISPER_COMPLETE] Whisper from %s to %s processed", 
-                     sender_username, target_user);
-        } else {
-            strcpy(response, "[SERVER] Usage: /whisper <username> <message>");
-            log_event("[COMMAND_ERROR] Client %d sent invalid whisper command", client_index);
-        }
+        return;
+    }
+    
+    // Only the room lookup needs rooms_mutex, the ring has its own lock
+    LOCK(rooms_mutex);
+    int room_index = find_room_index(current_room);
+    UNLOCK(rooms_mutex);
+    
+    int sent = history_replay(room_index, client_socket, offset, limit);
+    if (sent == 0) {
+        strcpy(response, "[SERVER] No history at that offset");
         send(client_socket, response, strlen(response), 0);
+    }
+    log_event("[HISTORY] Client %d requested history of '%s' (offset %d, limit %d), %d sent", 
+             client_index, current_room, offset, limit, sent);
+}
 
-    } else if (strcmp(cmd, "/sendfile") == 0) {
-        char recipient[32] = {0}, filename[128] = {0}, size_buffer[64] = {0};
-        char *args = message + 10;  // Skip "/sendfile "
-        
-        if (strlen(message) > 10) {
-            sscanf(args, "%127s %31s %63s", filename, recipient, size_buffer);
-        }
+static void cmd_presence(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *mode = next_token(&args);
+    int enable = mode && strcmp(mode, "on") == 0;
+    
+    if (enable || (mode && strcmp(mode, "off") == 0)) {
+        LOCK(clients_mutex);
+        clients[client_index].presence = enable;
+        UNLOCK(clients_mutex);
+        strcpy(response, enable ? "PRESENCE_ON" : "PRESENCE_OFF");
+        log_event("[PRESENCE] Client %d presence updates %s", client_index, enable ? "on" : "off");
+    } else {
+        strcpy(response, "[SERVER] Usage: /presence on|off");
+    }
+    send(client_socket, response, strlen(response), 0);
+}
 
-        log_event("[FILE_TRANSFER_START] Client %d (%s) initiating file transfer to '%s', file: %s", 
-                 client_index, clients[client_index].username, recipient, filename);
+// No reply on success: typing notices are frequent and only matter to others
+static void cmd_typing(int client_socket, int client_index, char *args) {
+    char *mode = next_token(&args);
+    int typing = !(mode && strcmp(mode, "off") == 0);
+    if (!presence_typing(client_index, typing)) {
+        const char *response = "[SERVER] You must join a room first";
+        send(client_socket, response, strlen(response), 0);
+    }
+}
 
-        if (strlen(recipient) == 0 || strlen(filename) == 0) {
-            send(client_socket, "[SERVER] Usage: /sendfile <recipient> <filename> <size>\n", 56, 0);
-            log_event("[FILE_TRANSFER_ERROR] Client %d sent invalid file transfer command", client_index);
-            return;
-        }
+static void cmd_compress(int client_socket, int client_index, char *args) {
+    char response[BUFFER_SIZE];
+    char *mode = next_token(&args);
+    
+    LOCK(clients_mutex);
+    client_info_t *c = &clients[client_index];
+    if (mode && strcmp(mode, "on") == 0) {
+        c->compress = 1;
+        snprintf(response, sizeof(response), "COMPRESS_ON lz4 %d", COMPRESS_THRESHOLD);
+    } else if (mode && strcmp(mode, "off") == 0) {
+        c->compress = 0;
+        strcpy(response, "COMPRESS_OFF");
+    } else if (!mode || strcmp(mode, "stats") == 0) {
+        snprintf(response, sizeof(response),
+                 "[SERVER] Compression %s: %lu -> %lu bytes (ratio %.2f), %.3f ms CPU",
+                 c->compress ? "on" : "off", (unsigned long)c->raw_bytes, (unsigned long)c->wire_bytes,
+                 c->wire_bytes ? (double)c->raw_bytes / c->wire_bytes : 1.0, c->compress_ns / 1e6);
+    } else {
+        strcpy(response, "[SERVER] Usage: /compress on|off|stats");
+    }
+    int enabled = c->compress;
+    UNLOCK(clients_mutex);
+    
+    send(client_socket, response, strlen(response), 0);
+    log_event("[COMPRESS] Client %d compression %s", client_index, enabled ? "on" : "off");
+}
 
-        if (!validate_file_type(filename)) {
-            send(client_socket, "INVALID_FILE_TYPE", 18, 0);
-            log_event("[FILE_TRANSFER_ERROR] Invalid file type '%s' from %s", filename, clients[client_index].username);
-            return;
-        }
+// A message going to one or more clients. It is compressed at most once,
+// on the first recipient that negotiated compression, and that frame is
+// reused for the rest; the CPU time is split between those recipients.
+typedef struct {
+    const char *msg;
+    size_t len;
+    char frame[LZ_FRAME_BOUND(BUFFER_SIZE * 2)];
+    size_t frame_len;       // 0 = send msg as plain text
+    int encoded;
+    uint64_t cpu_ns;
+    int sharers[MAX_CLIENTS];
+    int sharer_count;
+} outgoing_msg_t;
 
-        // Find recipient first
-        int recp_idx = find_client_by_username(recipient);
-        if (recp_idx < 0) {
-            send(client_socket, "RECIPIENT_NOT_FOUND", 20, 0);
-            log_event("[FILE_TRANSFER_ERROR] Recipient '%s' not found for file from %s", 
-                     recipient, clients[client_index].username);
-            return;
-        }
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-        // Check if recipient is online
-        pthread_mutex_lock(&clients_mutex);
-        if (!clients[recp_idx].active) {
-            pthread_mutex_unlock(&clients_mutex);
-            send(client_socket, "RECIPIENT_OFFLINE\n", 19, 0);
-            log_event("[FILE_TRANSFER_ERROR] Recipient '%s' is offline", recipient);
-            return;
-        }
-        int recipient_socket = clients[recp_idx].socket;
-        pthread_mutex_unlock(&clients_mutex);
+// Caller holds clients_mutex. Returns the number of bytes sent.
+static size_t send_outgoing(int client_index, outgoing_msg_t *out) {
+    client_info_t *c = &clients[client_index];
+    if (!c->compress || out->len < COMPRESS_THRESHOLD || out->len > BUFFER_SIZE * 2) {
+        send(c->socket, out->msg, out->len, 0);
+        return out->len;
+    }
+    if (!out->encoded) {
+        uint64_t start = thread_cpu_ns();
+        out->frame_len = lz_frame_encode(out->msg, out->len, out->frame, sizeof(out->frame));
+        out->cpu_ns = thread_cpu_ns() - start;
+        out->encoded = 1;
+    }
+    const char *data = out->frame_len ? out->frame : out->msg;
+    size_t n = out->frame_len ? out->frame_len : out->len;
+    send(c->socket, data, n, 0);
+    c->raw_bytes += out->len;
+    c->wire_bytes += n;
+    out->sharers[out->sharer_count++] = client_index;
+    return n;
+}
 
-        // Get filesize
-        size_t filesize = atol(size_buffer);
-        
-        log_event("[FILE_TRANSFER] File metadata received - size: %zu bytes", filesize);
+// Charge the compression time and count the bytes. Caller holds clients_mutex.
+static void finish_outgoing(outgoing_msg_t *out) {
+    if (out->sharer_count == 0) return;
+    for (int i = 0; i < out->sharer_count; i++) {
+        clients[out->sharers[i]].compress_ns += out->cpu_ns / out->sharer_count;
+    }
+    size_t n = out->frame_len ? out->frame_len : out->len;
+    metrics_add(METRIC_COMPRESS_RAW_BYTES, (uint64_t)out->sharer_count * out->len);
+    metrics_add(METRIC_COMPRESS_WIRE_BYTES, (uint64_t)out->sharer_count * n);
+    metrics_add(METRIC_COMPRESS_CPU_NS, out->cpu_ns);
+}
 
-        // Check file size limit
-        if (filesize > MAX_FILE_SIZE) {
-            send(client_socket, "FILE_SIZE_EXCEEDS_LIMIT", 24, 0);
-            log_event("[FILE_TRANSFER_ERROR] File size %zu exceeds limit for %s", filesize, clients[client_index].username);
-            return;
-        }
+// Bus consumer or mesh link thread: messages from users on other nodes
+void handle_bus_message(const bus_msg_t *msg) {
+    char text[BUS_MAX_TEXT + 1];
+    memcpy(text, msg->text, msg->len);
+    text[msg->len] = '\0';
+    
+    if (msg->type == BUS_BROADCAST) {
+        char room[MAX_GROUP_NAME_LENGTH];
+        snprintf(room, sizeof(room), "%s", msg->target);
+        broadcast_to_room(text, room, -1);
+        return;
+    }
+    if (msg->type != BUS_WHISPER) return;
+    
+    LOCK(clients_mutex);
+    int target_index = find_client_by_username((char *)msg->target);
+    if (target_index != -1) {
+        outgoing_msg_t out = { .msg = text, .len = msg->len };
+        send_outgoing(target_index, &out);
+        finish_outgoing(&out);
+        log_event("[WHISPER_DELIVERY] Private message from node %u delivered to %s (client %d)", 
+                 msg->from_node, msg->target, target_index);
+    }
+    UNLOCK(clients_mutex);
+    if (target_index == -1 && !session_buffer_user(msg->target, text, msg->len)) {
+        mailbox_store(msg->target, MAILBOX_WHISPER, text);
+    }
+}
 
-        // Create file metadata for queue
-        FileMeta file_meta;
-        pthread_mutex_lock(&clients_mutex);
-        strncpy(file_meta.sender, clients[client_index].username, sizeof(file_meta.sender) - 1);
-        file_meta.sender[sizeof(file_meta.sender) - 1] = '\0';
-        pthread_mutex_unlock(&clients_mutex);
-        
-        strncpy(file_meta.recipient, recipient, sizeof(file_meta.recipient) - 1);
-        file_meta.recipient[sizeof(file_meta.recipient) - 1] = '\0';
-        strncpy(file_meta.filename, filename, sizeof(file_meta.filename) - 1);
-        file_meta.filename[sizeof(file_meta.filename) - 1] = '\0';
-        file_meta.filesize = filesize;
-        file_meta.sender_socket = client_socket;
-        file_meta.recipient_socket = recipient_socket;
-        
-        // Try to start transfer immediately or queue it
-        if (filequeue_start_transfer(&file_queue, &file_meta)) {
-            // Transfer can start immediately
-            log_event("[FILE_TRANSFER] Starting immediate transfer: %s -> %s", 
-                     file_meta.sender, recipient);
-            printf("[FILE_TRANSFER] Starting immediate transfer: %s -> %s\n", 
-                   file_meta.sender, recipient);
-
-            send(client_socket, "READY_FOR_FILE", 15, 0);
-            
-            // Inform recipient 
-            char filemeta[FILE_META_MSG_LEN];
-            snprintf(filemeta, sizeof(filemeta), "INCOMING_FILE %s %s %zu\n", 
-                    file_meta.sender, filename, filesize);
-            send(recipient_socket, filemeta, strlen(filemeta), 0);
-
-            // Start transfer in separate thread
-            pthread_t transfer_thread;
-            FileMeta *meta_ptr = malloc(sizeof(FileMeta));
-            if (meta_ptr == NULL) {
-                log_event("[FILE_TRANSFER_ERROR] Failed to allocate memory for transfer");
-                send(client_socket, "[SERVER] File transfer failed.\n", 32, 0);
-                filequeue_finish_transfer(&file_queue);
-                return;
-            }
-            *meta_ptr = file_meta;
-            
-            if (pthread_create(&transfer_thread, NULL, handle_file_transfer, meta_ptr) != 0) {
-                log_event("[FILE_TRANSFER_ERROR] Failed to create transfer thread");
-                send(client_socket, "[SERVER] File transfer failed.\n", 32, 0);
-                filequeue_finish_transfer(&file_queue);
-                free(meta_ptr);
-            } else {
-                pthread_detach(transfer_thread);
-            }
-        } else {
-            // Transfer was queued - handled inside filequeue_start_transfer
-            log_event("[FILE_TRANSFER] Transfer queued for %s -> %s", file_meta.sender, recipient);
-        }
-        
-    } else if (strcmp(cmd, "/list") == 0) {
-        pthread_mutex_lock(&clients_mutex);
-        char current_room[MAX_GROUP_NAME_LENGTH];
-        strcpy(current_room, clients[client_index].current_room);
-        pthread_mutex_unlock(&clients_mutex);
-        
-        log_event("[LIST_COMMAND] Client %d (%s) requesting user list for room '%s'", 
-                 client_index, clients[client_index].username, current_room);
-        
-        // List users in current room
-        if (strlen(current_room) > 0) {
-            pthread_mutex_lock(&clients_mutex);
-            pthread_mutex_lock(&rooms_mutex);
-            
-            int room_index = find_or_create_room(current_room);
-            strcpy(response, "[SERVER] Users in room: ");
-            
-            int user_count = 0;
-            for (int i = 0; i < rooms[room_index].member_count; i++) {
-                int member_index = rooms[room_index].members[i];
-                if (member_index >= 0 && clients[member_index].active) {
-                    strcat(response, clients[member_index].username);
-                    strcat(response, " ");
-                    user_count++;
-                }
-            }
-            
-            log_event("[LIST_RESULT] Room '%s' has %d active users", current_room, user_count);
-            
-            pthread_mutex_unlock(&rooms_mutex);
-            pthread_mutex_unlock(&clients_mutex);
-        } else {
-            strcpy(response, "[SERVER] You must join a room first");
-            log_event("[LIST_ERROR] Client %d tried to list users without joining room", 
-                     client_index);
+// Presence flush thread callback: one shared (possibly compressed) line per room
+void deliver_presence(const char *room_name, const int *client_indices, int count,
+                      const char *frame, size_t len) {
+    outgoing_msg_t out = { .msg = frame, .len = len };
+    LOCK(clients_mutex);
+    for (int i = 0; i < count; i++) {
+        client_info_t *c = &clients[client_indices[i]];
+        if (c->active && c->presence && strcmp(c->current_room, room_name) == 0) {
+            send_outgoing(client_indices[i], &out);
         }
-        send(client_socket, response, strlen(response), 0);
-        
-    } else if (strcmp(cmd, "/exit") == 0) {
-        strcpy(response, "[SERVER] Goodbye!");
-        send(client_socket, response, strlen(response), 0);
-        pthread_mutex_lock(&clients_mutex);
-        clients[client_index].active = 0;
-        pthread_mutex_unlock(&clients_mutex);
-        log_event("[EXIT] Client %d (%s) disconnected voluntarily", 
-                 client_index, clients[client_index].username);
-        
-    } else if (strcmp(cmd, "/help") == 0) {
-        strcpy(response, "[SERVER] Available commands:\n"
-                        "/username <name> - Set your username\n"
-                        "/join <room> - Join a chat room\n"
-                        "/leave - Leave current room\n"
-                        "/broadcast <msg> - Send message to room\n"
-                        "/whisper <user> <msg> - Private message\n"
-                        "/sendfile <user> <file> <size> - Send file\n"
-                        "/list - List users in current room\n"
-                        "/exit - Disconnect from server");
-        send(client_socket, response, strlen(response), 0);
-        log_event("[HELP] Client %d requested help", client_index);
-        
-    } else {
-        strcpy(response, "[SERVER] Unknown command. Type /help for available commands.");
-        send(client_socket, response, strlen(response), 0);
-        log_event("[UNKNOWN_COMMAND] Client %d sent unrecognized command: %s", client_index, cmd);
     }
+    finish_outgoing(&out);
+    UNLOCK(clients_mutex);
 }
 
 void broadcast_to_room(char *msg, char *room_name, int sender_socket) {
-    pthread_mutex_lock(&clients_mutex);
-    pthread_mutex_lock(&rooms_mutex);
+    uint64_t start_ns = metrics_now_ns();
+    size_t msg_len = strlen(msg);
+    int messages_sent = 0;
+    uint64_t bytes_sent = 0;
+    outgoing_msg_t out = { .msg = msg, .len = msg_len };
+    uint64_t span = TRACE_START();
+    LOCK(clients_mutex);
+    LOCK(rooms_mutex);
+    TRACE_END("lock_wait", span);
     
     int room_index = -1;
     for (int i = 0; i < room_count; i++) {
@@ -708,12 +1906,14 @@ void broadcast_to_room(char *msg, char *room_name, int sender_socket) {
     }
     
     if (room_index != -1) {
-        int messages_sent = 0;
+        uint64_t fanout_span = TRACE_START();
         for (int i = 0; i < rooms[room_index].member_count; i++) {
             int member_index = rooms[room_index].members[i];
             if (member_index >= 0 && clients[member_index].active && 
                 clients[member_index].socket != sender_socket) {
-                send(clients[member_index].socket, msg, strlen(msg), 0);
+                span = TRACE_START();
+                bytes_sent += send_outgoing(member_index, &out);
+                TRACE_END("send", span);
                 messages_sent++;
                 log_event("[BROADCAST_DELIVERY] Message delivered to client %d (%s) in room '%s'", 
                          member_index, clients[member_index].username, room_name);
@@ -721,30 +1921,69 @@ void broadcast_to_room(char *msg, char *room_name, int sender_socket) {
         }
         log_event("[BROADCAST_SUMMARY] Broadcast in room '%s' delivered to %d clients", 
                  room_name, messages_sent);
+        finish_outgoing(&out);
+        TRACE_END("fanout", fanout_span);
     } else {
         log_event("[BROADCAST_ERROR] Room '%s' not found for broadcast", room_name);
     }
     
-    pthread_mutex_unlock(&rooms_mutex);
-    pthread_mutex_unlock(&clients_mutex);
+    UNLOCK(rooms_mutex);
+    UNLOCK(clients_mutex);
+    
+    // Room slots are never reused, so the index stays valid without the lock
+    if (room_index != -1) {
+        session_buffer_room(room_name, msg, msg_len);
+        metrics_observe(METRIC_HIST_BROADCAST_FANOUT, metrics_now_ns() - start_ns);
+        metrics_add(METRIC_BROADCASTS, 1);
+        metrics_add(METRIC_BROADCAST_DELIVERIES, messages_sent);
+        metrics_add(METRIC_CHAT_BYTES_RELAYED, bytes_sent);
+        span = TRACE_START();
+        history_append(room_index, msg, msg_len);
+        TRACE_END("history_append", span);
+    }
 }
 
 void send_private_message(char *msg, char *target_username, int sender_socket) {
-    pthread_mutex_lock(&clients_mutex);
+    LOCK(clients_mutex);
     
     int target_index = find_client_by_username(target_username);
     if (target_index != -1 && clients[target_index].active) {
-        send(clients[target_index].socket, msg, strlen(msg), 0);
+        outgoing_msg_t out = { .msg = msg, .len = strlen(msg) };
+        size_t bytes_sent = send_outgoing(target_index, &out);
+        finish_outgoing(&out);
+        metrics_add(METRIC_WHISPERS, 1);
+        metrics_add(METRIC_CHAT_BYTES_RELAYED, bytes_sent);
         log_event("[WHISPER_DELIVERY] Private message delivered to %s (client %d)", 
                  target_username, target_index);
+        UNLOCK(clients_mutex);
+        return;
+    }
+    UNLOCK(clients_mutex);
+    
+    // Dropped connections with a session get it when they resume
+    if (session_buffer_user(target_username, msg, strlen(msg))) {
+        metrics_add(METRIC_WHISPERS, 1);
+        log_event("[WHISPER_BUFFERED] Target user '%s' is reconnecting, whisper held in its session", target_username);
+        return;
+    }
+    
+    if ((cluster_enabled && bus_whisper(target_username, msg, strlen(msg)) == 0) ||
+        (mesh_enabled && mesh_whisper(target_username, msg, strlen(msg)) == 0)) {
+        metrics_add(METRIC_WHISPERS, 1);
+        log_event("[WHISPER_DELIVERY] Private message for %s forwarded to its cluster node", target_username);
+        return;
+    }
+    
+    // Keep the whisper for the next time target_username registers
+    char error_msg[BUFFER_SIZE];
+    if (mailbox_store(target_username, MAILBOX_WHISPER, msg) == 0) {
+        snprintf(error_msg, sizeof(error_msg), "[SERVER] User '%s' is offline, message stored for delivery", target_username);
+        log_event("[WHISPER_STORED] Target user '%s' offline, whisper stored in mailbox", target_username);
     } else {
-        char error_msg[BUFFER_SIZE];
         snprintf(error_msg, sizeof(error_msg), "[SERVER] User '%s' not found or offline", target_username);
-        send(sender_socket, error_msg, strlen(error_msg), 0);
         log_event("[WHISPER_ERROR] Target user '%s' not found or offline", target_username);
     }
-    
-    pthread_mutex_unlock(&clients_mutex);
+    send(sender_socket, error_msg, strlen(error_msg), 0);
 }
 
 int find_client_by_socket(int socket) {
@@ -768,6 +2007,15 @@ int find_client_by_username(char *username) {
     return -1;
 }
 
+int find_room_index(const char *room_name) {
+    for (int i = 0; i < room_count; i++) {
+        if (strcmp(rooms[i].name, room_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int find_or_create_room(char *room_name) {
     // Find existing room
     for (int i = 0; i < room_count; i++) {
@@ -785,6 +2033,7 @@ int find_or_create_room(char *room_name) {
         for (int i = 0; i < MAX_GROUP_MEMBERS; i++) {
             rooms[room_count].members[i] = -1;
         }
+        history_open_room(room_count, room_name);
         log_event("[ROOM_CREATED] New room '%s' created at index %d", room_name, room_count);
         return room_count++;
     }
@@ -829,6 +2078,9 @@ void remove_client_from_room(int client_index) {
     }
     
     memset(clients[client_index].current_room, 0, MAX_GROUP_NAME_LENGTH);
+    presence_leave(client_index);
+    if (cluster_enabled) bus_set_room(clients[client_index].username, "");
+    if (mesh_enabled) mesh_set_room(clients[client_index].username, "");
 }
 
 void add_client_to_room(int client_index, char *room_name) {
@@ -836,6 +2088,9 @@ void add_client_to_room(int client_index, char *room_name) {
     if (room_index != -1 && rooms[room_index].member_count < MAX_GROUP_MEMBERS) {
         rooms[room_index].members[rooms[room_index].member_count] = client_index;
         rooms[room_index].member_count++;
+        presence_join(room_index, room_name, client_index, clients[client_index].username);
+        if (cluster_enabled) bus_set_room(clients[client_index].username, room_name);
+        if (mesh_enabled) mesh_set_room(clients[client_index].username, room_name);
         log_event("[ROOM_ADD] Client %d (%s) added to room '%s', %d members total", 
                  client_index, clients[client_index].username, room_name, 
                  rooms[room_index].member_count);
@@ -850,76 +2105,366 @@ void add_client_to_room(int client_index, char *room_name) {
     }
 }
 
-int relay_file() {
+int relay_file(transfer_watch_t *watch) {
     log_event("[FILE_RELAY] Simulating file transfer (no actual transfer)");
-    // Simulate file transfer delay
-    sleep(2);
+    // Simulate file transfer delay, reporting progress to the stall timer
+    for (int step = 0; step < 20; step++) {
+        usleep(100 * 1000);
+        if (!watch) continue;
+        if (__atomic_load_n(&watch->stalled, __ATOMIC_RELAXED)) return -1;
+        __atomic_store_n(&watch->last_progress_ms, timers_now_ms(), __ATOMIC_RELAXED);
+    }
     return 0;  // Return success
 }
 
+// Copy len bytes from one data connection to the other. Every chunk that
+// moves counts as progress for the stall timer. Returns 0 once all moved.
+static int relay_range(int in, int out, size_t len, transfer_watch_t *watch) {
+    // A recipient that stops reading must not hold the thread past a stall
+    struct timeval send_timeout = { .tv_sec = 1 };
+    setsockopt(out, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    char *chunk = malloc(TRANSFER_CHUNK_SIZE);
+    if (!chunk) return -1;
+    size_t relayed = 0;
+    while (relayed < len && !__atomic_load_n(&watch->stalled, __ATOMIC_RELAXED)) {
+        struct pollfd pfd = { .fd = in, .events = POLLIN };
+        int ready = poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready <= 0) continue;
+        size_t want = len - relayed;
+        if (want > TRANSFER_CHUNK_SIZE) want = TRANSFER_CHUNK_SIZE;
+        ssize_t n = read(in, chunk, want);
+        if (n <= 0) break;
+        ssize_t sent = 0;
+        while (sent < n) {
+            ssize_t w = send(out, chunk + sent, n - sent, MSG_NOSIGNAL);
+            if (w < 0) {
+                if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+                    !__atomic_load_n(&watch->stalled, __ATOMIC_RELAXED)) continue;
+                break;
+            }
+            sent += w;
+            __atomic_store_n(&watch->last_progress_ms, timers_now_ms(), __ATOMIC_RELAXED);
+        }
+        if (sent < n) break;
+        relayed += n;
+    }
+    free(chunk);
+    return relayed == len ? 0 : -1;
+}
+
+// One frame of a delta transfer: its length, checked against limit, then
+// that many bytes. Returns the length, -1 on failure.
+static long relay_frame(int in, int out, size_t limit, transfer_watch_t *watch) {
+    unsigned char head[4];
+    size_t got = 0;
+    while (got < sizeof(head) && !__atomic_load_n(&watch->stalled, __ATOMIC_RELAXED)) {
+        struct pollfd pfd = { .fd = in, .events = POLLIN };
+        int ready = poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR) return -1;
+        if (ready <= 0) continue;
+        ssize_t n = read(in, head + got, sizeof(head) - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    if (got < sizeof(head)) return -1;
+    size_t len = (size_t)head[0] << 24 | (size_t)head[1] << 16 | (size_t)head[2] << 8 | head[3];
+    if (len > limit || send(out, head, sizeof(head), MSG_NOSIGNAL) != sizeof(head)) return -1;
+    return relay_range(in, out, len, watch) == 0 ? (long)len : -1;
+}
+
+// A delta transfer on stream 0: the recipient's signature to the sender,
+// then the sender's delta to the recipient
+static int relay_delta(const FileMeta *meta, transfer_watch_t *watch) {
+    long signature = relay_frame(watch->recipient_fd[0], watch->sender_fd[0], DELTA_MAX_SIGNATURE, watch);
+    long delta = signature < 0 ? -1 :
+                 relay_frame(watch->sender_fd[0], watch->recipient_fd[0], DELTA_MAX_WIRE(meta->filesize), watch);
+    if (delta < 0) return -1;
+    // Both frames and their lengths count against what was saved
+    watch->relayed = signature + delta + 8;
+    size_t saved = meta->filesize > watch->relayed ? meta->filesize - watch->relayed : 0;
+    metrics_add(METRIC_FILE_BYTES_SAVED, saved);
+    log_event("[FILE_RELAY] Delta of '%s' %s -> %s: %zu bytes for %zu (%zu saved), signature %ld, delta %ld",
+              meta->filename, meta->sender, meta->recipient, watch->relayed, meta->filesize, saved,
+              signature, delta);
+    return 0;
+}
+
+// One stream of a multi-stream transfer, relayed on a thread of its own
+typedef struct {
+    int in, out;
+    size_t len;
+    transfer_watch_t *watch;
+    int result;
+} stream_job_t;
+
+static void *relay_stream(void *arg) {
+    stream_job_t *job = arg;
+    job->result = relay_range(job->in, job->out, job->len, job->watch);
+    return NULL;
+}
+
+// Wait for every data connection, then relay each stream's range of the
+// file from the sender's connection to the recipient's, the streams in
+// parallel. The stall timer also ends the wait for a side that never comes.
+int relay_data(const FileMeta *meta, transfer_watch_t *watch) {
+    if (!watch) return -1;
+    int streams = watch->streams;
+    pthread_mutex_lock(&file_queue.mutex);
+    int attached = 0;
+    while (!__atomic_load_n(&watch->stalled, __ATOMIC_RELAXED)) {
+        attached = 0;
+        for (int i = 0; i < streams; i++) {
+            attached += watch->sender_fd[i] >= 0 && watch->recipient_fd[i] >= 0;
+        }
+        if (attached == streams) break;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&data_attached_cond, &file_queue.mutex, &deadline);
+    }
+    stream_job_t jobs[MAX_TRANSFER_STREAMS];
+    for (int i = 0; i < streams; i++) {
+        jobs[i] = (stream_job_t){
+            .in = watch->sender_fd[i], .out = watch->recipient_fd[i], .watch = watch, .result = -1,
+            .len = TRANSFER_RANGE_START(meta->filesize, streams, i + 1) -
+                   TRANSFER_RANGE_START(meta->filesize, streams, i),
+        };
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+    if (attached < streams) return -1;
+    if (meta->delta) return relay_delta(meta, watch);
+    log_event("[FILE_RELAY] Relaying '%s' (%zu bytes) %s -> %s over %d data connection pair(s)",
+              meta->filename, meta->filesize, meta->sender, meta->recipient, streams);
+    
+    // This thread takes the first stream, a thread each the rest
+    pthread_t threads[MAX_TRANSFER_STREAMS];
+    int started[MAX_TRANSFER_STREAMS] = {0};
+    for (int i = 1; i < streams; i++) {
+        started[i] = pthread_create(&threads[i], NULL, relay_stream, &jobs[i]) == 0;
+        if (!started[i]) relay_stream(&jobs[i]);
+    }
+    relay_stream(&jobs[0]);
+    int result = jobs[0].result;
+    for (int i = 1; i < streams; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (jobs[i].result != 0) result = -1;
+    }
+    return result;
+}
+
+// Fails a transfer that made no progress for TRANSFER_STALL_TIMEOUT
+static void transfer_stall_fired(void *arg) {
+    transfer_watch_t *watch = arg;
+    uint64_t stall_ms = TRANSFER_STALL_TIMEOUT * 1000;
+    pthread_mutex_lock(&file_queue.mutex);
+    if (watch->used) {
+        uint64_t quiet = timers_now_ms() - __atomic_load_n(&watch->last_progress_ms, __ATOMIC_RELAXED);
+        if (quiet >= stall_ms) {
+            __atomic_store_n(&watch->stalled, 1, __ATOMIC_RELAXED);
+            metrics_add(METRIC_TRANSFERS_STALLED, 1);
+            log_event("[FILE_TRANSFER_ERROR] Transfer in slot %d stalled for %lu ms, failing it",
+                      (int)(watch - transfer_watches), (unsigned long)quiet);
+        } else {
+            timer_arm(&watch->timer, stall_ms - quiet, transfer_stall_fired, watch);
+        }
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+}
+
+// Data tokens only have to be unguessable by other clients
+static uint64_t new_data_token(void) {
+    uint64_t token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = ((uint64_t)rand() << 32) ^ (uint64_t)rand() ^ metrics_now_ns();
+        }
+    }
+    return token;
+}
+
+static transfer_watch_t *watch_transfer(int streams) {
+    transfer_watch_t *watch = NULL;
+    pthread_mutex_lock(&file_queue.mutex);
+    for (int i = 0; i < MAX_SIMULTANEOUS_TRANSFERS && !watch; i++) {
+        if (!transfer_watches[i].used) watch = &transfer_watches[i];
+    }
+    if (watch) {
+        watch->used = 1;
+        watch->stalled = 0;
+        watch->last_progress_ms = timers_now_ms();
+        watch->sender_token = new_data_token();
+        watch->recipient_token = new_data_token();
+        watch->streams = streams;
+        watch->relayed = 0;
+        for (int i = 0; i < MAX_TRANSFER_STREAMS; i++) {
+            watch->sender_fd[i] = watch->recipient_fd[i] = -1;
+        }
+        timer_arm(&watch->timer, TRANSFER_STALL_TIMEOUT * 1000, transfer_stall_fired, watch);
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+    return watch;
+}
+
+static void unwatch_transfer(transfer_watch_t *watch) {
+    if (!watch) return;
+    timer_cancel(&watch->timer);
+    pthread_mutex_lock(&file_queue.mutex);
+    watch->used = 0;
+    int fds[2 * MAX_TRANSFER_STREAMS];
+    for (int i = 0; i < MAX_TRANSFER_STREAMS; i++) {
+        fds[2 * i] = watch->sender_fd[i];
+        fds[2 * i + 1] = watch->recipient_fd[i];
+        watch->sender_fd[i] = watch->recipient_fd[i] = -1;
+    }
+    pthread_mutex_unlock(&file_queue.mutex);
+    for (int i = 0; i < 2 * MAX_TRANSFER_STREAMS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+}
+
+// Sender-facing replies about a transfer name it by the sender's id;
+// clients that sent none get the bare code they always got
+void send_transfer_reply(int socket, const char *code, uint32_t transfer_id) {
+    char reply[64];
+    if (transfer_id) {
+        snprintf(reply, sizeof(reply), "%s %u\n", code, transfer_id);
+        send(socket, reply, strlen(reply), MSG_NOSIGNAL);
+    } else {
+        send(socket, code, strlen(code) + 1, MSG_NOSIGNAL);
+    }
+}
+
+// Tell both sides the transfer is starting and relay it on its own thread.
+// The caller has taken one of the active transfer slots for it.
+void start_file_transfer(const FileMeta *meta) {
+    transfer_job_t *job = malloc(sizeof(transfer_job_t));
+    if (job == NULL) {
+        log_event("[FILE_TRANSFER_ERROR] Failed to allocate memory for transfer");
+        send(meta->sender_socket, "[SERVER] File transfer failed.\n", 32, 0);
+        filequeue_finish_transfer(&file_queue);
+        return;
+    }
+    job->meta = *meta;
+    // A delta goes back and forth on one stream
+    if (meta->delta) job->meta.streams = 1;
+    // Data connections hold a client slot until they attach, so a split
+    // file gets no more streams than half the free slots can handshake
+    if (job->meta.streams > 1) {
+        int free_slots = 0;
+        LOCK(clients_mutex);
+        for (int i = 0; i < MAX_CLIENTS; i++) free_slots += !clients[i].active;
+        UNLOCK(clients_mutex);
+        if (job->meta.streams > (uint32_t)free_slots / 2) {
+            job->meta.streams = free_slots >= 2 ? free_slots / 2 : 1;
+        }
+    }
+    meta = &job->meta;
+    job->watch = watch_transfer(meta->streams ? meta->streams : 1);
+    
+    char ready[FILE_META_MSG_LEN], incoming[FILE_META_MSG_LEN];
+    if (meta->transfer_id && job->watch && meta->streams) {
+        // Clients that split files get the stream count and checksum back
+        snprintf(ready, sizeof(ready), "READY_FOR_FILE %u %016llx %u%s\n", meta->transfer_id,
+                 (unsigned long long)job->watch->sender_token, meta->streams, meta->delta ? " 1" : "");
+        snprintf(incoming, sizeof(incoming), "INCOMING_FILE %s %s %zu %u %016llx %u %08x%s\n",
+                 meta->sender, meta->filename, meta->filesize, meta->transfer_id,
+                 (unsigned long long)job->watch->recipient_token, meta->streams, meta->checksum,
+                 meta->delta ? " 1" : "");
+        send(meta->sender_socket, ready, strlen(ready), MSG_NOSIGNAL);
+    } else if (meta->transfer_id && job->watch) {
+        snprintf(ready, sizeof(ready), "READY_FOR_FILE %u %016llx\n",
+                 meta->transfer_id, (unsigned long long)job->watch->sender_token);
+        snprintf(incoming, sizeof(incoming), "INCOMING_FILE %s %s %zu %u %016llx\n",
+                 meta->sender, meta->filename, meta->filesize, meta->transfer_id,
+                 (unsigned long long)job->watch->recipient_token);
+        send(meta->sender_socket, ready, strlen(ready), MSG_NOSIGNAL);
+    } else {
+        snprintf(incoming, sizeof(incoming), "INCOMING_FILE %s %s %zu\n",
+                 meta->sender, meta->filename, meta->filesize);
+        send(meta->sender_socket, "READY_FOR_FILE", 15, MSG_NOSIGNAL);
+    }
+    send(meta->recipient_socket, incoming, strlen(incoming), MSG_NOSIGNAL);
+    
+    pthread_t transfer_thread;
+    if (pthread_create(&transfer_thread, NULL, handle_file_transfer, job) != 0) {
+        log_event("[FILE_TRANSFER_ERROR] Failed to create transfer thread");
+        send(meta->sender_socket, "[SERVER] File transfer failed.\n", 32, 0);
+        unwatch_transfer(job->watch);
+        filequeue_finish_transfer(&file_queue);
+        free(job);
+    } else {
+        pthread_detach(transfer_thread);
+    }
+}
+
 void *handle_file_transfer(void *arg) {
-    FileMeta *meta = (FileMeta *)arg;
+    transfer_job_t *job = (transfer_job_t *)arg;
+    FileMeta *meta = &job->meta;
     meta->start_time = time(NULL);
     time_t wait_duration = meta->start_time - meta->enqueue_time;
+    metrics_observe(METRIC_HIST_TRANSFER_QUEUE_WAIT, metrics_now_ns() - meta->queued_ns);
+    TRACE_END_FROM("transfer_queue_wait", meta->queued_ns);
+    uint64_t transfer_span = TRACE_START();
     
     log_event("[FILE_TRANSFER] Processing transfer: %s -> %s (%s, %zu bytes) after %ld seconds in queue", 
              meta->sender, meta->recipient, meta->filename, meta->filesize, wait_duration);
     
-    // Simulate file transfer
-    int result = relay_file();
+    uint64_t span = TRACE_START();
+    int result = meta->transfer_id ? relay_data(meta, job->watch) : relay_file(job->watch);
+    size_t relayed = meta->delta && job->watch ? job->watch->relayed : meta->filesize;
+    unwatch_transfer(job->watch);
+    TRACE_END("relay_file", span);
     
+    // Free the slot before telling anyone: a sender that fires its next
+    // /sendfile on seeing the outcome must find it free, as server.py does
+    filequeue_finish_transfer(&file_queue);
+    
+    const char *outcome = result == 0 ? "FILE_TRANSFER_SUCCESS" : "FILE_TRANSFER_FAILED";
+    if (meta->transfer_id) {
+        // The recipient tells transfers apart by sender and id
+        char notice[FILE_META_MSG_LEN];
+        send_transfer_reply(meta->sender_socket, outcome, meta->transfer_id);
+        snprintf(notice, sizeof(notice), "%s %u %s\n", outcome, meta->transfer_id, meta->sender);
+        send(meta->recipient_socket, notice, strlen(notice), MSG_NOSIGNAL);
+    } else {
+        send(meta->sender_socket, outcome, strlen(outcome) + 1, 0);
+        send(meta->recipient_socket, outcome, strlen(outcome) + 1, 0);
+    }
     if (result == 0) {
-        send(meta->sender_socket, "FILE_TRANSFER_SUCCESS", 22, 0);
-        send(meta->recipient_socket, "FILE_TRANSFER_SUCCESS", 22, 0);
-        
-        log_event("[SEND FILE] '%s' sent from %s to %s (simulated success)", 
-                meta->filename, meta->sender, meta->recipient);
+        metrics_add(METRIC_TRANSFERS_COMPLETED, 1);
+        metrics_add(METRIC_FILE_BYTES_RELAYED, relayed);
+        log_event("[SEND FILE] '%s' sent from %s to %s (%s)", meta->filename, meta->sender,
+                  meta->recipient, meta->transfer_id ? "relayed" : "simulated success");
     } else {
-        send(meta->sender_socket, "FILE_TRANSFER_FAILED", 20, 0);
-        send(meta->recipient_socket, "FILE_TRANSFER_FAILED", 20, 0);
-        log_event("[SEND FILE] '%s' from %s to %s (simulated failure)", 
-                meta->filename, meta->sender, meta->recipient);
+        log_event("[SEND FILE] '%s' from %s to %s (%s)", meta->filename, meta->sender,
+                  meta->recipient, meta->transfer_id ? "failed" : "simulated failure");
     }
     
-    // Mark transfer as finished
-    filequeue_finish_transfer(&file_queue);
+    TRACE_END("transfer", transfer_span);
     
     // Try to start next queued transfer
+    launch_next_transfer();
+    
+    free(job);
+    return NULL;
+}
+
+// Start the oldest queued transfer if a slot is free, returns 1 if one started
+int launch_next_transfer(void) {
     FileMeta next_meta;
-    if (filequeue_try_start_next(&file_queue, &next_meta)) {
-        log_event("[FILE_TRANSFER] Starting next queued transfer: %s -> %s", 
-                 next_meta.sender, next_meta.recipient);
-        
-        // Notify sender they can start
-        send(next_meta.sender_socket, "READY_FOR_FILE", 15, 0);
-        
-        // Inform recipient of queued transfer
-        char filemeta[FILE_META_MSG_LEN];
-        snprintf(filemeta, sizeof(filemeta), "INCOMING_FILE %s %s %zu\n", 
-                next_meta.sender, next_meta.filename, next_meta.filesize);
-        send(next_meta.recipient_socket, filemeta, strlen(filemeta), 0);
-        
-        // Start next transfer in new thread
-        pthread_t next_transfer_thread;
-        FileMeta *next_meta_ptr = malloc(sizeof(FileMeta));
-        if (next_meta_ptr == NULL) {
-            log_event("[FILE_TRANSFER_ERROR] Failed to allocate memory for queued transfer");
-            filequeue_finish_transfer(&file_queue);
-        } else {
-            *next_meta_ptr = next_meta;
-            
-            if (pthread_create(&next_transfer_thread, NULL, handle_file_transfer, next_meta_ptr) != 0) {
-                log_event("[FILE_TRANSFER_ERROR] Failed to create thread for queued transfer");
-                filequeue_finish_transfer(&file_queue);
-                free(next_meta_ptr);
-            } else {
-                pthread_detach(next_transfer_thread);
-            }
-        }
+    if (!filequeue_try_start_next(&file_queue, &next_meta)) {
+        return 0;
     }
+    log_event("[FILE_TRANSFER] Starting next queued transfer: %s -> %s", 
+             next_meta.sender, next_meta.recipient);
     
-    free(meta);
-    return NULL;
+    start_file_transfer(&next_meta);
+    return 1;
 }
 
 void log_event(const char *format, ...) {
@@ -960,6 +2505,80 @@ void filequeue_init(FileQueue *q) {
     log_event("[FILE_QUEUE] File queue initialized");
 }
 
+// Drops a queued transfer that waited QUEUED_TRANSFER_EXPIRY without starting.
+// arg is the queue_id the timer was armed for: a callback that was already on
+// its way out when the slot got cancelled and reused finds no match and stops.
+static void queue_expiry_fired(void *arg) {
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    FileQueue *q = &file_queue;
+    pthread_mutex_lock(&q->mutex);
+    int slot = 0;
+    while (slot < MAX_FILE_QUEUE && queue_timer_ids[slot] != id) slot++;
+    if (slot == MAX_FILE_QUEUE) {
+        pthread_mutex_unlock(&q->mutex);
+        return;
+    }
+    if (transfers_paused) {
+        // A hot restart carries the queue over; try again if it is aborted
+        timer_arm(&queue_timers[slot], 1000, queue_expiry_fired, arg);
+        pthread_mutex_unlock(&q->mutex);
+        return;
+    }
+    queue_timer_ids[slot] = 0;
+    
+    int position = -1;
+    for (int i = 0; i < q->count && position < 0; i++) {
+        if (q->files[(q->front + i) % MAX_FILE_QUEUE].queue_id == id) position = i;
+    }
+    if (position < 0) {
+        pthread_mutex_unlock(&q->mutex);
+        return;
+    }
+    FileMeta meta = q->files[(q->front + position) % MAX_FILE_QUEUE];
+    // Close the gap so the rest keep their order
+    for (int i = position; i < q->count - 1; i++) {
+        q->files[(q->front + i) % MAX_FILE_QUEUE] = q->files[(q->front + i + 1) % MAX_FILE_QUEUE];
+    }
+    q->rear = (q->rear + MAX_FILE_QUEUE - 1) % MAX_FILE_QUEUE;
+    q->count--;
+    metrics_gauge_add(METRIC_QUEUED_TRANSFERS, -1);
+    metrics_add(METRIC_QUEUED_TRANSFERS_EXPIRED, 1);
+    wal_log_transfer(WAL_TRANSFER_DEQUEUED, &meta);
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+    
+    log_event("[FILE_QUEUE] Transfer %s -> %s ('%s') expired after %d seconds in queue",
+              meta.sender, meta.recipient, meta.filename, QUEUED_TRANSFER_EXPIRY);
+    char notice[BUFFER_SIZE];
+    if (meta.transfer_id) {
+        snprintf(notice, sizeof(notice), "FILE_QUEUE_EXPIRED %s %s %u\n",
+                 meta.recipient, meta.filename, meta.transfer_id);
+    } else {
+        snprintf(notice, sizeof(notice), "FILE_QUEUE_EXPIRED %s %s", meta.recipient, meta.filename);
+    }
+    send(meta.sender_socket, notice, strlen(notice), MSG_NOSIGNAL);
+}
+
+// Caller holds file_queue.mutex
+void arm_queue_expiry(uint32_t queue_id, uint64_t delay_ms) {
+    for (int slot = 0; slot < MAX_FILE_QUEUE; slot++) {
+        if (queue_timer_ids[slot] != 0) continue;
+        queue_timer_ids[slot] = queue_id;
+        timer_arm(&queue_timers[slot], delay_ms, queue_expiry_fired, (void *)(uintptr_t)queue_id);
+        return;
+    }
+}
+
+// Caller holds file_queue.mutex
+static void cancel_queue_expiry(uint32_t queue_id) {
+    for (int slot = 0; slot < MAX_FILE_QUEUE; slot++) {
+        if (queue_timer_ids[slot] != queue_id) continue;
+        timer_cancel(&queue_timers[slot]);
+        queue_timer_ids[slot] = 0;
+        return;
+    }
+}
+
 // Enqueue a file transfer request
 int filequeue_enqueue(FileQueue *q, FileMeta *meta) {
     log_event("[FILE_QUEUE] Enqueueing file transfer: %s -> %s (size: %zu)", 
@@ -970,23 +2589,32 @@ int filequeue_enqueue(FileQueue *q, FileMeta *meta) {
     
     if (q->count == MAX_FILE_QUEUE) {
         log_event("[FILE_QUEUE] Queue full, notifying sender");
-        send(meta->sender_socket, "FILE_QUEUE_FULL", 16, 0);
+        send_transfer_reply(meta->sender_socket, "FILE_QUEUE_FULL", meta->transfer_id);
         pthread_mutex_unlock(&q->mutex);
         return -1;
     }
     
     meta->enqueue_time = time(NULL);
+    meta->queue_id = next_queue_id++;
+    if (next_queue_id == 0) next_queue_id = 1;
+    arm_queue_expiry(meta->queue_id, QUEUED_TRANSFER_EXPIRY * 1000);
     q->files[q->rear] = *meta;
     q->rear = (q->rear + 1) % MAX_FILE_QUEUE;
     q->count++;
+    metrics_gauge_add(METRIC_QUEUED_TRANSFERS, 1);
     
     char wait_msg[BUFFER_SIZE];
-    snprintf(wait_msg, sizeof(wait_msg), 
-             "[SERVER] File transfer queued. Queue position: %d\n", 
-             q->count);
+    if (meta->transfer_id) {
+        snprintf(wait_msg, sizeof(wait_msg), "FILE_QUEUED %u %d\n", meta->transfer_id, q->count);
+    } else {
+        snprintf(wait_msg, sizeof(wait_msg), 
+                 "[SERVER] File transfer queued. Queue position: %d\n", 
+                 q->count);
+    }
     send(meta->sender_socket, wait_msg, strlen(wait_msg), 0);
     
     log_event("[FILE_QUEUE] File enqueued successfully, queue size: %d", q->count);
+    wal_log_transfer(WAL_TRANSFER_QUEUED, meta);
     
     pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->mutex);
@@ -1029,30 +2657,51 @@ int filequeue_try_start_next(FileQueue *q, FileMeta *meta) {
     log_event("[FILE_QUEUE] Trying to start next queued transfer");
     
     pthread_mutex_lock(&q->mutex);
-    if (q->count > 0 && q->active_transfers < MAX_SIMULTANEOUS_TRANSFERS) {
+    if (q->count > 0 && q->active_transfers < MAX_SIMULTANEOUS_TRANSFERS && !transfers_paused) {
         *meta = q->files[q->front];
         
         // Verify sender and recipient are still active
         int sender_idx = find_client_by_username(meta->sender);
         int recipient_idx = find_client_by_username(meta->recipient);
         
-        pthread_mutex_lock(&clients_mutex);
+        LOCK(clients_mutex);
         int sender_active = (sender_idx != -1 && clients[sender_idx].active);
         int recipient_active = (recipient_idx != -1 && clients[recipient_idx].active);
-        pthread_mutex_unlock(&clients_mutex);
+        UNLOCK(clients_mutex);
         
         if (!sender_active || !recipient_active) {
             log_event("[FILE_QUEUE_ERROR] Sender or recipient offline for queued transfer");
             q->front = (q->front + 1) % MAX_FILE_QUEUE;
             q->count--;
+            cancel_queue_expiry(meta->queue_id);
+            metrics_gauge_add(METRIC_QUEUED_TRANSFERS, -1);
+            wal_log_transfer(WAL_TRANSFER_DEQUEUED, meta);
             pthread_cond_signal(&q->not_full);
             pthread_mutex_unlock(&q->mutex);
+            
+            // Leave the offer in the recipient's mailbox instead of dropping it
+            if (sender_active) {
+                char offer[BUFFER_SIZE];
+                snprintf(offer, sizeof(offer), 
+                         "[FILE OFFER] %s tried to send you '%s' (%zu bytes) while you were offline", 
+                         meta->sender, meta->filename, meta->filesize);
+                if (mailbox_store(meta->recipient, MAILBOX_FILE_OFFER, offer) == 0) {
+                    char notice[BUFFER_SIZE];
+                    snprintf(notice, sizeof(notice), 
+                             "[SERVER] %s went offline, your file offer for '%s' was left in their mailbox", 
+                             meta->recipient, meta->filename);
+                    send(meta->sender_socket, notice, strlen(notice), 0);
+                }
+            }
             return 0;
         }
         
         q->front = (q->front + 1) % MAX_FILE_QUEUE;
         q->count--;
         q->active_transfers++;
+        cancel_queue_expiry(meta->queue_id);
+        metrics_gauge_add(METRIC_QUEUED_TRANSFERS, -1);
+        wal_log_transfer(WAL_TRANSFER_DEQUEUED, meta);
         
         log_event("[FILE_QUEUE] Next transfer started: %s -> %s, queue size: %d, active: %d", 
                  meta->sender, meta->recipient, q->count, q->active_transfers);
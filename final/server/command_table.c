@@ -0,0 +1,70 @@
+// Generated by gen_command_table.py - do not edit by hand.
+#include "command_table.h"
+#include <string.h>
+
+#define COMMAND_TABLE_SIZE 32
+#define COMMAND_HASH_MUL_LEN 2
+#define COMMAND_HASH_MUL_FIRST 24
+
+typedef struct {
+    const char *name;   // without the leading '/'
+    unsigned char len;
+    command_id_t id;
+} command_slot_t;
+
+static const command_slot_t command_slots[COMMAND_TABLE_SIZE] = {
+    [1] = {"resume", 6, CMD_RESUME},
+    [4] = {"session", 7, CMD_SESSION},
+    [6] = {"join", 4, CMD_JOIN},
+    [7] = {"history", 7, CMD_HISTORY},
+    [8] = {"whisper", 7, CMD_WHISPER},
+    [9] = {"data", 4, CMD_DATA},
+    [11] = {"compress", 8, CMD_COMPRESS},
+    [13] = {"username", 8, CMD_USERNAME},
+    [15] = {"leave", 5, CMD_LEAVE},
+    [19] = {"typing", 6, CMD_TYPING},
+    [20] = {"exit", 4, CMD_EXIT},
+    [21] = {"presence", 8, CMD_PRESENCE},
+    [22] = {"broadcast", 9, CMD_BROADCAST},
+    [24] = {"help", 4, CMD_HELP},
+    [28] = {"list", 4, CMD_LIST},
+    [29] = {"sendfile", 8, CMD_SENDFILE},
+};
+
+static const char *const command_names[CMD_COUNT] = {
+    [CMD_USERNAME] = "/username",
+    [CMD_JOIN] = "/join",
+    [CMD_BROADCAST] = "/broadcast",
+    [CMD_LEAVE] = "/leave",
+    [CMD_WHISPER] = "/whisper",
+    [CMD_SENDFILE] = "/sendfile",
+    [CMD_LIST] = "/list",
+    [CMD_EXIT] = "/exit",
+    [CMD_HELP] = "/help",
+    [CMD_HISTORY] = "/history",
+    [CMD_COMPRESS] = "/compress",
+    [CMD_PRESENCE] = "/presence",
+    [CMD_TYPING] = "/typing",
+    [CMD_DATA] = "/data",
+    [CMD_SESSION] = "/session",
+    [CMD_RESUME] = "/resume",
+};
+
+command_id_t command_lookup(const char *cmd, size_t len) {
+    if (len < 2 || cmd[0] != '/') return CMD_UNKNOWN;
+    cmd++;
+    len--;
+    unsigned int h = (COMMAND_HASH_MUL_LEN * (unsigned int)len +
+                      COMMAND_HASH_MUL_FIRST * (unsigned char)cmd[0] +
+                      (unsigned char)cmd[len - 1]) & (COMMAND_TABLE_SIZE - 1);
+    const command_slot_t *s = &command_slots[h];
+    if (s->name && s->len == len && memcmp(s->name, cmd, len) == 0) {
+        return s->id;
+    }
+    return CMD_UNKNOWN;
+}
+
+const char *command_name(command_id_t id) {
+    if (id < 0 || id >= CMD_COUNT) return "unknown";
+    return command_names[id];
+}
@@ -0,0 +1,33 @@
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <stddef.h>
+
+// Opcodes for the slash commands understood by the server.
+// Order must match COMMANDS in gen_command_table.py.
+typedef enum {
+    CMD_UNKNOWN = -1,
+    CMD_USERNAME = 0,
+    CMD_JOIN,
+    CMD_BROADCAST,
+    CMD_LEAVE,
+    CMD_WHISPER,
+    CMD_SENDFILE,
+    CMD_LIST,
+    CMD_EXIT,
+    CMD_HELP,
+    CMD_HISTORY,
+    CMD_COMPRESS,
+    CMD_PRESENCE,
+    CMD_TYPING,
+    CMD_DATA,
+    CMD_SESSION,
+    CMD_RESUME,
+    CMD_COUNT
+} command_id_t;
+
+// Map "/name" (len bytes, not necessarily NUL terminated) to its opcode.
+command_id_t command_lookup(const char *cmd, size_t len);
+const char *command_name(command_id_t id);
+
+#endif // COMMAND_TABLE_H
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Generates command_table.c - the perfect hash used by handle_command().
+Run: python3 gen_command_table.py > command_table.c
+
+Keep COMMANDS in the same order as command_id_t in command_table.h.
+Rerun after adding a command; the script searches for multipliers that
+give every command its own slot so lookup is one hash and one memcmp.
+"""
+
+import sys
+
+COMMANDS = [
+    ("CMD_USERNAME", "username"),
+    ("CMD_JOIN", "join"),
+    ("CMD_BROADCAST", "broadcast"),
+    ("CMD_LEAVE", "leave"),
+    ("CMD_WHISPER", "whisper"),
+    ("CMD_SENDFILE", "sendfile"),
+    ("CMD_LIST", "list"),
+    ("CMD_EXIT", "exit"),
+    ("CMD_HELP", "help"),
+    ("CMD_HISTORY", "history"),
+    ("CMD_COMPRESS", "compress"),
+    ("CMD_PRESENCE", "presence"),
+    ("CMD_TYPING", "typing"),
+    ("CMD_DATA", "data"),
+    ("CMD_SESSION", "session"),
+    ("CMD_RESUME", "resume"),
+]
+
+
+def slot(name, mul_len, mul_first, size):
+    return (mul_len * len(name) + mul_first * ord(name[0]) + ord(name[-1])) & (size - 1)
+
+
+def search():
+    size = 16
+    while size <= 1024:
+        for mul_len in range(1, 64):
+            for mul_first in range(0, 64):
+                slots = {slot(n, mul_len, mul_first, size) for _, n in COMMANDS}
+                if len(slots) == len(COMMANDS):
+                    return size, mul_len, mul_first
+        size *= 2
+    sys.exit("no perfect hash found")
+
+
+def main():
+    size, mul_len, mul_first = search()
+    table = [None] * size
+    for enum_name, name in COMMANDS:
+        table[slot(name, mul_len, mul_first, size)] = (enum_name, name)
+
+    out = []
+    out.append("// Generated by gen_command_table.py - do not edit by hand.")
+    out.append('#include "command_table.h"')
+    out.append("#include <string.h>")
+    out.append("")
+    out.append("#define COMMAND_TABLE_SIZE %d" % size)
+    out.append("#define COMMAND_HASH_MUL_LEN %d" % mul_len)
+    out.append("#define COMMAND_HASH_MUL_FIRST %d" % mul_first)
+    out.append("")
+    out.append("typedef struct {")
+    out.append("    const char *name;   // without the leading '/'")
+    out.append("    unsigned char len;")
+    out.append("    command_id_t id;")
+    out.append("} command_slot_t;")
+    out.append("")
+    out.append("static const command_slot_t command_slots[COMMAND_TABLE_SIZE] = {")
+    for i, entry in enumerate(table):
+        if entry:
+            enum_name, name = entry
+            out.append('    [%d] = {"%s", %d, %s},' % (i, name, len(name), enum_name))
+    out.append("};")
+    out.append("")
+    out.append("static const char *const command_names[CMD_COUNT] = {")
+    for enum_name, name in COMMANDS:
+        out.append('    [%s] = "/%s",' % (enum_name, name))
+    out.append("};")
+    out.append("")
+    out.append("command_id_t command_lookup(const char *cmd, size_t len) {")
+    out.append("    if (len < 2 || cmd[0] != '/') return CMD_UNKNOWN;")
+    out.append("    cmd++;")
+    out.append("    len--;")
+    out.append("    unsigned int h = (COMMAND_HASH_MUL_LEN * (unsigned int)len +")
+    out.append("                      COMMAND_HASH_MUL_FIRST * (unsigned char)cmd[0] +")
+    out.append("                      (unsigned char)cmd[len - 1]) & (COMMAND_TABLE_SIZE - 1);")
+    out.append("    const command_slot_t *s = &command_slots[h];")
+    out.append("    if (s->name && s->len == len && memcmp(s->name, cmd, len) == 0) {")
+    out.append("        return s->id;")
+    out.append("    }")
+    out.append("    return CMD_UNKNOWN;")
+    out.append("}")
+    out.append("")
+    out.append("const char *command_name(command_id_t id) {")
+    out.append("    if (id < 0 || id >= CMD_COUNT) return \"unknown\";")
+    out.append("    return command_names[id];")
+    out.append("}")
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
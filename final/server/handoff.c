@@ -0,0 +1,256 @@
+#include "handoff.h"
+#include <poll.h>
+#include <sys/wait.h>
+
+#define HANDOFF_MAGIC 0x48525354u   // "HRST"
+#define HANDOFF_MAX_FDS (MAX_CLIENTS + 1)
+#define HANDOFF_READY_BYTE 'R'
+
+// Sent together with the fds; the tables follow as a plain byte stream
+typedef struct {
+    uint32_t magic;
+    uint32_t fd_count;          // listening socket + one per active client
+    uint32_t room_count;
+    uint32_t queued_count;
+    uint32_t session_count;
+} handoff_header_t;
+
+void log_event(const char *format, ...);
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_state(int sock, const handoff_state_t *st) {
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count = 0;
+    fds[fd_count++] = st->listen_fd;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (st->clients[i].active) fds[fd_count++] = st->clients[i].socket;
+    }
+
+    handoff_header_t hdr = {
+        .magic = HANDOFF_MAGIC,
+        .fd_count = fd_count,
+        .room_count = st->room_count,
+        .queued_count = st->queued_count,
+        .session_count = st->session_count
+    };
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+    if (sendmsg(sock, &msg, 0) != sizeof(hdr)) return -1;
+
+    if (write_all(sock, st->clients, sizeof(st->clients)) < 0) return -1;
+    if (write_all(sock, st->rooms, sizeof(st->rooms)) < 0) return -1;
+    if (write_all(sock, st->queued, sizeof(FileMeta) * st->queued_count) < 0) return -1;
+    if (write_all(sock, st->sessions, sizeof(session_t) * st->session_count) < 0) return -1;
+    if (write_all(sock, st->carried_len, sizeof(st->carried_len)) < 0) return -1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (st->carried_len[i] > 0 && write_all(sock, st->carried[i], st->carried_len[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Build argv for the new process: the old arguments minus any previous
+// --hot-restart-fd, plus one naming our end of the socketpair
+static char **child_argv(char *const argv[], int fd) {
+    int argc = 0;
+    while (argv[argc]) argc++;
+    char **out = calloc(argc + 3, sizeof(char *));
+    if (!out) return NULL;
+
+    int n = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], HANDOFF_FD_OPTION) == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        out[n++] = argv[i];
+    }
+    static char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    out[n++] = HANDOFF_FD_OPTION;
+    out[n++] = fd_str;
+    out[n] = NULL;
+    return out;
+}
+
+pid_t handoff_start(const char *exec_path, char *const argv[], const handoff_state_t *st) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_event("[HOT_RESTART_ERROR] socketpair failed: %s", strerror(errno));
+        return -1;
+    }
+    char **new_argv = child_argv(argv, sv[1]);
+    if (!new_argv) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_event("[HOT_RESTART_ERROR] fork failed: %s", strerror(errno));
+        free(new_argv);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // Only stdio and our end of the pair survive, everything else arrives via SCM_RIGHTS
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd < 0 || max_fd > 4096) max_fd = 4096;
+        for (int fd = 3; fd < max_fd; fd++) {
+            if (fd != sv[1]) close(fd);
+        }
+        execv(exec_path, new_argv);
+        _exit(127);
+    }
+
+    free(new_argv);
+    close(sv[1]);
+
+    if (send_state(sv[0], st) < 0) {
+        log_event("[HOT_RESTART_ERROR] Sending state to pid %d failed: %s", (int)pid, strerror(errno));
+        goto fail;
+    }
+
+    struct pollfd pfd = { .fd = sv[0], .events = POLLIN };
+    char ack = 0;
+    int ready;
+    while ((ready = poll(&pfd, 1, HANDOFF_READY_TIMEOUT_MS)) < 0 && errno == EINTR) {}
+    if (ready <= 0 || read(sv[0], &ack, 1) != 1 || ack != HANDOFF_READY_BYTE) {
+        log_event("[HOT_RESTART_ERROR] New process %d did not become ready", (int)pid);
+        goto fail;
+    }
+    close(sv[0]);
+    return pid;
+
+fail:
+    close(sv[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+int handoff_receive(int fd, handoff_state_t *st) {
+    memset(st, 0, sizeof(*st));
+
+    handoff_header_t hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+    if (n != sizeof(hdr) || hdr.magic != HANDOFF_MAGIC || (msg.msg_flags & MSG_CTRUNC)) {
+        log_event("[HOT_RESTART_ERROR] Bad handoff header");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * hdr.fd_count) ||
+        hdr.fd_count < 1 || hdr.fd_count > HANDOFF_MAX_FDS ||
+        hdr.room_count > MAX_GROUPS || hdr.queued_count > MAX_FILE_QUEUE ||
+        hdr.session_count > SESSION_SLOTS) {
+        log_event("[HOT_RESTART_ERROR] Handoff carried an unexpected fd set");
+        return -1;
+    }
+    int fds[HANDOFF_MAX_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * hdr.fd_count);
+
+    if (read_all(fd, st->clients, sizeof(st->clients)) < 0 ||
+        read_all(fd, st->rooms, sizeof(st->rooms)) < 0 ||
+        read_all(fd, st->queued, sizeof(FileMeta) * hdr.queued_count) < 0 ||
+        read_all(fd, st->sessions, sizeof(session_t) * hdr.session_count) < 0 ||
+        read_all(fd, st->carried_len, sizeof(st->carried_len)) < 0) {
+        log_event("[HOT_RESTART_ERROR] Handoff tables truncated");
+        for (uint32_t i = 0; i < hdr.fd_count; i++) close(fds[i]);
+        return -1;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (st->carried_len[i] < 0 || st->carried_len[i] >= BUFFER_SIZE ||
+            read_all(fd, st->carried[i], st->carried_len[i]) < 0) {
+            log_event("[HOT_RESTART_ERROR] Handoff input of client %d truncated", i);
+            for (uint32_t j = 0; j < hdr.fd_count; j++) close(fds[j]);
+            return -1;
+        }
+    }
+
+    // Client fds were sent in slot order, swap them in for the old numbers
+    st->listen_fd = fds[0];
+    uint32_t next = 1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!st->clients[i].active) {
+            st->clients[i].socket = -1;
+        } else if (next < hdr.fd_count) {
+            st->clients[i].socket = fds[next++];
+        } else {
+            st->clients[i].active = 0;
+            st->clients[i].socket = -1;
+        }
+    }
+    st->room_count = hdr.room_count;
+    st->queued_count = hdr.queued_count;
+    st->session_count = hdr.session_count;
+    for (int i = 0; i < st->queued_count; i++) {
+        st->queued[i].sender_socket = -1;
+        st->queued[i].recipient_socket = -1;
+    }
+    return 0;
+}
+
+void handoff_ready(int fd) {
+    char ack = HANDOFF_READY_BYTE;
+    write_all(fd, &ack, 1);
+    close(fd);
+}
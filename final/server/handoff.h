@@ -0,0 +1,42 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+#include "../shared/chatDefination.h"
+#include "session.h"
+
+// Hot restart: the running server forks and execs the (possibly upgraded)
+// binary, then passes it the listening socket and every client socket over
+// a Unix socketpair with SCM_RIGHTS, followed by the clients/rooms tables,
+// the queued file transfers, the resumable sessions and any input a reader
+// had received but not yet run. The old process exits once the new one
+// reports it is serving, so clients never see their connection drop.
+
+#define HANDOFF_FD_OPTION "--hot-restart-fd"
+#define HANDOFF_READY_TIMEOUT_MS 5000   // new process must be serving by then
+#define HANDOFF_PARK_TIMEOUT_MS 2000    // readers finishing their current command
+#define HANDOFF_DRAIN_TIMEOUT_MS 5000   // running transfers finishing
+
+typedef struct {
+    int listen_fd;
+    client_info_t clients[MAX_CLIENTS];     // socket is an fd of the receiving process
+    room_t rooms[MAX_GROUPS];
+    int room_count;
+    FileMeta queued[MAX_FILE_QUEUE];        // oldest first, sockets are not carried over
+    int queued_count;
+    session_t sessions[SESSION_SLOTS];      // attached and detached, timers are re-armed
+    int session_count;
+    char carried[MAX_CLIENTS][BUFFER_SIZE]; // start of a line cut off by a reader's last read
+    int carried_len[MAX_CLIENTS];
+} handoff_state_t;
+
+// Old process: exec exec_path with argv plus --hot-restart-fd, send st and
+// wait for the new process to become ready. Returns its pid, or -1.
+pid_t handoff_start(const char *exec_path, char *const argv[], const handoff_state_t *st);
+
+// New process: receive the state sent by handoff_start() on fd
+int handoff_receive(int fd, handoff_state_t *st);
+// New process: tell the old one it can exit, then close fd
+void handoff_ready(int fd);
+
+#endif // HANDOFF_H
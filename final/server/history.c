@@ -0,0 +1,172 @@
+#include "history.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HISTORY_MAGIC 0x48495354u  // "HIST"
+#define HISTORY_HEADER_SIZE 4096   // keep entries page aligned in the segment
+
+static history_ring_t rings[MAX_GROUPS];
+static const char *history_dir = NULL;
+
+void log_event(const char *format, ...);
+
+void history_init(const char *segment_dir) {
+    history_dir = segment_dir;
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        pthread_mutex_init(&rings[i].lock, NULL);
+        rings[i].hdr = NULL;
+        rings[i].entries = NULL;
+        rings[i].map = NULL;
+    }
+    if (history_dir && mkdir(history_dir, 0755) < 0 && errno != EEXIST) {
+        log_event("[HISTORY_ERROR] Cannot create '%s': %s, using in-memory rings", history_dir, strerror(errno));
+        history_dir = NULL;
+    }
+}
+
+static int history_map_segment(history_ring_t *ring, const char *room_name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.seg", history_dir, room_name);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+
+    size_t size = HISTORY_HEADER_SIZE + (size_t)HISTORY_SEGMENT_LEN * sizeof(history_entry_t);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    ring->map = map;
+    ring->map_size = size;
+    ring->hdr = map;
+    ring->entries = (history_entry_t *)((char *)map + HISTORY_HEADER_SIZE);
+    if (ring->hdr->magic != HISTORY_MAGIC || ring->hdr->capacity != HISTORY_SEGMENT_LEN) {
+        ring->hdr->magic = HISTORY_MAGIC;
+        ring->hdr->capacity = HISTORY_SEGMENT_LEN;
+        ring->hdr->head = 0;
+    }
+    // The segment is read back as is; a corrupt length would overrun replay
+    uint64_t retained = ring->hdr->head < HISTORY_SEGMENT_LEN ? ring->hdr->head : HISTORY_SEGMENT_LEN;
+    for (uint64_t i = 0; i < retained; i++) {
+        if (ring->entries[i].len > sizeof(ring->entries[i].text)) {
+            log_event("[HISTORY_ERROR] Corrupt entry in %s, discarding its history", path);
+            ring->hdr->head = 0;
+            break;
+        }
+    }
+    log_event("[HISTORY] Room '%s' mapped to %s (%lu messages retained)", room_name, path,
+              (unsigned long)(ring->hdr->head < HISTORY_SEGMENT_LEN ? ring->hdr->head : HISTORY_SEGMENT_LEN));
+    return 0;
+}
+
+// Called when a room slot is created (rooms_mutex held by caller)
+int history_open_room(int room_index, const char *room_name) {
+    if (room_index < 0 || room_index >= MAX_GROUPS) return -1;
+    history_ring_t *ring = &rings[room_index];
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->hdr) {
+        pthread_mutex_unlock(&ring->lock);
+        return 0;
+    }
+
+    if (!history_dir || history_map_segment(ring, room_name) < 0) {
+        if (history_dir) {
+            log_event("[HISTORY_ERROR] Cannot map segment for '%s', using in-memory ring", room_name);
+        }
+        ring->hdr = calloc(1, sizeof(history_header_t));
+        ring->entries = calloc(HISTORY_RING_LEN, sizeof(history_entry_t));
+        if (!ring->hdr || !ring->entries) {
+            free(ring->hdr);
+            free(ring->entries);
+            ring->hdr = NULL;
+            ring->entries = NULL;
+            pthread_mutex_unlock(&ring->lock);
+            return -1;
+        }
+        ring->hdr->magic = HISTORY_MAGIC;
+        ring->hdr->capacity = HISTORY_RING_LEN;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+void history_append(int room_index, const char *msg, size_t len) {
+    if (room_index < 0 || room_index >= MAX_GROUPS) return;
+    history_ring_t *ring = &rings[room_index];
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->hdr) {
+        history_entry_t *e = &ring->entries[ring->hdr->head % ring->hdr->capacity];
+        if (len > sizeof(e->text)) len = sizeof(e->text);
+        memcpy(e->text, msg, len);
+        e->len = (uint16_t)len;
+        ring->hdr->head++;
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Send up to limit messages, skipping the offset most recent ones, oldest
+// first in a single write. Returns the number of messages sent.
+int history_replay(int room_index, int socket, int offset, int limit) {
+    if (room_index < 0 || room_index >= MAX_GROUPS || offset < 0 || limit <= 0) return 0;
+    if (limit > HISTORY_MAX_LIMIT) limit = HISTORY_MAX_LIMIT;
+    history_ring_t *ring = &rings[room_index];
+
+    char *out = malloc((size_t)limit * sizeof(history_entry_t) + 64);
+    if (!out) return 0;
+
+    pthread_mutex_lock(&ring->lock);
+    if (!ring->hdr) {
+        pthread_mutex_unlock(&ring->lock);
+        free(out);
+        return 0;
+    }
+    uint64_t head = ring->hdr->head;
+    uint64_t available = head < ring->hdr->capacity ? head : ring->hdr->capacity;
+    if ((uint64_t)offset >= available) {
+        pthread_mutex_unlock(&ring->lock);
+        free(out);
+        return 0;
+    }
+    uint64_t end = head - offset;
+    uint64_t count = available - offset < (uint64_t)limit ? available - offset : (uint64_t)limit;
+
+    size_t out_len = snprintf(out, 64, "[HISTORY] %lu earlier message(s):\n", (unsigned long)count);
+    for (uint64_t seq = end - count; seq < end; seq++) {
+        history_entry_t *e = &ring->entries[seq % ring->hdr->capacity];
+        size_t len = e->len < sizeof(e->text) ? e->len : sizeof(e->text);
+        memcpy(out + out_len, e->text, len);
+        out_len += len;
+        out[out_len++] = '\n';
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    send(socket, out, out_len, 0);
+    free(out);
+    return (int)count;
+}
+
+void history_close(void) {
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        history_ring_t *ring = &rings[i];
+        pthread_mutex_lock(&ring->lock);
+        if (ring->map) {
+            msync(ring->map, ring->map_size, MS_ASYNC);
+            munmap(ring->map, ring->map_size);
+        } else {
+            free(ring->hdr);
+            free(ring->entries);
+        }
+        ring->hdr = NULL;
+        ring->entries = NULL;
+        ring->map = NULL;
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Per-room ring of recent broadcasts. Each ring has its own lock so
+// replaying history never holds clients_mutex or rooms_mutex.
+// With a segment directory configured the ring lives in an mmap'd file
+// (history/<room>.seg) that holds more entries and survives restarts.
+
+#define HISTORY_RING_LEN 64         // entries kept in memory per room
+#define HISTORY_SEGMENT_LEN 4096    // entries per room when mmap-backed
+#define HISTORY_ENTRY_SIZE 1152     // fits a formatted [BROADCAST] line
+#define HISTORY_REPLAY_COUNT 20     // sent to a client on /join
+#define HISTORY_MAX_LIMIT 50        // max entries per /history request
+
+typedef struct {
+    uint16_t len;
+    char text[HISTORY_ENTRY_SIZE - sizeof(uint16_t)];
+} history_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    uint64_t head;      // number of messages ever appended
+} history_header_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    history_header_t *hdr;
+    history_entry_t *entries;
+    void *map;          // segment mapping, NULL for in-memory rings
+    size_t map_size;
+} history_ring_t;
+
+void history_init(const char *segment_dir);
+int history_open_room(int room_index, const char *room_name);
+void history_append(int room_index, const char *msg, size_t len);
+int history_replay(int room_index, int socket, int offset, int limit);
+void history_close(void);
+
+#endif // HISTORY_H
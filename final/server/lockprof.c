@@ -0,0 +1,195 @@
+#include "lockprof.h"
+#include <semaphore.h>
+#include <stdarg.h>
+
+typedef struct {
+    const char *file;       // NULL = free slot
+    int line;
+    const char *func;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns, max_wait_ns;
+    uint64_t hold_ns, max_hold_ns;
+} lockprof_site_t;
+
+// Site stats are only written by the thread holding the lock they describe,
+// so the profiled mutex itself protects its table.
+typedef struct {
+    pthread_mutex_t *mutex;
+    const char *name;
+    lockprof_site_t *holder_site;
+    uint64_t acquired_ns;
+    lockprof_site_t sites[LOCKPROF_MAX_SITES];
+} lockprof_lock_t;
+
+static lockprof_lock_t locks[LOCKPROF_MAX_LOCKS];
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t dump_sem;
+
+void log_event(const char *format, ...);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static lockprof_lock_t *find_lock(pthread_mutex_t *m, const char *name) {
+    for (int i = 0; i < LOCKPROF_MAX_LOCKS; i++) {
+        if (__atomic_load_n(&locks[i].mutex, __ATOMIC_ACQUIRE) == m) return &locks[i];
+    }
+    if (!name) return NULL;
+
+    // First use of this mutex, register it
+    pthread_mutex_lock(&registry_mutex);
+    lockprof_lock_t *found = NULL;
+    for (int i = 0; i < LOCKPROF_MAX_LOCKS && !found; i++) {
+        if (locks[i].mutex == m) {
+            found = &locks[i];
+        } else if (locks[i].mutex == NULL) {
+            locks[i].name = name;
+            __atomic_store_n(&locks[i].mutex, m, __ATOMIC_RELEASE);
+            found = &locks[i];
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return found;
+}
+
+// Call sites are keyed by the __FILE__ pointer and line. Caller holds the lock.
+static lockprof_site_t *find_site(lockprof_lock_t *l, const char *file, int line, const char *func) {
+    uint32_t start = ((uint32_t)line * 2654435761u) % LOCKPROF_MAX_SITES;
+    for (int i = 0; i < LOCKPROF_MAX_SITES; i++) {
+        lockprof_site_t *s = &l->sites[(start + i) % LOCKPROF_MAX_SITES];
+        if (s->file == NULL) {
+            s->file = file;
+            s->line = line;
+            s->func = func;
+            return s;
+        }
+        if (s->line == line && s->file == file) return s;
+    }
+    return NULL;
+}
+
+void lockprof_lock(pthread_mutex_t *m, const char *name, const char *file, int line, const char *func) {
+    uint64_t wait_ns = 0;
+    int contended = 0;
+    if (pthread_mutex_trylock(m) != 0) {
+        uint64_t start = now_ns();
+        pthread_mutex_lock(m);
+        wait_ns = now_ns() - start;
+        contended = 1;
+    }
+
+    lockprof_lock_t *l = find_lock(m, name);
+    if (!l) return;
+    lockprof_site_t *s = find_site(l, file, line, func);
+    l->holder_site = s;
+    l->acquired_ns = now_ns();
+    if (!s) return;
+    s->acquisitions++;
+    s->contended += contended;
+    s->wait_ns += wait_ns;
+    if (wait_ns > s->max_wait_ns) s->max_wait_ns = wait_ns;
+}
+
+void lockprof_unlock(pthread_mutex_t *m) {
+    lockprof_lock_t *l = find_lock(m, NULL);
+    if (l && l->holder_site) {
+        uint64_t hold = now_ns() - l->acquired_ns;
+        l->holder_site->hold_ns += hold;
+        if (hold > l->holder_site->max_hold_ns) l->holder_site->max_hold_ns = hold;
+        l->holder_site = NULL;
+    }
+    pthread_mutex_unlock(m);
+}
+
+static int by_wait_desc(const void *a, const void *b) {
+    const lockprof_site_t *x = a, *y = b;
+    return x->wait_ns < y->wait_ns ? 1 : x->wait_ns > y->wait_ns ? -1 : 0;
+}
+
+static void report(const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    log_event("%s", line);
+    fprintf(stderr, "%s\n", line);
+}
+
+void lockprof_dump(void) {
+    static lockprof_site_t snapshot[LOCKPROF_MAX_SITES];
+    report("[LOCKPROF] Contention report (wait = blocked in lock, hold = lock to unlock)");
+
+    for (int i = 0; i < LOCKPROF_MAX_LOCKS; i++) {
+        lockprof_lock_t *l = &locks[i];
+        pthread_mutex_t *m = __atomic_load_n(&l->mutex, __ATOMIC_ACQUIRE);
+        if (!m) continue;
+
+        // Copy under the lock itself so the numbers are consistent
+        pthread_mutex_lock(m);
+        memcpy(snapshot, l->sites, sizeof(snapshot));
+        pthread_mutex_unlock(m);
+
+        int n = 0;
+        uint64_t acq = 0, cont = 0, wait = 0, hold = 0;
+        for (int s = 0; s < LOCKPROF_MAX_SITES; s++) {
+            if (!snapshot[s].file) continue;
+            snapshot[n++] = snapshot[s];
+            acq += snapshot[s].acquisitions;
+            cont += snapshot[s].contended;
+            wait += snapshot[s].wait_ns;
+            hold += snapshot[s].hold_ns;
+        }
+        qsort(snapshot, n, sizeof(lockprof_site_t), by_wait_desc);
+
+        report("[LOCKPROF] %s: %lu acquisitions, %lu contended (%.1f%%), wait %.3f ms, hold %.3f ms",
+               l->name, (unsigned long)acq, (unsigned long)cont, acq ? 100.0 * cont / acq : 0.0,
+               wait / 1e6, hold / 1e6);
+        for (int s = 0; s < n; s++) {
+            lockprof_site_t *site = &snapshot[s];
+            const char *file = strrchr(site->file, '/');
+            report("[LOCKPROF]   %s:%d %-26s acq %8lu  contended %6lu  wait %9.3f ms (max %7.3f)  hold %9.3f ms (max %7.3f)",
+                   file ? file + 1 : site->file, site->line, site->func,
+                   (unsigned long)site->acquisitions, (unsigned long)site->contended,
+                   site->wait_ns / 1e6, site->max_wait_ns / 1e6,
+                   site->hold_ns / 1e6, site->max_hold_ns / 1e6);
+        }
+    }
+}
+
+// Signal handlers may only sem_post; the report is written from this thread
+static void *dump_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        if (sem_wait(&dump_sem) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        lockprof_dump();
+    }
+    return NULL;
+}
+
+static void dump_signal(int signal) {
+    (void)signal;
+    sem_post(&dump_sem);
+}
+
+int lockprof_init(void) {
+    if (sem_init(&dump_sem, 0, 0) < 0) return -1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dump_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+
+    struct sigaction sa;
+    sa.sa_handler = dump_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) < 0) return -1;
+    log_event("[LOCKPROF] Lock profiling enabled, send SIGUSR1 for a report");
+    return 0;
+}
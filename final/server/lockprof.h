@@ -0,0 +1,30 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Lock contention profiler. Build with `make LOCKPROF=1` (-DLOCK_PROFILE)
+// and every LOCK()/UNLOCK() records wait and hold time per call site;
+// SIGUSR1 writes a report sorted by total wait to server.log and stderr.
+// Without the flag LOCK()/UNLOCK() are plain pthread calls.
+
+#define LOCKPROF_MAX_LOCKS 8
+#define LOCKPROF_MAX_SITES 128      // per lock
+
+#ifdef LOCK_PROFILE
+#define LOCK(m) lockprof_lock(&(m), #m, __FILE__, __LINE__, __func__)
+#define UNLOCK(m) lockprof_unlock(&(m))
+#else
+#define LOCK(m) pthread_mutex_lock(&(m))
+#define UNLOCK(m) pthread_mutex_unlock(&(m))
+#endif
+
+void lockprof_lock(pthread_mutex_t *m, const char *name, const char *file, int line, const char *func);
+void lockprof_unlock(pthread_mutex_t *m);
+
+// Start the report thread and install the SIGUSR1 handler
+int lockprof_init(void);
+void lockprof_dump(void);
+
+#endif // LOCKPROF_H
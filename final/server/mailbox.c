@@ -0,0 +1,298 @@
+#include "mailbox.h"
+#include "../shared/textscan.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define MAILBOX_MAGIC 0x4d424f58u  // "MBOX"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slots;
+    mailbox_index_entry_t entries[MAILBOX_INDEX_SLOTS];
+} mailbox_index_t;
+
+static mailbox_index_t *mailbox_index = NULL;
+static pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void log_event(const char *format, ...);
+
+// Usernames become file names, so only allow what the client allows
+static int mailbox_valid_name(const char *username) {
+    return text_is_name(username, 1, MAX_USERNAME_LENGTH - 1);
+}
+
+static uint32_t mailbox_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Find the index slot for username; with create set, claim a free slot.
+// Caller holds mailbox_mutex. NULL once mailbox_close has run.
+static mailbox_index_entry_t *mailbox_slot(const char *username, int create) {
+    if (!mailbox_index) return NULL;
+    uint32_t start = mailbox_hash(username) % MAILBOX_INDEX_SLOTS;
+    mailbox_index_entry_t *reusable = NULL;
+
+    for (uint32_t i = 0; i < MAILBOX_INDEX_SLOTS; i++) {
+        mailbox_index_entry_t *e = &mailbox_index->entries[(start + i) % MAILBOX_INDEX_SLOTS];
+        if (e->username[0] == '\0') {
+            if (!reusable) reusable = e;
+            break;  // end of probe chain
+        }
+        if (strncmp(e->username, username, MAX_USERNAME_LENGTH) == 0) {
+            return e;
+        }
+        if (e->count == 0 && !reusable) {
+            reusable = e;
+        }
+    }
+
+    if (!create || !reusable) return NULL;
+    memset(reusable, 0, sizeof(*reusable));
+    strncpy(reusable->username, username, MAX_USERNAME_LENGTH - 1);
+    return reusable;
+}
+
+static void mailbox_path(const char *username, char *path, size_t size) {
+    snprintf(path, size, MAILBOX_DIR "/%s.mbox", username);
+}
+
+int mailbox_init(void) {
+    if (mkdir(MAILBOX_DIR, 0755) < 0 && errno != EEXIST) {
+        log_event("[MAILBOX_ERROR] Cannot create directory '%s': %s", MAILBOX_DIR, strerror(errno));
+        return -1;
+    }
+
+    int fd = open(MAILBOX_INDEX_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_event("[MAILBOX_ERROR] Cannot open index: %s", strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    int fresh = (fstat(fd, &st) == 0 && st.st_size != sizeof(mailbox_index_t));
+    if (fresh && ftruncate(fd, sizeof(mailbox_index_t)) < 0) {
+        log_event("[MAILBOX_ERROR] Cannot size index: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    mailbox_index = mmap(NULL, sizeof(mailbox_index_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mailbox_index == MAP_FAILED) {
+        mailbox_index = NULL;
+        log_event("[MAILBOX_ERROR] Cannot map index: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fresh || mailbox_index->magic != MAILBOX_MAGIC || mailbox_index->slots != MAILBOX_INDEX_SLOTS) {
+        memset(mailbox_index, 0, sizeof(mailbox_index_t));
+        mailbox_index->magic = MAILBOX_MAGIC;
+        mailbox_index->slots = MAILBOX_INDEX_SLOTS;
+    }
+
+    int pending = 0;
+    for (int i = 0; i < MAILBOX_INDEX_SLOTS; i++) {
+        if (mailbox_index->entries[i].count > 0) pending++;
+    }
+    log_event("[MAILBOX] Index mapped, %d mailboxes with pending messages", pending);
+    return 0;
+}
+
+int mailbox_store(const char *username, mailbox_kind_t kind, const char *text) {
+    if (!mailbox_index || !mailbox_valid_name(username)) return -1;
+
+    size_t len = strlen(text);
+    if (len > MAILBOX_MAX_RECORD) len = MAILBOX_MAX_RECORD;
+    mailbox_record_t rec = { .kind = (uint8_t)kind, .len = (uint16_t)len };
+
+    pthread_mutex_lock(&mailbox_mutex);
+    mailbox_index_entry_t *e = mailbox_slot(username, 1);
+    if (!e) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        if (mailbox_index) log_event("[MAILBOX_ERROR] Index full, dropping message for '%s'", username);
+        return -1;
+    }
+    if (e->bytes + sizeof(rec) + len > MAILBOX_MAX_BYTES) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        log_event("[MAILBOX_ERROR] Mailbox of '%s' is full (%u bytes)", username, e->bytes);
+        return -1;
+    }
+
+    char path[64];
+    mailbox_path(username, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        log_event("[MAILBOX_ERROR] Cannot open '%s': %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = &rec, .iov_len = sizeof(rec) },
+        { .iov_base = (void *)text, .iov_len = len },
+    };
+    ssize_t written = writev(fd, iov, 2);
+    close(fd);
+    if (written != (ssize_t)(sizeof(rec) + len)) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        log_event("[MAILBOX_ERROR] Short write to '%s'", path);
+        return -1;
+    }
+
+    e->count++;
+    e->bytes += written;
+    log_event("[MAILBOX_STORE] Stored %s for '%s' (%u pending, %u bytes)",
+              kind == MAILBOX_WHISPER ? "whisper" : "file offer", username, e->count, e->bytes);
+    pthread_mutex_unlock(&mailbox_mutex);
+    return 0;
+}
+
+// Remove the first taken bytes of a mailbox holding total bytes, keeping
+// what was stored after them. Caller holds mailbox_mutex.
+static int mailbox_drop_front(const char *path, size_t taken, size_t total) {
+    if (taken >= total) return unlink(path);
+
+    char rest[MAILBOX_MAX_BYTES];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, rest, total - taken, taken);
+    close(fd);
+    if (n != (ssize_t)(total - taken)) return -1;
+
+    char tmp[80];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int ok = write(fd, rest, n) == n;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Send one chunk, all of it or fail
+static int mailbox_send(int socket, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send all pending records to socket in MAILBOX_DELIVERY_CHUNK sized writes,
+// then drop them. The lock is only held to map what is there and, once it
+// is all written, to remove it: a slow reader never holds up stores, and
+// records that could not be sent stay for the next login. Returns the
+// number of records delivered.
+int mailbox_deliver(const char *username, int socket) {
+    if (!mailbox_index || !mailbox_valid_name(username)) return 0;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    mailbox_index_entry_t *e = mailbox_slot(username, 0);
+    if (!e || e->count == 0) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        return 0;
+    }
+
+    char path[64];
+    mailbox_path(username, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_event("[MAILBOX_ERROR] Index lists %u messages for '%s' but file is missing", e->count, username);
+        e->count = 0;
+        e->bytes = 0;
+        pthread_mutex_unlock(&mailbox_mutex);
+        return 0;
+    }
+
+    // Mailboxes are capped at MAILBOX_MAX_BYTES, so map the whole file. The
+    // mapping keeps these bytes after unlocking: stores only append past them.
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        log_event("[MAILBOX_ERROR] Index lists %u messages for '%s' but file is empty", e->count, username);
+        e->count = 0;
+        e->bytes = 0;
+        pthread_mutex_unlock(&mailbox_mutex);
+        return 0;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        pthread_mutex_unlock(&mailbox_mutex);
+        log_event("[MAILBOX_ERROR] Cannot map '%s': %s", path, strerror(errno));
+        return 0;
+    }
+    uint32_t records = e->count;
+    size_t taken = st.st_size;
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    char out[MAILBOX_DELIVERY_CHUNK];
+    int out_len = snprintf(out, sizeof(out), "[SERVER] %u message(s) arrived while you were offline:\n", records);
+    int delivered = 0;
+    int failed = 0;
+    size_t pos = 0;
+
+    while (!failed && pos + sizeof(mailbox_record_t) <= taken) {
+        mailbox_record_t rec;
+        memcpy(&rec, data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (rec.len > MAILBOX_MAX_RECORD || pos + rec.len > taken) break;
+
+        if (out_len + rec.len + 1 > (int)sizeof(out)) {
+            failed = mailbox_send(socket, out, out_len) < 0;
+            out_len = 0;
+        }
+        memcpy(out + out_len, data + pos, rec.len);
+        out_len += rec.len;
+        out[out_len++] = '\n';
+        pos += rec.len;
+        delivered++;
+    }
+    if (!failed && out_len > 0) {
+        failed = mailbox_send(socket, out, out_len) < 0;
+    }
+    munmap((void *)data, st.st_size);
+
+    if (failed) {
+        log_event("[MAILBOX_ERROR] Delivery to '%s' failed, keeping %u message(s)", username, records);
+        return 0;
+    }
+
+    pthread_mutex_lock(&mailbox_mutex);
+    e = mailbox_slot(username, 0);
+    if (e && e->bytes >= taken) {
+        if (mailbox_drop_front(path, taken, e->bytes) == 0) {
+            e->count = e->count > records ? e->count - records : 0;
+            e->bytes -= taken;
+        } else {
+            // Left as it was: the next login gets these again rather than none
+            log_event("[MAILBOX_ERROR] Cannot trim '%s': %s", path, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    log_event("[MAILBOX_DELIVER] Delivered %d offline message(s) to '%s'", delivered, username);
+    return delivered;
+}
+
+void mailbox_close(void) {
+    pthread_mutex_lock(&mailbox_mutex);
+    if (mailbox_index) {
+        msync(mailbox_index, sizeof(mailbox_index_t), MS_SYNC);
+        munmap(mailbox_index, sizeof(mailbox_index_t));
+        mailbox_index = NULL;
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Offline mailboxes: one append-only file per username plus a fixed size
+// index file that is mmap'd at startup, so nothing is loaded into memory.
+
+#define MAILBOX_DIR "mailbox"
+#define MAILBOX_INDEX_FILE MAILBOX_DIR "/index"
+#define MAILBOX_INDEX_SLOTS 256
+#define MAILBOX_MAX_BYTES (64 * 1024)   // per user, keeps disk use bounded
+#define MAILBOX_DELIVERY_CHUNK 4096     // bytes per write when delivering
+#define MAILBOX_MAX_RECORD (BUFFER_SIZE * 2)
+
+typedef enum {
+    MAILBOX_WHISPER = 1,
+    MAILBOX_FILE_OFFER = 2
+} mailbox_kind_t;
+
+// On-disk record header, followed by len bytes of text
+typedef struct __attribute__((packed)) {
+    uint8_t kind;
+    uint16_t len;
+} mailbox_record_t;
+
+typedef struct {
+    char username[MAX_USERNAME_LENGTH];
+    uint32_t count;     // undelivered records, 0 = slot free for reuse
+    uint32_t bytes;     // size of the user's .mbox file
+} mailbox_index_entry_t;
+
+int mailbox_init(void);
+int mailbox_store(const char *username, mailbox_kind_t kind, const char *text);
+int mailbox_deliver(const char *username, int socket);
+void mailbox_close(void);
+
+#endif // MAILBOX_H
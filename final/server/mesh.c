@@ -0,0 +1,825 @@
+#include "mesh.h"
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+#define MESH_MAX_USERS (MESH_MAX_NODES * MAX_CLIENTS)
+#define MESH_MAX_RPC 64
+#define MESH_READ_SIZE (64 * 1024)
+#define MESH_MAX_FRAME (sizeof(mesh_frame_t) + MAX_GROUP_NAME_LENGTH + BUS_MAX_TEXT)
+
+typedef enum {
+    MESH_HELLO = 1,     // first frame on a new link, from = dialing node
+    MESH_CLAIM,         // target = username, answered with MESH_REPLY
+    MESH_ADOPT,         // target = username, registered without asking
+    MESH_RELEASE,
+    MESH_LOOKUP,        // answered with the node of target, -1 if offline
+    MESH_REPLY,         // id = request id, payload = int32 result
+    MESH_ROOM,          // target = username, payload = room ("" = none)
+    MESH_BROADCAST,     // target = room
+    MESH_WHISPER        // target = username
+} mesh_type_t;
+
+// Every field in network byte order, followed by target and payload
+typedef struct {
+    uint32_t len;           // bytes after the header
+    uint8_t type;
+    uint8_t from;
+    uint16_t target_len;
+    uint32_t id;
+} __attribute__((packed)) mesh_frame_t;
+
+typedef struct {
+    char name[MAX_USERNAME_LENGTH];
+    char room[MAX_GROUP_NAME_LENGTH];
+    int node;           // directory: session node; local: directory node we registered with
+    int used;
+} mesh_user_t;
+
+typedef struct {
+    char host[64];
+    int port;
+    int fd;
+    int up;                 // written under mesh_mutex and out_lock
+    uint32_t generation;    // bumped whenever the link is replaced or lost
+    pthread_mutex_t out_lock;
+    pthread_cond_t out_cond;
+    char *out;              // frames waiting for the writer
+    char *spare;            // what the writer is sending
+    size_t out_len;
+    mesh_user_t members[MAX_CLIENTS];   // that node's users and their rooms
+} mesh_peer_t;
+
+typedef struct {
+    uint32_t hash;
+    int node;
+} ring_point_t;
+
+typedef struct {
+    uint32_t id;
+    int done;
+    int32_t result;
+} mesh_rpc_t;
+
+typedef struct {
+    int node;
+    uint32_t generation;
+    int fd;
+} link_arg_t;
+
+static mesh_peer_t peers[MESH_MAX_NODES];
+static int node_count = 0;
+static int my_node = -1;
+static ring_point_t ring[MESH_MAX_NODES * MESH_VNODES];
+static int ring_size = 0;
+static mesh_user_t directory[MESH_MAX_USERS];    // names whose ring owner is us
+static mesh_user_t local_users[MAX_CLIENTS];     // sessions on this node
+static pthread_mutex_t mesh_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static mesh_rpc_t rpcs[MESH_MAX_RPC];
+static uint32_t next_rpc_id = 1;
+static pthread_mutex_t rpc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rpc_cond = PTHREAD_COND_INITIALIZER;
+
+static bus_handler_t handler_fn;
+static mesh_stats_t stats;
+static int mesh_running = 0;
+static int listen_fd = -1;
+
+void log_event(const char *format, ...);
+
+static void count(uint64_t *counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// FNV-1a with a murmur finalizer so similar names spread over the ring
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const ring_point_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+static void build_ring(void) {
+    char key[32];
+    ring_size = 0;
+    for (int node = 0; node < node_count; node++) {
+        for (int v = 0; v < MESH_VNODES; v++) {
+            snprintf(key, sizeof(key), "node%d#%d", node, v);
+            ring[ring_size].hash = hash_name(key);
+            ring[ring_size].node = node;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(ring_point_t), compare_points);
+}
+
+// Caller holds mesh_mutex
+static int node_live(int node) {
+    return node == my_node || peers[node].up;
+}
+
+// Directory node for a name: first live node clockwise from its hash.
+// Caller holds mesh_mutex.
+static int home_of(const char *username) {
+    uint32_t h = hash_name(username);
+    int lo = 0, hi = ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int i = 0; i < ring_size; i++) {
+        int node = ring[(lo + i) % ring_size].node;
+        if (node_live(node)) return node;
+    }
+    return my_node;
+}
+
+static mesh_user_t *find_user(mesh_user_t *table, int size, const char *username) {
+    for (int i = 0; i < size; i++) {
+        if (table[i].used && strcmp(table[i].name, username) == 0) return &table[i];
+    }
+    return NULL;
+}
+
+static mesh_user_t *free_user(mesh_user_t *table, int size) {
+    for (int i = 0; i < size; i++) {
+        if (!table[i].used) return &table[i];
+    }
+    return NULL;
+}
+
+// ---- directory, caller holds mesh_mutex ----
+
+static int dir_claim(const char *username, int node, int force) {
+    mesh_user_t *u = find_user(directory, MESH_MAX_USERS, username);
+    if (u) {
+        if (u->node != node && !force && node_live(u->node)) return -1;
+        u->node = node;
+        return 0;
+    }
+    u = free_user(directory, MESH_MAX_USERS);
+    if (!u) return -1;
+    snprintf(u->name, sizeof(u->name), "%s", username);
+    u->node = node;
+    u->used = 1;
+    return 0;
+}
+
+static void dir_release(const char *username, int node) {
+    mesh_user_t *u = find_user(directory, MESH_MAX_USERS, username);
+    if (u && u->node == node) u->used = 0;
+}
+
+static int dir_lookup(const char *username) {
+    if (find_user(local_users, MAX_CLIENTS, username)) return my_node;
+    mesh_user_t *u = find_user(directory, MESH_MAX_USERS, username);
+    return u && node_live(u->node) ? u->node : -1;
+}
+
+// ---- links ----
+
+// Append a frame to node's output buffer; never blocks on the network
+static int queue_frame(int node, mesh_type_t type, uint32_t id, const char *target,
+                       const void *payload, size_t len) {
+    size_t target_len = target ? strlen(target) : 0;
+    size_t total = sizeof(mesh_frame_t) + target_len + len;
+    mesh_peer_t *p = &peers[node];
+    pthread_mutex_lock(&p->out_lock);
+    if (!p->up || p->out_len + total > MESH_OUTBUF_SIZE) {
+        pthread_mutex_unlock(&p->out_lock);
+        count(&stats.dropped, 1);
+        return -1;
+    }
+    mesh_frame_t header = {
+        .len = htonl(target_len + len),
+        .type = type,
+        .from = my_node,
+        .target_len = htons(target_len),
+        .id = htonl(id)
+    };
+    char *dst = p->out + p->out_len;
+    memcpy(dst, &header, sizeof(header));
+    memcpy(dst + sizeof(header), target, target_len);
+    memcpy(dst + sizeof(header) + target_len, payload, len);
+    if (p->out_len == 0) pthread_cond_signal(&p->out_cond);
+    p->out_len += total;
+    pthread_mutex_unlock(&p->out_lock);
+    count(&stats.frames_sent, 1);
+    return 0;
+}
+
+// Tell the other nodes about a local user's room. Caller holds mesh_mutex.
+static void announce_room(const mesh_user_t *u, int only_node) {
+    for (int node = 0; node < node_count; node++) {
+        if (node == my_node || !peers[node].up || (only_node >= 0 && node != only_node)) continue;
+        queue_frame(node, MESH_ROOM, 0, u->name, u->room, strlen(u->room));
+    }
+}
+
+// Register u with the directory node it maps to now, if that changed or
+// force is set. Caller holds mesh_mutex.
+static void reregister(mesh_user_t *u, int force) {
+    int home = home_of(u->name);
+    if (home == u->node && !force) return;
+    u->node = home;
+    if (home == my_node) dir_claim(u->name, my_node, 1);
+    else queue_frame(home, MESH_ADOPT, 0, u->name, NULL, 0);
+}
+
+// The set of live nodes changed: hand off names we no longer own and move
+// our users to their new directory nodes. Caller holds mesh_mutex.
+static void rebalance(void) {
+    int moved = 0;
+    for (int i = 0; i < MESH_MAX_USERS; i++) {
+        if (directory[i].used && home_of(directory[i].name) != my_node) {
+            directory[i].used = 0;
+            moved++;
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (local_users[i].used) reregister(&local_users[i], 0);
+    }
+    if (moved) log_event("[MESH] %d directory entries moved to other nodes", moved);
+}
+
+// Caller holds mesh_mutex
+static void drop_link(int node) {
+    mesh_peer_t *p = &peers[node];
+    pthread_mutex_lock(&p->out_lock);
+    p->up = 0;
+    p->generation++;
+    p->out_len = 0;
+    pthread_cond_broadcast(&p->out_cond);
+    pthread_mutex_unlock(&p->out_lock);
+    shutdown(p->fd, SHUT_RDWR);
+    memset(p->members, 0, sizeof(p->members));
+    for (int i = 0; i < MESH_MAX_USERS; i++) {
+        if (directory[i].used && directory[i].node == node) directory[i].used = 0;
+    }
+}
+
+static void link_lost(int node, uint32_t generation) {
+    pthread_mutex_lock(&mesh_mutex);
+    if (peers[node].up && peers[node].generation == generation) {
+        drop_link(node);
+        rebalance();
+        log_event("[MESH] Link to node %d lost", node);
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *link_writer(void *arg) {
+    link_arg_t *link = arg;
+    mesh_peer_t *p = &peers[link->node];
+    while (1) {
+        pthread_mutex_lock(&p->out_lock);
+        while (p->out_len == 0 && p->generation == link->generation) {
+            pthread_cond_wait(&p->out_cond, &p->out_lock);
+        }
+        if (p->generation != link->generation) {
+            pthread_mutex_unlock(&p->out_lock);
+            break;
+        }
+        // Take everything queued so far; producers continue in the other buffer
+        char *batch = p->out;
+        size_t len = p->out_len;
+        p->out = p->spare;
+        p->spare = batch;
+        p->out_len = 0;
+        pthread_mutex_unlock(&p->out_lock);
+
+        if (write_all(link->fd, batch, len) < 0) {
+            shutdown(link->fd, SHUT_RDWR);      // the reader reports the loss
+            break;
+        }
+        count(&stats.writes, 1);
+        count(&stats.bytes_sent, len);
+    }
+    return NULL;
+}
+
+static void complete_rpc(uint32_t id, int32_t result) {
+    pthread_mutex_lock(&rpc_mutex);
+    for (int i = 0; i < MESH_MAX_RPC; i++) {
+        if (rpcs[i].id == id) {
+            rpcs[i].result = result;
+            rpcs[i].done = 1;
+            pthread_cond_broadcast(&rpc_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rpc_mutex);
+}
+
+// Send a request to node and wait for its MESH_REPLY; -1 on timeout
+static int32_t call(int node, mesh_type_t type, const char *target) {
+    pthread_mutex_lock(&rpc_mutex);
+    mesh_rpc_t *rpc = NULL;
+    for (int i = 0; i < MESH_MAX_RPC && !rpc; i++) {
+        if (rpcs[i].id == 0) rpc = &rpcs[i];
+    }
+    if (!rpc) {
+        pthread_mutex_unlock(&rpc_mutex);
+        return -1;
+    }
+    rpc->id = next_rpc_id++;
+    if (next_rpc_id == 0) next_rpc_id = 1;
+    rpc->done = 0;
+    rpc->result = -1;
+    uint32_t id = rpc->id;
+    pthread_mutex_unlock(&rpc_mutex);
+
+    count(&stats.rpcs, 1);
+    int queued = queue_frame(node, type, id, target, NULL, 0) == 0;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MESH_RPC_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (MESH_RPC_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&rpc_mutex);
+    while (queued && !rpc->done) {
+        if (pthread_cond_timedwait(&rpc_cond, &rpc_mutex, &deadline) != 0) break;
+    }
+    int32_t result = rpc->done ? rpc->result : -1;
+    if (queued && !rpc->done) {
+        log_event("[MESH_ERROR] Node %d did not answer a directory request for '%s'", node, target);
+    }
+    rpc->id = 0;
+    pthread_mutex_unlock(&rpc_mutex);
+    return result;
+}
+
+static void reply(int node, uint32_t id, int32_t result) {
+    int32_t wire = htonl(result);
+    queue_frame(node, MESH_REPLY, id, NULL, &wire, sizeof(wire));
+}
+
+static void handle_frame(int node, const mesh_frame_t *header, const char *body) {
+    uint32_t len = ntohl(header->len);
+    uint16_t target_len = ntohs(header->target_len);
+    uint32_t id = ntohl(header->id);
+    char target[MAX_GROUP_NAME_LENGTH];
+    snprintf(target, sizeof(target), "%.*s", (int)target_len, body);
+    const char *payload = body + target_len;
+    size_t payload_len = len - target_len;
+    count(&stats.frames_received, 1);
+
+    switch (header->type) {
+    case MESH_BROADCAST:
+    case MESH_WHISPER: {
+        if (payload_len > BUS_MAX_TEXT) return;
+        bus_msg_t msg;
+        msg.type = header->type == MESH_BROADCAST ? BUS_BROADCAST : BUS_WHISPER;
+        msg.from_node = node;
+        memcpy(msg.target, target, sizeof(msg.target));
+        msg.len = payload_len;
+        memcpy(msg.text, payload, payload_len);
+        handler_fn(&msg);
+        return;
+    }
+    case MESH_REPLY: {
+        int32_t result = -1;
+        if (payload_len == sizeof(result)) {
+            memcpy(&result, payload, sizeof(result));
+            result = ntohl(result);
+        }
+        complete_rpc(id, result);
+        return;
+    }
+    default:
+        break;
+    }
+
+    pthread_mutex_lock(&mesh_mutex);
+    switch (header->type) {
+    case MESH_CLAIM:
+        reply(node, id, dir_claim(target, node, 0));
+        break;
+    case MESH_ADOPT:
+        dir_claim(target, node, 1);
+        break;
+    case MESH_RELEASE:
+        dir_release(target, node);
+        break;
+    case MESH_LOOKUP:
+        reply(node, id, dir_lookup(target));
+        break;
+    case MESH_ROOM: {
+        mesh_peer_t *p = &peers[node];
+        mesh_user_t *u = find_user(p->members, MAX_CLIENTS, target);
+        if (payload_len == 0) {
+            if (u) u->used = 0;
+            break;
+        }
+        if (!u) u = free_user(p->members, MAX_CLIENTS);
+        if (!u) break;
+        snprintf(u->name, sizeof(u->name), "%.*s", MAX_USERNAME_LENGTH - 1, target);
+        snprintf(u->room, sizeof(u->room), "%.*s", (int)payload_len, payload);
+        u->used = 1;
+        break;
+    }
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+}
+
+// One per link: parses frames until the link fails, then tidies up
+static void *link_reader(void *arg) {
+    link_arg_t *link = arg;
+    pthread_t writer;
+    int have_writer = pthread_create(&writer, NULL, link_writer, link) == 0;
+    if (!have_writer) shutdown(link->fd, SHUT_RDWR);
+
+    char *buf = malloc(MESH_READ_SIZE + MESH_MAX_FRAME);
+    size_t len = 0;
+    while (buf && have_writer) {
+        ssize_t n = recv(link->fd, buf + len, MESH_READ_SIZE, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+
+        size_t pos = 0;
+        int bad = 0;
+        while (len - pos >= sizeof(mesh_frame_t)) {
+            mesh_frame_t header;
+            memcpy(&header, buf + pos, sizeof(header));
+            uint32_t body_len = ntohl(header.len);
+            if (sizeof(header) + body_len > MESH_MAX_FRAME || ntohs(header.target_len) > body_len ||
+                ntohs(header.target_len) >= MAX_GROUP_NAME_LENGTH) {
+                bad = 1;
+                break;
+            }
+            if (len - pos < sizeof(header) + body_len) break;
+            handle_frame(link->node, &header, buf + pos + sizeof(header));
+            pos += sizeof(header) + body_len;
+        }
+        if (bad) {
+            log_event("[MESH_ERROR] Malformed frame from node %d, dropping the link", link->node);
+            break;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+    free(buf);
+
+    link_lost(link->node, link->generation);
+    if (have_writer) pthread_join(writer, NULL);
+    close(link->fd);
+    free(link);
+    return NULL;
+}
+
+// A handshaken connection to node becomes its link, replacing any old one
+static void link_up(int node, int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    link_arg_t *link = malloc(sizeof(link_arg_t));
+    if (!link) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&mesh_mutex);
+    mesh_peer_t *p = &peers[node];
+    if (p->up) {
+        // The peer restarted before we noticed it was gone
+        drop_link(node);
+    }
+    pthread_mutex_lock(&p->out_lock);
+    p->fd = fd;
+    p->up = 1;
+    p->out_len = 0;
+    link->node = node;
+    link->generation = p->generation;
+    link->fd = fd;
+    pthread_mutex_unlock(&p->out_lock);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, link_reader, link) != 0) {
+        drop_link(node);
+        pthread_mutex_unlock(&mesh_mutex);
+        close(fd);
+        free(link);
+        return;
+    }
+    pthread_detach(reader);
+
+    rebalance();
+    // The peer starts from nothing: tell it our rooms and the names it owns
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        mesh_user_t *u = &local_users[i];
+        if (!u->used) continue;
+        if (u->room[0]) announce_room(u, node);
+        if (u->node == node) reregister(u, 1);
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+    log_event("[MESH] Link to node %d up (%s:%d)", node, p->host, p->port);
+}
+
+static int connect_to(const char *host, int port) {
+    char service[16];
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Each pair has one link: the higher node id dials the lower one
+static void *dialer(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&mesh_running, __ATOMIC_RELAXED)) {
+        for (int node = 0; node < my_node; node++) {
+            pthread_mutex_lock(&mesh_mutex);
+            int up = peers[node].up;
+            pthread_mutex_unlock(&mesh_mutex);
+            if (up) continue;
+
+            int fd = connect_to(peers[node].host, peers[node].port);
+            if (fd < 0) continue;
+            mesh_frame_t hello = { .type = MESH_HELLO, .from = my_node };
+            if (write_all(fd, (char *)&hello, sizeof(hello)) < 0) {
+                close(fd);
+                continue;
+            }
+            link_up(node, fd);
+        }
+        usleep(MESH_DIAL_MS * 1000);
+    }
+    return NULL;
+}
+
+static void *acceptor(void *arg) {
+    (void)arg;
+    // During a hot restart the old process holds the port until it exits
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(peers[my_node].port),
+                                .sin_addr.s_addr = INADDR_ANY };
+    int logged = 0;
+    while (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, MESH_MAX_NODES) < 0) {
+        if (!logged++) log_event("[MESH] Link port %d busy, retrying", peers[my_node].port);
+        usleep(MESH_DIAL_MS * 1000);
+    }
+
+    while (__atomic_load_n(&mesh_running, __ATOMIC_RELAXED)) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // The dialer introduces itself first
+        struct timeval timeout = { 1, 0 }, none = { 0, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        mesh_frame_t hello;
+        if (recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) || hello.type != MESH_HELLO ||
+            hello.from <= my_node || hello.from >= node_count) {
+            log_event("[MESH_ERROR] Rejected a link connection without a valid hello");
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+        link_up(hello.from, fd);
+    }
+    return NULL;
+}
+
+int mesh_open(const char *peer_list, int node_id) {
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", peer_list);
+    node_count = 0;
+    for (char *save, *entry = strtok_r(list, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(entry, ':');
+        if (!colon || node_count == MESH_MAX_NODES) return -1;
+        *colon = '\0';
+        mesh_peer_t *p = &peers[node_count++];
+        snprintf(p->host, sizeof(p->host), "%s", entry);
+        p->port = atoi(colon + 1);
+        if (p->port <= 0) return -1;
+    }
+    if (node_id < 0 || node_id >= node_count) return -1;
+    my_node = node_id;
+
+    for (int i = 0; i < node_count; i++) {
+        mesh_peer_t *p = &peers[i];
+        p->fd = -1;
+        pthread_mutex_init(&p->out_lock, NULL);
+        pthread_cond_init(&p->out_cond, NULL);
+        p->out = malloc(MESH_OUTBUF_SIZE);
+        p->spare = malloc(MESH_OUTBUF_SIZE);
+        if (!p->out || !p->spare) return -1;
+    }
+    build_ring();
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) return -1;
+    log_event("[MESH] Node %d of %d, links on port %d, %d ring points",
+              my_node, node_count, peers[my_node].port, ring_size);
+    return 0;
+}
+
+int mesh_start(bus_handler_t handler) {
+    if (my_node < 0) return -1;
+    handler_fn = handler;
+    mesh_running = 1;
+    pthread_t accept_thread, dial_thread;
+    if (pthread_create(&accept_thread, NULL, acceptor, NULL) != 0) return -1;
+    pthread_detach(accept_thread);
+    if (pthread_create(&dial_thread, NULL, dialer, NULL) != 0) return -1;
+    pthread_detach(dial_thread);
+    return 0;
+}
+
+void mesh_close(void) {
+    if (my_node < 0) return;
+    __atomic_store_n(&mesh_running, 0, __ATOMIC_RELAXED);
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_mutex_lock(&mesh_mutex);
+    for (int node = 0; node < node_count; node++) {
+        if (peers[node].up) shutdown(peers[node].fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+    log_event("[MESH] Left mesh: %lu frames in %lu writes, %lu received, %lu dropped, %lu directory requests",
+              (unsigned long)stats.frames_sent, (unsigned long)stats.writes,
+              (unsigned long)stats.frames_received, (unsigned long)stats.dropped, (unsigned long)stats.rpcs);
+}
+
+int mesh_claim_user(const char *username) {
+    if (my_node < 0) return 0;
+    pthread_mutex_lock(&mesh_mutex);
+    if (find_user(local_users, MAX_CLIENTS, username)) {
+        pthread_mutex_unlock(&mesh_mutex);
+        return 0;
+    }
+    int home = home_of(username);
+    int result = home == my_node ? dir_claim(username, my_node, 0) : 0;
+    pthread_mutex_unlock(&mesh_mutex);
+
+    if (home != my_node) result = call(home, MESH_CLAIM, username);
+    if (result != 0) return -1;
+
+    pthread_mutex_lock(&mesh_mutex);
+    // Another local client may have claimed the same name meanwhile
+    mesh_user_t *u = find_user(local_users, MAX_CLIENTS, username) ? NULL : free_user(local_users, MAX_CLIENTS);
+    if (u) {
+        snprintf(u->name, sizeof(u->name), "%s", username);
+        u->room[0] = '\0';
+        u->node = home;
+        u->used = 1;
+        reregister(u, 0);   // in case the ring moved while we waited
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+    return 0;
+}
+
+void mesh_release_user(const char *username) {
+    if (my_node < 0) return;
+    pthread_mutex_lock(&mesh_mutex);
+    mesh_user_t *u = find_user(local_users, MAX_CLIENTS, username);
+    if (u) {
+        if (u->room[0]) {
+            u->room[0] = '\0';
+            announce_room(u, -1);
+        }
+        if (u->node == my_node) dir_release(username, my_node);
+        else queue_frame(u->node, MESH_RELEASE, 0, username, NULL, 0);
+        u->used = 0;
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+}
+
+void mesh_restore_user(const char *username, const char *room) {
+    if (my_node < 0) return;
+    pthread_mutex_lock(&mesh_mutex);
+    mesh_user_t *u = free_user(local_users, MAX_CLIENTS);
+    if (u) {
+        snprintf(u->name, sizeof(u->name), "%s", username);
+        snprintf(u->room, sizeof(u->room), "%s", room);
+        u->used = 1;
+        reregister(u, 1);
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+}
+
+void mesh_set_room(const char *username, const char *room) {
+    if (my_node < 0) return;
+    pthread_mutex_lock(&mesh_mutex);
+    mesh_user_t *u = find_user(local_users, MAX_CLIENTS, username);
+    if (u && strcmp(u->room, room) != 0) {
+        snprintf(u->room, sizeof(u->room), "%s", room);
+        announce_room(u, -1);
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+}
+
+static int append_member(char *out, size_t size, size_t *len, const char *name) {
+    size_t n = strlen(name);
+    if (*len + n + 2 > size) return 0;
+    memcpy(out + *len, name, n);
+    out[*len + n] = ' ';
+    *len += n + 1;
+    out[*len] = '\0';
+    return 1;
+}
+
+int mesh_room_members(const char *room, char *out, size_t size) {
+    size_t len = 0;
+    int members = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&mesh_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        mesh_user_t *u = &local_users[i];
+        if (u->used && strcmp(u->room, room) == 0) members += append_member(out, size, &len, u->name);
+    }
+    for (int node = 0; node < node_count; node++) {
+        if (node == my_node || !peers[node].up) continue;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            mesh_user_t *u = &peers[node].members[i];
+            if (u->used && strcmp(u->room, room) == 0) members += append_member(out, size, &len, u->name);
+        }
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+    return members;
+}
+
+int mesh_broadcast(const char *room, const char *text, size_t len) {
+    if (my_node < 0 || len > BUS_MAX_TEXT) return 0;
+    int queued = 0;
+    pthread_mutex_lock(&mesh_mutex);
+    for (int node = 0; node < node_count; node++) {
+        if (node == my_node || !peers[node].up) continue;
+        int has_members = 0;
+        for (int i = 0; i < MAX_CLIENTS && !has_members; i++) {
+            mesh_user_t *u = &peers[node].members[i];
+            has_members = u->used && strcmp(u->room, room) == 0;
+        }
+        if (!has_members) continue;
+        if (queue_frame(node, MESH_BROADCAST, 0, room, text, len) == 0) {
+            queued++;
+        } else {
+            log_event("[MESH_ERROR] Link to node %d backed up, broadcast to '%s' dropped", node, room);
+        }
+    }
+    pthread_mutex_unlock(&mesh_mutex);
+    return queued;
+}
+
+int mesh_whisper(const char *target, const char *text, size_t len) {
+    if (my_node < 0 || len > BUS_MAX_TEXT) return -1;
+    // Users in a room are known locally; anyone else is asked of the directory
+    int node = -1;
+    pthread_mutex_lock(&mesh_mutex);
+    for (int n = 0; n < node_count && node < 0; n++) {
+        if (n != my_node && peers[n].up && find_user(peers[n].members, MAX_CLIENTS, target)) node = n;
+    }
+    int home = home_of(target);
+    if (node < 0 && home == my_node) node = dir_lookup(target);
+    pthread_mutex_unlock(&mesh_mutex);
+
+    if (node < 0 && home != my_node) node = call(home, MESH_LOOKUP, target);
+    if (node < 0 || node == my_node || node >= node_count) return -1;
+    return queue_frame(node, MESH_WHISPER, 0, target, text, len);
+}
+
+void mesh_get_stats(mesh_stats_t *out) {
+    out->frames_sent = __atomic_load_n(&stats.frames_sent, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    out->bytes_sent = __atomic_load_n(&stats.bytes_sent, __ATOMIC_RELAXED);
+    out->frames_received = __atomic_load_n(&stats.frames_received, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    out->rpcs = __atomic_load_n(&stats.rpcs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+#include "bus.h"
+
+// Federation: chatserver nodes on any hosts joined by a full TCP mesh.
+// --mesh lists every node's link address in node id order and --node picks
+// ours. A user's session lives on the node they connected to; rooms span
+// nodes.
+//  - Usernames are claimed in a directory sharded by consistent hashing:
+//    MESH_VNODES points per node on a ring, skipping nodes whose link is
+//    down. When a node comes or goes only names whose ring owner changed
+//    move, and each node re-registers its own users with their new owner.
+//    While a node is joining a name can briefly be claimed twice.
+//  - Room membership is replicated to every peer, so /list and broadcast
+//    routing need no round trip: a broadcast goes once to each node with
+//    members in the room, which fans it out to its own clients.
+//  - Each link has an output buffer drained by a writer thread. Frames
+//    queued while a write is in flight go out together in the next one,
+//    and only /username and whisper lookups wait for a reply.
+// Incoming broadcasts and whispers reach the same handler as bus messages.
+
+#define MESH_MAX_NODES 16
+#define MESH_VNODES 64
+#define MESH_OUTBUF_SIZE (256 * 1024)   // per link, frames beyond it are dropped
+#define MESH_RPC_TIMEOUT_MS 1000
+#define MESH_DIAL_MS 200                // retry interval for links that are down
+
+// peers: "host:port,host:port,..." for nodes 0..n-1
+int mesh_open(const char *peers, int node_id);
+int mesh_start(bus_handler_t handler);
+void mesh_close(void);
+
+// Directory. mesh_claim_user returns -1 if the name is in use on another
+// node or its directory node did not answer; it may block for a round trip,
+// so call it without holding the client or room tables.
+int mesh_claim_user(const char *username);
+void mesh_release_user(const char *username);
+// A session handed over by a hot restart, registered again once links are up
+void mesh_restore_user(const char *username, const char *room);
+void mesh_set_room(const char *username, const char *room);
+// Space separated members of room on all nodes, returns the count
+int mesh_room_members(const char *room, char *out, size_t size);
+
+// Returns how many nodes the message was queued to
+int mesh_broadcast(const char *room, const char *text, size_t len);
+// 0 if target is online on another node and the message was queued
+int mesh_whisper(const char *target, const char *text, size_t len);
+
+typedef struct {
+    uint64_t frames_sent;
+    uint64_t writes;            // frames_sent / writes is the batching factor
+    uint64_t bytes_sent;
+    uint64_t frames_received;
+    uint64_t dropped;           // link down or output buffer full
+    uint64_t rpcs;
+} mesh_stats_t;
+
+void mesh_get_stats(mesh_stats_t *stats);
+
+#endif // MESH_H
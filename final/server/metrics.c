@@ -0,0 +1,321 @@
+#include "metrics.h"
+#include "trace.h"
+
+#define METRICS_RENDER_SIZE (128 * 1024)
+#define METRICS_REQUEST_SIZE 1024
+
+typedef struct {
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+} metrics_hist_shard_t;
+
+typedef struct {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    metrics_hist_shard_t hists[METRIC_HIST_COUNT];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static metrics_shard_t shards[METRICS_SHARDS];
+static int64_t gauges[METRIC_GAUGE_COUNT];
+static int next_shard = 0;
+static __thread int my_shard = -1;
+static int admin_fd = -1;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = {"chat_connections_accepted_total", "Client connections accepted"},
+    [METRIC_BROADCASTS] = {"chat_broadcasts_total", "Messages broadcast to a room"},
+    [METRIC_BROADCAST_DELIVERIES] = {"chat_broadcast_deliveries_total", "Per-recipient broadcast sends"},
+    [METRIC_WHISPERS] = {"chat_whispers_total", "Private messages delivered"},
+    [METRIC_CHAT_BYTES_RELAYED] = {"chat_relayed_bytes_total", "Chat message bytes sent to recipients"},
+    [METRIC_FILE_BYTES_RELAYED] = {"chat_file_relayed_bytes_total", "File bytes relayed between clients"},
+    [METRIC_FILE_BYTES_SAVED] = {"chat_file_saved_bytes_total", "File bytes delta transfers did not have to send"},
+    [METRIC_TRANSFERS_COMPLETED] = {"chat_transfers_completed_total", "File transfers finished"},
+    [METRIC_COMPRESS_RAW_BYTES] = {"chat_compress_raw_bytes_total", "Bytes of messages sent to compressing clients, before compression"},
+    [METRIC_COMPRESS_WIRE_BYTES] = {"chat_compress_wire_bytes_total", "Bytes of those messages actually sent"},
+    [METRIC_COMPRESS_CPU_NS] = {"chat_compress_cpu_nanoseconds_total", "Thread CPU time spent compressing"},
+    [METRIC_HEARTBEATS_SENT] = {"chat_heartbeats_sent_total", "PINGs sent to silent clients"},
+    [METRIC_IDLE_DISCONNECTS] = {"chat_idle_disconnects_total", "Clients dropped by the idle timeout"},
+    [METRIC_TRANSFERS_STALLED] = {"chat_transfers_stalled_total", "File transfers failed by the stall timeout"},
+    [METRIC_QUEUED_TRANSFERS_EXPIRED] = {"chat_queued_transfers_expired_total", "Queued file transfers dropped before they started"},
+    [METRIC_SESSIONS_RESUMED] = {"chat_sessions_resumed_total", "Dropped connections that resumed their session"},
+    [METRIC_SESSIONS_EXPIRED] = {"chat_sessions_expired_total", "Dropped sessions not resumed in time"},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} gauge_info[METRIC_GAUGE_COUNT] = {
+    [METRIC_ACTIVE_CONNECTIONS] = {"chat_active_connections", "Connected clients"},
+    [METRIC_QUEUED_TRANSFERS] = {"chat_queued_transfers", "File transfers waiting for a slot"},
+};
+
+// Bucket bounds used for the exported histograms, in seconds
+static const double export_bounds[] = {
+    0.000001, 0.0000025, 0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025,
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+#define EXPORT_BOUNDS (sizeof(export_bounds) / sizeof(export_bounds[0]))
+
+void log_event(const char *format, ...);
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Threads are spread over the shards round robin on first use
+static metrics_shard_t *shard(void) {
+    if (my_shard < 0) {
+        my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS;
+    }
+    return &shards[my_shard];
+}
+
+// Log-linear bucket: exact below 8, then 8 sub-buckets per power of two
+static int bucket_index(uint64_t v) {
+    if (v < (1u << METRICS_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > METRICS_MAX_EXP) return METRICS_HIST_BUCKETS - 1;
+    int sub = (int)(v >> (e - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Exclusive upper bound of a bucket, in ns
+static uint64_t bucket_upper(int idx) {
+    if (idx < (1 << METRICS_SUB_BITS)) return idx + 1;
+    int e = (idx >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t sub = idx & ((1 << METRICS_SUB_BITS) - 1);
+    return ((1ull << METRICS_SUB_BITS) + sub + 1) << (e - METRICS_SUB_BITS);
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n) {
+    __atomic_fetch_add(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_add(metric_gauge_t gauge, int64_t delta) {
+    __atomic_fetch_add(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value) {
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metric_hist_t hist, uint64_t ns) {
+    metrics_hist_shard_t *h = &shard()->hists[hist];
+    __atomic_fetch_add(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_observe_command(command_id_t id, uint64_t ns) {
+    metrics_observe(METRIC_HIST_COMMAND + (id == CMD_UNKNOWN ? CMD_COUNT : id), ns);
+}
+
+static void hist_sum_shards(metric_hist_t hist, metrics_hist_shard_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        const metrics_hist_shard_t *h = &shards[s].hists[hist];
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+        out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    }
+}
+
+// Append one histogram series; labels is "" or 'key="value",'
+static size_t render_hist(char *out, size_t size, const char *name, const char *labels,
+                          metric_hist_t hist) {
+    metrics_hist_shard_t h;
+    hist_sum_shards(hist, &h);
+    size_t len = 0;
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (size_t i = 0; i < EXPORT_BOUNDS && len < size; i++) {
+        uint64_t bound_ns = (uint64_t)(export_bounds[i] * 1e9);
+        while (b < METRICS_HIST_BUCKETS && bucket_upper(b) <= bound_ns) {
+            cumulative += h.buckets[b++];
+        }
+        len += snprintf(out + len, size - len, "%s_bucket{%sle=\"%g\"} %lu\n",
+                        name, labels, export_bounds[i], (unsigned long)cumulative);
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "%s_bucket{%sle=\"+Inf\"} %lu\n",
+                        name, labels, (unsigned long)h.count);
+    }
+    // Drop the trailing comma for the _sum/_count label sets
+    char plain[64];
+    snprintf(plain, sizeof(plain), "%s", labels);
+    size_t plain_len = strlen(plain);
+    if (plain_len > 0) plain[plain_len - 1] = '\0';
+    const char *open = plain_len ? "{" : "";
+    const char *close = plain_len ? "}" : "";
+    if (len < size) {
+        len += snprintf(out + len, size - len, "%s_sum%s%s%s %.9f\n%s_count%s%s%s %lu\n",
+                        name, open, plain, close, h.sum / 1e9,
+                        name, open, plain, close, (unsigned long)h.count);
+    }
+    return len < size ? len : size;
+}
+
+size_t metrics_render(char *out, size_t size) {
+    size_t len = 0;
+#define APPEND(...) do { \
+        if (len < size) len += snprintf(out + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+        uint64_t total = 0;
+        for (int s = 0; s < METRICS_SHARDS; s++) {
+            total += __atomic_load_n(&shards[s].counters[c], __ATOMIC_RELAXED);
+        }
+        APPEND("# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+               counter_info[c].name, counter_info[c].help, counter_info[c].name,
+               counter_info[c].name, (unsigned long)total);
+    }
+    for (int g = 0; g < METRIC_GAUGE_COUNT; g++) {
+        APPEND("# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+               gauge_info[g].name, gauge_info[g].help, gauge_info[g].name,
+               gauge_info[g].name, (long)__atomic_load_n(&gauges[g], __ATOMIC_RELAXED));
+    }
+
+    APPEND("# HELP chat_command_latency_seconds Time spent in handle_command per opcode\n"
+           "# TYPE chat_command_latency_seconds histogram\n");
+    for (int id = 0; id <= CMD_COUNT; id++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "command=\"%s\",",
+                 id == CMD_COUNT ? "unknown" : command_name(id));
+        if (len < size) {
+            len += render_hist(out + len, size - len, "chat_command_latency_seconds", labels,
+                               METRIC_HIST_COMMAND + id);
+        }
+    }
+
+    APPEND("# HELP chat_broadcast_fanout_seconds Time to send one broadcast to every room member\n"
+           "# TYPE chat_broadcast_fanout_seconds histogram\n");
+    if (len < size) {
+        len += render_hist(out + len, size - len, "chat_broadcast_fanout_seconds", "",
+                           METRIC_HIST_BROADCAST_FANOUT);
+    }
+    APPEND("# HELP chat_transfer_queue_wait_seconds Time from /sendfile to transfer start\n"
+           "# TYPE chat_transfer_queue_wait_seconds histogram\n");
+    if (len < size) {
+        len += render_hist(out + len, size - len, "chat_transfer_queue_wait_seconds", "",
+                           METRIC_HIST_TRANSFER_QUEUE_WAIT);
+    }
+#undef APPEND
+    return len < size ? len : size;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void send_response(int fd, const char *status, const char *type, const char *body, size_t len) {
+    char header[256];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: %s\r\n"
+                        "Content-Length: %zu\r\n\r\n", status, type, len);
+    send_all(fd, header, hlen);
+    send_all(fd, body, len);
+}
+
+static void serve_request(int fd, char *body) {
+    char request[METRICS_REQUEST_SIZE];
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) return;
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        size_t len = metrics_render(body, METRICS_RENDER_SIZE);
+        send_response(fd, "200 OK", "text/plain; version=0.0.4", body, len);
+    } else if (strncmp(request, "GET /trace ", 11) == 0) {
+        char *json = NULL;
+        size_t len = trace_export_json(&json);
+        send_response(fd, "200 OK", "application/json", json ? json : "", len);
+        free(json);
+    } else if (strncmp(request, "GET /trace/start ", 17) == 0 ||
+               strncmp(request, "GET /trace/stop ", 16) == 0) {
+        int start = strncmp(request + 11, "start", 5) == 0;
+        trace_set_enabled(start);
+        const char *msg = start ? "tracing started\n" : "tracing stopped\n";
+        send_response(fd, "200 OK", "text/plain", msg, strlen(msg));
+    } else {
+        send_response(fd, "404 Not Found", "text/plain", "", 0);
+    }
+}
+
+static void *metrics_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+    free(arg);
+    char *body = malloc(METRICS_RENDER_SIZE);
+    if (!body) return NULL;
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // A stuck scraper must not block the next one for long
+        struct timeval tv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        serve_request(fd, body);
+        close(fd);
+    }
+    free(body);
+    close(listen_fd);
+    return NULL;
+}
+
+int metrics_serve(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Admin port, only reachable from the machine itself
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        log_event("[METRICS_ERROR] Cannot listen on 127.0.0.1:%d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    int *arg = malloc(sizeof(int));
+    if (!arg) {
+        close(fd);
+        return -1;
+    }
+    *arg = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread, arg) != 0) {
+        free(arg);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    admin_fd = fd;
+    log_event("[METRICS] Serving Prometheus metrics on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (admin_fd < 0) return;
+    shutdown(admin_fd, SHUT_RDWR);  // wakes accept(), the thread closes the fd
+    admin_fd = -1;
+}
@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+#include "command_table.h"
+
+// In-process metrics. Counters and histograms are sharded per thread so the
+// hot paths only touch their own cache lines; the admin endpoint sums the
+// shards when scraped and serves Prometheus text format over HTTP.
+
+#define METRICS_SHARDS 16
+#define METRICS_SUB_BITS 3          // 8 linear sub-buckets per power of two
+#define METRICS_MAX_EXP 36          // values up to ~68 s in ns, larger ones clamp
+#define METRICS_HIST_BUCKETS (((METRICS_MAX_EXP - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + (1 << METRICS_SUB_BITS))
+
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_BROADCASTS,
+    METRIC_BROADCAST_DELIVERIES,
+    METRIC_WHISPERS,
+    METRIC_CHAT_BYTES_RELAYED,
+    METRIC_FILE_BYTES_RELAYED,
+    METRIC_FILE_BYTES_SAVED,
+    METRIC_TRANSFERS_COMPLETED,
+    METRIC_COMPRESS_RAW_BYTES,
+    METRIC_COMPRESS_WIRE_BYTES,
+    METRIC_COMPRESS_CPU_NS,
+    METRIC_HEARTBEATS_SENT,
+    METRIC_IDLE_DISCONNECTS,
+    METRIC_TRANSFERS_STALLED,
+    METRIC_QUEUED_TRANSFERS_EXPIRED,
+    METRIC_SESSIONS_RESUMED,
+    METRIC_SESSIONS_EXPIRED,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_ACTIVE_CONNECTIONS,
+    METRIC_QUEUED_TRANSFERS,
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+// One latency histogram per opcode (CMD_COUNT is unknown commands), then the rest
+typedef enum {
+    METRIC_HIST_COMMAND = 0,
+    METRIC_HIST_BROADCAST_FANOUT = CMD_COUNT + 1,
+    METRIC_HIST_TRANSFER_QUEUE_WAIT,
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+uint64_t metrics_now_ns(void);
+
+void metrics_add(metric_counter_t counter, uint64_t n);
+void metrics_gauge_add(metric_gauge_t gauge, int64_t delta);
+void metrics_gauge_set(metric_gauge_t gauge, int64_t value);
+void metrics_observe(metric_hist_t hist, uint64_t ns);
+void metrics_observe_command(command_id_t id, uint64_t ns);
+
+// Render everything in Prometheus text format, returns bytes written
+size_t metrics_render(char *out, size_t size);
+
+// Serve GET /metrics (and /trace, see trace.h) on 127.0.0.1:port from a background thread
+int metrics_serve(int port);
+// Release the admin port, e.g. before a hot restart binds it again
+void metrics_stop(void);
+
+#endif // METRICS_H
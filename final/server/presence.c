@@ -0,0 +1,253 @@
+#include "presence.h"
+
+typedef struct {
+    char name[MAX_USERNAME_LENGTH];
+    int was_member;     // state when this flush window opened
+    int is_member;
+    int typing_changed;
+    int typing;
+} presence_delta_t;
+
+typedef struct {
+    char name[MAX_GROUP_NAME_LENGTH];
+    int members[MAX_GROUP_MEMBERS];     // client indices
+    char member_names[MAX_GROUP_MEMBERS][MAX_USERNAME_LENGTH];
+    int member_count;
+    uint64_t version;
+    char snapshot[BUFFER_SIZE];         // cached /list text
+    int snapshot_count;
+    uint64_t snapshot_version;          // version the snapshot was built for
+    presence_delta_t pending[PRESENCE_MAX_PENDING];
+    int pending_count;
+    int resync;                         // pending overflowed, send the full list
+} presence_room_t;
+
+static presence_room_t proom[MAX_GROUPS];
+static int client_room[MAX_CLIENTS];    // room index of each client, -1 = none
+static int dirty = 0;
+static pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t presence_cond = PTHREAD_COND_INITIALIZER;
+static presence_deliver_t deliver_fn;
+
+void log_event(const char *format, ...);
+
+// Caller holds presence_mutex. NULL means the room overflowed.
+static presence_delta_t *pending_entry(presence_room_t *r, const char *username, int was_member) {
+    for (int i = 0; i < r->pending_count; i++) {
+        if (strcmp(r->pending[i].name, username) == 0) return &r->pending[i];
+    }
+    if (!dirty) {
+        dirty = 1;
+        pthread_cond_signal(&presence_cond);
+    }
+    if (r->pending_count == PRESENCE_MAX_PENDING) {
+        r->resync = 1;
+        return NULL;
+    }
+    presence_delta_t *d = &r->pending[r->pending_count++];
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", username);
+    d->was_member = was_member;
+    d->is_member = was_member;
+    return d;
+}
+
+static void add_member(int room_index, const char *room_name, int client_index, const char *username) {
+    presence_room_t *r = &proom[room_index];
+    if (r->member_count == MAX_GROUP_MEMBERS) return;
+    snprintf(r->name, sizeof(r->name), "%s", room_name);
+    r->members[r->member_count] = client_index;
+    snprintf(r->member_names[r->member_count], MAX_USERNAME_LENGTH, "%s", username);
+    r->member_count++;
+    r->version++;
+    client_room[client_index] = room_index;
+}
+
+void presence_join(int room_index, const char *room_name, int client_index, const char *username) {
+    if (room_index < 0 || room_index >= MAX_GROUPS) return;
+    pthread_mutex_lock(&presence_mutex);
+    add_member(room_index, room_name, client_index, username);
+    presence_delta_t *d = pending_entry(&proom[room_index], username, 0);
+    if (d) {
+        d->is_member = 1;
+        d->typing_changed = 0;
+    }
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+void presence_restore(int room_index, const char *room_name, int client_index, const char *username) {
+    if (room_index < 0 || room_index >= MAX_GROUPS) return;
+    pthread_mutex_lock(&presence_mutex);
+    add_member(room_index, room_name, client_index, username);
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+void presence_leave(int client_index) {
+    pthread_mutex_lock(&presence_mutex);
+    int room_index = client_room[client_index];
+    if (room_index >= 0) {
+        presence_room_t *r = &proom[room_index];
+        for (int i = 0; i < r->member_count; i++) {
+            if (r->members[i] != client_index) continue;
+            presence_delta_t *d = pending_entry(r, r->member_names[i], 1);
+            if (d) {
+                d->is_member = 0;
+                d->typing_changed = 0;
+            }
+            r->member_count--;
+            r->members[i] = r->members[r->member_count];
+            memcpy(r->member_names[i], r->member_names[r->member_count], MAX_USERNAME_LENGTH);
+            r->version++;
+            break;
+        }
+        client_room[client_index] = -1;
+    }
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+void presence_rename(int client_index, const char *username) {
+    pthread_mutex_lock(&presence_mutex);
+    int room_index = client_room[client_index];
+    if (room_index >= 0) {
+        presence_room_t *r = &proom[room_index];
+        for (int i = 0; i < r->member_count; i++) {
+            if (r->members[i] != client_index) continue;
+            presence_delta_t *d = pending_entry(r, r->member_names[i], 1);
+            if (d) {
+                d->is_member = 0;
+                d->typing_changed = 0;
+            }
+            snprintf(r->member_names[i], MAX_USERNAME_LENGTH, "%s", username);
+            d = pending_entry(r, username, 0);
+            if (d) {
+                d->is_member = 1;
+                d->typing_changed = 0;
+            }
+            r->version++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+int presence_typing(int client_index, int typing) {
+    pthread_mutex_lock(&presence_mutex);
+    int room_index = client_room[client_index];
+    if (room_index >= 0) {
+        presence_room_t *r = &proom[room_index];
+        for (int i = 0; i < r->member_count; i++) {
+            if (r->members[i] != client_index) continue;
+            presence_delta_t *d = pending_entry(r, r->member_names[i], 1);
+            if (d) {
+                d->typing_changed = 1;
+                d->typing = typing;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&presence_mutex);
+    return room_index >= 0;
+}
+
+int presence_list(int client_index, char *out, size_t size, uint64_t *version) {
+    pthread_mutex_lock(&presence_mutex);
+    int room_index = client_room[client_index];
+    if (room_index < 0) {
+        pthread_mutex_unlock(&presence_mutex);
+        return -1;
+    }
+    presence_room_t *r = &proom[room_index];
+    if (r->snapshot_version != r->version) {
+        size_t len = snprintf(r->snapshot, sizeof(r->snapshot), "[SERVER] Users in room: ");
+        for (int i = 0; i < r->member_count; i++) {
+            size_t n = strlen(r->member_names[i]);
+            if (len + n + 2 > sizeof(r->snapshot)) break;
+            memcpy(r->snapshot + len, r->member_names[i], n);
+            r->snapshot[len + n] = ' ';
+            len += n + 1;
+        }
+        r->snapshot[len] = '\0';
+        r->snapshot_count = r->member_count;
+        r->snapshot_version = r->version;
+    }
+    snprintf(out, size, "%s", r->snapshot);
+    int count = r->snapshot_count;
+    if (version) *version = r->version;
+    pthread_mutex_unlock(&presence_mutex);
+    return count;
+}
+
+// Build the delta line for a room and reset its window. Caller holds
+// presence_mutex. Returns 0 if everything cancelled out.
+static size_t build_frame(presence_room_t *r, char *out) {
+    size_t len = snprintf(out, PRESENCE_FRAME_SIZE, "PRESENCE %s %lu", r->name, (unsigned long)r->version);
+    size_t header_len = len;
+    if (r->resync) {
+        for (int i = 0; i < r->member_count; i++) {
+            len += snprintf(out + len, PRESENCE_FRAME_SIZE - len, " =%s", r->member_names[i]);
+        }
+        header_len = 0;     // an empty list is still news
+    } else {
+        for (int i = 0; i < r->pending_count; i++) {
+            presence_delta_t *d = &r->pending[i];
+            char mark = 0;
+            if (d->was_member != d->is_member) mark = d->is_member ? '+' : '-';
+            else if (d->is_member && d->typing_changed) mark = d->typing ? '*' : '.';
+            if (mark) len += snprintf(out + len, PRESENCE_FRAME_SIZE - len, " %c%s", mark, d->name);
+        }
+    }
+    r->pending_count = 0;
+    r->resync = 0;
+    if (len == header_len) return 0;
+    len += snprintf(out + len, PRESENCE_FRAME_SIZE - len, "\n");
+    return len;
+}
+
+static void *flush_thread(void *arg) {
+    (void)arg;
+    static char frames[MAX_GROUPS][PRESENCE_FRAME_SIZE];
+    static size_t frame_len[MAX_GROUPS];
+    static int recipients[MAX_GROUPS][MAX_GROUP_MEMBERS];
+    static int recipient_count[MAX_GROUPS];
+    static char room_names[MAX_GROUPS][MAX_GROUP_NAME_LENGTH];
+
+    pthread_mutex_lock(&presence_mutex);
+    while (1) {
+        while (!dirty) pthread_cond_wait(&presence_cond, &presence_mutex);
+
+        // Let the window fill so a burst of changes goes out as one line
+        pthread_mutex_unlock(&presence_mutex);
+        usleep(PRESENCE_FLUSH_MS * 1000);
+        pthread_mutex_lock(&presence_mutex);
+
+        for (int i = 0; i < MAX_GROUPS; i++) {
+            presence_room_t *r = &proom[i];
+            frame_len[i] = 0;
+            if (r->pending_count == 0 && !r->resync) continue;
+            frame_len[i] = build_frame(r, frames[i]);
+            recipient_count[i] = r->member_count;
+            memcpy(recipients[i], r->members, sizeof(int) * r->member_count);
+            memcpy(room_names[i], r->name, MAX_GROUP_NAME_LENGTH);
+        }
+        dirty = 0;
+        pthread_mutex_unlock(&presence_mutex);
+
+        for (int i = 0; i < MAX_GROUPS; i++) {
+            if (frame_len[i] > 0 && recipient_count[i] > 0) {
+                deliver_fn(room_names[i], recipients[i], recipient_count[i], frames[i], frame_len[i]);
+            }
+        }
+        pthread_mutex_lock(&presence_mutex);
+    }
+    return NULL;
+}
+
+int presence_init(presence_deliver_t deliver) {
+    for (int i = 0; i < MAX_CLIENTS; i++) client_room[i] = -1;
+    deliver_fn = deliver;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, flush_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    log_event("[PRESENCE] Presence deltas flushed every %d ms", PRESENCE_FLUSH_MS);
+    return 0;
+}
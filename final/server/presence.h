@@ -0,0 +1,48 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Room presence: who is in each room and who is typing. Changes are not
+// pushed one by one; they collect per room and a flush thread sends one
+// delta line per room every PRESENCE_FLUSH_MS to members that opted in
+// with /presence on:
+//
+//   PRESENCE <room> <version> +joined -left *typing .stopped_typing
+//
+// A join and leave inside the same window cancel out. If a room collects
+// more distinct users than PRESENCE_MAX_PENDING the line carries the whole
+// member list instead, as "=name" entries. <version> counts membership
+// changes and also keys the cached /list snapshot, so /list never walks
+// the room under clients_mutex and rooms_mutex.
+
+#define PRESENCE_FLUSH_MS 5
+#define PRESENCE_MAX_PENDING 32     // distinct users per room per flush
+#define PRESENCE_FRAME_SIZE (64 + PRESENCE_MAX_PENDING * (MAX_USERNAME_LENGTH + 2))
+
+// Called by the flush thread with each room's delta line and the members
+// to offer it to; it decides who opted in and is still in room_name.
+typedef void (*presence_deliver_t)(const char *room_name, const int *client_indices, int count,
+                                   const char *frame, size_t len);
+
+int presence_init(presence_deliver_t deliver);
+
+// Membership hooks, called with the room tables locked by the caller
+void presence_join(int room_index, const char *room_name, int client_index, const char *username);
+void presence_leave(int client_index);
+// client_index changed its name: announced as the old name leaving and
+// the new one joining
+void presence_rename(int client_index, const char *username);
+// Rebuild membership after a hot restart without announcing anything
+void presence_restore(int room_index, const char *room_name, int client_index, const char *username);
+
+// Returns 0 if the client is not in a room
+int presence_typing(int client_index, int typing);
+
+// Copy the member list of client_index's room into out, rebuilding the
+// cached snapshot if the room changed. Returns the member count, -1 if
+// the client is not in a room.
+int presence_list(int client_index, char *out, size_t size, uint64_t *version);
+
+#endif // PRESENCE_H
@@ -1,21 +1,32 @@
 #!/usr/bin/env python3
 """
-Chat Server Implementation
-Compile/Run: python3 chatserver.py <port>
+Chat Server Implementation (asyncio)
+Run: python3 server.py <port> [--fast]
+
+One event loop serves every connection: a reader coroutine per client,
+rooms as sets of clients and a buffered writer per connection that hands
+everything sent to a client during one loop iteration to the transport in
+a single write. Speaks chatserver.c's protocol for /username, /join,
+/leave, /broadcast, /whisper, /sendfile (queueing, data connections,
+split and delta transfers), /list, /compress, /help and /exit, with this
+port's own limits below. History, presence, mailboxes, sessions and
+clustering stay in the C server.
+
+--fast is the performance mode: uvloop's event loop when it is installed,
+only warnings and errors logged and nothing printed per message.
 """
 
-import socket
-import threading
-import time
-import sys
-import signal
-import os
+import argparse
+import asyncio
 import logging
-from datetime import datetime
-from queue import Queue, Full
-from dataclasses import dataclass
-from typing import Dict, List, Optional, Tuple
 import re
+import secrets
+import signal
+import sys
+import time
+from collections import deque
+from dataclasses import dataclass, field
+from typing import Deque, Dict, List, Optional, Set
 
 # Constants from chatDefination.h
 BUFFER_SIZE = 1024
@@ -27,651 +38,789 @@ MAX_GROUP_MEMBERS = 15  # Changed to match MAX_CLIENTS
 MAX_SIMULTANEOUS_TRANSFERS = 5
 MAX_FILE_QUEUE = 5
 MAX_FILE_SIZE = 3 * 1024 * 1024  # 3 MB
+MAX_FILENAME_LENGTH = 127  # bytes; the longest name chatserver's WAL records hold
+TRANSFER_CHUNK_SIZE = 64 * 1024
+MAX_TRANSFER_STREAMS = 8
+DELTA_MIN_BLOCK = 512
+DELTA_MAX_SIGNATURE = 8 + 12 * (MAX_FILE_SIZE // DELTA_MIN_BLOCK + 1)
+TRANSFER_STALL_TIMEOUT = 10  # a transfer making no progress for this long fails
+QUEUED_TRANSFER_EXPIRY = 60  # a queued transfer not started by then is dropped
+BARE_COMMAND_WAIT = 0.05  # a client that never sent '\n' has its input run after this much quiet
 LOG_FILE = "server.log"
 
-@dataclass
-class ClientInfo:
-    socket: socket.socket
-    username: str = ""
-    current_room: str = ""
-    active: bool = True
-    address: Tuple[str, int] = None
-
-@dataclass
-class Room:
-    name: str
-    members: List[int]
-    member_count: int = 0
-
-@dataclass
+# A client that stops reading is dropped once this much waits for it
+MAX_PENDING_OUTPUT = 1024 * 1024
+LOGIN_GREETING = b"SUCCESS_LOGIN\0"
+VALID_EXTENSIONS = (".txt", ".pdf", ".jpg", ".png")
+
+NAME_RE = re.compile(r"[A-Za-z0-9_]+")
+
+HELP_TEXT = ("[SERVER] Available commands:\n"
+             "/username <name> - Set your username\n"
+             "/join <room> - Join a chat room\n"
+             "/leave - Leave current room\n"
+             "/broadcast <msg> - Send message to room\n"
+             "/whisper <user> <msg> - Private message\n"
+             "/sendfile <user> <file> <size> - Send file\n"
+             "/list - List users in current room\n"
+             "/exit - Disconnect from server")
+
+
+def is_name(text: str, min_len: int, max_len: int) -> bool:
+    """Letters, digits and '_', like text_is_name() in the C server"""
+    return min_len <= len(text) <= max_len and NAME_RE.fullmatch(text) is not None
+
+
+def next_token(args: str):
+    """Split off the first space separated word, strtok(" ") style"""
+    args = args.lstrip(" ")
+    if not args:
+        return None, ""
+    word, _, rest = args.partition(" ")
+    return word, rest
+
+
+def leading_uint(text: str, base: int = 10) -> int:
+    """The number text starts with, 0 if none (atol/%u semantics)"""
+    digits = re.match(r"[0-9a-fA-F]*" if base == 16 else r"[0-9]*", text).group()
+    return int(digits, base) if digits else 0
+
+
+def new_token() -> int:
+    token = 0
+    while token == 0:
+        token = secrets.randbits(64)
+    return token
+
+
+class Client:
+    """One connection. Replies go through send(), which buffers them until
+    the loop comes round; several replies and deliveries for the same
+    client then leave in one write."""
+
+    __slots__ = ("slot", "reader", "writer", "address", "username", "room",
+                 "active", "data", "out", "flush_scheduled", "loop", "server", "line_framed")
+
+    def __init__(self, server: "ChatServer", slot: int, reader, writer):
+        self.server = server
+        self.slot = slot
+        self.reader = reader
+        self.writer = writer
+        self.address = writer.get_extra_info("peername") or ("?", 0)
+        self.username = ""
+        self.room = ""
+        self.active = True
+        self.data: Optional["DataStream"] = None    # set once this became a data connection
+        self.line_framed = False    # has ended a command with '\n'
+        self.out: List[bytes] = []
+        self.flush_scheduled = False
+        self.loop = asyncio.get_running_loop()
+
+    def send(self, data: bytes):
+        if not self.active:
+            return
+        self.out.append(data)
+        if not self.flush_scheduled:
+            self.flush_scheduled = True
+            self.loop.call_soon(self.flush)
+
+    def flush(self):
+        self.flush_scheduled = False
+        if not self.out or self.writer.is_closing():
+            self.out.clear()
+            return
+        data = self.out[0] if len(self.out) == 1 else b"".join(self.out)
+        self.out.clear()
+        self.writer.write(data)
+        if self.writer.transport.get_write_buffer_size() > MAX_PENDING_OUTPUT:
+            self.server.log_event("[SLOW_CLIENT] Client %d (%s) is not reading, dropping it",
+                                  self.slot, self.username or "unnamed")
+            self.active = False
+            self.writer.transport.abort()
+
+    def name(self) -> str:
+        return self.username or "unnamed"
+
+
+class DataStream:
+    """A transfer's data connection, with whatever arrived behind /data"""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+        self.pending = b""
+
+    async def read(self, n: int) -> bytes:
+        if self.pending:
+            chunk, self.pending = self.pending[:n], self.pending[n:]
+            return chunk
+        return await self.reader.read(n)
+
+    async def read_exactly(self, n: int) -> bytes:
+        data = b""
+        while len(data) < n:
+            chunk = await asyncio.wait_for(self.read(n - len(data)), TRANSFER_STALL_TIMEOUT)
+            if not chunk:
+                raise ConnectionError("data connection closed")
+            data += chunk
+        return data
+
+    def close(self):
+        self.writer.close()
+
+
+@dataclass(eq=False)
 class FileMeta:
-    sender: str
-    recipient: str
+    sender: Client
+    recipient: Client
     filename: str
     filesize: int
-    sender_socket: socket.socket
-    recipient_socket: socket.socket
+    transfer_id: int = 0
+    streams: int = 0
+    checksum: int = 0
+    delta: bool = False
     enqueue_time: float = 0
-    start_time: float = 0
-
-class FileQueue:
-    def __init__(self):
-        self.queue = Queue(maxsize=MAX_FILE_QUEUE)
-        self.active_transfers = 0
-        self.lock = threading.Lock()
+    expiry: Optional[asyncio.TimerHandle] = None
+
+
+@dataclass(eq=False)
+class Transfer:
+    """A running transfer waiting for, then relaying over, its data connections"""
+    meta: FileMeta
+    streams: int
+    sender_token: int = field(default_factory=new_token)
+    recipient_token: int = field(default_factory=new_token)
+    sender_data: List[Optional[DataStream]] = field(default_factory=list)
+    recipient_data: List[Optional[DataStream]] = field(default_factory=list)
+    attached: asyncio.Event = field(default_factory=asyncio.Event)
+    relayed: int = 0
+
+    def __post_init__(self):
+        self.sender_data = [None] * self.streams
+        self.recipient_data = [None] * self.streams
+
+    def attach(self, token: int, stream: int, data: DataStream) -> Optional[str]:
+        if stream < 0 or stream >= self.streams:
+            return None
+        side = (self.sender_data if token == self.sender_token else
+                self.recipient_data if token == self.recipient_token else None)
+        if side is None or side[stream] is not None:
+            return None
+        side[stream] = data
+        if all(self.sender_data) and all(self.recipient_data):
+            self.attached.set()
+        return "sender" if side is self.sender_data else "recipient"
 
-    def enqueue(self, meta: FileMeta) -> bool:
-        try:
-            with self.lock:
-                if self.queue.full():
-                    return False
-                meta.enqueue_time = time.time()
-                self.queue.put(meta)
-                return True
-        except Full:
-            return False
-
-    def start_transfer(self, meta: FileMeta) -> bool:
-        with self.lock:
-            if self.active_transfers < MAX_SIMULTANEOUS_TRANSFERS:
-                self.active_transfers += 1
-                return True
-            else:
-                # Queue for later
-                if self.enqueue(meta):
-                    return False
-                return False
+    def close(self):
+        for data in self.sender_data + self.recipient_data:
+            if data:
+                data.close()
 
-    def finish_transfer(self):
-        with self.lock:
-            self.active_transfers -= 1
-
-    def try_start_next(self) -> Optional[FileMeta]:
-        with self.lock:
-            if not self.queue.empty() and self.active_transfers < MAX_SIMULTANEOUS_TRANSFERS:
-                meta = self.queue.get()
-                self.active_transfers += 1
-                return meta
-            return None
 
 class ChatServer:
-    def __init__(self, port: int):
+    def __init__(self, port: int, fast: bool):
         self.port = port
+        self.fast = fast
         self.running = True
-        self.server_socket = None
-        self.clients: Dict[int, ClientInfo] = {}
-        self.rooms: Dict[str, Room] = {}
-        self.clients_lock = threading.Lock()
-        self.rooms_lock = threading.Lock()
-        self.file_queue = FileQueue()
-        
+        self.server: Optional[asyncio.AbstractServer] = None
+        self.clients: List[Optional[Client]] = [None] * MAX_CLIENTS
+        self.users: Dict[str, Client] = {}
+        # Insertion ordered sets, so /list names members in join order
+        self.rooms: Dict[str, Dict[Client, None]] = {}
+        self.active_transfers = 0
+        self.file_queue: Deque[FileMeta] = deque()
+        self.transfers: Dict[int, Transfer] = {}    # by either data token
+        self.tasks: Set[asyncio.Task] = set()
+        self.stopped: Optional[asyncio.Event] = None
+        self.commands = {
+            "/username": self.cmd_username,
+            "/join": self.cmd_join,
+            "/broadcast": self.cmd_broadcast,
+            "/leave": self.cmd_leave,
+            "/whisper": self.cmd_whisper,
+            "/sendfile": self.cmd_sendfile,
+            "/list": self.cmd_list,
+            "/exit": self.cmd_exit,
+            "/help": self.cmd_help,
+            "/compress": self.cmd_compress,
+            "/data": self.cmd_data,
+        }
+
         # Setup logging
         logging.basicConfig(
             filename=LOG_FILE,
-            level=logging.INFO,
+            level=logging.WARNING if fast else logging.INFO,
             format='%(asctime)s - %(message)s',
             datefmt='%Y-%m-%d %H:%M:%S'
         )
-        
-        # Setup signal handlers
-        signal.signal(signal.SIGINT, self.signal_handler)
-        signal.signal(signal.SIGTERM, self.signal_handler)
+        self.logger = logging.getLogger("chatserver")
 
     def log_event(self, message: str, *args):
-        """Log events to file"""
-        if args:
-            message = message % args
-        logging.info(message)
-        print(f"[LOG] {message}")  # Also print to console for debugging
-        
-    def signal_handler(self, signum, frame):
+        """Log events to file; dropped in --fast mode"""
+        self.logger.info(message, *args)
+
+    def log_error(self, message: str, *args):
+        self.logger.warning(message, *args)
+        if not self.fast:
+            print(message % args if args else message)
+
+    def shutdown(self, signame: str):
         """Handle shutdown signals"""
-        signal_name = "SIGINT" if signum == signal.SIGINT else "SIGTERM"
-        self.log_event("[SHUTDOWN] %s received. Disconnecting clients", signal_name)
+        self.log_error("[SHUTDOWN] %s received. Disconnecting clients", signame)
         print("\nServer shutting down...")
-        
-        with self.clients_lock:
-            for client_id, client in list(self.clients.items()):
-                if client.active:
-                    try:
-                        client.socket.send(b"[SERVER] Server is shutting down. Disconnecting...\n")
-                        client.socket.shutdown(socket.SHUT_RDWR)
-                        client.socket.close()
-                    except:
-                        pass
-                    client.active = False
-        
         self.running = False
-        if self.server_socket:
-            self.server_socket.close()
-
-    def start(self):
+        for client in self.clients:
+            if client and client.active:
+                client.send(b"[SERVER] Server is shutting down. Disconnecting...\n")
+                client.flush()
+                client.active = False
+                client.writer.close()
+        if self.server:
+            self.server.close()
+        self.stopped.set()
+
+    async def start(self):
         """Start the server"""
-        self.log_event("[STARTUP] Chat server starting up")
+        self.stopped = asyncio.Event()
+        self.log_event("[STARTUP] Chat server starting up (%s event loop%s)",
+                       type(asyncio.get_running_loop()).__module__.split(".")[0],
+                       ", fast mode" if self.fast else "")
         self.log_event("[STARTUP] Server port set to %d", self.port)
-        
-        # Create socket
-        self.server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        self.server_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-        
         try:
-            self.server_socket.bind(('', self.port))
-            self.server_socket.listen(MAX_CLIENTS)
-            self.log_event("[STARTUP] Server listening on port %d", self.port)
-            print(f"[INFO] Server listening on port {self.port}...")
-        except Exception as e:
-            self.log_event("[ERROR] Failed to bind to port %d: %s", self.port, str(e))
+            self.server = await asyncio.start_server(self.handle_new_connection, host=None, port=self.port,
+                                                     backlog=MAX_CLIENTS, reuse_address=True)
+        except OSError as e:
+            self.log_error("[ERROR] Failed to bind to port %d: %s", self.port, str(e))
             print(f"Failed to bind to port {self.port}: {e}")
             sys.exit(1)
-        
-        # Accept connections
-        while self.running:
-            try:
-                client_socket, client_addr = self.server_socket.accept()
-                self.handle_new_connection(client_socket, client_addr)
-            except OSError:
-                if self.running:
-                    self.log_event("[ERROR] Accept failed")
-                break
-        
-        self.log_event("[SHUTDOWN] Server shutdown complete")
-
-    def handle_new_connection(self, client_socket: socket.socket, client_addr: Tuple[str, int]):
+        loop = asyncio.get_running_loop()
+        for signum in (signal.SIGINT, signal.SIGTERM):
+            loop.add_signal_handler(signum, self.shutdown, signal.Signals(signum).name)
+        self.log_event("[STARTUP] Server listening on port %d", self.port)
+        print(f"[INFO] Server listening on port {self.port}...")
+
+        await self.stopped.wait()
+        for task in list(self.tasks):
+            task.cancel()
+        self.log_error("[SHUTDOWN] Server shutdown complete")
+
+    def spawn(self, coro):
+        """Run coro on its own task, holding a reference until it is done"""
+        task = asyncio.get_running_loop().create_task(coro)
+        self.tasks.add(task)
+        task.add_done_callback(self.tasks.discard)
+        return task
+
+    async def handle_new_connection(self, reader, writer):
         """Handle new client connection"""
-        client_ip, client_port = client_addr
+        client_ip, client_port = writer.get_extra_info("peername")[:2]
         self.log_event("[CONNECTION] New connection from %s:%d", client_ip, client_port)
-        
+
         # Find available slot
-        with self.clients_lock:
-            client_id = None
-            for i in range(MAX_CLIENTS):
-                if i not in self.clients or not self.clients[i].active:
-                    client_id = i
-                    self.clients[i] = ClientInfo(
-                        socket=client_socket,
-                        active=True,
-                        address=client_addr
-                    )
-                    break
-        
-        if client_id is None:
-            self.log_event("[CONNECTION_REJECTED] Max clients reached, rejecting %s:%d", 
-                          client_ip, client_port)
-            print(f"[CONNECT] Max clients reached. Rejecting connection from {client_ip}:{client_port}")
-            client_socket.send(b"Server full. Try again later.\n")
-            client_socket.close()
+        slot = next((i for i, c in enumerate(self.clients) if c is None), None)
+        if slot is None or not self.running:
+            self.log_event("[CONNECTION_REJECTED] Max clients reached, rejecting %s:%d",
+                           client_ip, client_port)
+            if not self.fast:
+                print(f"[CONNECT] Max clients reached. Rejecting connection from {client_ip}:{client_port}")
+            writer.write(b"Server full. Try again later.\n\0")
+            writer.close()
             return
-        
-        print(f"[CONNECT] Client connected: user=unnamed from {client_ip}:{client_port}")
-        self.log_event("[CONNECTION_ACCEPTED] Client assigned to slot %d from %s:%d", 
-                      client_id, client_ip, client_port)
-        client_socket.send(b"SUCCESS_LOGIN")
-        
-        # Start client handler thread
-        client_thread = threading.Thread(target=self.handle_client, args=(client_id,))
-        client_thread.daemon = True
-        client_thread.start()
-
-    def handle_client(self, client_id: int):
-        """Handle client messages"""
-        client = self.clients[client_id]
-        
-        while client.active and self.running:
-            try:
-                data = client.socket.recv(BUFFER_SIZE)
+        client = self.clients[slot] = Client(self, slot, reader, writer)
+
+        if not self.fast:
+            print(f"[CONNECT] Client connected: user=unnamed from {client_ip}:{client_port}")
+        self.log_event("[CONNECTION_ACCEPTED] Client assigned to slot %d from %s:%d",
+                       slot, client_ip, client_port)
+        client.send(LOGIN_GREETING)
+        self.tasks.add(asyncio.current_task())
+        try:
+            await self.handle_client(client)
+        finally:
+            self.tasks.discard(asyncio.current_task())
+
+    async def handle_client(self, client: Client):
+        """Read commands until the client leaves, then clean up after it"""
+        buffer = b""
+        try:
+            while client.active:
+                read = client.reader.read(BUFFER_SIZE - 1 - len(buffer))
+                if buffer and not client.line_framed:
+                    # A bare command from an older client runs once it goes quiet
+                    try:
+                        data = await asyncio.wait_for(read, BARE_COMMAND_WAIT)
+                    except asyncio.TimeoutError:
+                        self.handle_message(client, buffer)
+                        buffer = b""
+                        continue
+                else:
+                    data = await read
                 if not data:
+                    # A last command written without a newline before closing
+                    if buffer and client.active and not client.data:
+                        self.handle_message(client, buffer)
                     break
-                
-                message = data.decode('utf-8').strip()
-                if not message:
-                    continue
-                
-                self.log_event("[MESSAGE_RECEIVED] Client %d (%s): %s [%d bytes]",
-                              client_id, client.username or "unnamed", message, len(data))
-                print(f"[COMMAND] {client.username or 'unnamed'} {message}")
-                
-                if message.startswith('/'):
-                    self.log_event("[COMMAND] Processing command from client %d: %s", 
-                                  client_id, message)
-                    self.handle_command(client_id, message)
-                elif message.startswith("FILE_EXISTS"):
-                    self.log_event("[FILE] Conflict: '%s' received twice -> renamed by client", 
-                                  message[12:])
-                elif message.isdigit():
-                    # This might be file size data during file transfer
-                    pass
-                else:
-                    # Unknown command
-                    response = f"[SERVER] Unknown command: '{message}'. Type /help for available commands."
-                    client.socket.send(response.encode())
-                    self.log_event("[UNKNOWN_COMMAND] Client %d sent invalid command: %s",
-                                  client_id, message)
-                    
-            except Exception as e:
-                self.log_event("[ERROR] Client %d error: %s", client_id, str(e))
-                break
-        
-        # Client disconnected
-        self.log_event("[DISCONNECT] Client %d (%s) disconnected",
-                      client_id, client.username or "unnamed")
-        print(f"[DISCONNECT] Client {client.username or 'unnamed'} disconnected.")
-        
-        with self.clients_lock:
-            self.remove_client_from_room(client_id)
-            client.active = False
-            try:
-                client.socket.close()
-            except:
-                pass
-            if client_id in self.clients:
-                del self.clients[client_id]
-
-    def handle_command(self, client_id: int, message: str):
-        """Handle client commands"""
-        parts = message.split(' ', 1)
-        cmd = parts[0]
-        args = parts[1] if len(parts) > 1 else ""
-        
-        client = self.clients[client_id]
-        
-        if cmd == "/username":
-            self.handle_username(client_id, args)
-        elif cmd == "/join":
-            self.handle_join(client_id, args)
-        elif cmd == "/broadcast":
-            self.handle_broadcast(client_id, args)
-        elif cmd == "/leave":
-            self.handle_leave(client_id)
-        elif cmd == "/whisper":
-            self.handle_whisper(client_id, args)
-        elif cmd == "/sendfile":
-            self.handle_sendfile(client_id, args)
-        elif cmd == "/list":
-            self.handle_list(client_id)
-        elif cmd == "/exit":
-            client.socket.send(b"[SERVER] Goodbye!")
-            client.active = False
-            self.log_event("[EXIT] Client %d (%s) disconnected voluntarily",
-                          client_id, client.username)
-        else:
-            response = "[SERVER] Unknown command. Available commands: /username, /join, /broadcast, /whisper, /sendfile, /list, /exit"
-            client.socket.send(response.encode())
+                buffer += data
+
+                # A read can hold several commands, one per line. Whatever
+                # follows the last newline waits for the rest; only a full
+                # buffer with no newline at all runs as it is.
+                start, end = 0, len(buffer)
+                while start < end and client.active and not client.data:
+                    newline = buffer.find(b"\n", start)
+                    if newline < 0 and end - start < BUFFER_SIZE - 1:
+                        break
+                    if newline >= 0:
+                        client.line_framed = True
+                    stop = newline if newline >= 0 else end
+                    self.handle_message(client, buffer[start:stop])
+                    start = stop + 1
+                buffer = buffer[start:] if start < end else b""
+                if client.data:
+                    # The connection now carries a transfer: free the slot only
+                    client.data.pending = buffer
+                    self.clients[client.slot] = None
+                    return
+        except (ConnectionError, OSError) as e:
+            self.log_event("[ERROR] Client %d error: %s", client.slot, str(e))
+        except asyncio.CancelledError:
+            pass
 
-    def handle_username(self, client_id: int, username: str):
-        """Handle username setting"""
-        if not username:
-            self.clients[client_id].socket.send(b"[SERVER] Username cannot be empty")
+        # Client disconnected
+        self.log_event("[DISCONNECT] Client %d (%s) disconnected", client.slot, client.name())
+        if not self.fast:
+            print(f"[DISCONNECT] Client {client.name()} disconnected.")
+        self.remove_client_from_room(client)
+        if client.username and self.users.get(client.username) is client:
+            del self.users[client.username]
+        client.flush()
+        client.active = False
+        client.writer.close()
+        self.clients[client.slot] = None
+        self.log_event("[CLEANUP] Client %d resources cleaned up", client.slot)
+
+    def handle_message(self, client: Client, raw: bytes):
+        # Heartbeat answers share the stream with commands
+        if not raw or raw == b"PONG":
+            return
+        try:
+            message = raw.decode("utf-8")
+        except UnicodeDecodeError:
+            client.send(b"[SERVER] Message rejected, text must be valid UTF-8")
+            self.log_event("[INVALID_UTF8] Client %d sent %d bytes that are not valid UTF-8",
+                           client.slot, len(raw))
             return
-            
-        if len(username) > MAX_USERNAME_LENGTH:
-            self.clients[client_id].socket.send(b"[SERVER] Username too long")
+        # chatserver frames compressed messages with 0x01; keep the same rule
+        if b"\x01" in raw:
+            client.send(b"[SERVER] Message rejected, text must not contain byte 0x01")
+            self.log_event("[INVALID_TEXT] Client %d sent a 0x01 byte", client.slot)
             return
-            
-        # Check if username is alphanumeric
-        if not re.match("^[a-zA-Z0-9_]+$", username):
-            self.clients[client_id].socket.send(b"[SERVER] Username must be alphanumeric")
+
+        self.log_event("[MESSAGE_RECEIVED] Client %d (%s): %s [%d bytes]",
+                       client.slot, client.name(), message, len(raw))
+        if not self.fast:
+            print(f"Client {client.slot}: {message}")
+
+        if message.startswith("/"):
+            cmd, _, args = message.partition(" ")
+            handler = self.commands.get(cmd)
+            if handler is None:
+                client.send(b"[SERVER] Unknown command. Type /help for available commands.")
+                self.log_event("[UNKNOWN_COMMAND] Client %d sent unrecognized command: %s",
+                               client.slot, message)
+            else:
+                handler(client, args)
+        elif message.startswith("FILE_EXISTS"):
+            self.log_event("[FILE] Conflict: '%s' received twice -> renamed by client",
+                           message[12:] or "?")
+        else:
+            # if not a command, warn the user for entering a command
+            client.send(f"Unknown command: '{message}'. Type /help for available commands.".encode())
+            self.log_event("[UNKNOWN_COMMAND] Client %d sent invalid command: %s", client.slot, message)
+
+    def cmd_username(self, client: Client, args: str):
+        username, _ = next_token(args)
+        if username is None:
+            client.send(b"[SERVER] Usage: /username <name>")
             return
-            
-        # Check if username is already taken
-        with self.clients_lock:
-            for other_id, other_client in self.clients.items():
-                if other_id != client_id and other_client.username == username:
-                    self.clients[client_id].socket.send(b"ALREADY_TAKEN")
-                    self.log_event("[USERNAME_TAKEN] Client %d tried to use taken username: %s", 
-                                  client_id, username)
-                    return
-            
-            self.clients[client_id].username = username
-            self.clients[client_id].socket.send(b"SET_USERNAME")
-            self.log_event("[USERNAME_SET] Client %d set username to: %s", client_id, username)
-            print(f"[USERNAME] Client {client_id} set username to: {username}")
-
-    def handle_join(self, client_id: int, room_name: str):
-        """Handle room joining"""
-        if not room_name:
-            self.clients[client_id].socket.send(b"[SERVER] Room name cannot be empty")
+        # Same rule as the client: names become file names on the C server
+        if not is_name(username, 3, MAX_USERNAME_LENGTH - 1):
+            client.send(f"[SERVER] Invalid username. Use 3-{MAX_USERNAME_LENGTH - 1} "
+                        f"letters, digits or underscores".encode())
+            self.log_event("[COMMAND_ERROR] Client %d sent invalid username: %s", client.slot, username)
             return
-            
-        if not self.validate_room_name(room_name):
-            self.clients[client_id].socket.send(b"[SERVER] Invalid room name. Use alphanumeric characters only (max 32 chars)")
+        if username in self.users:
+            client.send(b"ALREADY_TAKEN")
+            self.log_event("[USERNAME_TAKEN] Client %d tried to use taken username: %s",
+                           client.slot, username)
             return
-            
-        client = self.clients[client_id]
-        if not client.username:
-            client.socket.send(b"[SERVER] Please set a username first using /username <name>")
+
+        old_username = client.username
+        if old_username:
+            del self.users[old_username]
+        client.username = username
+        self.users[username] = client
+        client.send(b"SET_USERNAME")
+        self.log_event("[USERNAME_SET] Client %d changed username from '%s' to '%s'",
+                       client.slot, old_username or "unnamed", username)
+
+    def cmd_join(self, client: Client, args: str):
+        room_name, _ = next_token(args)
+        if room_name is None:
+            client.send(b"[SERVER] Usage: /join <room_name>")
             return
-            
-        with self.rooms_lock:
-            # Remove from current room if any
-            if client.current_room:
-                self.remove_client_from_room(client_id)
-            
-            # Create room if it doesn't exist
-            if room_name not in self.rooms:
-                self.rooms[room_name] = Room(name=room_name, members=[])
-                self.log_event("[ROOM_CREATED] Room '%s' created by client %d (%s)", 
-                              room_name, client_id, client.username)
-            
-            room = self.rooms[room_name]
-            
-            # Check if room is full
-            if len(room.members) >= MAX_GROUP_MEMBERS:
-                client.socket.send(b"[SERVER] Room is full")
-                return
-            
-            # Add client to room
-            room.members.append(client_id)
-            room.member_count = len(room.members)
-            client.current_room = room_name
-            
-            # Notify client
-            response = f"[SERVER] You joined room '{room_name}'"
-            client.socket.send(response.encode())
-            
-            # Notify other room members
-            join_msg = f"[SERVER] {client.username} joined the room"
-            self.broadcast_to_room(join_msg, room_name, client_id)
-            
-            self.log_event("[ROOM_JOIN] Client %d (%s) joined room '%s'", 
-                          client_id, client.username, room_name)
-            print(f"[ROOM] {client.username} joined room '{room_name}'")
-
-    def handle_broadcast(self, client_id: int, message: str):
-        """Handle broadcast message"""
-        client = self.clients[client_id]
-        
-        if not client.username:
-            client.socket.send(b"[SERVER] Please set a username first")
+        if not is_name(room_name, 1, MAX_GROUP_NAME_LENGTH - 1):
+            client.send(f"[SERVER] Invalid room name. Use 1-{MAX_GROUP_NAME_LENGTH - 1} "
+                        f"letters, digits or underscores".encode())
+            self.log_event("[COMMAND_ERROR] Client %d tried to join invalid room name: '%s'",
+                           client.slot, room_name)
             return
-            
-        if not client.current_room:
-            client.socket.send(b"[SERVER] You must join a room first")
+
+        members = self.rooms.get(room_name)
+        if members is None and len(self.rooms) >= MAX_GROUPS:
+            client.send(b"[SERVER] Too many rooms, join an existing one")
             return
-            
-        if not message:
-            client.socket.send(b"[SERVER] Message cannot be empty")
+        if members is not None and client not in members and len(members) >= MAX_GROUP_MEMBERS:
+            client.send(b"[SERVER] Room is full")
             return
-            
-        broadcast_msg = f"[BROADCAST] {client.username}: {message}"
-        self.broadcast_to_room(broadcast_msg, client.current_room, client_id)
-        
-        self.log_event("[BROADCAST] Client %d (%s) in room '%s': %s", 
-                      client_id, client.username, client.current_room, message)
-
-    def handle_leave(self, client_id: int):
-        """Handle leaving current room"""
-        client = self.clients[client_id]
-        
-        if not client.current_room:
-            client.socket.send(b"[SERVER] You are not in any room")
+
+        self.remove_client_from_room(client)
+        if room_name not in self.rooms:
+            self.log_event("[ROOM_CREATED] Room '%s' created by client %d (%s)",
+                           room_name, client.slot, client.name())
+        self.rooms.setdefault(room_name, {})[client] = None
+        client.room = room_name
+        client.send(f"[SERVER] Joined room '{room_name}'".encode())
+        self.log_event("[ROOM_JOIN] Client %d (%s) joined room '%s'", client.slot, client.name(), room_name)
+
+    def cmd_broadcast(self, client: Client, args: str):
+        # Everything after "/broadcast " is the message
+        if not args:
+            client.send(b"[SERVER] Usage: /broadcast <message>")
             return
-            
-        room_name = client.current_room
-        
-        with self.rooms_lock:
-            self.remove_client_from_room(client_id)
-            
-        client.socket.send(b"ROOM_LEFT")
-        
-        # Notify other room members
-        leave_msg = f"[SERVER] {client.username} left the room"
-        self.broadcast_to_room(leave_msg, room_name, client_id)
-        
-        self.log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", 
-                      client_id, client.username, room_name)
-        print(f"[ROOM] {client.username} left room '{room_name}'")
-
-    def handle_whisper(self, client_id: int, args: str):
-        """Handle private message"""
-        parts = args.split(' ', 1)
-        if len(parts) < 2:
-            self.clients[client_id].socket.send(b"[SERVER] Usage: /whisper <username> <message>")
+        if not client.room:
+            client.send(b"[SERVER] You must join a room first")
+            self.log_event("[BROADCAST_ERROR] Client %d tried to broadcast without joining room", client.slot)
             return
-            
-        target_username, message = parts
-        client = self.clients[client_id]
-        
-        if not client.username:
-            client.socket.send(b"[SERVER] Please set a username first")
+        self.broadcast_to_room(f"[BROADCAST] {client.username}: {args}".encode(), client.room, client)
+        client.send(b"[SERVER] Message broadcasted")
+        self.log_event("[BROADCAST] Client %d (%s) in room '%s': %s",
+                       client.slot, client.name(), client.room, args)
+
+    def cmd_leave(self, client: Client, args: str):
+        if not client.room:
+            client.send(b"[SERVER] You are not in a room")
             return
-            
-        if target_username == client.username:
-            client.socket.send(b"[SERVER] You cannot whisper to yourself")
+        room_name = client.room
+        self.remove_client_from_room(client)
+        client.send(b"ROOM_LEFT")
+        self.log_event("[ROOM_LEAVE] Client %d (%s) left room '%s'", client.slot, client.name(), room_name)
+
+    def cmd_whisper(self, client: Client, args: str):
+        target_username, message = next_token(args)
+        if target_username is None or not message:
+            client.send(b"[SERVER] Usage: /whisper <username> <message>")
             return
-            
-        # Find target client
-        target_client_id = None
-        with self.clients_lock:
-            for other_id, other_client in self.clients.items():
-                if other_client.username == target_username and other_client.active:
-                    target_client_id = other_id
-                    break
-        
-        if target_client_id is None:
-            client.socket.send(f"[SERVER] User '{target_username}' not found or offline".encode())
+        target = self.users.get(target_username)
+        if target is not None and target.active:
+            target.send(f"[WHISPER from {client.username}]: {message}".encode())
+            self.log_event("[WHISPER] %s -> %s: %s", client.name(), target_username, message)
+        else:
+            client.send(f"[SERVER] User '{target_username}' not found or offline".encode())
+            self.log_event("[WHISPER_ERROR] Target user '%s' not found or offline", target_username)
+        client.send(f"[SERVER] Whisper sent to {target_username}".encode())
+
+    def cmd_list(self, client: Client, args: str):
+        members = self.rooms.get(client.room) if client.room else None
+        if members is None:
+            client.send(b"[SERVER] You must join a room first")
             return
-            
-        # Send private message
-        whisper_msg = f"[WHISPER from {client.username}] {message}"
-        self.clients[target_client_id].socket.send(whisper_msg.encode())
-        
-        # Confirm to sender
-        confirm_msg = f"[WHISPER to {target_username}] {message}"
-        client.socket.send(confirm_msg.encode())
-        
-        self.log_event("[WHISPER] %s -> %s: %s", client.username, target_username, message)
-
-    def handle_sendfile(self, client_id: int, args: str):
-        """Handle file transfer request"""
-        parts = args.split(' ', 2)
-        if len(parts) < 3:
-            self.clients[client_id].socket.send(b"[SERVER] Usage: /sendfile <username> <filename> <filesize>")
+        client.send(("[SERVER] Users in room: " +
+                     "".join(member.username + " " for member in members)).encode())
+
+    def cmd_exit(self, client: Client, args: str):
+        client.send(b"[SERVER] Goodbye!")
+        client.active = False
+        self.log_event("[EXIT] Client %d (%s) disconnected voluntarily", client.slot, client.name())
+
+    def cmd_help(self, client: Client, args: str):
+        client.send(HELP_TEXT.encode())
+
+    def cmd_compress(self, client: Client, args: str):
+        # Replies are never compressed here; clients that ask are told so
+        mode, _ = next_token(args)
+        if mode in ("on", "off"):
+            client.send(b"COMPRESS_OFF")
+        elif mode is None or mode == "stats":
+            client.send(b"[SERVER] Compression off: 0 -> 0 bytes (ratio 1.00), 0.000 ms CPU")
+        else:
+            client.send(b"[SERVER] Usage: /compress on|off|stats")
+
+    def broadcast_to_room(self, message: bytes, room_name: str, sender: Optional[Client]):
+        """Send message to all members of a room except sender"""
+        for member in self.rooms.get(room_name, ()):
+            if member is not sender:
+                member.send(message)
+
+    def remove_client_from_room(self, client: Client):
+        """Remove client from their current room, deleting it once empty"""
+        if not client.room:
             return
-            
-        target_username, filename, filesize_str = parts
-        
-        try:
-            filesize = int(filesize_str)
-        except ValueError:
-            self.clients[client_id].socket.send(b"[SERVER] Invalid file size")
+        members = self.rooms.get(client.room)
+        if members is not None:
+            members.pop(client, None)
+            if not members:
+                del self.rooms[client.room]
+                self.log_event("[ROOM_DELETED] Empty room '%s' deleted", client.room)
+        client.room = ""
+
+    # File transfers: at most MAX_SIMULTANEOUS_TRANSFERS relay at once, up
+    # to MAX_FILE_QUEUE more wait their turn. Clients that send a transfer
+    # id get data connections to relay over; the rest get the simulated
+    # two second transfer chatserver.c gives them.
+
+    def transfer_reply(self, client: Client, code: str, transfer_id: int):
+        """Sender-facing replies name the transfer by the sender's id"""
+        if transfer_id:
+            client.send(f"{code} {transfer_id}\n".encode())
+        else:
+            client.send(code.encode() + b"\0")
+
+    def cmd_sendfile(self, client: Client, args: str):
+        words = args.split()
+        filename = words[0] if len(words) > 0 else ""
+        recipient_name = words[1] if len(words) > 1 else ""
+        size = leading_uint(words[2]) if len(words) > 2 else 0
+        transfer_id = leading_uint(words[3]) if len(words) > 3 else 0
+        streams = min(leading_uint(words[4]) if len(words) > 4 else 0, MAX_TRANSFER_STREAMS)
+        checksum = leading_uint(words[5], 16) if len(words) > 5 else 0
+        delta = leading_uint(words[6]) if len(words) > 6 else 0
+
+        if not filename or not recipient_name:
+            client.send(b"[SERVER] Usage: /sendfile <recipient> <filename> <size>\n")
             return
-            
-        if filesize > MAX_FILE_SIZE:
-            self.clients[client_id].socket.send(f"[SERVER] File too large (max {MAX_FILE_SIZE} bytes)".encode())
+        if len(filename.encode()) > MAX_FILENAME_LENGTH or not filename.lower().endswith(VALID_EXTENSIONS):
+            self.transfer_reply(client, "INVALID_FILE_TYPE", transfer_id)
             return
-            
-        client = self.clients[client_id]
-        
-        if not client.username:
-            client.socket.send(b"[SERVER] Please set a username first")
+        recipient = self.users.get(recipient_name)
+        if recipient is None:
+            self.transfer_reply(client, "RECIPIENT_NOT_FOUND", transfer_id)
             return
-            
-        # Find target client
-        target_client_id = None
-        with self.clients_lock:
-            for other_id, other_client in self.clients.items():
-                if other_client.username == target_username and other_client.active:
-                    target_client_id = other_id
-                    break
-        
-        if target_client_id is None:
-            client.socket.send(f"[SERVER] User '{target_username}' not found or offline".encode())
+        if not recipient.active:
+            self.transfer_reply(client, "RECIPIENT_OFFLINE", transfer_id)
             return
-            
-        # Create file meta
-        file_meta = FileMeta(
-            sender=client.username,
-            recipient=target_username,
-            filename=filename,
-            filesize=filesize,
-            sender_socket=client.socket,
-            recipient_socket=self.clients[target_client_id].socket
-        )
-        
-        # Start file transfer
-        if self.file_queue.start_transfer(file_meta):
-            self.handle_file_transfer(file_meta)
+        if size > MAX_FILE_SIZE:
+            self.transfer_reply(client, "FILE_SIZE_EXCEEDS_LIMIT", transfer_id)
+            return
+
+        meta = FileMeta(sender=client, recipient=recipient, filename=filename, filesize=size,
+                        transfer_id=transfer_id, streams=streams, checksum=checksum,
+                        delta=bool(delta and transfer_id and streams))
+        self.log_event("[FILE_TRANSFER] %s -> %s: %s (%d bytes)", client.name(), recipient_name, filename, size)
+        if self.active_transfers < MAX_SIMULTANEOUS_TRANSFERS:
+            self.active_transfers += 1
+            self.start_file_transfer(meta)
         else:
-            client.socket.send(b"[SERVER] File transfer queue full. Try again later.")
-            
-        self.log_event("[FILE_TRANSFER] %s -> %s: %s (%d bytes)", 
-                      client.username, target_username, filename, filesize)
-
-    def handle_list(self, client_id: int):
-        """Handle list users in current room"""
-        client = self.clients[client_id]
-        
-        if not client.current_room:
-            client.socket.send(b"[SERVER] You are not in any room")
+            self.enqueue_transfer(meta)
+
+    def enqueue_transfer(self, meta: FileMeta):
+        if len(self.file_queue) == MAX_FILE_QUEUE:
+            self.log_event("[FILE_QUEUE] Queue full, notifying sender")
+            self.transfer_reply(meta.sender, "FILE_QUEUE_FULL", meta.transfer_id)
             return
-            
-        with self.rooms_lock:
-            room = self.rooms.get(client.current_room)
-            if not room:
-                client.socket.send(b"[SERVER] Room not found")
-                return
-                
-            users = []
-            for member_id in room.members:
-                if member_id in self.clients and self.clients[member_id].active:
-                    users.append(self.clients[member_id].username)
-            
-            if users:
-                user_list = ", ".join(users)
-                response = f"[SERVER] Users in room '{client.current_room}': {user_list}"
-            else:
-                response = f"[SERVER] No users in room '{client.current_room}'"
-                
-            client.socket.send(response.encode())
+        meta.enqueue_time = time.time()
+        meta.expiry = asyncio.get_running_loop().call_later(QUEUED_TRANSFER_EXPIRY, self.expire_queued, meta)
+        self.file_queue.append(meta)
+        if meta.transfer_id:
+            meta.sender.send(f"FILE_QUEUED {meta.transfer_id} {len(self.file_queue)}\n".encode())
+        else:
+            meta.sender.send(f"[SERVER] File transfer queued. Queue position: {len(self.file_queue)}\n".encode())
+        self.log_event("[FILE_QUEUE] File enqueued successfully, queue size: %d", len(self.file_queue))
 
-    def handle_file_transfer(self, file_meta: FileMeta):
-        """Handle file transfer between clients"""
+    def expire_queued(self, meta: FileMeta):
+        if meta not in self.file_queue:
+            return
+        self.file_queue.remove(meta)
+        self.log_event("[FILE_QUEUE] Transfer %s -> %s ('%s') expired after %d seconds in queue",
+                       meta.sender.name(), meta.recipient.name(), meta.filename, QUEUED_TRANSFER_EXPIRY)
+        if meta.transfer_id:
+            notice = f"FILE_QUEUE_EXPIRED {meta.recipient.username} {meta.filename} {meta.transfer_id}\n"
+        else:
+            notice = f"FILE_QUEUE_EXPIRED {meta.recipient.username} {meta.filename}"
+        meta.sender.send(notice.encode())
+
+    def launch_next_transfers(self):
+        """Start queued transfers while slots are free"""
+        while self.file_queue and self.active_transfers < MAX_SIMULTANEOUS_TRANSFERS:
+            meta = self.file_queue.popleft()
+            meta.expiry.cancel()
+            if not meta.sender.active or not meta.recipient.active:
+                self.log_event("[FILE_QUEUE_ERROR] Sender or recipient offline for queued transfer")
+                meta.sender.send(f"[SERVER] {meta.recipient.username} went offline, your file offer "
+                                 f"for '{meta.filename}' was dropped".encode())
+                continue
+            self.active_transfers += 1
+            self.log_event("[FILE_TRANSFER] Starting next queued transfer: %s -> %s",
+                           meta.sender.name(), meta.recipient.name())
+            self.start_file_transfer(meta)
+
+    def start_file_transfer(self, meta: FileMeta):
+        """Tell both sides the transfer is starting and relay it on a task of
+        its own. The caller has taken one of the active transfer slots."""
+        transfer = None
+        if meta.transfer_id:
+            # A delta goes back and forth on one stream; data connections
+            # hold a client slot until they attach, so a split file gets no
+            # more streams than half the free slots can handshake
+            if meta.delta:
+                meta.streams = 1
+            if meta.streams > 1:
+                free_slots = self.clients.count(None)
+                if meta.streams > free_slots // 2:
+                    meta.streams = free_slots // 2 if free_slots >= 2 else 1
+            transfer = Transfer(meta, meta.streams or 1)
+            self.transfers[transfer.sender_token] = transfer
+            self.transfers[transfer.recipient_token] = transfer
+
+        sender, delta = meta.sender.username, " 1" if meta.delta else ""
+        if transfer and meta.streams:
+            # Clients that split files get the stream count and checksum back
+            ready = (f"READY_FOR_FILE {meta.transfer_id} {transfer.sender_token:016x} "
+                     f"{meta.streams}{delta}\n").encode()
+            incoming = (f"INCOMING_FILE {sender} {meta.filename} {meta.filesize} {meta.transfer_id} "
+                        f"{transfer.recipient_token:016x} {meta.streams} {meta.checksum:08x}{delta}\n")
+        elif transfer:
+            ready = f"READY_FOR_FILE {meta.transfer_id} {transfer.sender_token:016x}\n".encode()
+            incoming = (f"INCOMING_FILE {sender} {meta.filename} {meta.filesize} {meta.transfer_id} "
+                        f"{transfer.recipient_token:016x}\n")
+        else:
+            ready = b"READY_FOR_FILE\0"
+            incoming = f"INCOMING_FILE {sender} {meta.filename} {meta.filesize}\n"
+        meta.sender.send(ready)
+        meta.recipient.send(incoming.encode())
+        self.spawn(self.handle_file_transfer(meta, transfer))
+
+    async def handle_file_transfer(self, meta: FileMeta, transfer: Optional[Transfer]):
+        self.log_event("[FILE_TRANSFER] Processing transfer: %s -> %s (%s, %d bytes)",
+                       meta.sender.name(), meta.recipient.name(), meta.filename, meta.filesize)
         try:
-            # Notify recipient about incoming file
-            incoming_msg = f"INCOMING_FILE {file_meta.sender} {file_meta.filename} {file_meta.filesize}"
-            file_meta.recipient_socket.send(incoming_msg.encode())
-            
-            # Notify sender that recipient was notified
-            file_meta.sender_socket.send(b"READY_FOR_FILE")
-            
-            # Relay file data
-            self.relay_file_data(file_meta)
-            
-        except Exception as e:
-            self.log_event("[FILE_TRANSFER_ERROR] %s", str(e))
-            try:
-                file_meta.sender_socket.send(b"FILE_TRANSFER_FAILED")
-                file_meta.recipient_socket.send(b"FILE_TRANSFER_FAILED")
-            except:
-                pass
+            if transfer:
+                ok = await self.relay_data(transfer)
+            else:
+                await asyncio.sleep(2)
+                ok = True
         finally:
-            self.file_queue.finish_transfer()
-            
-            # Try to start next queued transfer
-            next_meta = self.file_queue.try_start_next()
-            if next_meta:
-                transfer_thread = threading.Thread(target=self.handle_file_transfer, args=(next_meta,))
-                transfer_thread.daemon = True
-                transfer_thread.start()
-
-    def relay_file_data(self, file_meta: FileMeta):
-        """Relay file data from sender to recipient"""
-        total_relayed = 0
-        
-        while total_relayed < file_meta.filesize:
-            try:
-                # Calculate remaining bytes
-                remaining = file_meta.filesize - total_relayed
-                chunk_size = min(BUFFER_SIZE, remaining)
-                
-                # Receive from sender
-                data = file_meta.sender_socket.recv(chunk_size)
-                if not data:
-                    raise Exception("Sender disconnected during file transfer")
-                
-                # Send to recipient
-                file_meta.recipient_socket.send(data)
-                total_relayed += len(data)
-                
-            except Exception as e:
-                self.log_event("[FILE_RELAY_ERROR] %s", str(e))
-                raise
-        
-        # Notify both parties of successful transfer
-        file_meta.sender_socket.send(b"FILE_TRANSFER_SUCCESS")
-        file_meta.recipient_socket.send(b"FILE_TRANSFER_SUCCESS")
-        
-        self.log_event("[FILE_TRANSFER_SUCCESS] Relayed %d bytes from %s to %s", 
-                      total_relayed, file_meta.sender, file_meta.recipient)
-
-    def broadcast_to_room(self, message: str, room_name: str, sender_id: int):
-        """Broadcast message to all members of a room except sender"""
-        with self.rooms_lock:
-            room = self.rooms.get(room_name)
-            if not room:
-                return
-                
-            for member_id in room.members:
-                if member_id != sender_id and member_id in self.clients:
-                    client = self.clients[member_id]
-                    if client.active:
-                        try:
-                            client.socket.send(message.encode())
-                        except:
-                            # Client might have disconnected
-                            pass
-
-    def remove_client_from_room(self, client_id: int):
-        """Remove client from their current room"""
-        client = self.clients[client_id]
-        if not client.current_room:
+            if transfer:
+                transfer.close()
+                self.transfers.pop(transfer.sender_token, None)
+                self.transfers.pop(transfer.recipient_token, None)
+            self.active_transfers -= 1
+
+        outcome = "FILE_TRANSFER_SUCCESS" if ok else "FILE_TRANSFER_FAILED"
+        if meta.transfer_id:
+            # The recipient tells transfers apart by sender and id
+            self.transfer_reply(meta.sender, outcome, meta.transfer_id)
+            meta.recipient.send(f"{outcome} {meta.transfer_id} {meta.sender.username}\n".encode())
+        else:
+            meta.sender.send(outcome.encode() + b"\0")
+            meta.recipient.send(outcome.encode() + b"\0")
+        self.log_event("[SEND FILE] '%s' from %s to %s (%s)", meta.filename, meta.sender.name(),
+                       meta.recipient.name(), "relayed" if ok else "failed")
+        self.launch_next_transfers()
+
+    def cmd_data(self, client: Client, args: str):
+        """The first command of a transfer's data connection. Once the token
+        matches, the connection belongs to the relay."""
+        token_arg, args = next_token(args)
+        stream_arg, _ = next_token(args)
+        token = leading_uint(token_arg, 16) if token_arg else 0
+        stream = leading_uint(stream_arg) if stream_arg else 0
+        transfer = self.transfers.get(token) if token and not client.username else None
+        data = DataStream(client.reader, client.writer)
+        role = transfer.attach(token, stream, data) if transfer else None
+        if role is None:
+            client.send(b"DATA_REJECTED\n")
+            self.log_event("[FILE_TRANSFER_ERROR] Client %d sent an unknown data token", client.slot)
             return
-            
-        room_name = client.current_room
-        if room_name in self.rooms:
-            room = self.rooms[room_name]
-            if client_id in room.members:
-                room.members.remove(client_id)
-                room.member_count = len(room.members)
-                
-                # Remove empty rooms
-                if room.member_count == 0:
-                    del self.rooms[room_name]
-                    self.log_event("[ROOM_DELETED] Empty room '%s' deleted", room_name)
-        
-        client.current_room = ""
-
-    def validate_room_name(self, room_name: str) -> bool:
-        """Validate room name format"""
-        if not room_name or len(room_name) > MAX_GROUP_NAME_LENGTH:
-            return False
-        return re.match("^[a-zA-Z0-9_]+$", room_name) is not None
+        # Acknowledge before the relay can write file data behind it
+        client.send(b"DATA_OK\n")
+        client.flush()
+        client.data = data
+        self.log_event("[FILE_TRANSFER] Client %d attached as %s data connection %d", client.slot, role, stream)
+
+    async def relay_range(self, src: DataStream, dst: DataStream, length: int):
+        relayed = 0
+        while relayed < length:
+            want = min(TRANSFER_CHUNK_SIZE, length - relayed)
+            chunk = await asyncio.wait_for(src.read(want), TRANSFER_STALL_TIMEOUT)
+            if not chunk:
+                raise ConnectionError("data connection closed mid-transfer")
+            dst.writer.write(chunk)
+            await asyncio.wait_for(dst.writer.drain(), TRANSFER_STALL_TIMEOUT)
+            relayed += len(chunk)
+
+    async def relay_frame(self, src: DataStream, dst: DataStream, limit: int) -> int:
+        """One length-prefixed frame of a delta transfer, checked against limit"""
+        head = await src.read_exactly(4)
+        length = int.from_bytes(head, "big")
+        if length > limit:
+            raise ValueError(f"delta frame of {length} bytes over the {limit} byte limit")
+        dst.writer.write(head)
+        await self.relay_range(src, dst, length)
+        return length
+
+    async def relay_data(self, transfer: Transfer) -> bool:
+        meta = transfer.meta
+        try:
+            await asyncio.wait_for(transfer.attached.wait(), TRANSFER_STALL_TIMEOUT)
+            if meta.delta:
+                # The recipient's signature to the sender, then the sender's
+                # delta to the recipient
+                signature = await self.relay_frame(transfer.recipient_data[0], transfer.sender_data[0],
+                                                   DELTA_MAX_SIGNATURE)
+                delta = await self.relay_frame(transfer.sender_data[0], transfer.recipient_data[0],
+                                               meta.filesize + 5)
+                transfer.relayed = signature + delta + 8
+            else:
+                n = transfer.streams
+                await asyncio.gather(*(
+                    self.relay_range(transfer.sender_data[i], transfer.recipient_data[i],
+                                     meta.filesize * (i + 1) // n - meta.filesize * i // n)
+                    for i in range(n)))
+                transfer.relayed = meta.filesize
+            return True
+        except asyncio.TimeoutError:
+            self.log_event("[FILE_TRANSFER_ERROR] Transfer '%s' stalled for %d s, failing it",
+                           meta.filename, TRANSFER_STALL_TIMEOUT)
+        except (ConnectionError, OSError, ValueError) as e:
+            self.log_event("[FILE_RELAY_ERROR] %s", str(e))
+        return False
 
 
 def main():
     """Main function"""
-    if len(sys.argv) != 2:
-        print(f"Usage: {sys.argv[0]} <port>")
+    parser = argparse.ArgumentParser(description="asyncio port of chatserver")
+    parser.add_argument("port", type=int)
+    parser.add_argument("--fast", action="store_true",
+                        help="uvloop if installed, no per-message logging or output")
+    options = parser.parse_args()
+    if options.port <= 0 or options.port > 65535:
+        print("Error: Port must be between 1 and 65535")
         sys.exit(1)
-        
+
+    if options.fast:
+        try:
+            import uvloop
+            uvloop.install()
+        except ImportError:
+            print("[INFO] uvloop is not installed, using the default event loop")
+
+    server = ChatServer(options.port, options.fast)
     try:
-        port = int(sys.argv[1])
-        if port <= 0 or port > 65535:
-            raise ValueError("Port must be between 1 and 65535")
-            
-        server = ChatServer(port)
-        server.start()
-        
-    except ValueError as e:
-        print(f"Error: {e}")
-        sys.exit(1)
+        asyncio.run(server.start())
     except KeyboardInterrupt:
         print("\nServer interrupted by user")
-        sys.exit(0)
-    except Exception as e:
-        print(f"Error: {e}")
-        sys.exit(1)
 
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()
@@ -0,0 +1,212 @@
+#include "session.h"
+#include <sys/random.h>
+
+static session_t sessions[SESSION_SLOTS];
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static session_expired_t expired_fn;
+
+void log_event(const char *format, ...);
+
+void session_init(session_expired_t expired) {
+    expired_fn = expired;
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        sessions[i].client_index = -1;
+    }
+}
+
+static uint64_t new_token(void) {
+    uint64_t token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            token = ((uint64_t)rand() << 32) ^ (uint64_t)rand() ^ (uint64_t)ts.tv_nsec;
+        }
+    }
+    return token;
+}
+
+// Caller holds session_mutex
+static session_t *find_owned(int client_index) {
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        if (sessions[i].token && sessions[i].client_index == client_index) return &sessions[i];
+    }
+    return NULL;
+}
+
+// Caller holds session_mutex
+static session_t *find_named(const char *username) {
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        if (sessions[i].token && strcmp(sessions[i].username, username) == 0) return &sessions[i];
+    }
+    return NULL;
+}
+
+// Caller holds session_mutex
+static void free_session(session_t *s) {
+    timer_cancel(&s->expiry);
+    s->token = 0;
+    s->client_index = -1;
+    s->username[0] = '\0';
+    s->room[0] = '\0';
+    s->buffered = 0;
+    s->messages = 0;
+    s->dropped = 0;
+}
+
+uint64_t session_issue(int client_index, const char *username) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_owned(client_index);
+    for (int i = 0; i < SESSION_SLOTS && !s; i++) {
+        if (!sessions[i].token) s = &sessions[i];
+    }
+    uint64_t token = 0;
+    if (s) {
+        free_session(s);
+        token = s->token = new_token();
+        s->client_index = client_index;
+        snprintf(s->username, sizeof(s->username), "%s", username);
+    }
+    pthread_mutex_unlock(&session_mutex);
+    return token;
+}
+
+void session_end(int client_index) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_owned(client_index);
+    if (s) free_session(s);
+    pthread_mutex_unlock(&session_mutex);
+}
+
+static void session_expiry_fired(void *arg) {
+    session_t *s = arg;
+    char username[MAX_USERNAME_LENGTH];
+    pthread_mutex_lock(&session_mutex);
+    // Resumed in the meantime
+    if (!s->token || s->client_index != -1 || timers_now_ms() + TIMER_TICK_MS < s->expires_ms) {
+        pthread_mutex_unlock(&session_mutex);
+        return;
+    }
+    strcpy(username, s->username);
+    log_event("[SESSION_EXPIRED] Session of '%s' not resumed within %d s, %d buffered message(s) dropped",
+              username, SESSION_RESUME_WINDOW, s->messages);
+    free_session(s);
+    pthread_mutex_unlock(&session_mutex);
+    if (expired_fn) expired_fn(username);
+}
+
+int session_detach(int client_index, const client_info_t *client) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_owned(client_index);
+    if (s) {
+        s->client_index = -1;
+        snprintf(s->room, sizeof(s->room), "%s", client->current_room);
+        s->compress = client->compress;
+        s->presence = client->presence;
+        s->buffered = 0;
+        s->messages = 0;
+        s->dropped = 0;
+        s->expires_ms = timers_now_ms() + SESSION_RESUME_WINDOW * 1000ull;
+        timer_arm(&s->expiry, SESSION_RESUME_WINDOW * 1000ull, session_expiry_fired, s);
+    }
+    pthread_mutex_unlock(&session_mutex);
+    return s != NULL;
+}
+
+int session_held(const char *username) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_named(username);
+    int held = s && s->client_index == -1;
+    pthread_mutex_unlock(&session_mutex);
+    return held;
+}
+
+// Append one line, pushing out the oldest ones to make room. Caller holds
+// session_mutex.
+static void buffer_message(session_t *s, const char *msg, size_t len) {
+    if (len + 1 > SESSION_BUFFER_BYTES) {
+        s->dropped++;
+        return;
+    }
+    while (s->buffered + len + 1 > SESSION_BUFFER_BYTES) {
+        char *end = memchr(s->buffer, '\n', s->buffered);
+        size_t first = end ? (size_t)(end - s->buffer) + 1 : s->buffered;
+        memmove(s->buffer, s->buffer + first, s->buffered - first);
+        s->buffered -= first;
+        s->messages--;
+        s->dropped++;
+    }
+    memcpy(s->buffer + s->buffered, msg, len);
+    s->buffered += len;
+    s->buffer[s->buffered++] = '\n';
+    s->messages++;
+}
+
+void session_buffer_room(const char *room, const char *msg, size_t len) {
+    pthread_mutex_lock(&session_mutex);
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        session_t *s = &sessions[i];
+        if (s->token && s->client_index == -1 && s->room[0] && strcmp(s->room, room) == 0) {
+            buffer_message(s, msg, len);
+        }
+    }
+    pthread_mutex_unlock(&session_mutex);
+}
+
+int session_buffer_user(const char *username, const char *msg, size_t len) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_named(username);
+    int detached = s && s->client_index == -1;
+    if (detached) buffer_message(s, msg, len);
+    pthread_mutex_unlock(&session_mutex);
+    return detached;
+}
+
+int session_resume(int client_index, const char *username, uint64_t token, session_t *out, int *owner) {
+    pthread_mutex_lock(&session_mutex);
+    session_t *s = find_named(username);
+    if (!s || s->token != token) {
+        pthread_mutex_unlock(&session_mutex);
+        return SESSION_UNKNOWN;
+    }
+    if (s->client_index != -1) {
+        *owner = s->client_index;
+        pthread_mutex_unlock(&session_mutex);
+        return SESSION_ATTACHED;
+    }
+    timer_cancel(&s->expiry);
+    s->client_index = client_index;
+    *out = *s;
+    int messages = s->messages;
+    s->buffered = 0;
+    s->messages = 0;
+    s->dropped = 0;
+    s->room[0] = '\0';
+    pthread_mutex_unlock(&session_mutex);
+    return messages;
+}
+
+int session_export(session_t *out) {
+    int count = 0;
+    pthread_mutex_lock(&session_mutex);
+    for (int i = 0; i < SESSION_SLOTS; i++) {
+        if (sessions[i].token) out[count++] = sessions[i];
+    }
+    pthread_mutex_unlock(&session_mutex);
+    return count;
+}
+
+void session_import(const session_t *in, int count) {
+    uint64_t now = timers_now_ms();
+    pthread_mutex_lock(&session_mutex);
+    for (int i = 0; i < count && i < SESSION_SLOTS; i++) {
+        session_t *s = &sessions[i];
+        *s = in[i];
+        // The old process's timer is not ours; CLOCK_MONOTONIC is shared
+        memset(&s->expiry, 0, sizeof(s->expiry));
+        if (s->client_index == -1) {
+            timer_arm(&s->expiry, s->expires_ms > now ? s->expires_ms - now : 0, session_expiry_fired, s);
+        }
+    }
+    pthread_mutex_unlock(&session_mutex);
+}
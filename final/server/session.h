@@ -0,0 +1,75 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+#include "timerwheel.h"
+
+// Resumable sessions. A registered client asks for a token with /session;
+// if its connection drops, the server keeps the session detached for
+// SESSION_RESUME_WINDOW seconds: the name stays taken, room broadcasts and
+// whispers meant for it collect in a buffer, and a new connection whose
+// first frame is
+//
+//   /resume <username> <token>
+//
+// takes it over, gets its room and options back and the buffered messages
+// flushed.
+// Sessions live in memory only; after a restart the client logs in again.
+
+#define SESSION_BUFFER_BYTES (16 * 1024)    // per detached session, oldest dropped first
+#define SESSION_SLOTS (MAX_CLIENTS * 2)     // every client plus as many detached
+
+typedef struct {
+    char username[MAX_USERNAME_LENGTH];
+    char room[MAX_GROUP_NAME_LENGTH];   // kept while detached
+    int compress;                       // the client's options, restored on resume
+    int presence;
+    uint64_t token;                     // 0 = slot free
+    int client_index;                   // owning connection, -1 while detached
+    char buffer[SESSION_BUFFER_BYTES];  // one message per line
+    size_t buffered;
+    int messages;
+    int dropped;                        // messages pushed out by newer ones
+    wheel_timer_t expiry;
+    uint64_t expires_ms;                // a late callback from an earlier detach is ignored
+} session_t;
+
+// Called on the timer thread, no session lock held, when a detached
+// session runs out of time and its name is free again
+typedef void (*session_expired_t)(const char *username);
+
+void session_init(session_expired_t expired);
+
+// Give client_index a token for username, replacing any it had. Returns
+// the token, 0 if every slot is in use.
+uint64_t session_issue(int client_index, const char *username);
+// The client left on purpose or changed its name: forget its session
+void session_end(int client_index);
+// client_index's connection dropped. If it had a session, keep it
+// detached with the client's room and options and return 1.
+int session_detach(int client_index, const client_info_t *client);
+// A detached session holds username
+int session_held(const char *username);
+
+// Buffer a message for every detached session in room, or for username.
+// session_buffer_user returns 1 if username is detached.
+void session_buffer_room(const char *room, const char *msg, size_t len);
+int session_buffer_user(const char *username, const char *msg, size_t len);
+
+// Hand a detached session to client_index if token matches. Copies it,
+// buffered messages and all, to out and returns the number of messages,
+// or SESSION_UNKNOWN. A session whose old connection the server has not
+// seen drop yet is SESSION_ATTACHED, with that connection's index in
+// *owner; the caller cuts it and the client tries again.
+#define SESSION_UNKNOWN (-1)
+#define SESSION_ATTACHED (-2)
+int session_resume(int client_index, const char *username, uint64_t token, session_t *out, int *owner);
+
+// Hot restart: copy every session, attached or detached, to out (room
+// for SESSION_SLOTS) and return how many; the new process installs them
+// and re-arms the expiry of the detached ones
+int session_export(session_t *out);
+void session_import(const session_t *in, int count);
+
+#endif // SESSION_H
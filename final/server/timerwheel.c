@@ -0,0 +1,167 @@
+#include "timerwheel.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// wheel_timer_t.pending
+#define TIMER_IDLE 0
+#define TIMER_IN_WHEEL 1
+#define TIMER_EXPIRED 2     // on an expired list, callback not started yet
+
+static timer_wheel_t wheel;
+static wheel_timer_t expired;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+
+void log_event(const char *format, ...);
+
+void wheel_list_init(wheel_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(wheel_timer_t *head, wheel_timer_t *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = t;
+}
+
+void wheel_init(timer_wheel_t *w, uint64_t now) {
+    w->now = now;
+    w->pending = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            wheel_list_init(&w->slots[level][slot]);
+        }
+    }
+}
+
+// Put t in the coarsest level whose slot still separates it from now: a
+// level-L slot is next visited exactly when the lower levels wrap to zero
+// on the way to t->expires
+static void place(timer_wheel_t *w, wheel_timer_t *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    list_append(&w->slots[level][slot], t);
+}
+
+void wheel_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t expires) {
+    if (t->pending) wheel_del(w, t);
+    if (expires <= w->now) expires = w->now + 1;
+    if (expires - w->now > WHEEL_MAX_TICKS) expires = w->now + WHEEL_MAX_TICKS;
+    t->expires = expires;
+    t->pending = TIMER_IN_WHEEL;
+    place(w, t);
+    w->pending++;
+}
+
+void wheel_del(timer_wheel_t *w, wheel_timer_t *t) {
+    if (t->pending == TIMER_IDLE) return;
+    if (t->pending == TIMER_IN_WHEEL) w->pending--;
+    list_unlink(t);
+    t->pending = TIMER_IDLE;
+}
+
+int wheel_advance(timer_wheel_t *w, uint64_t now, wheel_timer_t *out) {
+    int moved = 0;
+    if (w->pending == 0 && now > w->now) {
+        w->now = now;       // nothing to walk past
+        return 0;
+    }
+    while (w->now < now) {
+        uint64_t tick = ++w->now;
+        // A level's slot comes due when every level below it wraps round
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (tick & ((1ULL << (WHEEL_BITS * level)) - 1)) break;
+            wheel_timer_t *head = &w->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            while (head->next != head) {
+                wheel_timer_t *t = head->next;
+                list_unlink(t);
+                place(w, t);
+            }
+        }
+        wheel_timer_t *head = &w->slots[0][tick & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            wheel_timer_t *t = head->next;
+            list_unlink(t);
+            t->pending = TIMER_EXPIRED;
+            list_append(out, t);
+            w->pending--;
+            moved++;
+        }
+    }
+    return moved;
+}
+
+uint64_t timers_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *timer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&timer_mutex);
+    while (1) {
+        while (wheel.pending == 0 && expired.next == &expired) {
+            pthread_cond_wait(&timer_cond, &timer_mutex);
+        }
+        pthread_mutex_unlock(&timer_mutex);
+        usleep(TIMER_TICK_MS * 1000);
+        pthread_mutex_lock(&timer_mutex);
+
+        wheel_advance(&wheel, timers_now_ms() / TIMER_TICK_MS, &expired);
+        while (expired.next != &expired) {
+            wheel_timer_t *t = expired.next;
+            list_unlink(t);
+            t->pending = TIMER_IDLE;
+            timer_fn_t fn = t->fn;
+            void *fn_arg = t->arg;
+            pthread_mutex_unlock(&timer_mutex);
+            fn(fn_arg);
+            pthread_mutex_lock(&timer_mutex);
+        }
+    }
+    return NULL;
+}
+
+int timers_init(void) {
+    wheel_init(&wheel, timers_now_ms() / TIMER_TICK_MS);
+    wheel_list_init(&expired);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    log_event("[TIMERS] Timing wheel running: %d levels of %d slots, %d ms ticks",
+              WHEEL_LEVELS, WHEEL_SLOTS, TIMER_TICK_MS);
+    return 0;
+}
+
+void timer_arm(wheel_timer_t *t, uint64_t delay_ms, timer_fn_t fn, void *arg) {
+    uint64_t tick = timers_now_ms() / TIMER_TICK_MS;
+    pthread_mutex_lock(&timer_mutex);
+    if (t->pending) wheel_del(&wheel, t);
+    if (wheel.pending == 0 && tick > wheel.now) wheel.now = tick;
+    t->fn = fn;
+    t->arg = arg;
+    int wake = wheel.pending == 0;
+    wheel_add(&wheel, t, tick + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    if (wake) pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+void timer_cancel(wheel_timer_t *t) {
+    pthread_mutex_lock(&timer_mutex);
+    wheel_del(&wheel, t);
+    pthread_mutex_unlock(&timer_mutex);
+}
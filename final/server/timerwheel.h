@@ -0,0 +1,60 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel: WHEEL_LEVELS wheels of WHEEL_SLOTS slots, each
+// level's slot spanning a whole turn of the level below. A timer goes in the
+// coarsest slot that still tells it apart from "now" and moves down a level
+// when that slot comes round. Arming and cancelling unlink/link one list
+// node, and advancing one tick touches one slot plus, every WHEEL_SLOTS
+// ticks, one slot of the next level, so every operation is O(1) however
+// many timers are pending. Timers live in the caller's memory, so nothing
+// is allocated either.
+//
+// At TIMER_TICK_MS per tick the wheel reaches 2^24 ticks (~46 hours);
+// later deadlines are clamped to that and the callback should re-arm.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define TIMER_TICK_MS 10
+
+typedef void (*timer_fn_t)(void *arg);
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires;       // tick
+    timer_fn_t fn;
+    void *arg;
+    int pending;            // 0 idle, 1 in the wheel, 2 due and waiting for its callback
+} wheel_timer_t;
+
+typedef struct {
+    uint64_t now;           // last tick processed
+    uint64_t pending;       // timers in the wheel
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];     // list heads
+} timer_wheel_t;
+
+// The data structure alone; not thread safe
+void wheel_init(timer_wheel_t *w, uint64_t now);
+void wheel_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t expires);
+void wheel_del(timer_wheel_t *w, wheel_timer_t *t);
+// Process ticks up to and including now; due timers are moved to the
+// expired list (a head initialised with wheel_list_init), still pending.
+// Returns how many were moved.
+int wheel_advance(timer_wheel_t *w, uint64_t now, wheel_timer_t *expired);
+void wheel_list_init(wheel_timer_t *head);
+
+// The server's wheel, driven by one thread. Callbacks run on that thread
+// without any timer lock held, so they may arm or cancel timers, including
+// their own. A timer cancelled before its callback started never fires.
+int timers_init(void);
+uint64_t timers_now_ms(void);
+// (Re)arm t to call fn(arg) in delay_ms
+void timer_arm(wheel_timer_t *t, uint64_t delay_ms, timer_fn_t fn, void *arg);
+void timer_cancel(wheel_timer_t *t);
+
+#endif // TIMERWHEEL_H
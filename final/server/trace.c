@@ -0,0 +1,143 @@
+#include "trace.h"
+#include <sys/syscall.h>
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+} trace_event_t;
+
+// Only the owning thread writes; head is published with release so the
+// exporter sees complete events (a span being overwritten meanwhile may
+// come out mixed, which is acceptable for a profiling view).
+typedef struct {
+    int tid;
+    uint64_t head;              // events ever written
+    trace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer_t;
+
+// A thread's spans outlive it: on exit its buffer is copied into the
+// retired ring and goes back on the free list for the next thread
+typedef struct {
+    int tid;
+    trace_event_t event;
+} trace_retired_t;
+
+int trace_enabled = 0;
+
+static trace_buffer_t *buffers[TRACE_MAX_THREADS];     // live threads
+static int buffer_count = 0;
+static trace_buffer_t *free_buffers[TRACE_FREE_BUFFERS];
+static int free_count = 0;
+static trace_retired_t *retired = NULL;
+static uint64_t retired_head = 0;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer_t *my_buffer = NULL;
+
+void log_event(const char *format, ...);
+
+uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Thread exit: flush the buffer's spans to the retired ring, then recycle it
+static void retire_buffer(void *arg) {
+    trace_buffer_t *b = arg;
+    pthread_mutex_lock(&buffers_mutex);
+    for (int i = 0; i < buffer_count; i++) {
+        if (buffers[i] == b) {
+            buffers[i] = buffers[--buffer_count];
+            break;
+        }
+    }
+    if (!retired) retired = calloc(TRACE_RETIRED_EVENTS, sizeof(trace_retired_t));
+    if (retired) {
+        uint64_t from = b->head > TRACE_BUFFER_EVENTS ? b->head - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t n = from; n < b->head; n++) {
+            trace_retired_t *r = &retired[retired_head++ % TRACE_RETIRED_EVENTS];
+            r->tid = b->tid;
+            r->event = b->events[n % TRACE_BUFFER_EVENTS];
+        }
+    }
+    if (free_count < TRACE_FREE_BUFFERS) {
+        free_buffers[free_count++] = b;
+    } else {
+        free(b);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+}
+
+static void make_buffer_key(void) {
+    pthread_key_create(&buffer_key, retire_buffer);
+}
+
+static trace_buffer_t *thread_buffer(void) {
+    if (my_buffer) return my_buffer;
+    pthread_once(&buffer_key_once, make_buffer_key);
+    pthread_mutex_lock(&buffers_mutex);
+    if (buffer_count < TRACE_MAX_THREADS) {
+        trace_buffer_t *b = free_count > 0 ? free_buffers[--free_count] : malloc(sizeof(trace_buffer_t));
+        if (b) {
+            b->tid = (int)syscall(SYS_gettid);
+            b->head = 0;
+            buffers[buffer_count++] = b;
+            my_buffer = b;
+            pthread_setspecific(buffer_key, b);
+        }
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    return my_buffer;
+}
+
+void trace_span(const char *name, uint64_t start_ns) {
+    uint64_t end = trace_now_ns();
+    trace_buffer_t *b = thread_buffer();
+    if (!b) return;
+    trace_event_t *e = &b->events[b->head % TRACE_BUFFER_EVENTS];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->dur_ns = end > start_ns ? end - start_ns : 0;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_set_enabled(int enabled) {
+    __atomic_store_n(&trace_enabled, enabled, __ATOMIC_RELAXED);
+    log_event("[TRACE] Span tracing %s", enabled ? "started" : "stopped");
+}
+
+static void write_event(FILE *f, int *first, int tid, const trace_event_t *e) {
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            *first ? "" : ",", e->name, (int)getpid(), tid, e->start_ns / 1e3, e->dur_ns / 1e3);
+    *first = 0;
+}
+
+size_t trace_export_json(char **out) {
+    size_t len = 0;
+    FILE *f = open_memstream(out, &len);
+    if (!f) return 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    int first = 1;
+    pthread_mutex_lock(&buffers_mutex);
+    for (int i = 0; i < buffer_count; i++) {
+        trace_buffer_t *b = buffers[i];
+        uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+        uint64_t from = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t n = from; n < head; n++) {
+            write_event(f, &first, b->tid, &b->events[n % TRACE_BUFFER_EVENTS]);
+        }
+    }
+    uint64_t from = retired_head > TRACE_RETIRED_EVENTS ? retired_head - TRACE_RETIRED_EVENTS : 0;
+    for (uint64_t n = from; n < retired_head; n++) {
+        const trace_retired_t *r = &retired[n % TRACE_RETIRED_EVENTS];
+        write_event(f, &first, r->tid, &r->event);
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return len;
+}
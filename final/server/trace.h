@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Span tracing for the command path. Each thread records complete spans
+// (name, start, duration) into its own ring buffer; GET /trace on the
+// metrics port exports all rings as Chrome trace-event JSON, which
+// chrome://tracing and Perfetto open directly.
+//
+// Tracing starts off (--trace or GET /trace/start turns it on). While off,
+// TRACE_START and TRACE_END each cost one predicted-not-taken branch.
+
+#define TRACE_BUFFER_EVENTS 8192    // per thread, oldest spans are overwritten
+#define TRACE_MAX_THREADS 256       // threads tracing at the same time
+#define TRACE_RETIRED_EVENTS 65536  // spans kept from threads that have exited
+#define TRACE_FREE_BUFFERS 8        // exited threads' buffers kept for reuse
+
+extern int trace_enabled;
+
+#define TRACE_START() (__builtin_expect(trace_enabled, 0) ? trace_now_ns() : 0)
+#define TRACE_END(name, start) do { \
+        if (__builtin_expect((start) != 0, 0)) trace_span((name), (start)); \
+    } while (0)
+// For spans whose start was taken without TRACE_START, e.g. queue wait
+#define TRACE_END_FROM(name, start) do { \
+        if (__builtin_expect(trace_enabled, 0)) trace_span((name), (start)); \
+    } while (0)
+
+uint64_t trace_now_ns(void);
+// name must be a string literal or otherwise outlive the trace
+void trace_span(const char *name, uint64_t start_ns);
+
+void trace_set_enabled(int enabled);
+// Chrome trace JSON of everything buffered; caller frees *out
+size_t trace_export_json(char **out);
+
+#endif // TRACE_H
@@ -0,0 +1,75 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "../shared/chatDefination.h"
+
+// Write-ahead log of chat state mutations.
+//
+// Every mutation is applied to a shadow copy of the durable state
+// (wal_state_t) and encoded into an in-memory buffer. A flusher thread
+// writes and fdatasync()s the buffer every WAL_GROUP_COMMIT_MS, so many
+// mutations share one sync. Every snapshot_every records the shadow state
+// is written to a snapshot and older log generations are deleted.
+// Recovery = load the snapshot, replay the log generations after it.
+
+#define WAL_GROUP_COMMIT_MS 5
+#define WAL_BUFFER_SIZE (64 * 1024)
+#define WAL_DEFAULT_SNAPSHOT_EVERY 10000
+#define WAL_MAX_SESSIONS 1024
+#define WAL_MAX_PENDING 64
+#define WAL_FILENAME_LEN MAX_FILENAME_LENGTH
+
+typedef enum {
+    WAL_USERNAME_SET = 1,
+    WAL_JOIN,
+    WAL_LEAVE,
+    WAL_DISCONNECT,
+    WAL_TRANSFER_QUEUED,
+    WAL_TRANSFER_DEQUEUED
+} wal_type_t;
+
+typedef struct {
+    wal_type_t type;
+    char username[MAX_USERNAME_LENGTH];     // sender for transfers
+    char recipient[MAX_USERNAME_LENGTH];
+    char room[MAX_GROUP_NAME_LENGTH];
+    char filename[WAL_FILENAME_LEN];
+    uint64_t filesize;
+} wal_event_t;
+
+typedef struct {
+    char username[MAX_USERNAME_LENGTH];
+    char room[MAX_GROUP_NAME_LENGTH];
+    uint8_t online;
+} wal_session_t;
+
+typedef struct {
+    char sender[MAX_USERNAME_LENGTH];
+    char recipient[MAX_USERNAME_LENGTH];
+    char filename[WAL_FILENAME_LEN];
+    uint64_t filesize;
+} wal_transfer_t;
+
+// Everything that survives a restart. Plain data so a snapshot is one write.
+typedef struct {
+    uint64_t lsn;                               // records applied so far
+    uint32_t room_count;
+    char rooms[MAX_GROUPS][MAX_GROUP_NAME_LENGTH];  // creation order
+    uint32_t session_count;
+    wal_session_t sessions[WAL_MAX_SESSIONS];   // open addressed by username
+    uint32_t pending_count;
+    wal_transfer_t pending[WAL_MAX_PENDING];    // FIFO, oldest first
+} wal_state_t;
+
+// Open (or create) the log in dir and rebuild *recovered from it.
+int wal_open(const char *dir, uint32_t snapshot_every, wal_state_t *recovered);
+void wal_append(const wal_event_t *ev);
+void wal_sync(void);
+void wal_close(void);
+
+// Pure state helpers, shared by recovery and the live shadow state
+void wal_state_apply(wal_state_t *st, const wal_event_t *ev);
+const wal_session_t *wal_state_session(const wal_state_t *st, const char *username);
+
+#endif // WAL_H
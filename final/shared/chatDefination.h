@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 
 
@@ -26,6 +27,7 @@
 #define MAX_MESSAGE_LENGTH 256
 #define MAX_USERNAME_LENGTH 16
 #define MAX_GROUP_NAME_LENGTH 32
+#define MAX_FILENAME_LENGTH 128         // with the NUL; queued transfers keep it in the WAL
 #define MAX_GROUPS 15
 #define MAX_GROUP_MEMBERS 10
 #define FILE_META_MSG_LEN 256*2
@@ -36,6 +38,48 @@
 
 #define MAX_FILE_SIZE (1024 * 1024 * 3) // 3 MB
 
+// A /sendfile carrying the sender's transfer id moves real bytes: each side
+// opens a data connection to the chat port and sends /data <token> with the
+// token from READY_FOR_FILE or INCOMING_FILE. Without an id it is simulated.
+#define TRANSFER_CHUNK_SIZE (64 * 1024)
+
+// A sender may split a file over up to this many data connections:
+// "/sendfile <file> <recipient> <size> <id> <streams> <checksum>". Stream
+// i carries bytes [TRANSFER_RANGE_START(i), TRANSFER_RANGE_START(i + 1))
+// and every side of it sends "/data <token> <i>". The checksum is FNV-1a
+// over the whole file, passed on for the recipient to verify.
+#define MAX_TRANSFER_STREAMS 8
+#define TRANSFER_RANGE_START(size, streams, i) ((size_t)(size) * (i) / (streams))
+
+// "... <checksum> 1" offers to send only what changed (client/delta.h). The
+// server then runs the transfer over one stream, adds a trailing 1 to
+// READY_FOR_FILE and INCOMING_FILE, and relays two frames: the recipient's
+// signature of the copy it has, then the sender's delta against it. Each
+// frame is a 4-byte big-endian length and that many bytes.
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_SIGNATURE (8 + 12 * (MAX_FILE_SIZE / DELTA_MIN_BLOCK + 1))
+#define DELTA_MAX_WIRE(size) ((size_t)(size) + 5)     // one literal of the whole file
+
+// Commands end with '\n', and input is held until the newline arrives, so
+// a command split across TCP segments still runs whole. Older clients write
+// one bare command per write and never send one: until a client has ended a
+// command with '\n', its unterminated input runs once the connection has
+// been quiet for this long, and at EOF.
+#define BARE_COMMAND_WAIT_MS 50
+
+// Server timers, in seconds
+#define IDLE_TIMEOUT_DEFAULT 120        // silent clients are dropped, --idle-timeout
+#define HEARTBEATS_PER_TIMEOUT 3        // PINGs sent to a silent client before that
+#define TRANSFER_STALL_TIMEOUT 10       // a transfer making no progress for this long fails
+#define QUEUED_TRANSFER_EXPIRY 60       // a queued transfer not started by then is dropped
+#define SESSION_RESUME_WINDOW 60        // a dropped session can be resumed for this long
+
+// A client asks for a token with /session ("SESSION <hex>") and after a
+// dropped connection sends "/resume <username> <token>" as its first
+// frame. The answer is one line: RESUMED <username> <room or ->,
+// RESUME_RETRY or RESUME_FAILED.
+#define SESSION_TOKEN_HEX 16
+
 
 
 #define LOG_FILE "server.log"
@@ -45,6 +89,12 @@ typedef struct {
     char username[MAX_USERNAME_LENGTH];
     char current_room[MAX_GROUP_NAME_LENGTH];
     int active;
+    int compress;           // negotiated with /compress on, see compress.h
+    int presence;           // wants presence delta lines, see presence.h
+    int line_framed;        // has ended a command with '\n', see BARE_COMMAND_WAIT_MS
+    uint64_t raw_bytes;     // compressible messages sent, before compression
+    uint64_t wire_bytes;    // the same messages as they went on the wire
+    uint64_t compress_ns;   // this client's share of the CPU time spent compressing
 } client_info_t;
 
 typedef struct {
@@ -57,12 +107,18 @@ typedef struct {
 typedef struct {
     char sender[MAX_USERNAME_LENGTH];
     char recipient[MAX_USERNAME_LENGTH]; 
-    char filename[256];
+    char filename[MAX_FILENAME_LENGTH];
     size_t filesize;
     int sender_socket;
     int recipient_socket;
     time_t enqueue_time;
     time_t start_time;  // Add this to track when transfer starts
+    uint64_t queued_ns; // monotonic time of the /sendfile, for queue wait metrics
+    uint32_t queue_id;  // names the expiry timer while the transfer is queued
+    uint32_t transfer_id;   // the sender's id for it, 0 = simulated transfer
+    uint32_t streams;       // data connections per side, 0 = a client that sent none
+    uint32_t checksum;      // the sender's, for the recipient
+    uint32_t delta;         // sent as a delta against the recipient's copy
 } FileMeta;
 
 
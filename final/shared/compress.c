@@ -0,0 +1,159 @@
+#include "compress.h"
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5     // the block must end with at least 5 literals
+#define LZ_MATCH_LIMIT 12      // and no match may start in the last 12 bytes
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// One sequence: token, literal run, and unless this is the last one, the match
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) op = put_length(op, ml - 15);
+    return op;
+}
+
+size_t lz_compress(const void *src_buf, size_t len, void *dst_buf, size_t cap) {
+    const uint8_t *src = src_buf;
+    uint8_t *op = dst_buf, *oend = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS];  // position + 1, 0 = empty
+    size_t anchor = 0, ip = 0;
+
+    memset(table, 0, sizeof(table));
+    if (len > LZ_MATCH_LIMIT) {
+        size_t limit = len - LZ_MATCH_LIMIT;
+        size_t match_end = len - LZ_LAST_LITERALS;
+        while (ip <= limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash32(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)(ip + 1);
+            if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_len = LZ_MIN_MATCH;
+            while (ip + match_len < match_end && src[ip + match_len] == src[ref + match_len]) {
+                match_len++;
+            }
+            op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+            if (!op) return 0;
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+    op = put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst_buf) : 0;
+}
+
+// Continuation bytes of a length field, NULL if the input ends first
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (ip >= iend) return NULL;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+size_t lz_decompress(const void *src_buf, size_t len, void *dst_buf, size_t cap) {
+    const uint8_t *ip = src_buf, *iend = ip + len;
+    uint8_t *dst = dst_buf, *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !(ip = get_length(ip, iend, &lit_len))) return (size_t)-1;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return (size_t)-1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) break;  // last sequence has no match
+
+        if (iend - ip < 2) return (size_t)-1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return (size_t)-1;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !(ip = get_length(ip, iend, &match_len))) return (size_t)-1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return (size_t)-1;
+        // Byte by byte: the match may overlap what it is producing
+        const uint8_t *match = op - offset;
+        while (match_len--) *op++ = *match++;
+    }
+    return (size_t)(op - dst);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t lz_frame_encode(const void *src, size_t len, void *dst_buf, size_t cap) {
+    uint8_t *dst = dst_buf;
+    if (cap <= LZ_FRAME_HEADER || len > UINT32_MAX) return 0;
+    size_t comp = lz_compress(src, len, dst + LZ_FRAME_HEADER, cap - LZ_FRAME_HEADER);
+    if (comp == 0 || comp + LZ_FRAME_HEADER >= len) return 0;
+    dst[0] = LZ_FRAME_MAGIC0;
+    dst[1] = LZ_FRAME_MAGIC1;
+    put_u32(dst + 2, (uint32_t)len);
+    put_u32(dst + 6, (uint32_t)comp);
+    return comp + LZ_FRAME_HEADER;
+}
+
+int lz_frame_header(const void *buf_in, size_t len, uint32_t *raw_len, uint32_t *comp_len) {
+    const uint8_t *buf = buf_in;
+    if (len >= 1 && buf[0] != LZ_FRAME_MAGIC0) return -1;
+    if (len >= 2 && buf[1] != LZ_FRAME_MAGIC1) return -1;
+    if (len < LZ_FRAME_HEADER) return 0;
+    *raw_len = get_u32(buf + 2);
+    *comp_len = get_u32(buf + 6);
+    return 1;
+}
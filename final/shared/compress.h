@@ -0,0 +1,39 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ4 block format codec plus the frame both ends use on the chat socket.
+// Once a client sends "/compress on", server messages of at least
+// COMPRESS_THRESHOLD bytes may arrive as a frame instead of plain text:
+//
+//   0x01 'Z' <raw length, u32 LE> <compressed length, u32 LE> <LZ4 block>
+//
+// Plain text never contains 0x01 (the server rejects client text holding
+// one), so a reader can tell the two apart.
+// Frames are independent (no dictionary carried between them), which is
+// what lets one compressed broadcast be sent to every recipient as is.
+
+#define COMPRESS_THRESHOLD 128
+#define LZ_FRAME_MAGIC0 0x01
+#define LZ_FRAME_MAGIC1 'Z'
+#define LZ_FRAME_HEADER 10
+
+// Worst case for incompressible input
+#define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+#define LZ_FRAME_BOUND(n) (LZ_FRAME_HEADER + LZ_COMPRESS_BOUND(n))
+
+// Returns the compressed size, or 0 if dst is too small
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+// Returns the decompressed size, or (size_t)-1 on malformed input or overflow
+size_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+// Frame src into dst. Returns the frame length, or 0 when compressing
+// does not save anything and the message should go out as plain text.
+size_t lz_frame_encode(const void *src, size_t len, void *dst, size_t cap);
+// Parse a frame header: 1 and the two lengths if buf holds one, 0 if more
+// bytes are needed, -1 if buf does not start with a frame.
+int lz_frame_header(const void *buf, size_t len, uint32_t *raw_len, uint32_t *comp_len);
+
+#endif // COMPRESS_H
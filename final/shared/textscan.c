@@ -0,0 +1,421 @@
+#include "textscan.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXTSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static int detected = -1;           // best textscan_level_t the CPU has
+static int active = -1;             // detected, capped by textscan_limit()
+
+static void detect(void) {
+    int level = TEXTSCAN_SCALAR;
+#ifdef TEXTSCAN_X86
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? TEXTSCAN_AVX2 :
+            __builtin_cpu_supports("sse2") ? TEXTSCAN_SSE2 : TEXTSCAN_SCALAR;
+#endif
+    detected = level;
+}
+
+textscan_level_t textscan_level(void) {
+    if (active < 0) {
+        if (detected < 0) detect();
+        active = detected;
+    }
+    return active;
+}
+
+const char *textscan_level_name(textscan_level_t level) {
+    switch (level) {
+    case TEXTSCAN_AVX2: return "avx2";
+    case TEXTSCAN_SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+void textscan_limit(textscan_level_t level) {
+    if (detected < 0) detect();
+    active = (int)level < detected ? (int)level : detected;
+}
+
+static inline int is_name_char(unsigned char c) {
+    return (unsigned char)(c - '0') < 10 || (unsigned char)((c | 0x20) - 'a') < 26 || c == '_';
+}
+
+static inline int is_delim(char c) {
+    return c == ' ' || c == '\n' || c == '\0';
+}
+
+// ---- scalar ----
+
+static size_t name_span_scalar(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && is_name_char(s[i])) i++;
+    return i;
+}
+
+static char *find_delim_scalar(const char *s) {
+    while (!is_delim(*s)) s++;
+    return (char *)s;
+}
+
+static char *find_byte_scalar(const char *s, size_t len, char c) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == c) return (char *)s + i;
+    }
+    return NULL;
+}
+
+// Validates the sequence at s[i], returns its length or 0 if malformed
+static size_t utf8_sequence(const unsigned char *s, size_t i, size_t len) {
+    unsigned char c = s[i];
+    size_t n;
+    uint32_t cp;
+    if (c < 0x80) return 1;
+    if (c >= 0xC2 && c <= 0xDF) { n = 2; cp = c & 0x1F; }
+    else if (c >= 0xE0 && c <= 0xEF) { n = 3; cp = c & 0x0F; }
+    else if (c >= 0xF0 && c <= 0xF4) { n = 4; cp = c & 0x07; }
+    else return 0;
+    if (len - i < n) return 0;
+    for (size_t k = 1; k < n; k++) {
+        if ((s[i + k] & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (s[i + k] & 0x3F);
+    }
+    if ((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF))) return 0;
+    if (cp >= 0xD800 && cp <= 0xDFFF) return 0;
+    return n;
+}
+
+static int utf8_valid_scalar(const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    for (size_t i = 0; i < len;) {
+        size_t n = utf8_sequence(u, i, len);
+        if (n == 0) return 0;
+        i += n;
+    }
+    return 1;
+}
+
+#ifdef TEXTSCAN_X86
+
+// ---- SSE2, 16 bytes per step ----
+
+// Bit i set where byte i is in [A-Za-z0-9_]; classes by unsigned range
+// checks, min(x, bound) == x meaning x <= bound
+static inline unsigned name_mask_sse2(__m128i v) {
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha);
+    __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha), under));
+}
+
+static size_t name_span_sse2(const char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = name_mask_sse2(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+    }
+    if (i == len) return len;
+    // Short tail: names are mostly shorter than one vector
+    char tail[16] = {0};
+    memcpy(tail, s + i, len - i);
+    unsigned mask = ~name_mask_sse2(_mm_loadu_si128((const __m128i *)tail)) & ((1u << (len - i)) - 1);
+    return mask ? i + __builtin_ctz(mask) : len;
+}
+
+static inline unsigned delim_mask_sse2(__m128i v) {
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return _mm_movemask_epi8(_mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+// Aligned loads never cross a page, so reading the block around the NUL
+// is safe even though the string's length is unknown
+static char *find_delim_sse2(const char *s) {
+    size_t offset = (uintptr_t)s & 15;
+    const char *p = s - offset;
+    unsigned mask = delim_mask_sse2(_mm_load_si128((const __m128i *)p)) >> offset;
+    if (mask) return (char *)s + __builtin_ctz(mask);
+    for (p += 16;; p += 16) {
+        mask = delim_mask_sse2(_mm_load_si128((const __m128i *)p));
+        if (mask) return (char *)p + __builtin_ctz(mask);
+    }
+}
+
+static char *find_byte_sse2(const char *s, size_t len, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), needle));
+        if (mask) return (char *)s + i + __builtin_ctz(mask);
+    }
+    return find_byte_scalar(s + i, len - i, c);
+}
+
+// Name check and length in one pass over a NUL terminated string, with the
+// same aligned loads as find_delim_sse2
+static int is_name_sse2(const char *s, size_t min_len, size_t max_len) {
+    size_t offset = (uintptr_t)s & 15;
+    const char *p = s - offset;
+    __m128i v = _mm_load_si128((const __m128i *)p);
+    unsigned nul = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) >> offset;
+    unsigned bad = (~name_mask_sse2(v) & 0xFFFF) >> offset;     // includes the NUL
+    size_t base = 0;
+    size_t step = 16 - offset;
+    while (!nul) {
+        if (bad) return 0;
+        base += step;
+        if (base > max_len) return 0;
+        p += 16;
+        step = 16;
+        v = _mm_load_si128((const __m128i *)p);
+        nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        bad = ~name_mask_sse2(v) & 0xFFFF;
+    }
+    unsigned n = __builtin_ctz(nul);
+    size_t len = base + n;
+    return len >= min_len && len <= max_len && !(bad & ((1u << n) - 1));
+}
+
+// SSE2 has no byte shuffle for table lookups, so only ASCII runs are
+// vectorised; multibyte sequences go through the scalar decoder
+static int utf8_valid_sse2(const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i = 0;
+    while (i < len) {
+        if (i + 16 <= len) {
+            unsigned high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+            if (high == 0) {
+                i += 16;
+                continue;
+            }
+            i += __builtin_ctz(high);
+        }
+        size_t n = utf8_sequence(u, i, len);
+        if (n == 0) return 0;
+        i += n;
+    }
+    return 1;
+}
+
+// ---- AVX2, 32 bytes per step ----
+
+__attribute__((target("avx2")))
+static inline unsigned name_mask_avx2(__m256i v) {
+    __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(25)), alpha);
+    __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, alpha), under));
+}
+
+__attribute__((target("avx2")))
+static size_t name_span_avx2(const char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = name_mask_avx2(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (mask != 0xFFFFFFFFu) return i + __builtin_ctz(~mask);
+    }
+    if (i == len) return len;
+    char tail[32] = {0};
+    memcpy(tail, s + i, len - i);
+    unsigned mask = ~name_mask_avx2(_mm256_loadu_si256((const __m256i *)tail));
+    if (len - i < 32) mask &= (1u << (len - i)) - 1;
+    return mask ? i + __builtin_ctz(mask) : len;
+}
+
+__attribute__((target("avx2")))
+static char *find_byte_avx2(const char *s, size_t len, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), needle));
+        if (mask) return (char *)s + i + __builtin_ctz(mask);
+    }
+    if (i == len) return NULL;
+    // Finish in AVX2 too: handing the tail to the SSE2 loop with the upper
+    // halves still dirty costs an AVX/SSE transition stall on every call.
+    // Past one vector, reload the last 32 bytes; the overlap has no match.
+    if (len >= 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + len - 32)), needle));
+        return mask ? (char *)s + len - 32 + __builtin_ctz(mask) : NULL;
+    }
+    char tail[32] = {0};
+    memcpy(tail, s, len);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)tail), needle)) & ((1u << len) - 1);
+    return mask ? (char *)s + __builtin_ctz(mask) : NULL;
+}
+
+// UTF-8 validation by table lookups (Keiser and Lemire, "Validating UTF-8 in
+// less than one instruction per byte"). Each byte's error class comes from
+// three 16-entry tables indexed by the previous byte's high and low nibble
+// and its own high nibble; the AND of the three is non-zero exactly where
+// the pair is illegal. A continuation that must be the 2nd/3rd one after a
+// 3 or 4 byte lead is the only class needing two bytes of lookbehind.
+#define U8_TOO_SHORT    (1 << 0)
+#define U8_TOO_LONG     (1 << 1)
+#define U8_OVERLONG_3   (1 << 2)
+#define U8_TOO_LARGE    (1 << 3)
+#define U8_SURROGATE    (1 << 4)
+#define U8_OVERLONG_2   (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4   (1 << 6)
+#define U8_TWO_CONTS    (1 << 7)
+#define U8_CARRY        (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// The bytes of input shifted right by n, the gap filled from the end of prev
+#define U8_PREV(input, prev, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i utf8_block_errors(__m256i input, __m256i prev) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    __m256i prev1 = U8_PREV(input, prev, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(U8_TABLE(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(U8_TABLE(
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(U8_TABLE(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT),
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Only 111_____ two back and 1111____ three back leave the high bit set
+    __m256i third = _mm256_subs_epu8(U8_PREV(input, prev, 2), _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(U8_PREV(input, prev, 3), _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_be_cont = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_be_cont, special);
+}
+
+__attribute__((target("avx2")))
+static int utf8_valid_avx2(const char *s, size_t len) {
+    // Non-zero where the last bytes start a sequence the block cut short
+    const __m256i incomplete_max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i prev = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+    for (;; i += 32) {
+        __m256i input;
+        if (i + 32 <= len) {
+            input = _mm256_loadu_si256((const __m256i *)(s + i));
+        } else if (i < len) {
+            char tail[32] = {0};
+            memcpy(tail, s + i, len - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        } else {
+            break;
+        }
+        if (_mm256_movemask_epi8(input) == 0) {
+            // ASCII can not finish a sequence the previous block started
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+            prev = input;
+            continue;
+        }
+        error = _mm256_or_si256(error, utf8_block_errors(input, prev));
+        incomplete = _mm256_subs_epu8(input, incomplete_max);
+        prev = input;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+#endif // TEXTSCAN_X86
+
+// ---- dispatch ----
+
+size_t text_name_span(const char *s, size_t len) {
+#ifdef TEXTSCAN_X86
+    switch (textscan_level()) {
+    case TEXTSCAN_AVX2: return name_span_avx2(s, len);
+    case TEXTSCAN_SSE2: return name_span_sse2(s, len);
+    default: break;
+    }
+#endif
+    return name_span_scalar(s, len);
+}
+
+int text_is_name(const char *s, size_t min_len, size_t max_len) {
+    if (!s) return 0;
+#ifdef TEXTSCAN_X86
+    // Names fit in one 16 byte block, so AVX2 only adds its setup cost and
+    // measured slower than SSE2; stay at SSE2 like text_find_delim
+    if (textscan_level() >= TEXTSCAN_SSE2) return is_name_sse2(s, min_len, max_len);
+#endif
+    size_t len = strnlen(s, max_len + 1);
+    return len >= min_len && len <= max_len && text_name_span(s, len) == len;
+}
+
+char *text_find_delim(const char *s) {
+#ifdef TEXTSCAN_X86
+    // Command words are short: one 16 byte block usually holds the
+    // delimiter, and the wider loads only add their setup cost
+    if (textscan_level() >= TEXTSCAN_SSE2) return find_delim_sse2(s);
+#endif
+    return find_delim_scalar(s);
+}
+
+char *text_find_byte(const char *s, size_t len, char c) {
+#ifdef TEXTSCAN_X86
+    switch (textscan_level()) {
+    case TEXTSCAN_AVX2: return find_byte_avx2(s, len, c);
+    case TEXTSCAN_SSE2: return find_byte_sse2(s, len, c);
+    default: break;
+    }
+#endif
+    return find_byte_scalar(s, len, c);
+}
+
+int text_utf8_valid(const char *s, size_t len) {
+#ifdef TEXTSCAN_X86
+    switch (textscan_level()) {
+    case TEXTSCAN_AVX2: return utf8_valid_avx2(s, len);
+    case TEXTSCAN_SSE2: return utf8_valid_sse2(s, len);
+    default: break;
+    }
+#endif
+    return utf8_valid_scalar(s, len);
+}
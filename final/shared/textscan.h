@@ -0,0 +1,35 @@
+#ifndef TEXTSCAN_H
+#define TEXTSCAN_H
+
+#include <stddef.h>
+
+// Byte scanning for the per-message text paths: name validation, command
+// tokenising, line splitting and UTF-8 checks. On x86 each scan looks at
+// 16 (SSE2) or 32 (AVX2) bytes per step, picked once from the CPU; other
+// machines get the scalar loops. Every level gives the same answers and
+// classes are plain ASCII, independent of the locale.
+
+typedef enum {
+    TEXTSCAN_SCALAR,
+    TEXTSCAN_SSE2,
+    TEXTSCAN_AVX2
+} textscan_level_t;
+
+textscan_level_t textscan_level(void);
+const char *textscan_level_name(textscan_level_t level);
+// Use at most this level, for benchmarks and cross-checks
+void textscan_limit(textscan_level_t level);
+
+// Length of the longest prefix of s[0..len) made of [A-Za-z0-9_]
+size_t text_name_span(const char *s, size_t len);
+// A user or room name: min_len to max_len characters of [A-Za-z0-9_]
+int text_is_name(const char *s, size_t min_len, size_t max_len);
+// First ' ', '\n' or the terminating NUL in s
+char *text_find_delim(const char *s);
+// First c in s[0..len), NULL if there is none
+char *text_find_byte(const char *s, size_t len, char c);
+// 1 if s[0..len) is well-formed UTF-8: no overlong forms, surrogates or
+// code points past U+10FFFF
+int text_utf8_valid(const char *s, size_t len);
+
+#endif // TEXTSCAN_H